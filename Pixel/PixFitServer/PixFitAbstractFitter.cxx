@@ -0,0 +1,26 @@
+/* @file PixFitAbstractFitter.cxx
+ */
+
+#include <cmath>
+
+#include "PixFitAbstractFitter.h"
+#include "RawHisto.h"
+
+using namespace PixLib;
+
+bool PixFitAbstractFitter::matchesData(RawHisto &histo, int pixel, int start, int end, double injections,
+		double mu, double sigma, double &residuals) {
+	residuals = 0.;
+	if (end - start < 2 || !(sigma > 0.)) return false;
+
+	/* Variance of the model plus one, so that bins at 0 or at the plateau do not dominate. */
+	const double inv = 1. / (sigma * M_SQRT2);
+	double chi2 = 0.;
+	for (int b = start; b <= end; b++) {
+		const double f = 0.5 * injections * std::erfc((mu - b) * inv);
+		const double r = histo(pixel, b, 0) - f;
+		residuals += r * r;
+		chi2 += r * r / (f * (1. - f / injections) + 1.);
+	}
+	return chi2 / (end - start - 1) <= s_maxMatchChi2;
+}
@@ -13,17 +13,105 @@ namespace PixLib {
 
 class RawHisto;
 class PixFitResult;
+class PixFitThreadPool;
+class PixFitFitCache;
+
+/** Different fitting methods matching PixFitAbstractFitter derived fitters. */
+enum class FitMethod : int {
+	FIT_NONE,
+	FIT_LMMIN,
+	FIT_LEVMAR,
+	FIT_DSP,
+	FIT_DSP_LUT,
+	FIT_ROOT,
+	FIT_CUDA,
+	FIT_SIMD,
+	FIT_MOMENT
+};
 
 /** Abstract base class for fitter implementations. */
 class PixFitAbstractFitter {
 public:
-	PixFitAbstractFitter() {};
+	PixFitAbstractFitter() : m_pool(nullptr), m_fitCache(nullptr), m_momentFastPath(false) {};
 	virtual ~PixFitAbstractFitter() {};
 
+	/** A fit that has been started with startFit() and may still be running in the thread pool. */
+	class PendingFit {
+	public:
+		virtual ~PendingFit() {};
+
+		/** Waits for the fit to complete (helping the pool meanwhile) and returns the result.
+		 * Must be called only once. */
+		virtual std::shared_ptr<PixFitResult> finish() = 0;
+	};
+
 	/** Performs an S-Curve fit on the raw histogram and returns a PixFitResult.
 	 * @param histo Raw histogram containing data for the S-curve fit.
 	 * @returns PixFitResult containing the fitted parameters and errors. */
 	virtual std::shared_ptr<PixFitResult> fit(std::shared_ptr<RawHisto> histo) = 0;
+
+	/** Prepares the fit of a histogram and hands the actual fitting to the thread pool without
+	 * waiting for it. This allows to set up the next histogram while the pool is still busy.
+	 * The default implementation fits synchronously.
+	 * @param histo Raw histogram containing data for the S-curve fit.
+	 * @returns Handle to retrieve the PixFitResult. */
+	virtual std::unique_ptr<PendingFit> startFit(std::shared_ptr<RawHisto> histo) {
+		return std::unique_ptr<PendingFit>(new CompletedFit(fit(histo)));
+	}
+
+	/** Sets the pool that executes the fits. Without a pool fits run in the calling thread.
+	 * @param pool Thread pool, owned by the caller. */
+	void setThreadPool(PixFitThreadPool *pool) {
+		m_pool = pool;
+	}
+
+	/** Sets the cache of previous results. Fitters that support it start the fit of a pixel from
+	 * its previous curve and stop once a step changes it by much less than its width.
+	 * @param fitCache The cache, owned by the caller, nullptr to fit from scratch. */
+	void setFitCache(PixFitFitCache *fitCache) {
+		m_fitCache = fitCache;
+	}
+
+	/** Takes the S-curve from the moments of the data (PixFitMoments) for pixels where it matches
+	 * the data points and only fits the others. Fitters that do not support it ignore the setting.
+	 * @param enable True to skip the fit for clean pixels. */
+	void setMomentFastPath(bool enable) {
+		m_momentFastPath = enable;
+	}
+
+	/** Checks whether an S-curve describes the data points of a pixel, using the model of the
+	 * fitters and binomial errors.
+	 * @param start, end Range of bins to check.
+	 * @param injections Height of the plateau.
+	 * @param residuals Sum of squared residuals, as minimised by the fitters.
+	 * @returns True if the chi2 per degree of freedom is at most s_maxMatchChi2. */
+	static bool matchesData(RawHisto &histo, int pixel, int start, int end, double injections,
+			double mu, double sigma, double &residuals);
+
+protected:
+	/** Thread pool shared by all fitters, may be nullptr. */
+	PixFitThreadPool *m_pool;
+
+	/** Cache of previous results, may be nullptr. */
+	PixFitFitCache *m_fitCache;
+
+	/** See setMomentFastPath(). */
+	bool m_momentFastPath;
+
+	/** Largest chi2 per degree of freedom for which matchesData() accepts a curve. */
+	constexpr static const double s_maxMatchChi2 = 4.;
+
+private:
+	/** PendingFit for fitters that do not run asynchronously. */
+	class CompletedFit : public PendingFit {
+	public:
+		explicit CompletedFit(std::shared_ptr<PixFitResult> result) : m_result(result) {};
+		virtual std::shared_ptr<PixFitResult> finish() {
+			return m_result;
+		}
+	private:
+		std::shared_ptr<PixFitResult> m_result;
+	};
 };
 
 } /* namespace PixLib */
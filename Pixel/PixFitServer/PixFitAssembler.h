@@ -4,12 +4,14 @@
  *      Author: mkretz
  */
 
+#include <atomic>
 #include <vector>
 #include <map>
 #include <memory>
 
 #include <boost/thread.hpp>
 
+#include "PixFitFlatMap.h"
 #include "PixFitWorkQueue.h"
 #include "PixFitThread.h"
 #include "PixFitScanConfig.h"
@@ -23,17 +25,54 @@ class PixFitResult;
 class PixFitInstanceConfig;
 
 /** Class that re-assembles incomplete histograms caused by mask-stepping. It takes PixFitResults
- * and buffers them in an internal, dynamically sized hold, until all the necessary data segments
- * have been retrieved; then it re-assembles the segments. If necessary, it will also split the
- * results that contain data from more than one chip, before enqueuing them in the publishQueue.
+ * and fills every mask step into the per-chip results of its histogram as soon as it arrives, so
+ * the data of the step is released right away. The per-chip results wait in an internal,
+ * dynamically sized hold until all mask steps have been filled in, then they are enqueued in the
+ * publishQueue.
+ * Several assemblers can run in parallel, each one owning a shard of the hold with its own input
+ * queue (see PixFitScanConfig::getAssemblerShard()).
  * Note: Input and output queue contain objects of the same type, which might be confusing...
  */
 class PixFitAssembler : public PixFitThread {
 	/* Some typedefs for better readability. */
 	typedef std::vector<std::shared_ptr<PixFitResult> > ResultsVector;
-	typedef std::pair<PixFitScanConfig::ScanIdType, int> OuterKey;
-	typedef std::map<HistoUnit, ResultsVector> InnerMap;
-	typedef std::map<OuterKey, InnerMap> OuterMap;
+
+	/** Histogram of a histogramming unit whose mask steps are being filled in. */
+	struct Assembly {
+		/** One result per chip, filled with every mask step. */
+		ResultsVector chips;
+
+		/** Mask steps that have been filled in. */
+		std::vector<bool> received;
+
+		/** Number of mask steps still missing. */
+		int remaining;
+	};
+
+	/** Identifies a histogram in the hold: scan, bin and packed histogramming unit. */
+	struct HoldKey {
+		PixFitScanConfig::ScanIdType scanId;
+		int bin;
+		HistoUnit::Key unit;
+
+		bool operator==(const HoldKey &rhs) const {
+			return scanId == rhs.scanId && bin == rhs.bin && unit == rhs.unit;
+		}
+	};
+
+	struct HoldKeyHash {
+		size_t operator()(const HoldKey &key) const;
+	};
+
+	typedef PixFitFlatMap<HoldKey, Assembly, HoldKeyHash> Hold;
+
+	/** Histograms in the hold that belong to one scan of a ROD. */
+	struct Farm {
+		PixFitScanConfig::ScanIdType scanId;
+		std::vector<HoldKey> keys;
+	};
+
+	typedef std::map<int, Farm> FarmIndex;
 
 public:
 	/** @param resultQueue Pointer to the input queue that is holding the results that (possibly)
@@ -51,6 +90,10 @@ public:
 	 * are to be stored in the global BlackList object. */
 	void setCleanFlag();
 
+	/** @returns Number of incomplete histograms (scan, bin and histogramming unit) in the hold.
+	 * Can be called from any thread. */
+	int getHoldSize() const;
+
 private:
 	/** Pointer to the input queue. */
 	PixFitWorkQueue<PixFitResult> *resultQueue;
@@ -61,24 +104,26 @@ private:
 	/** Main thread loop. */
 	void loop();
 
-	/** Hold the PixFitResults here. Two nested maps with scanId and HistoUnit keys contain vectors
-	 * of results. */
-	OuterMap m_results;
+	/** Hold the incomplete histograms here, one assembly per scan, bin and histogramming unit. */
+	Hold m_results;
 
-	/** Reassembles data.
-	 * This function is called once all the necessary data has been gathered. It then combines the
-	 * data fragments.
-	 * @param resVec Vector containing the complete results for a HistoUnit.
-	 * @returns Vector containing PixFitResults that are then enqueued for the publisher. */
-	ResultsVector reassemble(ResultsVector &resVec);
+	/** Keys of m_results by fitFarmId, so aborted scans are found without going through the hold. */
+	FarmIndex m_farms;
 
-	/** Calculates geographical pixel location from flat memory location.
-	 * @param j Flat memory location of the pixel, starting from 0.
-	 * @param scanConfig
-	 * @returns Vector containing chip, column, row number. */
-	std::vector<int> getRowColumn(unsigned int j, std::shared_ptr<const PixFitScanConfig> scanConfig);
+	/** Removes a histogram from the hold and the fitFarmId index. */
+	void release(int fitFarmId, const HoldKey &key);
 
-	/** Cleans up m_results from InnerMap objects belonging to blacklisted scans.
+	/** Creates the per-chip results of a histogram with empty maps.
+	 * @param scanConfig Configuration of any of the mask steps.
+	 * @returns One result per chip. */
+	ResultsVector createChipResults(std::shared_ptr<const PixFitScanConfig> scanConfig);
+
+	/** Fills the data of a single mask step into the per-chip results.
+	 * @param result Result of the mask step from the worker.
+	 * @param chips Results created by createChipResults(). */
+	void scatter(const PixFitResult &result, ResultsVector &chips);
+
+	/** Cleans up m_results from assemblies belonging to blacklisted scans.
 	 * @returns True in case object(s) were removed. */
 	bool cleanAssembler();
 
@@ -89,14 +134,10 @@ private:
 	/** Mutex for accessing the clean assembler flag. */
 	boost::mutex m_cleanMutex;
 
-	/** Set up histograms. Helper function.
-	 * @param histo Histogram in the PixFitResult.
-	 * @param ncol Number of columns.
-	 * @param nrow Number of rows.
-	 * @param name Name of the histogram.
-	 * @param id Identifier for the histogram (aka ROD, crate, etc.)
-	 * @param bin Optional bin number. */
-	void prepareHisto(std::shared_ptr<TH2F> &histo, int ncol, int nrow, std::string name, TString id, int bin = -1); 
+	/** Copy of the hold size for other threads, updated after every result. */
+	std::atomic<int> m_holdSize;
+
+	void updateHoldSize();
 };
 
 } /* end of namespace PixLib */
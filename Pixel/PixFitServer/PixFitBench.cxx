@@ -0,0 +1,659 @@
+/* @file PixFitBench.cxx
+ */
+
+/* End-to-end benchmark of the processing pipeline behind PixFitNet: synthetic RawHistos, prepared
+ * the way PixFitNet hands them over, go through PixFitWorker, PixFitAssembler and a publisher stub
+ * that only takes the timings. Every combination of scan type, readout mode, mask steps and size
+ * of the fitting pool is run as a separate case and the results are written to a JSON file.
+ *
+ * Measured per case:
+ * - pixels per second from the first enqueued RawHisto to the last published result,
+ * - latency percentiles of the pipeline steps as recorded by PixFitTracer, the network step is
+ *   the time taken to hand over the bins,
+ * - peak RSS and the high-water mark of the memory budget.
+ *
+ * Workers and assemblers are set up as in the server, one of each unless -W or -A ask for more. */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <boost/thread.hpp>
+#include <ers/ers.h>
+
+#include "RootDb/RootDb.h"
+#include "PixFe/PixGeometry.h"
+
+#include "PixFitManager.h" // for ROOT lock
+#include "PixFitInstanceConfig.h"
+#include "PixFitScanConfig.h"
+#include "PixFitWorkQueue.h"
+#include "PixFitThread.h"
+#include "PixFitThreadPool.h"
+#include "PixFitTracer.h"
+#include "PixFitWorker.h"
+#include "PixFitAssembler.h"
+#include "PixFitResult.h"
+#include "PixFitStreamingFit.h"
+#include "PixFitToolCommon.h"
+#include "PixFitUnpack.h"
+#include "RawHisto.h"
+
+using namespace PixLib;
+using PixFitToolCommon::now;
+
+namespace {
+
+typedef PixFitScanConfig::scanType ScanType;
+typedef PixFitScanConfig::readoutMode ReadoutMode;
+
+/** A scan type with a readout mode it can be read out in. */
+struct Case {
+	ScanType type;
+	ReadoutMode mode;
+	const char *typeName;
+	const char *modeName;
+
+	/** Number of bins, threshold scans use the -b option instead. */
+	int bins;
+};
+
+const Case s_cases[] = {
+	{ScanType::THRESHOLD, ReadoutMode::ONLINE_OCCUPANCY, "THRESHOLD", "ONLINE_OCCUPANCY", 0},
+	{ScanType::THRESHOLD, ReadoutMode::OFFLINE_OCCUPANCY, "THRESHOLD", "OFFLINE_OCCUPANCY", 0},
+	{ScanType::THRESHOLD, ReadoutMode::SHORT_TOT, "THRESHOLD", "SHORT_TOT", 0},
+	{ScanType::ANALOG, ReadoutMode::ONLINE_OCCUPANCY, "ANALOG", "ONLINE_OCCUPANCY", 1},
+	{ScanType::ANALOG, ReadoutMode::OFFLINE_OCCUPANCY, "ANALOG", "OFFLINE_OCCUPANCY", 1},
+	{ScanType::ANALOG, ReadoutMode::SHORT_TOT, "ANALOG", "SHORT_TOT", 1},
+	{ScanType::DIGITAL, ReadoutMode::ONLINE_OCCUPANCY, "DIGITAL", "ONLINE_OCCUPANCY", 1},
+	{ScanType::DIGITAL, ReadoutMode::OFFLINE_OCCUPANCY, "DIGITAL", "OFFLINE_OCCUPANCY", 1},
+	{ScanType::DIGITAL, ReadoutMode::SHORT_TOT, "DIGITAL", "SHORT_TOT", 1},
+	{ScanType::TOT, ReadoutMode::SHORT_TOT, "TOT", "SHORT_TOT", 1},
+	{ScanType::TOT, ReadoutMode::LONG_TOT, "TOT", "LONG_TOT", 1},
+	{ScanType::TOT_CALIB, ReadoutMode::SHORT_TOT, "TOT_CALIB", "SHORT_TOT", 10},
+	{ScanType::TOT_CALIB, ReadoutMode::LONG_TOT, "TOT_CALIB", "LONG_TOT", 10}
+};
+
+/** Charge injections per bin. */
+const int s_triggers = 100;
+
+/** Pixels of a histogramming unit (8 FE-I4 chips). */
+const int s_unitPixels = 8 * 26880;
+
+/** Threshold shift in bins from one step of a tuning loop to the next. */
+const double s_tuningShift = 0.2;
+
+/** Seconds to wait for a case to complete before giving up. */
+const double s_caseTimeout = 1800;
+
+/** Generates the data of all bins of a histogram as the ROD sends it: S-curves for threshold
+ * scans, full occupancy with a few dead pixels otherwise and ToT values around 8 for ToT scans.
+ * The same data is used for all histograms of a case.
+ * @param shift Offset of all thresholds in bins, to mimic the steps of a tuning. */
+std::vector<std::shared_ptr<const char> > generateBins(const Case &c, int pixels, int bins, unsigned int seed,
+		double shift) {
+	std::mt19937 random(seed);
+	std::normal_distribution<double> muDistribution(0.5 * bins, 0.05 * bins);
+	std::normal_distribution<double> sigmaDistribution(0.03 * bins, 0.005 * bins);
+	std::uniform_int_distribution<int> totDistribution(5, 11);
+	std::uniform_real_distribution<double> uniform(0, 1);
+
+	std::vector<double> mu(pixels);
+	std::vector<double> sigma(pixels);
+	std::vector<bool> dead(pixels);
+	for (int p = 0; p < pixels; p++) {
+		mu[p] = muDistribution(random) + shift;
+		sigma[p] = std::max(0.05, sigmaDistribution(random));
+		dead[p] = uniform(random) < 0.001;
+	}
+
+	const size_t size = static_cast<size_t>(pixels) * PixFitToolCommon::bytesPerPixel(c.mode);
+	std::vector<std::shared_ptr<const char> > data;
+	for (int bin = 0; bin < bins; bin++) {
+		std::shared_ptr<char> payload(new char[size], std::default_delete<char[]>());
+		for (int p = 0; p < pixels; p++) {
+			uint32_t occupancy = dead[p] ? 0 : s_triggers;
+			if (c.type == ScanType::THRESHOLD) {
+				const double efficiency = 0.5 * erfc((mu[p] - bin) / (M_SQRT2 * sigma[p]));
+				occupancy = static_cast<uint32_t>(lround(s_triggers * efficiency));
+			}
+			uint32_t tot = 0;
+			uint32_t tot2 = 0;
+			if (c.type == ScanType::TOT || c.type == ScanType::TOT_CALIB) {
+				const uint32_t value = totDistribution(random);
+				tot = occupancy * value;
+				tot2 = occupancy * value * value;
+			}
+			PixFitToolCommon::encode(c.mode, s_triggers, occupancy, tot, tot2, payload.get(), p);
+		}
+		data.push_back(payload);
+	}
+	return data;
+}
+
+/** Counts the results of a case and takes the time from the first enqueued histogram to the last
+ * published result. The latencies are taken by PixFitTracer. */
+class Recorder {
+public:
+	Recorder() {
+		reset(0);
+	}
+
+	/** Starts a new case.
+	 * @param expected Number of results the publisher has to receive. */
+	void reset(int expected) {
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_expected = expected;
+		m_published = 0;
+		m_first = 0;
+		m_last = 0;
+	}
+
+	void enqueued() {
+		const double t = now();
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		if (m_first == 0) m_first = t;
+	}
+
+	void published() {
+		const double t = now();
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_last = t;
+		if (++m_published == m_expected) m_done.notify_all();
+	}
+
+	/** Waits until all results have been published.
+	 * @returns False on timeout. */
+	bool wait(double timeout) {
+		boost::unique_lock<boost::mutex> lock(m_mutex);
+		const boost::system_time deadline = boost::get_system_time()
+				+ boost::posix_time::milliseconds(static_cast<long>(timeout * 1000));
+		while (m_published < m_expected) {
+			if (!m_done.timed_wait(lock, deadline)) return false;
+		}
+		return true;
+	}
+
+	/** @returns Seconds from the first enqueued histogram to the last published result. */
+	double getDuration() {
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		return m_last - m_first;
+	}
+
+private:
+	boost::mutex m_mutex;
+	boost::condition_variable m_done;
+	int m_expected;
+	int m_published;
+	double m_first;
+	double m_last;
+};
+
+/** Stands in for PixFitPublisher: creates the histograms, records the latencies and drops the
+ * result. */
+class BenchPublisher : public PixFitThread {
+public:
+	BenchPublisher(PixFitWorkQueue<PixFitResult> *publishQueue, Recorder *recorder, PixFitTracer *tracer) {
+		this->m_threadName = "publisher";
+		this->m_publishQueue = publishQueue;
+		this->m_recorder = recorder;
+		this->m_tracer = tracer;
+	}
+
+private:
+	void loop() {
+		while (true) {
+			std::shared_ptr<PixFitResult> result = m_publishQueue->getWork();
+			result->createHistograms();
+			result->stamp(PixFitWorkPackage::Stage::PUBLISHED);
+			m_tracer->recordPublished(*result, result->getScanConfig()->histogrammer);
+			m_recorder->published();
+		}
+	}
+
+	PixFitWorkQueue<PixFitResult> *m_publishQueue;
+	Recorder *m_recorder;
+	PixFitTracer *m_tracer;
+};
+
+/** All threads and queues for one size of the fitting pool. PixFitThreads cannot be stopped, so
+ * a pipeline is never destroyed; once the next pool size is benchmarked its threads just wait on
+ * their empty queues. */
+struct Pipeline {
+	Pipeline(PixFitInstanceConfig &instanceConfig, unsigned int poolThreads, FitMethod fitMethod) :
+		pool(poolThreads),
+		fitQueue("FitQueue", PixFitInstanceConfig::fitQueueCapacity),
+		publishQueue("PublishQueue", PixFitInstanceConfig::publishQueueCapacity) {
+		const int levels = PixFitScanConfig::numOfPriorities;
+		if (PixFitInstanceConfig::priorityScheduling) {
+			fitQueue.setPriority([](std::shared_ptr<RawHisto> histo) {
+				return static_cast<int>(histo->getScanConfig()->priority);
+			}, levels);
+			publishQueue.setPriority([](std::shared_ptr<PixFitResult> result) {
+				return static_cast<int>(result->getScanConfig()->priority);
+			}, levels);
+		}
+
+		std::vector<PixFitWorkQueue<PixFitResult>*> resultQueuePtrs;
+		for (int i = 0; i < instanceConfig.assemblerStage.threads; i++) {
+			resultQueues.push_back(std::unique_ptr<PixFitWorkQueue<PixFitResult> >(
+					new PixFitWorkQueue<PixFitResult>("ResultQueue-" + std::to_string(i),
+							PixFitInstanceConfig::resultQueueCapacity)));
+			if (PixFitInstanceConfig::priorityScheduling) {
+				resultQueues.back()->setPriority([](std::shared_ptr<PixFitResult> result) {
+					return static_cast<int>(result->getScanConfig()->priority);
+				}, levels);
+			}
+			resultQueuePtrs.push_back(resultQueues.back().get());
+		}
+
+		for (int i = 0; i < instanceConfig.workerStage.threads; i++) {
+			workers.push_back(std::unique_ptr<PixFitWorker>(
+					new PixFitWorker(&fitQueue, resultQueuePtrs, &pool, fitMethod, &instanceConfig)));
+			workers.back()->setThreadIndex(i);
+			workers.back()->setCpuAffinity(instanceConfig.workerStage.getCpu(i));
+			workers.back()->start();
+		}
+
+		for (int i = 0; i < instanceConfig.assemblerStage.threads; i++) {
+			assemblers.push_back(std::unique_ptr<PixFitAssembler>(
+					new PixFitAssembler(resultQueuePtrs[i], &publishQueue, &instanceConfig)));
+			assemblers.back()->setThreadIndex(i);
+			assemblers.back()->setCpuAffinity(instanceConfig.assemblerStage.getCpu(i));
+			assemblers.back()->start();
+		}
+
+		publisher.reset(new BenchPublisher(&publishQueue, &recorder, &instanceConfig.tracer));
+		publisher->start();
+	}
+
+	PixFitThreadPool pool;
+	PixFitWorkQueue<RawHisto> fitQueue;
+	std::vector<std::unique_ptr<PixFitWorkQueue<PixFitResult> > > resultQueues;
+	PixFitWorkQueue<PixFitResult> publishQueue;
+	Recorder recorder;
+	std::vector<std::unique_ptr<PixFitWorker> > workers;
+	std::vector<std::unique_ptr<PixFitAssembler> > assemblers;
+	std::unique_ptr<BenchPublisher> publisher;
+};
+
+/** Settings of a benchmark run, see usage(). */
+struct Options {
+	std::string output;
+	std::string trace;
+	std::string scanFile;
+	std::vector<int> maskSteps;
+	std::vector<int> poolThreads;
+	std::vector<std::string> cases;
+	std::string workers;
+	std::string assemblers;
+	int units;
+	int thresholdBins;
+	int binDelay;
+	int tuningSteps;
+	bool streamingFit;
+	FitMethod fitMethod;
+	const char *fitMethodName;
+};
+
+void usage(const char *name) {
+	std::cerr << "Usage: " << name << " [options]" << std::endl
+			<< "  -o file     JSON output (default PixFitBench.json)" << std::endl
+			<< "  -u units    histogramming units per case (default 4)" << std::endl
+			<< "  -m list     mask steps (default 1,2,4,8)" << std::endl
+			<< "  -t list     threads of the fitting pool (default powers of two up to the number of cores)" << std::endl
+			<< "  -c list     cases as SCANTYPE or SCANTYPE/READOUTMODE (default all)" << std::endl
+			<< "  -b bins     bins of threshold scans (default 101)" << std::endl
+			<< "  -f method   threshold fitter: lmmin, simd, moment or lut (default as configured for the server)" << std::endl
+			<< "  -s file     ROOT file with the PixScan for threshold scans (default slave emulator file)" << std::endl
+			<< "  -T file     write a Chrome trace of all work packages" << std::endl
+			<< "  -l steps    run every case steps times with slightly shifted thresholds, like a tuning loop (default 1)" << std::endl
+			<< "  -d us       delay between two bins of a histogram, as a ROD needs time per bin (default 0)" << std::endl
+			<< "  -S on|off   estimate threshold S-curves while the bins arrive (default as configured for the server)" << std::endl
+			<< "  -W threads  fitting workers as threads[:cpu,cpu,...] (default 1)" << std::endl
+			<< "  -A threads  assemblers as threads[:cpu,cpu,...] (default 1)" << std::endl;
+}
+
+std::vector<std::string> splitList(const std::string &list) {
+	std::vector<std::string> items;
+	std::istringstream in(list);
+	std::string item;
+	while (std::getline(in, item, ',')) {
+		if (!item.empty()) items.push_back(item);
+	}
+	return items;
+}
+
+std::vector<int> splitIntList(const std::string &list) {
+	std::vector<int> values;
+	for (auto& item : splitList(list)) {
+		if (atoi(item.c_str()) > 0) values.push_back(atoi(item.c_str()));
+	}
+	return values;
+}
+
+bool selected(const Options &options, const Case &c) {
+	if (options.cases.empty()) return true;
+	const std::string typeName = c.typeName;
+	const std::string fullName = typeName + "/" + c.modeName;
+	return std::find(options.cases.begin(), options.cases.end(), typeName) != options.cases.end()
+			|| std::find(options.cases.begin(), options.cases.end(), fullName) != options.cases.end();
+}
+
+/** Loads the PixScan the threshold scans need for the Vcal conversion in the assembler, like
+ * PixFitManager::setupScan() does for the slave emulator. */
+std::shared_ptr<PixScan> loadPixScan(const std::string &fileName) {
+	std::shared_ptr<PixScan> pixScan;
+	try {
+		boost::lock_guard<boost::mutex> lock(root_m);
+		RootDb root(fileName, "READ");
+		DbRecord* rec = root.DbFindRecordByName(fileName + ":/rootRecord;1");
+		if (rec != nullptr) pixScan = std::shared_ptr<PixScan>(new PixScan(rec));
+	} catch (...) {
+		ERS_INFO("Exception caught while reading PixScan from " << fileName)
+	}
+	return pixScan;
+}
+
+/** Reads the peak resident set size since the last resetPeakRss().
+ * @returns Size in MB, -1 if unknown. */
+double getPeakRss() {
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line)) {
+		if (line.compare(0, 6, "VmHWM:") == 0) return atof(line.c_str() + 6) / 1024;
+	}
+	return -1;
+}
+
+/** Starts a new peak RSS period, needs Linux 4.0 or later. */
+void resetPeakRss() {
+	std::ofstream clearRefs("/proc/self/clear_refs");
+	clearRefs << "5" << std::endl;
+}
+
+/** Sends one case through the pipeline and appends its results to out.
+ * @returns False if the results did not arrive in time. */
+bool runCase(const Options &options, const Case &c, int maskSteps, int tuningStep, Pipeline &pipeline,
+		PixFitInstanceConfig &instanceConfig, std::shared_ptr<PixScan> pixScan,
+		PixFitScanConfig::ScanIdType scanId, std::ostream &out) {
+	const int bins = (c.type == ScanType::THRESHOLD) ? options.thresholdBins : c.bins;
+	PixFitScanConfig::setSlaveEmuParameters(c.type, c.mode, maskSteps, bins, s_triggers);
+
+	PixGeometry geo(PixGeometry::FEI4_CHIP);
+	PixFitScanConfig prototype(true);
+	prototype.pixScanConfig = pixScan;
+	prototype.NumRow = geo.nRow();
+	prototype.NumCol = geo.nCol();
+	prototype.scanId = scanId;
+	prototype.fitFarmId = scanId;
+	prototype.modMask = 0xff;
+	prototype.partitionName = instanceConfig.getPartitionName();
+	prototype.serverName = instanceConfig.getServerName();
+	prototype.providerName = instanceConfig.getInstanceId();
+	prototype.histogrammer.crate = 0;
+	prototype.histogrammer.slave = 0;
+	prototype.histogrammer.histo = 0;
+	prototype.histogrammer.crateletter = "B";
+
+	const int pixels = prototype.getNumOfPixels();
+	const std::vector<std::shared_ptr<const char> > packed = generateBins(c, pixels, bins,
+			scanId - tuningStep, tuningStep * s_tuningShift);
+	const size_t payloadSize = static_cast<size_t>(pixels) * PixFitToolCommon::bytesPerPixel(c.mode);
+
+	/* Words per pixel PixFitNet extracts for this scan type and readout mode. */
+	const bool totWords = (c.type == ScanType::TOT || c.type == ScanType::TOT_CALIB)
+			&& (c.mode == ReadoutMode::SHORT_TOT || c.mode == ReadoutMode::LONG_TOT);
+	const int words = totWords ? 3 : 1;
+
+	/* One result per chip and unit, TOT_CALIB scans also publish one per chip and bin. */
+	const bool intermediates = (c.type == ScanType::TOT_CALIB);
+	const int expected = options.units * 8 * (intermediates ? bins + 1 : 1);
+
+	Recorder &recorder = pipeline.recorder;
+	recorder.reset(expected);
+	instanceConfig.tracer.reset();
+	instanceConfig.memoryBudget.resetHighWaterMark();
+	resetPeakRss();
+
+	for (int unit = 0; unit < options.units; unit++) {
+		for (int mask = 0; mask < maskSteps; mask++) {
+			std::shared_ptr<PixFitScanConfig> scanConfig = std::make_shared<PixFitScanConfig>(prototype);
+			scanConfig->histogrammer.rod = unit;
+			scanConfig->maskId = mask;
+			if (mask == maskSteps - 1) scanConfig->priority = PixFitScanConfig::priorityClass::PRIORITY_HIGH;
+
+			/* Same backpressure as in PixFitNet, but give up waiting if nothing is released. */
+			while (instanceConfig.memoryBudget.isExhausted() && instanceConfig.memoryBudget.waitForRelease(1000)) {}
+
+			std::shared_ptr<RawHisto> histo = std::make_shared<RawHisto>(scanConfig, PixFitInstanceConfig::receiveLayout);
+			if (histo->allocateMemory(&instanceConfig.memoryBudget) != 0) {
+				ERS_INFO("Could not allocate RawHisto, aborting.")
+				return false;
+			}
+			histo->stamp(PixFitWorkPackage::Stage::RECEIVED);
+			recorder.enqueued();
+			std::shared_ptr<PixFitStreamingFit> streamingFit;
+			if (options.streamingFit) {
+				streamingFit = PixFitStreamingFit::create(*scanConfig, &pipeline.pool);
+				histo->setStreamingFit(streamingFit);
+			}
+
+			/* Hand over the bins like PixFitNet: in place if the format allows, otherwise
+			 * packed for the worker to convert. */
+			const bool inPlace = words == 1 && histo->getPixelStride() == 1
+					&& (c.mode == ReadoutMode::ONLINE_OCCUPANCY || c.mode == ReadoutMode::SHORT_TOT);
+			for (int bin = 0; bin < bins; bin++) {
+				if (inPlace && c.mode == ReadoutMode::SHORT_TOT) {
+					PixFitUnpack::unpack(c.mode, 1, packed[bin].get(), pixels, (*histo)(0, bin), 1);
+				}
+				else if (inPlace) {
+					memcpy((*histo)(0, bin), packed[bin].get(), payloadSize);
+				}
+				else {
+					histo->addPackedBin(bin, c.mode, words, packed[bin], payloadSize);
+				}
+				if (streamingFit && inPlace) streamingFit->addBin(bin, histo);
+				else if (streamingFit) streamingFit->addPackedBin(bin, packed[bin]);
+				if (options.binDelay > 0) boost::this_thread::sleep(boost::posix_time::microseconds(options.binDelay));
+
+				if (intermediates) {
+					std::shared_ptr<PixFitScanConfig> binConfig = std::make_shared<PixFitScanConfig>(*scanConfig);
+					binConfig->binNumber = bin;
+					binConfig->intermediate = PixFitScanConfig::intermediateType::INTERMEDIATE_TOT;
+					binConfig->priority = PixFitScanConfig::priorityClass::PRIORITY_LOW;
+					std::shared_ptr<RawHisto> binHisto = std::make_shared<RawHisto>(binConfig);
+					binHisto->allocateMemory(&instanceConfig.memoryBudget);
+					binHisto->addPackedBin(0, c.mode, words, packed[bin], payloadSize);
+					binHisto->copyTimestamps(*histo);
+					binHisto->stamp(PixFitWorkPackage::Stage::ENQUEUED);
+					pipeline.fitQueue.addWork(binHisto);
+				}
+			}
+			histo->stamp(PixFitWorkPackage::Stage::ENQUEUED);
+			pipeline.fitQueue.addWork(histo);
+		}
+	}
+
+	if (!recorder.wait(s_caseTimeout)) {
+		ERS_INFO("Timeout waiting for the results of " << c.typeName << "/" << c.modeName)
+		return false;
+	}
+
+	const double seconds = recorder.getDuration();
+	const double totalPixels = static_cast<double>(options.units) * s_unitPixels;
+	out << "    {\"scanType\": \"" << c.typeName << "\", \"readoutMode\": \"" << c.modeName
+			<< "\", \"maskSteps\": " << maskSteps << ", \"tuningStep\": " << tuningStep << ", \"bins\": " << bins
+			<< ", \"poolThreads\": " << pipeline.pool.getNumOfThreads()
+			<< ", \"workers\": " << pipeline.workers.size()
+			<< ", \"assemblers\": " << pipeline.assemblers.size()
+			<< ", \"units\": " << options.units
+			<< ", \"histograms\": " << options.units * maskSteps
+			<< ", \"pixels\": " << totalPixels
+			<< ", \"seconds\": " << seconds
+			<< ", \"pixelsPerSecond\": " << (seconds > 0 ? totalPixels / seconds : 0)
+			<< "," << std::endl << "     \"latencyMs\": ";
+	instanceConfig.tracer.writeSummary(out);
+	instanceConfig.tracer.flushTrace();
+	out << "," << std::endl
+			<< "     \"peakRssMB\": " << getPeakRss()
+			<< ", \"budgetHighWaterMB\": " << instanceConfig.memoryBudget.getHighWaterMark() / (1024. * 1024.)
+			<< "}";
+
+	ERS_LOG(c.typeName << "/" << c.modeName << ", " << maskSteps << " mask step(s), "
+			<< pipeline.pool.getNumOfThreads() << " pool thread(s): "
+			<< (seconds > 0 ? totalPixels / seconds : 0) << " pixels/s")
+	return true;
+}
+
+} /* end of anonymous namespace */
+
+int main(int argc, char **argv) {
+	Options options;
+	options.output = "PixFitBench.json";
+	options.scanFile = PixFitInstanceConfig::slaveEmuRootFile;
+	options.maskSteps = {1, 2, 4, 8};
+	options.units = 4;
+	options.thresholdBins = 101;
+	options.binDelay = 0;
+	options.tuningSteps = 1;
+	options.streamingFit = PixFitInstanceConfig::streamingFit;
+	options.fitMethod = PixFitInstanceConfig::fitMethod;
+	options.fitMethodName = "default";
+	for (int threads = 1; threads <= PixFitInstanceConfig::getThreadingSettings(); threads *= 2) {
+		options.poolThreads.push_back(threads);
+	}
+
+	int opt;
+	while ((opt = getopt(argc, argv, "o:u:m:t:c:b:f:s:T:d:S:l:W:A:h")) != -1) {
+		switch (opt) {
+		case 'o': options.output = optarg; break;
+		case 'u': options.units = std::max(1, atoi(optarg)); break;
+		case 'm': options.maskSteps = splitIntList(optarg); break;
+		case 't': options.poolThreads = splitIntList(optarg); break;
+		case 'c': options.cases = splitList(optarg); break;
+		case 'b': options.thresholdBins = std::max(2, atoi(optarg)); break;
+		case 's': options.scanFile = optarg; break;
+		case 'T': options.trace = optarg; break;
+		case 'l': options.tuningSteps = std::max(1, atoi(optarg)); break;
+		case 'd': options.binDelay = std::max(0, atoi(optarg)); break;
+		case 'S': options.streamingFit = (strcmp(optarg, "off") != 0); break;
+		case 'W': options.workers = optarg; break;
+		case 'A': options.assemblers = optarg; break;
+		case 'f':
+			options.fitMethodName = optarg;
+			if (strcmp(optarg, "lmmin") == 0) options.fitMethod = FitMethod::FIT_LMMIN;
+			else if (strcmp(optarg, "simd") == 0) options.fitMethod = FitMethod::FIT_SIMD;
+			else if (strcmp(optarg, "moment") == 0) options.fitMethod = FitMethod::FIT_MOMENT;
+			else if (strcmp(optarg, "lut") == 0) options.fitMethod = FitMethod::FIT_DSP_LUT;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	for (auto steps : options.maskSteps) {
+		if (steps != 1 && steps != 2 && steps != 4 && steps != 8) {
+			std::cerr << "Mask steps have to be 1, 2, 4 or 8." << std::endl;
+			return 1;
+		}
+	}
+
+	PixFitResult::setupRoot();
+	PixFitInstanceConfig instanceConfig("PixFitBench", "PixFitBench", "bench", true);
+	instanceConfig.workerStage = PixFitInstanceConfig::parseStageConfig(options.workers);
+	instanceConfig.assemblerStage = PixFitInstanceConfig::parseStageConfig(options.assemblers);
+	if (!options.trace.empty() && !instanceConfig.tracer.openTrace(options.trace)) {
+		std::cerr << "Could not open " << options.trace << std::endl;
+		return 1;
+	}
+
+	/* Threshold scans convert bins to Vcal with the PixScan, the others do not need it. */
+	bool threshold = false;
+	for (auto& c : s_cases) threshold = threshold || (c.type == ScanType::THRESHOLD && selected(options, c));
+	std::shared_ptr<PixScan> pixScan;
+	if (threshold) {
+		pixScan = loadPixScan(options.scanFile);
+		if (!pixScan) ERS_INFO("No PixScan in " << options.scanFile << ", skipping threshold scans.")
+	}
+
+	char host[256] = "";
+	gethostname(host, sizeof(host) - 1);
+	const time_t startTime = time(nullptr);
+	char date[32];
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&startTime));
+
+	std::ostringstream out;
+	out << "{" << std::endl
+			<< "  \"fitServerVersion\": \"" << PixFitInstanceConfig::fitServerVersion << "\"," << std::endl
+			<< "  \"date\": \"" << date << "\"," << std::endl
+			<< "  \"host\": \"" << host << "\"," << std::endl
+			<< "  \"hardwareThreads\": " << PixFitInstanceConfig::getThreadingSettings() << "," << std::endl
+			<< "  \"fitMethod\": \"" << options.fitMethodName << "\"," << std::endl
+			<< "  \"streamingFit\": " << (options.streamingFit ? "true" : "false") << "," << std::endl
+			<< "  \"binDelayUs\": " << options.binDelay << "," << std::endl
+			<< "  \"unpackKernel\": \"" << PixFitUnpack::getKernelName() << "\"," << std::endl
+			<< "  \"receiveLayout\": \""
+			<< (PixFitInstanceConfig::receiveLayout == RawHisto::Layout::BIN_MAJOR ? "BIN_MAJOR" : "PIXEL_MAJOR") << "\"," << std::endl
+			<< "  \"cases\": [" << std::endl;
+
+	bool ok = true;
+	bool first = true;
+	PixFitScanConfig::ScanIdType scanId = 1;
+	for (auto threads : options.poolThreads) {
+		Pipeline *pipeline = new Pipeline(instanceConfig, threads, options.fitMethod); // never deleted, see Pipeline
+		for (auto& c : s_cases) {
+			if (!selected(options, c) || (c.type == ScanType::THRESHOLD && !pixScan)) continue;
+			for (auto steps : options.maskSteps) {
+				for (int tuningStep = 0; tuningStep < options.tuningSteps; tuningStep++) {
+					std::ostringstream caseOut;
+					ok = runCase(options, c, steps, tuningStep, *pipeline, instanceConfig, pixScan, scanId++, caseOut);
+					if (!ok) break;
+					if (!first) out << "," << std::endl;
+					out << caseOut.str();
+					first = false;
+				}
+				if (!ok) break;
+			}
+			if (!ok) break;
+		}
+		if (!ok) break;
+	}
+
+	rusage resources;
+	getrusage(RUSAGE_SELF, &resources);
+	out << std::endl << "  ]," << std::endl
+			<< "  \"complete\": " << (ok ? "true" : "false") << "," << std::endl
+			<< "  \"peakRssMB\": " << resources.ru_maxrss / 1024. << "," << std::endl
+			<< "  \"metrics\": ";
+	instanceConfig.metrics.write(out);
+	out << std::endl << "}" << std::endl;
+
+	std::ofstream file(options.output.c_str());
+	file << out.str();
+	if (!file) {
+		std::cerr << "Could not write " << options.output << std::endl;
+		return 1;
+	}
+	std::cout << "Results written to " << options.output << std::endl;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,156 @@
+/* @file PixFitBufferPool.cxx
+ */
+
+#include <cstdlib>
+
+#include <sys/mman.h>
+
+#include <ers/ers.h>
+
+#include "PixFitBufferPool.h"
+
+using namespace PixLib;
+
+PixFitBufferPool& PixFitBufferPool::instance() {
+	static PixFitBufferPool pool;
+	return pool;
+}
+
+PixFitBufferPool::PixFitBufferPool() : m_maxCachedBytes(s_defaultMaxCachedBytes), m_noHugePages(false) {
+	m_stats.hits = 0;
+	m_stats.misses = 0;
+	m_stats.trims = 0;
+	m_stats.cachedBytes = 0;
+	m_stats.totalBytes = 0;
+	m_stats.hugePageBytes = 0;
+}
+
+PixFitBufferPool::~PixFitBufferPool() {
+	trim();
+}
+
+size_t PixFitBufferPool::getSizeClass(size_t size) {
+	const size_t granularity = (size >= s_hugePageSize) ? s_hugePageSize : s_pageSize;
+	return (size + granularity - 1) / granularity * granularity;
+}
+
+void* PixFitBufferPool::acquire(size_t size, size_t &capacity) {
+	capacity = getSizeClass(size);
+
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		std::vector<void*> &buffers = m_free[capacity];
+		if (!buffers.empty()) {
+			void *buffer = buffers.back();
+			buffers.pop_back();
+			m_stats.hits++;
+			m_stats.cachedBytes -= capacity;
+			return buffer;
+		}
+		m_stats.misses++;
+	}
+
+	/* Allocate outside of the lock, mapping large buffers can take a while. */
+	void *buffer = allocate(capacity);
+
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	if (buffer != nullptr) m_stats.totalBytes += capacity;
+	return buffer;
+}
+
+void PixFitBufferPool::release(void *buffer, size_t capacity) {
+	if (buffer == nullptr) return;
+
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		if (m_stats.cachedBytes + capacity <= m_maxCachedBytes) {
+			m_free[capacity].push_back(buffer);
+			m_stats.cachedBytes += capacity;
+			return;
+		}
+		m_stats.trims++;
+		m_stats.totalBytes -= capacity;
+	}
+	deallocate(buffer, capacity);
+}
+
+std::shared_ptr<char> PixFitBufferPool::acquireShared(size_t size) {
+	size_t capacity = 0;
+	char *buffer = static_cast<char *>(acquire(size, capacity));
+	if (buffer == nullptr) return std::shared_ptr<char>();
+	return std::shared_ptr<char>(buffer, [this, capacity](char *p) { release(p, capacity); });
+}
+
+void PixFitBufferPool::setMaxCachedBytes(size_t bytes) {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_maxCachedBytes = bytes;
+}
+
+void PixFitBufferPool::trim() {
+	std::map<size_t, std::vector<void*> > buffers;
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		buffers.swap(m_free);
+		m_stats.totalBytes -= m_stats.cachedBytes;
+		m_stats.cachedBytes = 0;
+	}
+	for (auto& sizeClass : buffers) {
+		for (auto buffer : sizeClass.second) {
+			deallocate(buffer, sizeClass.first);
+		}
+	}
+}
+
+PixFitBufferPool::Statistics PixFitBufferPool::getStatistics() {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_stats;
+}
+
+void* PixFitBufferPool::allocate(size_t capacity) {
+	if (capacity < s_hugePageSize) {
+		void *buffer = nullptr;
+		if (posix_memalign(&buffer, s_alignment, capacity) != 0) return nullptr;
+		return buffer;
+	}
+
+	void *buffer = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	/* Explicit huge pages only exist if the administrator reserved some (vm.nr_hugepages). */
+	if (!m_noHugePages) {
+		buffer = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buffer != MAP_FAILED) {
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+			m_hugePageBuffers[buffer] = capacity;
+			m_stats.hugePageBytes += capacity;
+			return buffer;
+		}
+		m_noHugePages = true;
+		ERS_LOG("No explicit huge pages available for histogram buffers, using transparent huge pages.")
+	}
+#endif
+
+	buffer = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffer == MAP_FAILED) return nullptr;
+#ifdef MADV_HUGEPAGE
+	madvise(buffer, capacity, MADV_HUGEPAGE);
+#endif
+	return buffer;
+}
+
+void PixFitBufferPool::deallocate(void *buffer, size_t capacity) {
+	if (capacity < s_hugePageSize) {
+		free(buffer);
+		return;
+	}
+
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		std::map<void*, size_t>::iterator it = m_hugePageBuffers.find(buffer);
+		if (it != m_hugePageBuffers.end()) {
+			m_stats.hugePageBytes -= it->second;
+			m_hugePageBuffers.erase(it);
+		}
+	}
+	munmap(buffer, capacity);
+}
@@ -0,0 +1,123 @@
+/* @file PixFitBufferPool.h
+ */
+
+#ifndef PIXFITBUFFERPOOL_H_
+#define PIXFITBUFFERPOOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+namespace PixLib {
+
+/** Process-wide pool of histogram buffers. RawHistos take their memory from here and hand it back
+ * when they are destroyed, i.e. when the last shared_ptr to them is dropped, so during a scan the
+ * same few buffers circulate between PixFitNet, the workers and the assembler without touching
+ * the heap.
+ * Buffers are grouped in size classes: sizes are rounded up to the page size, or to the huge page
+ * size for large buffers. Large buffers are mapped with explicit huge pages if the system has some
+ * reserved, otherwise transparent huge pages are requested. All buffers are at least 64-byte
+ * aligned. Free buffers are kept up to a configurable amount of memory, the rest is returned to
+ * the system. */
+class PixFitBufferPool {
+public:
+	/** Counters for monitoring the pool. */
+	struct Statistics {
+		/** Requests served from a free buffer. */
+		unsigned long hits;
+
+		/** Requests that needed a new buffer. */
+		unsigned long misses;
+
+		/** Buffers returned to the system because the pool was full. */
+		unsigned long trims;
+
+		/** Bytes held in free buffers. */
+		size_t cachedBytes;
+
+		/** Bytes of all buffers that currently exist (free and in use). */
+		size_t totalBytes;
+
+		/** Bytes of buffers that are backed by explicit huge pages. */
+		size_t hugePageBytes;
+	};
+
+	/** @returns The pool instance of the process. */
+	static PixFitBufferPool& instance();
+
+	/** Gets a buffer. The content is undefined.
+	 * @param size Minimum size in bytes.
+	 * @param capacity Actual size of the buffer (its size class), needed for release().
+	 * @returns Pointer to the buffer, nullptr if the allocation failed. */
+	void* acquire(size_t size, size_t &capacity);
+
+	/** Hands a buffer back to the pool.
+	 * @param buffer Pointer returned by acquire().
+	 * @param capacity Capacity returned by acquire(). */
+	void release(void *buffer, size_t capacity);
+
+	/** Gets a buffer that goes back to the pool when the last shared_ptr to it is dropped.
+	 * @param size Minimum size in bytes.
+	 * @returns Pointer to the buffer, empty if the allocation failed. */
+	std::shared_ptr<char> acquireShared(size_t size);
+
+	/** Sets the maximum amount of memory that is kept in free buffers. Free buffers above the
+	 * limit are returned to the system immediately. */
+	void setMaxCachedBytes(size_t bytes);
+
+	/** Returns all free buffers to the system. */
+	void trim();
+
+	/** @returns Snapshot of the counters. */
+	Statistics getStatistics();
+
+	/** @returns The size class for a requested size. */
+	static size_t getSizeClass(size_t size);
+
+private:
+	PixFitBufferPool();
+	~PixFitBufferPool();
+	PixFitBufferPool(const PixFitBufferPool&) = delete;
+	PixFitBufferPool& operator=(const PixFitBufferPool&) = delete;
+
+	/** Gets memory from the system. */
+	void* allocate(size_t capacity);
+
+	/** Returns memory to the system. */
+	void deallocate(void *buffer, size_t capacity);
+
+	/** Free buffers by size class. */
+	std::map<size_t, std::vector<void*> > m_free;
+
+	/** Buffers that are mapped with explicit huge pages, they need no special treatment apart from
+	 * being counted. */
+	std::map<void*, size_t> m_hugePageBuffers;
+
+	size_t m_maxCachedBytes;
+	Statistics m_stats;
+
+	/** Set once mapping explicit huge pages failed, avoids futile attempts. */
+	std::atomic<bool> m_noHugePages;
+
+	boost::mutex m_mutex;
+
+	/** Buffers of at least this size are mapped directly and rounded to huge pages. */
+	static const size_t s_hugePageSize = 2 * 1024 * 1024;
+
+	/** Granularity of the small size classes. */
+	static const size_t s_pageSize = 4096;
+
+	/** Minimum alignment of all buffers. */
+	static const size_t s_alignment = 64;
+
+	/** Default for setMaxCachedBytes(). */
+	static const size_t s_defaultMaxCachedBytes = 512 * 1024 * 1024;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITBUFFERPOOL_H_ */
@@ -0,0 +1,58 @@
+/* @file PixFitChipMap.cxx
+ */
+
+#include <algorithm>
+
+#include <TH1.h>
+#include <TH2.h>
+
+#include "PixFitChipMap.h"
+
+using namespace PixLib;
+
+PixFitChipMap::PixFitChipMap() :
+		m_ncol(0),
+		m_nrow(0),
+		m_entries(0) {
+}
+
+void PixFitChipMap::allocate(int ncol, int nrow) {
+	m_ncol = ncol;
+	m_nrow = nrow;
+	m_entries = 0;
+	m_values.assign(static_cast<size_t>(ncol) * nrow, 0.f);
+	m_filled.assign(static_cast<size_t>(ncol) * nrow, false);
+}
+
+void PixFitChipMap::release() {
+	std::vector<float>().swap(m_values);
+	std::vector<bool>().swap(m_filled);
+	m_entries = 0;
+}
+
+void PixFitChipMap::copyTo(TH2F &histo, double scale, double offset) const {
+	/* Bins of a row are contiguous in ROOT as well, between the under- and overflow bins. */
+	float *bins = histo.GetArray();
+	for (int row = 0; row < m_nrow; row++) {
+		const size_t first = static_cast<size_t>(row) * m_ncol;
+		const float *values = &m_values[first];
+		float *dest = bins + histo.GetBin(1, row + 1);
+		if (scale == 1. && offset == 0.) {
+			/* Pixels that have not been filled are 0 already. */
+			std::copy(values, values + m_ncol, dest);
+		}
+		else {
+			for (int col = 0; col < m_ncol; col++) {
+				dest[col] = m_filled[first + col] ? scale * values[col] + offset : 0.f;
+			}
+		}
+	}
+	histo.ResetStats();
+	histo.SetEntries(m_entries);
+}
+
+void PixFitChipMap::fillInto(TH1F &histo) const {
+	for (size_t i = 0; i < m_values.size(); i++) {
+		if (m_filled[i]) histo.Fill(m_values[i]);
+	}
+}
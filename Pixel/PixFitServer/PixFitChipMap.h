@@ -0,0 +1,87 @@
+/* @file PixFitChipMap.h
+ */
+
+#ifndef PIXFITCHIPMAP_H_
+#define PIXFITCHIPMAP_H_
+
+#include <cstddef>
+#include <vector>
+
+class TH1F;
+class TH2F;
+
+namespace PixLib {
+
+/** Dense map of one value per pixel of a chip, stored row by row as plain floats.
+ * PixFitAssembler fills these instead of ROOT histograms, which needs neither a bin search nor the
+ * ROOT lock. The maps are turned into histograms in one go by PixFitResult::createHistograms()
+ * right before publishing. */
+class PixFitChipMap {
+public:
+	PixFitChipMap();
+
+	/** Sets the size and zeroes all values. */
+	void allocate(int ncol, int nrow);
+
+	/** Frees the values. */
+	void release();
+
+	/** @returns True between allocate() and release(). */
+	bool isAllocated() const {
+		return !m_values.empty();
+	}
+
+	/** Adds a value to a pixel, like TH2F::Fill(col, row, value), and marks the pixel as filled. */
+	void fill(int col, int row, float value) {
+		m_values[row * m_ncol + col] += value;
+		m_filled[row * m_ncol + col] = true;
+		m_entries++;
+	}
+
+	/** @returns True if the pixel has been filled, false if its mask step was not scanned. */
+	bool isFilled(int col, int row) const {
+		return m_filled[row * m_ncol + col];
+	}
+
+	/** @returns Value of a pixel. */
+	float operator()(int col, int row) const {
+		return m_values[row * m_ncol + col];
+	}
+
+	int getNumOfCols() const {
+		return m_ncol;
+	}
+
+	int getNumOfRows() const {
+		return m_nrow;
+	}
+
+	/** @returns Size of the values and the filled flags in bytes. */
+	size_t getBytes() const {
+		return m_values.size() * sizeof(float) + m_filled.size() / 8;
+	}
+
+	/** Copies the map into a histogram with ncol x nrow bins and the columns on the x axis, row by
+	 * row. The statistics of the histogram are recomputed from the bin contents.
+	 * @param scale, offset Each filled value is stored as scale * value + offset, pixels that have
+	 * not been filled stay 0. */
+	void copyTo(TH2F &histo, double scale = 1., double offset = 0.) const;
+
+	/** Fills the distribution of the values of the filled pixels into a histogram. */
+	void fillInto(TH1F &histo) const;
+
+private:
+	std::vector<float> m_values;
+
+	/** Pixels that have been filled. With partial mask staging the others were never scanned. */
+	std::vector<bool> m_filled;
+	int m_ncol;
+	int m_nrow;
+
+	/** Number of fill() calls, the entries of the histogram. */
+	size_t m_entries;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITCHIPMAP_H_ */
@@ -0,0 +1,79 @@
+/* @file PixFitDump.h
+ */
+
+#ifndef PIXFITDUMP_H_
+#define PIXFITDUMP_H_
+
+#include <stdint.h> // change to cstdint for C++11
+
+namespace PixLib {
+
+/** On-disk format of raw network dumps, written by PixFitDumpWriter.
+ *
+ * A dump file (.dump) starts with a FileHeader, followed by records. Every record is a
+ * RecordHeader and storedSize bytes of data: either a command header exactly as it was received
+ * from the ROD (RECORD_COMMAND) or the payload of a histogram data command (RECORD_PAYLOAD). The
+ * data of a record is deflate-compressed if the FLAG_DEFLATE bit is set, rawSize is the size
+ * before compression. All fields are in host byte order.
+ *
+ * Next to every dump file there is an index (.dump.idx): a FileHeader with magic s_indexMagic,
+ * followed by one IndexEntry per record, in file order. The index only lists records that have
+ * completely reached the dump file, so it stays consistent if the server dies while writing. */
+namespace PixFitDump {
+
+static const uint32_t s_fileMagic = 0x50464455; // "PFDU"
+static const uint32_t s_indexMagic = 0x50464958; // "PFIX"
+static const uint32_t s_recordMagic = 0x52454344; // "RECD"
+static const uint32_t s_version = 1;
+
+enum RecordType : uint16_t {
+	RECORD_COMMAND = 0,
+	RECORD_PAYLOAD = 1
+};
+
+enum RecordFlags : uint16_t {
+	FLAG_DEFLATE = 1
+};
+
+struct FileHeader {
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct RecordHeader {
+	uint32_t magic;
+	uint16_t type;
+	uint16_t flags;
+
+	/** Histogramming unit the data came from. */
+	int32_t crate;
+	int32_t rod;
+	int32_t slave;
+	int32_t histo;
+
+	/** Scan, mask step and bin the data belongs to as far as PixFitNet knows, bin is -1 for
+	 * commands. */
+	int32_t scanId;
+	int32_t maskId;
+	int32_t bin;
+
+	/** Bytes of data following the header in the file and bytes before compression. */
+	uint32_t storedSize;
+	uint32_t rawSize;
+	uint32_t reserved;
+
+	/** Receive time in nanoseconds since the epoch. */
+	uint64_t timestamp;
+};
+
+struct IndexEntry {
+	RecordHeader header;
+
+	/** Position of the RecordHeader in the dump file. */
+	uint64_t offset;
+};
+
+} /* end of namespace PixFitDump */
+} /* end of namespace PixLib */
+
+#endif /* PIXFITDUMP_H_ */
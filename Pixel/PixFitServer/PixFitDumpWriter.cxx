@@ -0,0 +1,335 @@
+/* @file PixFitDumpWriter.cxx
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <ers/ers.h>
+
+#include "PixFitDumpWriter.h"
+#include "PixFitBufferPool.h"
+
+using namespace PixLib;
+using namespace PixLib::PixFitDump;
+
+PixFitDumpWriter::PixFitDumpWriter(std::string directory, std::string prefix, bool compress,
+		size_t maxFileSize, size_t maxBufferedBytes) : m_ring(s_ringSlots) {
+	m_threadName = "dump";
+	this->m_directory = directory;
+	this->m_prefix = prefix;
+	this->m_compress = compress;
+	this->m_maxFileSize = maxFileSize;
+	this->m_maxBufferedBytes = maxBufferedBytes;
+	this->m_head = 0;
+	this->m_count = 0;
+	this->m_bufferedBytes = 0;
+	this->m_flushRequests = 0;
+	this->m_flushed = 0;
+	this->m_stats.records = 0;
+	this->m_stats.dropped = 0;
+	this->m_stats.files = 0;
+	this->m_stats.bytesWritten = 0;
+	this->m_fd = -1;
+	this->m_indexFd = -1;
+	this->m_direct = false;
+	this->m_fileNumber = 0;
+	this->m_fileOffset = 0;
+	this->m_persisted = 0;
+	this->m_preallocated = 0;
+	this->m_stagingLen = 0;
+
+	void *staging = nullptr;
+	if (posix_memalign(&staging, s_blockSize, s_stagingSize) != 0) staging = nullptr;
+	this->m_staging = static_cast<char *>(staging);
+}
+
+PixFitDumpWriter::~PixFitDumpWriter() {
+	if (m_fd != -1) closeFile();
+	free(m_staging);
+}
+
+bool PixFitDumpWriter::submit(const RecordHeader &header, const char *data, size_t size) {
+	Record record;
+	record.header = header;
+	if (size <= sizeof(record.inlineData)) {
+		memcpy(record.inlineData, data, size);
+	}
+	else {
+		std::shared_ptr<char> copy = PixFitBufferPool::instance().acquireShared(size);
+		if (!copy) {
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+			m_stats.dropped++;
+			return false;
+		}
+		memcpy(copy.get(), data, size);
+		record.data = copy;
+	}
+	return push(record, size);
+}
+
+bool PixFitDumpWriter::submit(const RecordHeader &header, std::shared_ptr<const char> data, size_t size) {
+	Record record;
+	record.header = header;
+	record.data = data;
+	return push(record, size);
+}
+
+bool PixFitDumpWriter::push(Record &record, size_t size) {
+	record.header.magic = s_recordMagic;
+	record.header.flags = 0;
+	record.header.rawSize = size;
+	record.header.storedSize = size;
+	record.header.reserved = 0;
+	record.header.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::system_clock::now().time_since_epoch()).count();
+
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	if (m_count == m_ring.size() || m_bufferedBytes + size > m_maxBufferedBytes) {
+		m_stats.dropped++;
+		return false;
+	}
+	m_ring[(m_head + m_count) % m_ring.size()] = record;
+	m_count++;
+	m_bufferedBytes += size;
+	m_dataCond.notify_one();
+	return true;
+}
+
+void PixFitDumpWriter::flush() {
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	const unsigned long request = ++m_flushRequests;
+	m_dataCond.notify_one();
+	while (m_flushed < request) m_flushCond.wait(lock);
+}
+
+PixFitDumpWriter::Statistics PixFitDumpWriter::getStatistics() {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_stats;
+}
+
+void PixFitDumpWriter::loop() {
+	if (m_staging == nullptr) {
+		ERS_INFO("Could not allocate staging buffer for dumping network data.")
+		return;
+	}
+
+	std::vector<Record> batch;
+	while (true) {
+		unsigned long flushRequests;
+		size_t batchBytes = 0;
+		{
+			boost::unique_lock<boost::mutex> lock(m_mutex);
+			if (m_count == 0 && m_flushed == m_flushRequests) {
+				m_dataCond.timed_wait(lock, boost::posix_time::milliseconds(s_idleFlushTime));
+			}
+			flushRequests = m_flushRequests;
+
+			/* Take everything at once, the slots are free again right away. */
+			for (; m_count > 0; m_count--) {
+				batch.push_back(m_ring[m_head]);
+				m_ring[m_head].data.reset();
+				batchBytes += m_ring[m_head].header.rawSize;
+				m_head = (m_head + 1) % m_ring.size();
+			}
+		}
+
+		for (auto& record : batch) writeRecord(record);
+		batch.clear();
+
+		/* Nothing new for a while or somebody waits: make everything visible on disk. */
+		if ((batchBytes == 0 || flushRequests != m_flushed) && m_fd != -1
+				&& m_persisted != m_fileOffset + m_stagingLen) {
+			writeStaging(true);
+		}
+
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_bufferedBytes -= batchBytes;
+		if (m_flushed != flushRequests) {
+			m_flushed = flushRequests;
+			m_flushCond.notify_all();
+		}
+	}
+}
+
+void PixFitDumpWriter::writeRecord(Record &record) {
+	const char *data = record.data ? record.data.get() : record.inlineData;
+	size_t size = record.header.rawSize;
+
+	/* Only keep the compressed data if it is actually smaller. */
+	if (m_compress && record.header.type == RECORD_PAYLOAD && size > 0) {
+		uLongf length = compressBound(size);
+		if (m_compressed.size() < length) m_compressed.resize(length);
+		if (compress2(reinterpret_cast<Bytef *>(m_compressed.data()), &length,
+				reinterpret_cast<const Bytef *>(data), size, Z_BEST_SPEED) == Z_OK && length < size) {
+			data = m_compressed.data();
+			size = length;
+			record.header.flags |= FLAG_DEFLATE;
+		}
+	}
+	record.header.storedSize = size;
+
+	const uint64_t recordSize = sizeof(RecordHeader) + size;
+	if (m_fd != -1 && m_fileOffset + m_stagingLen + recordSize > m_maxFileSize
+			&& m_fileOffset + m_stagingLen > sizeof(FileHeader)) {
+		closeFile();
+	}
+	if (m_fd == -1 && !openFile()) {
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_stats.dropped++;
+		return;
+	}
+
+	IndexEntry entry;
+	entry.header = record.header;
+	entry.offset = m_fileOffset + m_stagingLen;
+	m_pendingIndex.push_back(entry);
+
+	append(reinterpret_cast<const char *>(&record.header), sizeof(RecordHeader));
+	append(data, size);
+
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_stats.records++;
+	m_stats.bytesWritten += recordSize;
+}
+
+void PixFitDumpWriter::append(const char *data, size_t size) {
+	while (size > 0) {
+		const size_t n = std::min(size, s_stagingSize - m_stagingLen);
+		memcpy(m_staging + m_stagingLen, data, n);
+		m_stagingLen += n;
+		data += n;
+		size -= n;
+		if (m_stagingLen == s_stagingSize) writeStaging(false);
+	}
+}
+
+void PixFitDumpWriter::writeStaging(bool all) {
+	const size_t full = m_stagingLen / s_blockSize * s_blockSize;
+	const size_t length = all ? (m_stagingLen + s_blockSize - 1) / s_blockSize * s_blockSize : full;
+	if (length == 0 || m_fd == -1) return;
+	memset(m_staging + m_stagingLen, 0, length - m_stagingLen);
+
+	/* Preallocate ahead, this keeps the file contiguous. Not all file systems support it. */
+	while (m_fileOffset + length > m_preallocated) {
+		if (fallocate(m_fd, FALLOC_FL_KEEP_SIZE, m_preallocated, s_preallocateSize) != 0) {
+			m_preallocated = UINT64_MAX;
+			break;
+		}
+		m_preallocated += s_preallocateSize;
+	}
+
+	size_t done = 0;
+	while (done < length) {
+		ssize_t rc = pwrite(m_fd, m_staging + done, length - done, m_fileOffset + done);
+		if (rc < 0 && errno == EINTR) continue;
+		if (rc < 0 && errno == EINVAL && m_direct) {
+			/* The file system does not support direct I/O after all. */
+			fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+			m_direct = false;
+			continue;
+		}
+		if (rc <= 0) {
+			/* Give up on this file, the next record starts a new one. */
+			ERS_LOG(m_threadName << ": Writing dump file failed: " << strerror(errno))
+			close(m_fd);
+			close(m_indexFd);
+			m_fd = -1;
+			m_indexFd = -1;
+			m_pendingIndex.clear();
+			m_stagingLen = 0;
+			return;
+		}
+		done += rc;
+	}
+
+	/* Keep the last, partial block, it is written again once it is complete. */
+	m_persisted = m_fileOffset + (all ? m_stagingLen : full);
+	memmove(m_staging, m_staging + full, m_stagingLen - full);
+	m_fileOffset += full;
+	m_stagingLen -= full;
+	writeIndex();
+}
+
+void PixFitDumpWriter::writeIndex() {
+	size_t n = 0;
+	while (n < m_pendingIndex.size()) {
+		const IndexEntry &entry = m_pendingIndex[n];
+		if (entry.offset + sizeof(RecordHeader) + entry.header.storedSize > m_persisted) break;
+		n++;
+	}
+	if (n == 0) return;
+
+	const size_t bytes = n * sizeof(IndexEntry);
+	if (write(m_indexFd, m_pendingIndex.data(), bytes) != static_cast<ssize_t>(bytes)) {
+		ERS_LOG(m_threadName << ": Writing dump index failed.")
+	}
+	m_pendingIndex.erase(m_pendingIndex.begin(), m_pendingIndex.begin() + n);
+}
+
+bool PixFitDumpWriter::openFile() {
+	char number[16];
+	snprintf(number, sizeof(number), "%04d", m_fileNumber++);
+	const std::string fileName = m_directory + "/" + m_prefix + "-" + number + ".dump";
+
+	m_direct = true;
+	m_fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+	if (m_fd == -1 && errno == EINVAL) {
+		m_direct = false;
+		m_fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (m_fd == -1) {
+		ERS_LOG(m_threadName << ": Could not open " << fileName << ": " << strerror(errno))
+		return false;
+	}
+
+	m_indexFd = open((fileName + ".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (m_indexFd == -1) {
+		ERS_LOG(m_threadName << ": Could not open index for " << fileName << ": " << strerror(errno))
+		close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+
+	FileHeader header;
+	header.magic = s_indexMagic;
+	header.version = s_version;
+	if (write(m_indexFd, &header, sizeof(header)) != sizeof(header)) {
+		ERS_LOG(m_threadName << ": Writing dump index failed.")
+	}
+
+	m_fileOffset = 0;
+	m_persisted = 0;
+	m_preallocated = 0;
+	m_stagingLen = 0;
+	header.magic = s_fileMagic;
+	append(reinterpret_cast<const char *>(&header), sizeof(header));
+
+	ERS_LOG(m_threadName << ": Dumping network data to " << fileName << (m_direct ? " (direct I/O)" : ""))
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_stats.files++;
+	return true;
+}
+
+void PixFitDumpWriter::closeFile() {
+	const uint64_t size = m_fileOffset + m_stagingLen;
+	writeStaging(true);
+	if (m_fd == -1) return;
+
+	/* Cut the padding of the last block and the preallocated space. */
+	if (ftruncate(m_fd, size) != 0) {
+		ERS_LOG(m_threadName << ": Truncating dump file failed.")
+	}
+	close(m_fd);
+	close(m_indexFd);
+	m_fd = -1;
+	m_indexFd = -1;
+	m_pendingIndex.clear();
+	m_stagingLen = 0;
+}
@@ -0,0 +1,162 @@
+/* @file PixFitDumpWriter.h
+ */
+
+#ifndef PIXFITDUMPWRITER_H_
+#define PIXFITDUMPWRITER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "PixFitThread.h"
+#include "PixFitDump.h"
+
+namespace PixLib {
+
+/** Writes raw network data to disk in the background (see PixFitDump.h for the format).
+ * PixFitNet hands over records with submit(), which never blocks: records go into a ring of
+ * s_ringSlots slots and are dropped, and counted, if the ring or its byte limit is full. Payloads
+ * that are in a pool buffer anyway are shared instead of copied.
+ * The writer thread collects records in an aligned staging buffer and writes it in large
+ * sequential chunks, with O_DIRECT if the file system supports it. File space is preallocated in
+ * steps of s_preallocateSize. Payloads are optionally deflate-compressed on the writer thread.
+ * A new file is started once a file reaches the configured maximum size. */
+class PixFitDumpWriter : public PixFitThread {
+public:
+	/** Counters for monitoring. */
+	struct Statistics {
+		unsigned long records;
+		unsigned long dropped;
+		unsigned long files;
+		size_t bytesWritten;
+	};
+
+	/** @param directory Directory for the dump files.
+	 * @param prefix Prefix of the file names, a sequence number and .dump are appended.
+	 * @param compress Deflate-compress payloads.
+	 * @param maxFileSize Size in bytes after which a new file is started.
+	 * @param maxBufferedBytes Maximum amount of data waiting to be written. */
+	PixFitDumpWriter(std::string directory, std::string prefix, bool compress,
+			size_t maxFileSize, size_t maxBufferedBytes);
+	virtual ~PixFitDumpWriter();
+
+	/** Queues a record, copying the data.
+	 * @param header Record header, only type, the histogramming unit, scanId, maskId and bin need
+	 * to be filled.
+	 * @param data Data of the record.
+	 * @param size Size of the data in bytes.
+	 * @returns False if the record was dropped. */
+	bool submit(const PixFitDump::RecordHeader &header, const char *data, size_t size);
+
+	/** Queues a record without copying. The data must not be modified afterwards. */
+	bool submit(const PixFitDump::RecordHeader &header, std::shared_ptr<const char> data, size_t size);
+
+	/** Writes everything queued so far to disk, the index included. Blocks until done. */
+	void flush();
+
+	/** @returns Snapshot of the counters. */
+	Statistics getStatistics();
+
+private:
+	/** One slot of the ring. Command headers are small and stored inline. */
+	struct Record {
+		PixFitDump::RecordHeader header;
+		std::shared_ptr<const char> data;
+		char inlineData[32];
+	};
+
+	void loop();
+
+	/** Puts a record into the ring, data or inlineData has to be set by the caller. */
+	bool push(Record &record, size_t size);
+
+	/** Appends a record to the current file, compressing it if configured. */
+	void writeRecord(Record &record);
+
+	/** Copies data into the staging buffer, writing out full blocks. */
+	void append(const char *data, size_t size);
+
+	/** Writes the staging buffer to the file.
+	 * @param all Also write the last, partially filled block (zero padded). It stays in the
+	 * staging buffer and is written again once it is complete. */
+	void writeStaging(bool all);
+
+	/** Appends the index entries of all records that are completely in the file. */
+	void writeIndex();
+
+	/** Starts the next file. */
+	bool openFile();
+
+	/** Writes out everything, cuts the file to its real size and closes it. */
+	void closeFile();
+
+	std::string m_directory;
+	std::string m_prefix;
+	bool m_compress;
+	size_t m_maxFileSize;
+	size_t m_maxBufferedBytes;
+
+	/** Ring of records, m_head is the next slot to write, m_count the number of used slots. */
+	std::vector<Record> m_ring;
+	size_t m_head;
+	size_t m_count;
+	size_t m_bufferedBytes;
+
+	/** Incremented by flush(), m_flushed follows once the writer thread has caught up. */
+	unsigned long m_flushRequests;
+	unsigned long m_flushed;
+
+	Statistics m_stats;
+
+	boost::mutex m_mutex;
+	boost::condition_variable m_dataCond;
+	boost::condition_variable m_flushCond;
+
+	/* The members below are only used by the writer thread. */
+
+	/** Current dump file and its index. */
+	int m_fd;
+	int m_indexFd;
+	bool m_direct;
+	int m_fileNumber;
+
+	/** File offset of the start of the staging buffer (always block aligned). */
+	uint64_t m_fileOffset;
+
+	/** Bytes at the start of the file that have been written completely. */
+	uint64_t m_persisted;
+
+	/** Bytes up to which file space has been preallocated. */
+	uint64_t m_preallocated;
+
+	/** Staging buffer and number of bytes in it. */
+	char *m_staging;
+	size_t m_stagingLen;
+
+	/** Index entries of records that are not completely in the file yet. */
+	std::vector<PixFitDump::IndexEntry> m_pendingIndex;
+
+	/** Buffer for compressed data. */
+	std::vector<char> m_compressed;
+
+	/** Number of slots of the ring. */
+	static const size_t s_ringSlots = 4096;
+
+	/** Size of the staging buffer, a multiple of s_blockSize. */
+	static const size_t s_stagingSize = 4 * 1024 * 1024;
+
+	/** Alignment of file offsets, sizes and memory for O_DIRECT. */
+	static const size_t s_blockSize = 4096;
+
+	/** Step for preallocating file space. */
+	static const uint64_t s_preallocateSize = 64 * 1024 * 1024;
+
+	/** Milliseconds without new records after which everything is written out. */
+	static const int s_idleFlushTime = 1000;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITDUMPWRITER_H_ */
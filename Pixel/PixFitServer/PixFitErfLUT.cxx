@@ -0,0 +1,88 @@
+/* @file PixFitErfLUT.cxx
+ */
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "PixFitErfLUT.h"
+
+using namespace PixLib;
+
+namespace {
+
+const double cSqrt2 = 1.41421356237309504880;
+
+const int s_erfcSize = static_cast<int>((PixFitErfLUT::xMax - PixFitErfLUT::xMin) / PixFitErfLUT::xStep + 0.5) + 1;
+const int s_probitSize = static_cast<int>(1. / PixFitErfLUT::pStep + 0.5) + 1;
+
+std::vector<double> buildErfcTable() {
+	std::vector<double> table(s_erfcSize);
+	for (int i = 0; i < s_erfcSize; i++) {
+		table[i] = std::erfc(PixFitErfLUT::xMin + i * PixFitErfLUT::xStep);
+	}
+	return table;
+}
+
+/* Tables are built once at library load. */
+const std::vector<double> s_erfcTable = buildErfcTable();
+
+/* Inverts the (monotonically falling) erfc table for every point of the probit grid. */
+std::vector<double> buildProbitTable() {
+	std::vector<double> table(s_probitSize);
+	for (int i = 0; i < s_probitSize; i++) {
+		/* p = erfc(t) / 2 with t = -z / sqrt(2). */
+		const double target = 2. * i * PixFitErfLUT::pStep;
+		std::vector<double>::const_iterator it = std::lower_bound(s_erfcTable.begin(),
+				s_erfcTable.end(), target, std::greater<double>());
+		double t;
+		if (it == s_erfcTable.begin()) {
+			t = PixFitErfLUT::xMin;
+		}
+		else if (it == s_erfcTable.end()) {
+			t = PixFitErfLUT::xMax;
+		}
+		else {
+			const int k = it - s_erfcTable.begin();
+			const double frac = (s_erfcTable[k - 1] - target) / (s_erfcTable[k - 1] - s_erfcTable[k]);
+			t = PixFitErfLUT::xMin + (k - 1 + frac) * PixFitErfLUT::xStep;
+		}
+		table[i] = -cSqrt2 * t;
+	}
+	return table;
+}
+
+const std::vector<double> s_probitTable = buildProbitTable();
+
+} /* end of anonymous namespace */
+
+double PixFitErfLUT::erfc(double x) {
+	if (x <= xMin) return 2.;
+	if (x >= xMax) return 0.;
+
+	const double pos = (x - xMin) / xStep;
+	const int i = static_cast<int>(pos);
+	if (i >= s_erfcSize - 1) return s_erfcTable[s_erfcSize - 1];
+	const double frac = pos - i;
+	return s_erfcTable[i] + frac * (s_erfcTable[i + 1] - s_erfcTable[i]);
+}
+
+double PixFitErfLUT::probit(double p) {
+	double slope;
+	return probit(p, slope);
+}
+
+double PixFitErfLUT::probit(double p, double &slope) {
+	slope = 0.;
+	if (p <= 0.) return s_probitTable[0];
+	if (p >= 1.) return s_probitTable[s_probitSize - 1];
+
+	const double pos = p / pStep;
+	const int i = static_cast<int>(pos);
+	if (i >= s_probitSize - 1) return s_probitTable[s_probitSize - 1];
+	const double frac = pos - i;
+	const double diff = s_probitTable[i + 1] - s_probitTable[i];
+	slope = diff / pStep;
+	return s_probitTable[i] + frac * diff;
+}
@@ -0,0 +1,42 @@
+/* @file PixFitErfLUT.h
+ */
+
+#ifndef PIXFITERFLUT_H_
+#define PIXFITERFLUT_H_
+
+namespace PixLib {
+
+/** Lookup tables for the complementary error function and its inverse.
+ * The tables are generated once when the library is loaded (this replaces the former erf_LUT.dat
+ * which had to be shipped with the package). Lookups use linear interpolation, so the results are
+ * continuous and can also be used inside numerical minimizers. */
+class PixFitErfLUT {
+public:
+	/** Interpolated erfc(x). Absolute error below 2e-9 inside the table range, outside the range
+	 * the asymptotic values 2 and 0 are returned (error below 7.5e-7). */
+	static double erfc(double x);
+
+	/** Inverse of the standard normal cumulative distribution function, i.e. returns z with
+	 * p = erfc(-z / sqrt(2)) / 2. Absolute error below 5e-6 for p in [0.01, 0.99].
+	 * @param p Probability, clamped to [0, 1].
+	 * @returns z, limited to the range that is covered by the erfc table. */
+	static double probit(double p);
+
+	/** Same as probit(p), also returns the local slope dz/dp = 1/phi(z) of the table.
+	 * @param p Probability, clamped to [0, 1].
+	 * @param slope Derivative of z with respect to p.
+	 * @returns z, limited to the range that is covered by the erfc table. */
+	static double probit(double p, double &slope);
+
+	/** Range and granularity of the erfc table (same as the former erf_LUT.dat). */
+	constexpr static const double xMin = -3.5;
+	constexpr static const double xMax = 3.5;
+	constexpr static const double xStep = 1e-4;
+
+	/** Granularity of the probit table. */
+	constexpr static const double pStep = 1e-4;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITERFLUT_H_ */
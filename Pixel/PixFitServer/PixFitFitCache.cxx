@@ -0,0 +1,104 @@
+/* @file PixFitFitCache.cxx
+ */
+
+#include <tuple>
+
+#include "PixFitFitCache.h"
+#include "PixFitScanConfig.h"
+
+using namespace PixLib;
+
+bool PixFitFitCache::Key::operator<(const Key &rhs) const {
+	return std::tie(crate, rod, slave, histo, maskId, bins, injections, vcalMin, vcalStep)
+			< std::tie(rhs.crate, rhs.rod, rhs.slave, rhs.histo, rhs.maskId, rhs.bins, rhs.injections,
+					rhs.vcalMin, rhs.vcalStep);
+}
+
+PixFitFitCache::PixFitFitCache() :
+		m_bytes(0),
+		m_maxBytes(0),
+		m_clock(0) {
+}
+
+PixFitFitCache::~PixFitFitCache() {
+}
+
+void PixFitFitCache::setMaxBytes(size_t bytes) {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_maxBytes = bytes;
+	evict();
+}
+
+PixFitFitCache::Key PixFitFitCache::makeKey(const PixFitScanConfig &scanConfig) {
+	Key key;
+	key.crate = scanConfig.histogrammer.crate;
+	key.rod = scanConfig.histogrammer.rod;
+	key.slave = scanConfig.histogrammer.slave;
+	key.histo = scanConfig.histogrammer.histo;
+	key.maskId = scanConfig.maskId;
+	key.bins = scanConfig.getNumOfBins();
+	key.injections = scanConfig.getInjections();
+	key.vcalMin = 0;
+	key.vcalStep = 0;
+	if (scanConfig.pixScanConfig) {
+		key.vcalMin = scanConfig.getVcalfromBin(0);
+		key.vcalStep = scanConfig.getVcalfromBin(1) - key.vcalMin;
+	}
+	return key;
+}
+
+std::shared_ptr<const PixFitFitCache::Entry> PixFitFitCache::find(const PixFitScanConfig &scanConfig) {
+	const Key key = makeKey(scanConfig);
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	auto it = m_slots.find(key);
+	if (it == m_slots.end()) return std::shared_ptr<const Entry>();
+	it->second.lastUse = ++m_clock;
+	return it->second.entry;
+}
+
+void PixFitFitCache::store(const PixFitScanConfig &scanConfig, const double *par, int pixels) {
+	const size_t bytes = 2 * sizeof(float) * pixels;
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		if (bytes > m_maxBytes) return;
+	}
+
+	/* Entries are shared with running fits, so they are replaced instead of updated. */
+	std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+	entry->mu.resize(pixels);
+	entry->sigma.resize(pixels);
+	for (int i = 0; i < pixels; i++) {
+		entry->mu[i] = par[2 * i];
+		entry->sigma[i] = par[2 * i + 1];
+	}
+
+	const Key key = makeKey(scanConfig);
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	Slot &slot = m_slots[key];
+	if (slot.entry) m_bytes -= 2 * sizeof(float) * slot.entry->mu.size();
+	slot.entry = entry;
+	slot.lastUse = ++m_clock;
+	m_bytes += bytes;
+	evict();
+}
+
+void PixFitFitCache::evict() {
+	while (m_bytes > m_maxBytes && !m_slots.empty()) {
+		auto oldest = m_slots.begin();
+		for (auto it = m_slots.begin(); it != m_slots.end(); ++it) {
+			if (it->second.lastUse < oldest->second.lastUse) oldest = it;
+		}
+		m_bytes -= 2 * sizeof(float) * oldest->second.entry->mu.size();
+		m_slots.erase(oldest);
+	}
+}
+
+size_t PixFitFitCache::getEntries() const {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_slots.size();
+}
+
+size_t PixFitFitCache::getBytes() const {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_bytes;
+}
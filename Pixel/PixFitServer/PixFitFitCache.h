@@ -0,0 +1,87 @@
+/* @file PixFitFitCache.h
+ */
+
+#ifndef PIXFITFITCACHE_H_
+#define PIXFITFITCACHE_H_
+
+#include <stdint.h> // change to cstdint for C++11
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+namespace PixLib {
+
+class PixFitScanConfig;
+
+/** Keeps the S-curves of the last threshold fit of every histogramming unit and mask step.
+ * Threshold tunings scan the same units over and over with slightly changed settings, so the
+ * previous curve of a pixel is a much better initial guess than the one from analyzing the data.
+ * It is only ever a starting point: the fit still updates it with the new data, it just needs
+ * fewer iterations. Only fitted curves are stored.
+ * Entries are only reused for the same number of bins, injections and Vcal range. The least
+ * recently used entries are dropped when the cache grows beyond its limit. */
+class PixFitFitCache {
+public:
+	/** S-curves of all pixels of a histogram, in bins. mu is -1 for pixels without a result. */
+	struct Entry {
+		std::vector<float> mu;
+		std::vector<float> sigma;
+	};
+
+	PixFitFitCache();
+	virtual ~PixFitFitCache();
+
+	/** Sets the maximum size of all entries.
+	 * @param bytes Limit in bytes, 0 disables the cache. */
+	void setMaxBytes(size_t bytes);
+
+	/** Looks up the last result of a histogram.
+	 * @returns The entry, nullptr if there is none. */
+	std::shared_ptr<const Entry> find(const PixFitScanConfig &scanConfig);
+
+	/** Replaces the entry of a histogram.
+	 * @param par Fit results as in PixFitResult::thresh_array (mu and sigma per pixel, -1 if
+	 * there is none). */
+	void store(const PixFitScanConfig &scanConfig, const double *par, int pixels);
+
+	/** @returns Number of entries. */
+	size_t getEntries() const;
+
+	/** @returns Size of all entries in bytes. */
+	size_t getBytes() const;
+
+private:
+	/** Histogramming unit, mask step and the scan parameters the curves depend on. */
+	struct Key {
+		int crate, rod, slave, histo;
+		int maskId;
+		int bins;
+		int injections;
+		double vcalMin, vcalStep;
+
+		bool operator<(const Key &rhs) const;
+	};
+
+	struct Slot {
+		std::shared_ptr<const Entry> entry;
+		uint64_t lastUse;
+	};
+
+	static Key makeKey(const PixFitScanConfig &scanConfig);
+
+	/** Drops least recently used entries until the cache fits into its limit. */
+	void evict();
+
+	std::map<Key, Slot> m_slots;
+	size_t m_bytes;
+	size_t m_maxBytes;
+	uint64_t m_clock;
+	mutable boost::mutex m_mutex;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITFITCACHE_H_ */
@@ -5,6 +5,8 @@
  *      Author: mkretz, marx
  */
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <memory>
 
@@ -25,14 +27,20 @@
 #include "RawHisto.h"
 #include "PixFitManager.h" // for global locks
 #include "PixFitResult.h"
-#include "PixFitInstanceConfig.h" // for threading settings
+#include "PixFitErfLUT.h"
+#include "PixFitFitCache.h"
+#include "PixFitMoments.h"
+#include "PixFitStreamingFit.h"
+#include "PixFitThreadPool.h"
 
-#include <boost/asio.hpp>
-#include <boost/thread/thread.hpp>
-#include <boost/bind.hpp>
+#include <functional>
+#include <vector>
+#include <sys/time.h>
 
 using namespace PixLib;
 
+constexpr const double PixFitFitter_lmfit::s_sigmaMin;
+
 int getRow(unsigned int j);
 
 PixFitFitter_lmfit::PixFitFitter_lmfit() {
@@ -41,25 +49,20 @@ PixFitFitter_lmfit::PixFitFitter_lmfit() {
 PixFitFitter_lmfit::~PixFitFitter_lmfit() {
 }
 
-std::shared_ptr<PixFitResult> PixFitFitter_lmfit::fit(std::shared_ptr<RawHisto> histo) {
-	vcal_bins = histo->getScanConfig()->getNumOfBins();
-	inj_iterations = histo->getScanConfig()->getInjections();
-	return doFit(PixFitInstanceConfig::getThreadingSettings(), histo);
-}
-
 // determines range of "good" data for a single pixel
-void PixFitFitter_lmfit::analyzeData(std::shared_ptr<RawHisto> histo, ValidBins* validBins, int pixelNumber) {
+template <RawHisto::Layout L>
+void PixFitFitter_lmfit::analyzeData(RawHisto &histo, ValidBins* validBins, int pixelNumber) {
 	int i = 0;
 	int start = 0;
 	int end = 0;
 	int startsigma = 0;
 	int endsigma = 0;
-	int size = histo->getScanConfig()->getNumOfBins();
+	int size = histo.getScanConfig()->getNumOfBins();
 	double a0_guess, a1_guess, a2_guess;
 
 	// get first bin > 0
 	for (i = 0; i < size; i++) {
-		if ((*histo)(pixelNumber, i, 0) != 0.0) {
+		if (histo.at<L>(pixelNumber, i) != 0.0) {
 			if (i > 0)
 				start = i - 1; // include one zero datapoint
 			else
@@ -69,26 +72,26 @@ void PixFitFitter_lmfit::analyzeData(std::shared_ptr<RawHisto> histo, ValidBins*
 	}
 
 	// guess plateau
-	a0_guess = 0.999 * (*histo)(pixelNumber, size - 1, 0);
+	a0_guess = 0.999 * histo.at<L>(pixelNumber, size - 1);
 	for (i = start; i < size; i++) {
-	  if ((*histo)(pixelNumber, i, 0) >= a0_guess) {
+	  if (histo.at<L>(pixelNumber, i) >= a0_guess) {
 	    end = i;
 	    break;
 	  }
 	}
 
 	// guess lower and upper boundary for sigma
-	a1_guess = 0.16 * (*histo)(pixelNumber, size - 1, 0);
-	a2_guess = 0.84 * (*histo)(pixelNumber, size - 1, 0);
+	a1_guess = 0.16 * histo.at<L>(pixelNumber, size - 1);
+	a2_guess = 0.84 * histo.at<L>(pixelNumber, size - 1);
 	// guess the DSP way - find the range over which the data crosses the 16% and 84% points
 	int hi1 = 0; int hi2 = 0;
 	int lo1 = 0; int lo2 = 0;
 	int j = size - 1;
 	for(int k = 0; k < size ;) {
-	  if(!lo1 && ((*histo)(pixelNumber, k, 0) >= a1_guess)) lo1 = k;
-	  if(!lo2 && ((*histo)(pixelNumber, k, 0) >= a2_guess)) lo2 = k;
-	  if(!hi1 && ((*histo)(pixelNumber, size - 1 - k, 0) <= a1_guess)) hi1 = j;
-	  if(!hi2 && ((*histo)(pixelNumber, size - 1 - k, 0) <= a2_guess)) hi2 = j;
+	  if(!lo1 && (histo.at<L>(pixelNumber, k) >= a1_guess)) lo1 = k;
+	  if(!lo2 && (histo.at<L>(pixelNumber, k) >= a2_guess)) lo2 = k;
+	  if(!hi1 && (histo.at<L>(pixelNumber, size - 1 - k) <= a1_guess)) hi1 = j;
+	  if(!hi2 && (histo.at<L>(pixelNumber, size - 1 - k) <= a2_guess)) hi2 = j;
 	  --j;
 	  ++k;
 	}
@@ -96,13 +99,13 @@ void PixFitFitter_lmfit::analyzeData(std::shared_ptr<RawHisto> histo, ValidBins*
 	endsigma = (lo2 + hi2) * 0.5;
 	// guess in a more naive way
 	/*for (i = start; i < size; i++) {
-	  if ((*histo)(pixelNumber, i, 0) >= a1_guess) {
+	  if (histo.at<L>(pixelNumber, i) >= a1_guess) {
 	    startsigma = i;
 	    break;
 	  }
 	}
 	for (i = start; i < size; i++) {
-	  if ((*histo)(pixelNumber, i, 0) >= a2_guess) {
+	  if (histo.at<L>(pixelNumber, i) >= a2_guess) {
 	    endsigma = i;
 	    break;
 	  }
@@ -120,10 +123,6 @@ void PixFitFitter_lmfit::analyzeData(std::shared_ptr<RawHisto> histo, ValidBins*
 }
 
 
-std::shared_ptr<PixFitResult> PixFitFitter_lmfit::doFit(int nthreads, std::shared_ptr<RawHisto> histo) {
-	return lmfit(nthreads, histo);
-}
-
 /////////// LM FIT //////////////
 double PixFitFitter_lmfit::simpleerfWrapper(double x, const double *par, const PixFitFitter_lmfit *fitterInstance) {
         return fitterInstance->simpleerf(x, par);
@@ -131,23 +130,106 @@ double PixFitFitter_lmfit::simpleerfWrapper(double x, const double *par, const P
 
 double PixFitFitter_lmfit::simpleerf(double x, const double *par) const{
   return 0.5 * inj_iterations * (2 - erfc((x - par[0]) / (par[1] * cSqrt2))); // use analytic function - 2 params (careful with normalisation!)
-	//return 0.5 * inj_iterations*( 2 - matchLUT((x-par[0])/(par[1] * cSqrt2)) ); // use LUTs - only works if lmmin.c values get tweaked
+	//return 0.5 * inj_iterations*( 2 - matchLUT((x-par[0])/(par[1] * cSqrt2)) ); // use interpolated LUT
 	//return lut[((int) x)]*par[1]+par[0]; // use x-y reversed lut - need to change x-y order in lmcurve
 }
 
 
-std::shared_ptr<PixFitResult> PixFitFitter_lmfit::lmfit(int nthread,
-		std::shared_ptr<RawHisto> histo) {
+double PixFitFitter_lmfit::matchLUT(double x) {
+	return PixFitErfLUT::erfc(x);
+}
+
+/** State of a histogram whose pixel chunks have been handed to the thread pool. */
+class PixFitFitter_lmfit::Pending : public PixFitAbstractFitter::PendingFit {
+public:
+	Pending(std::shared_ptr<RawHisto> histo, PixFitThreadPool *pool, PixFitFitCache *fitCache,
+			bool momentFastPath);
+	virtual ~Pending();
+
+	virtual std::shared_ptr<PixFitResult> finish();
+
+private:
+	/** Data points of a single pixel that needs a fit. */
+	struct FitTask {
+		int pixel;
+		int offset;
+		int valid;
+	};
+
+	/** Guesses initial values, copies the data points and decides which pixels need a fit.
+	 * @tparam L Layout of the histogram. */
+	template <RawHisto::Layout L> void setup();
+
+	/** Posts the chunks of pixels to the pool or fits them right away if there is no pool. */
+	void post();
+
+	/** Fits the pixels of m_fitList in [first, last). */
+	void fitRange(int first, int last);
+
+	std::shared_ptr<RawHisto> m_histo;
+	PixFitThreadPool *m_pool;
+	PixFitFitCache *m_fitCache;
+	const bool m_momentFastPath;
+	const unsigned int npoints;
+	const unsigned int pixels;
+
+	/** Evaluates the S-curve with the settings of this histogram, so that the fitter itself can
+	 * already set up the next one. */
+	PixFitFitter_lmfit m_model;
+
+	std::unique_ptr<double[]> x;
+	std::unique_ptr<double[]> y;
+	std::unique_ptr<lm_status_struct[]> status;
+	std::unique_ptr<lm_control_struct[]> control;
+	std::unique_ptr<double[]> par;
+	std::vector<FitTask> m_fitList;
+
+	/** Sum of squared residuals of the pixels taken from the PixFitStreamingFit, the PixFitFitCache
+	 * or their moments without a fit, -1 for the others. nullptr if none of them is used. */
+	std::unique_ptr<double[]> m_acceptedResiduals;
+
+	/** Released when all chunks are done, nullptr if nothing was posted. */
+	std::unique_ptr<PixFitLatch> m_latch;
+
+	int zero;
+	int streamed;
+	int reused;
+	int estimated;
+	timeval begin;
+
+	static const int n_par = 2;
+};
+
+PixFitFitter_lmfit::Pending::Pending(std::shared_ptr<RawHisto> histo, PixFitThreadPool *pool,
+		PixFitFitCache *fitCache, bool momentFastPath) :
+		m_histo(histo),
+		m_pool(pool),
+		m_fitCache(fitCache),
+		m_momentFastPath(momentFastPath),
+		npoints(histo->getScanConfig()->getNumOfBins()),
+		pixels(histo->getScanConfig()->getNumOfPixels()),
+		zero(0),
+		streamed(0),
+		reused(0),
+		estimated(0) {
+	m_model.vcal_bins = npoints;
+	m_model.inj_iterations = histo->getScanConfig()->getInjections();
+	if (histo->getLayout() == RawHisto::Layout::PIXEL_MAJOR) setup<RawHisto::Layout::PIXEL_MAJOR>();
+	else setup<RawHisto::Layout::BIN_MAJOR>();
+	post();
+}
 
-	// Init options
-	unsigned int threads = nthread;
-	const unsigned int npoints = histo->getScanConfig()->getNumOfBins();
-	const unsigned int pixels = histo->getScanConfig()->getNumOfPixels();
+PixFitFitter_lmfit::Pending::~Pending() {
+	/* Chunks still refer to our arrays. */
+	if (m_latch) m_latch->wait();
+}
 
+template <RawHisto::Layout L>
+void PixFitFitter_lmfit::Pending::setup() {
 	ERS_DEBUG(1, "Reading " << npoints << " points of data for " << pixels << " pixels")
 
-	std::unique_ptr<double[]> x(new double[npoints * pixels]);
-	std::unique_ptr<double[]> y(new double[npoints * pixels]);
+	x.reset(new double[npoints * pixels]);
+	y.reset(new double[npoints * pixels]);
 
 	// for debugging purposes, make a root file with occ histograms (only temporary)
 #if 0
@@ -156,14 +238,14 @@ std::shared_ptr<PixFitResult> PixFitFitter_lmfit::lmfit(int nthread,
 
 	TString filename = "threshold.root";
 	TFile file(filename.Data(), "RECREATE");
-	TH1F* histo_scurve = new TH1F("scurve", "scurve", vcal_bins, 0., vcal_bins);
-	for(int thebin = 0; thebin<vcal_bins; thebin++){
+	TH1F* histo_scurve = new TH1F("scurve", "scurve", npoints, 0., npoints);
+	for(unsigned int thebin = 0; thebin<npoints; thebin++){
 	  TString k = Form ("%d", thebin);
 	  TH2F* histo_occ = new TH2F("occupancy"+k, "occupancy"+k, 80, 0., 80., 336, 0., 336.);
 	  for (unsigned int i = 0; i < pixels; i++) {
 	    int row = getRow(i);
-	    histo_occ->Fill(i - (row * 80), row, (*histo)(i, thebin, 0));
-	    if((*histo)(i, thebin, 0) <= inj_iterations) histo_scurve->Fill(thebin,(*histo)(i, thebin, 0));
+	    histo_occ->Fill(i - (row * 80), row, m_histo->at<L>(i, thebin));
+	    if(m_histo->at<L>(i, thebin) <= m_model.inj_iterations) histo_scurve->Fill(thebin,m_histo->at<L>(i, thebin));
 	  }
 	  histo_occ->Write();
 	}
@@ -173,66 +255,110 @@ std::shared_ptr<PixFitResult> PixFitFitter_lmfit::lmfit(int nthread,
 #endif
 
 	// Init fitter
-	ERS_LOG("Initializing lmfit fitter with " << threads << " threads.")
-	std::unique_ptr<lm_status_struct[]> status(new lm_status_struct[pixels]);
+	ERS_LOG("Initializing lmfit fitter with " << (m_pool ? m_pool->getNumOfThreads() : 1) << " threads.")
+	status.reset(new lm_status_struct[pixels]);
 	/* Initialize outcome so that we can tell if lmfit was actually run for this pixel later on. */
 	for (unsigned int i = 0; i < pixels; i++) {
 		status[i].outcome = -1;
 	}
 
-	std::unique_ptr<lm_control_struct[]> control(new lm_control_struct[pixels]);
+	control.reset(new lm_control_struct[pixels]);
 
-	const int n_par = 2;
 	/* Allocate memory for the results of the fit (n_par variables: mu and sigma) plus chi2 at the end of the array. */
-	std::unique_ptr<double[]> par(new double[pixels * n_par + pixels]);
+	par.reset(new double[pixels * n_par + pixels]);
+	m_fitList.reserve(pixels);
 
 	int overall_counter = 0;
 	ValidBins validBins;
 
-	/* Guess initial values. */
-	for (unsigned int i = 0; i < pixels; i++) {
-		control[i] = lm_control_double;
-		control[i].verbosity = 0;
-		analyzeData(histo, &validBins, i);
-		par[i*n_par+0] = validBins.start + (validBins.valid / 2);
-		par[i*n_par+1] = (validBins.endsigma - validBins.startsigma) / cSqrt2; //TODO: this could do with a bit of optimization
-		//ERS_DEBUG(1, std::cout << "Pixel " << i << ": initial guess thr = " << par[i*n_par+0] << ", noise = " << par[i*n_par+1])
-	}
-
-	// Thread pool
-
 	// Timer
-	timeval begin, finish;
-
-	// Counters for fit results
-	int exh = 0, trap = 0, zero = 0, convbad = 0, conv = 0;
-
-	// Only keep data that holds bins around s-curve centroid and do fit
 	gettimeofday(&begin, 0);
 
-	/* Use boost's io_service to handle the fit work with a threadpool. */
-	boost::asio::io_service ioservice(threads);
-	boost::thread_group tp;
+	const PixFitStreamingFit *streamingFit = m_histo->getStreamingFit().get();
+	std::shared_ptr<const PixFitFitCache::Entry> cached;
+	if (m_fitCache) cached = m_fitCache->find(*m_histo->getScanConfig());
+	if (cached && cached->mu.size() != pixels) cached.reset();
+	if (streamingFit || cached || m_momentFastPath) {
+	  m_acceptedResiduals.reset(new double[pixels]);
+	  std::fill(m_acceptedResiduals.get(), m_acceptedResiduals.get() + pixels, -1.);
+	}
 
+	/* In moment mode the moments of all pixels are taken in one pass, vectorized across pixels on
+	 * bin-major data. */
+	std::unique_ptr<PixFitMoments::Estimate[]> estimates;
+	if (m_momentFastPath) {
+	  estimates.reset(new PixFitMoments::Estimate[pixels]);
+	  PixFitMoments::estimateRange(*m_histo, 0, pixels, npoints, estimates.get());
+	}
+
+	/* Guess initial values and only keep data that holds bins around s-curve centroid. */
 	for (unsigned int i = 0; i < pixels; i++) {
-	  analyzeData(histo, &validBins, i);
-	  if (i == 0)
-	    overall_counter = validBins.start;
+	  control[i] = lm_control_double;
+	  control[i].verbosity = 0;
+
+	  /* Take the estimate of pixels that were complete before the last bin arrived. */
+	  double mu, sigma;
+	  if (streamingFit && streamingFit->getResult(*m_histo, i, mu, sigma, m_acceptedResiduals[i])) {
+	    par[i*n_par+0] = mu;
+	    par[i*n_par+1] = sigma;
+	    streamed++;
+	    continue;
+	  }
+	  if (m_acceptedResiduals) m_acceptedResiduals[i] = -1;
+
+	  const PixFitMoments::Estimate *moments = nullptr;
+	  if (m_momentFastPath) {
+	    /* Start from the moments of the rise, or from its middle if noise pushed the mean outside. */
+	    moments = &estimates[i];
+	    validBins.start = moments->start;
+	    validBins.end = moments->end;
+	    validBins.valid = moments->valid;
+	    const bool inside = moments->mu >= moments->start && moments->mu <= moments->end;
+	    par[i*n_par+0] = inside ? moments->mu : moments->start + (moments->valid / 2);
+	    par[i*n_par+1] = std::max(moments->sigma, s_sigmaMin);
+	  }
+	  else {
+	    m_model.analyzeData<L>(*m_histo, &validBins, i);
+	    par[i*n_par+0] = validBins.start + (validBins.valid / 2);
+	    par[i*n_par+1] = (validBins.endsigma - validBins.startsigma) / cSqrt2; //TODO: this could do with a bit of optimization
+	  }
+
 	  if(validBins.valid > 0){
 	    for (int point = validBins.start; point < (validBins.end + 1); point++) {
 	      x[overall_counter] = point; // VCal steps
-	      y[overall_counter] = (*histo)(i, point, 0); //number of injections
+	      y[overall_counter] = m_histo->at<L>(i, point); //number of injections
 	      overall_counter++;
 	    }
 	  }
-	  //cout << "Pixel "<< i << " start " << data->start << " end " << data->end << " bins " << data->validBins << " counter " << overall_counter << endl;
-	  
+
 	  /* Schedule fit only when there are more than 2 valid bins. */
 	  if (validBins.valid > 2) {
-			ioservice.post(boost::bind(lmcurve, n_par, &par[n_par*i], validBins.valid,
-				    &x[overall_counter - validBins.valid],
-				    &y[overall_counter - validBins.valid], simpleerfWrapper,
-				    &control[i], &status[i], this));
+	    /* Clean S-curves are described by their moments already, lmmin only gets the outliers. */
+	    if (moments != nullptr && matchesData(*m_histo, i, validBins.start, validBins.end, m_model.inj_iterations,
+	        moments->mu, moments->sigma, m_acceptedResiduals[i])) {
+	      par[i*n_par+0] = moments->mu;
+	      par[i*n_par+1] = moments->sigma;
+	      estimated++;
+	      continue;
+	    }
+	    if (m_acceptedResiduals) m_acceptedResiduals[i] = -1;
+
+	    /* Start from the curve of the previous scan. lmmin stops on a step that is small relative to
+	     * the parameter vector, so the tolerance is scaled to stop once mu and sigma change by less
+	     * than s_seedTol * sigma. */
+	    if (cached && cached->mu[i] >= 0) {
+	      mu = cached->mu[i];
+	      sigma = std::max<double>(cached->sigma[i], s_sigmaMin);
+	      par[i*n_par+0] = mu;
+	      par[i*n_par+1] = sigma;
+	      control[i].xtol = std::max(control[i].xtol, s_seedTol * sigma / std::sqrt(mu * mu + sigma * sigma));
+	      reused++;
+	    }
+	    FitTask task;
+	    task.pixel = i;
+	    task.offset = overall_counter - validBins.valid;
+	    task.valid = validBins.valid;
+	    m_fitList.push_back(task);
 	  }
 	  /* @todo: test if code is quick enough and can handle 3 bins or if analytical solution should
 	   * be added here also if only 2, use analytical solution from DSP code. */
@@ -246,22 +372,59 @@ std::shared_ptr<PixFitResult> PixFitFitter_lmfit::lmfit(int nthread,
 	    par[i*n_par+1] = -1;
 	  }
 	}
-	for (unsigned int i = 0; i < threads; i++) {
-	    tp.create_thread(boost::bind(&boost::asio::io_service::run, &ioservice));
+}
+
+void PixFitFitter_lmfit::Pending::post() {
+	const int numToFit = m_fitList.size();
+	const int chunks = (numToFit + s_chunkSize - 1) / s_chunkSize;
+
+	if (!m_pool || chunks < 2) {
+		fitRange(0, numToFit);
+		return;
 	}
 
-	
+	m_latch.reset(new PixFitLatch(chunks));
+	for (int c = 0; c < chunks; c++) {
+		m_pool->post(std::bind(&Pending::fitRange, this, c * s_chunkSize,
+				std::min((c + 1) * s_chunkSize, numToFit)), m_latch.get());
+	}
+}
+
+void PixFitFitter_lmfit::Pending::fitRange(int first, int last) {
+	for (int k = first; k < last; k++) {
+		const FitTask &task = m_fitList[k];
+		lmcurve(n_par, &par[n_par*task.pixel], task.valid, &x[task.offset], &y[task.offset],
+				simpleerfWrapper, &control[task.pixel], &status[task.pixel], &m_model);
+	}
+}
+
+std::shared_ptr<PixFitResult> PixFitFitter_lmfit::Pending::finish() {
 	/* Wait to finish tasks. */
-	tp.join_all();
+	if (m_latch) {
+		m_pool->wait(*m_latch);
+		m_latch.reset();
+	}
 
+	timeval finish;
 	gettimeofday(&finish, 0);
 	
 	double time = finish.tv_sec - begin.tv_sec + 1e-6 * (finish.tv_usec - begin.tv_usec);
-	ERS_LOG("Done fitting! (in " << time << "s with " << time / static_cast<double>(pixels) * 1e6 << "us per pixel)")
+	ERS_DEBUG(0, "Done fitting! (in " << time << "s with " << time / static_cast<double>(pixels) * 1e6 << "us per pixel)")
+
+	// Counters for fit results
+	int exh = 0, trap = 0, convbad = 0, conv = 0;
 
 	// Fit results
 	for (unsigned int i = 0; i < pixels; i++) {
-	  if (status[i].outcome != -1) {
+	  if (m_acceptedResiduals && m_acceptedResiduals[i] >= 0) {
+	    conv++;
+	    if (par[n_par * i + 0] < 0) {
+	      convbad++;
+	      par[n_par * i + 0] = -1;
+	      par[n_par * i + 1] = -1;
+	    }
+	  }
+	  else if (status[i].outcome != -1) {
 	    std::string searchstatus = lm_infmsg[status[i].outcome];
 	    if (searchstatus.find("exhausted") != std::string::npos) exh++;
 	    if (searchstatus.find("trapped") != std::string::npos) trap++;
@@ -276,7 +439,7 @@ std::shared_ptr<PixFitResult> PixFitFitter_lmfit::lmfit(int nthread,
 									<< ", noise = " << par[n_par * i + 1] << std::endl;
 					std::cout << "  raw bin values: ";
 					for (unsigned int j = 0; j < npoints; j++) {
-						std::cout << (*histo)(i, j, 0) << " ";
+						std::cout << (*m_histo)(i, j, 0) << " ";
 					}
 					std::cout << std::endl;
 				}
@@ -294,7 +457,7 @@ std::shared_ptr<PixFitResult> PixFitFitter_lmfit::lmfit(int nthread,
 							<< par[n_par * i + 1] << std::endl;
 					std::cout << "  raw bin values: ";
 					for (unsigned int j = 0; j < npoints; j++) {
-						std::cout << (*histo)(i, j, 0) << " ";
+						std::cout << (*m_histo)(i, j, 0) << " ";
 					}
 					std::cout << std::endl;
 				}
@@ -303,16 +466,30 @@ std::shared_ptr<PixFitResult> PixFitFitter_lmfit::lmfit(int nthread,
 			}
 	  }
 	}
-	ERS_LOG("Fit failure summary: total bad = " << exh + trap + convbad << ", total zero = " << zero)
-	ERS_LOG("  (ex " << exh << " / trap " << trap << " / convbad " << convbad << " / converged " << conv << ")")
+	ERS_DEBUG(0, "Fit failure summary: total bad = " << exh + trap + convbad << ", total zero = " << zero
+			<< " (ex " << exh << " / trap " << trap << " / convbad " << convbad << " / converged " << conv << ")")
 
 	/* Fill threshold and noise values for a chip into array to pass to Publisher */
-	std::shared_ptr<PixFitResult> result = std::make_shared<PixFitResult>(histo->getScanConfig());
+	std::shared_ptr<PixFitResult> result = std::make_shared<PixFitResult>(m_histo->getScanConfig());
+	result->fitOutcomes.converged = conv;
+	result->fitOutcomes.badConvergence = convbad;
+	result->fitOutcomes.exhausted = exh;
+	result->fitOutcomes.trapped = trap;
+	result->fitOutcomes.zero = zero;
+	result->fitOutcomes.streamed = streamed;
+	result->fitOutcomes.reused = reused;
+	result->fitOutcomes.estimated = estimated;
+
+	/* Keep the curves as initial guesses for the next scan, before the chi2 values are appended. */
+	if (m_fitCache) m_fitCache->store(*m_histo->getScanConfig(), par.get(), pixels);
 
 	/* Get chi2 values and write them at the back of the array. In case no fit was run fill with -1. */
 	int offset = pixels*n_par;
 	for (unsigned int i = 0; i < pixels; i++) {
-	  if (status[i].outcome != -1) {
+	  if (m_acceptedResiduals && m_acceptedResiduals[i] >= 0) {
+	    par[offset + i] = std::sqrt(m_acceptedResiduals[i]) / (npoints - n_par - 1); // same as fnorm
+	  }
+	  else if (status[i].outcome != -1) {
 	    par[offset + i] = status[i].fnorm / (npoints - n_par - 1); //chi2 per n.d.f.
 	  }
 	  else {
@@ -320,8 +497,6 @@ std::shared_ptr<PixFitResult> PixFitFitter_lmfit::lmfit(int nthread,
 	  }
 	}
 
-	result->thresh_array = std::move(par);
-
 	// In case you want to print the whole shebang
 #if 0
 	for (unsigned int i = 0; i < pixels; i++) {
@@ -331,9 +506,19 @@ std::shared_ptr<PixFitResult> PixFitFitter_lmfit::lmfit(int nthread,
 	  std::cout << "  Chi2 = " << status[i].fnorm  / (npoints - n_par - 1) << std::endl;
 	}
 #endif
+
+	result->thresh_array = std::move(par);
 	return result;
 }
 
+std::shared_ptr<PixFitResult> PixFitFitter_lmfit::fit(std::shared_ptr<RawHisto> histo) {
+	return startFit(histo)->finish();
+}
+
+std::unique_ptr<PixFitAbstractFitter::PendingFit> PixFitFitter_lmfit::startFit(std::shared_ptr<RawHisto> histo) {
+	return std::unique_ptr<PendingFit>(new Pending(histo, m_pool, m_fitCache, m_momentFastPath));
+}
+
 int getRow(unsigned int j){
   unsigned int row = 0;
   for (unsigned int x = 0; x < 336; x++) {
@@ -20,11 +20,11 @@
 #include "lmmin.h"
 
 #include "PixFitAbstractFitter.h"
+#include "RawHisto.h"
 
 namespace PixLib {
 
 class PixFitResult;
-class RawHisto;
 
 class PixFitFitter_lmfit : public PixFitAbstractFitter {
 public:
@@ -48,18 +48,22 @@ struct ValidBins {
 
 	virtual std::shared_ptr<PixFitResult> fit(std::shared_ptr<RawHisto> histo);
 
-	void analyzeData(std::shared_ptr<RawHisto> histo, ValidBins* validBins, int pixelNumber);
+	/** Sets up the histogram and posts chunks of pixels to the thread pool. */
+	virtual std::unique_ptr<PendingFit> startFit(std::shared_ptr<RawHisto> histo);
 
-	std::shared_ptr<PixFitResult> doFit(int nthreads, std::shared_ptr<RawHisto> histo);
+	/** Determines the range of good data of a pixel.
+	 * @tparam L Layout of the histogram, has to match histo.getLayout(). */
+	template <RawHisto::Layout L> void analyzeData(RawHisto &histo, ValidBins* validBins, int pixelNumber);
 
 	// LM fit
 	double simpleerf(double x, const double *par) const;
 	static double simpleerfWrapper(double x, const double *par, const PixFitFitter_lmfit *fitterInstance);
 	static double matchLUT(double x);
-	std::shared_ptr<PixFitResult> lmfit(int nthread, std::shared_ptr<RawHisto> histo);
 
 
 private:
+	class Pending;
+
 	int vcal_bins;
         static void lmcurve( int n_par, double *par, int m_dat, 
               const double *t, const double *y,
@@ -73,8 +77,18 @@ private:
 	constexpr static const double cSqrt2 = 1.41421356237309504880f;
 	constexpr static const double cInvSqrt6 = 0.40824829046f;
 
+	/** Lower bound for the initial sigma guess, steps within a single bin have no width. */
+	constexpr static const double s_sigmaMin = 0.5;
+
+	/** Step below which a fit that started from the previous curve of the pixel is final, in units
+	 * of sigma, see PixFitFitCache. */
+	constexpr static const double s_seedTol = 0.05;
+
 	/** Controls the verbosity of the fit output. */
 	static const bool s_doverbose = false;
+
+	/** Number of pixels per task of the thread pool. */
+	static const int s_chunkSize = 128;
 };
 } /* end of namespace PixLib */
 
@@ -0,0 +1,162 @@
+/* @file PixFitFitter_lut.cxx
+ */
+
+#include <cmath>
+#include <memory>
+
+#include <sys/time.h>
+
+#include <ers/ers.h>
+
+#include "PixFitFitter_lut.h"
+#include "PixFitErfLUT.h"
+#include "RawHisto.h"
+#include "PixFitResult.h"
+
+using namespace PixLib;
+
+PixFitFitter_lut::PixFitFitter_lut() {
+}
+
+PixFitFitter_lut::~PixFitFitter_lut() {
+}
+
+PixFitFitter_lut::Outcome PixFitFitter_lut::estimate(const RawHisto::histoWord_type *data,
+		int stride, int bins, double injections, double &mu, double &sigma, double &chi2) {
+	mu = -1;
+	sigma = -1;
+	chi2 = -1;
+
+	const double top = data[(bins - 1) * stride];
+	const double plateau = 0.999 * top;
+	const double level16 = 0.16 * injections;
+	const double level84 = 0.84 * injections;
+	const double invInjections = 1. / injections;
+
+	int firstNonZero = -1;
+	int firstPlateau = -1;
+	double x16 = -1;
+	double x84 = -1;
+	double prev = 0;
+
+	/* Sums for the weighted regression z = a + b*x. */
+	double s0 = 0, sx = 0, sz = 0, sxx = 0, sxz = 0;
+	int points = 0;
+
+	for (int i = 0; i < bins; i++) {
+		const double y = data[i * stride];
+		if (firstNonZero < 0 && y != 0.0) firstNonZero = i;
+		if (firstPlateau < 0 && y >= plateau) firstPlateau = i;
+
+		/* Interpolated crossing points, DSP style. */
+		if (x16 < 0 && y >= level16) x16 = (i > 0) ? i - 1 + (level16 - prev) / (y - prev) : i;
+		if (x84 < 0 && y >= level84) x84 = (i > 0) ? i - 1 + (level84 - prev) / (y - prev) : i;
+		prev = y;
+
+		/* Linearize the transition region. The weight is 1/var(z) up to a constant, with
+		 * var(z) = (dz/dp)^2 * var(p) and var(p) = p(1-p)/N. */
+		const double p = y * invInjections;
+		if (p >= s_pMin && p <= s_pMax) {
+			double slope;
+			const double z = PixFitErfLUT::probit(p, slope);
+			const double w = 1. / (slope * slope * p * (1. - p));
+			s0 += w;
+			sx += w * i;
+			sz += w * z;
+			sxx += w * i * i;
+			sxz += w * i * z;
+			points++;
+		}
+	}
+
+	/* Same bin range as PixFitMoments::estimate(), used to identify pixels without hits and
+	 * for the chi2 computation. */
+	const int start = (firstNonZero > 0) ? firstNonZero - 1 : 0;
+	const int end = (plateau > 0.) ? firstPlateau : start;
+	if (!((end - start > 0) || (end - start == 0 && end != 0))) {
+		return OUTCOME_ZERO;
+	}
+
+	Outcome outcome = OUTCOME_FAILED;
+	const double det = s0 * sxx - sx * sx;
+	const double b = (points >= 2 && det > 0.) ? (s0 * sxz - sx * sz) / det : 0.;
+	if (b > 0.) {
+		const double a = (sz - b * sx) / s0;
+		mu = -a / b;
+		sigma = 1. / b;
+		outcome = OUTCOME_REGRESSION;
+	}
+	else if (x16 >= 0 && x84 > x16) {
+		mu = 0.5 * (x16 + x84);
+		sigma = 0.5 * (x84 - x16);
+		outcome = OUTCOME_CROSSING;
+	}
+
+	if (outcome == OUTCOME_FAILED || mu < 0) {
+		mu = -1;
+		sigma = -1;
+		return OUTCOME_FAILED;
+	}
+
+	/* Chi2 with the same definition as lmmin's residual norm. */
+	double sum = 0;
+	const double inv = 1. / (sigma * cSqrt2);
+	for (int i = start; i <= end; i++) {
+		const double r = data[i * stride]
+				- injections * (1. - 0.5 * PixFitErfLUT::erfc((i - mu) * inv));
+		sum += r * r;
+	}
+	chi2 = std::sqrt(sum) / (bins - 2 - 1);
+
+	return outcome;
+}
+
+std::shared_ptr<PixFitResult> PixFitFitter_lut::fit(std::shared_ptr<RawHisto> histo) {
+	const int npoints = histo->getScanConfig()->getNumOfBins();
+	const int pixels = histo->getScanConfig()->getNumOfPixels();
+	const double injections = histo->getScanConfig()->getInjections();
+	const int stride = histo->getBinStride();
+
+	const int n_par = 2;
+	/* Results (n_par variables: mu and sigma) plus chi2 at the end of the array. */
+	std::unique_ptr<double[]> par(new double[pixels * n_par + pixels]);
+	const int offset = pixels * n_par;
+
+	// Counters for results
+	int regression = 0, crossing = 0, failed = 0, zero = 0;
+
+	timeval begin, finish;
+	gettimeofday(&begin, 0);
+
+	for (int i = 0; i < pixels; i++) {
+		switch (estimate((*histo)(i, 0), stride, npoints, injections,
+				par[n_par * i + 0], par[n_par * i + 1], par[offset + i])) {
+		case OUTCOME_REGRESSION:
+			regression++;
+			break;
+		case OUTCOME_CROSSING:
+			crossing++;
+			break;
+		case OUTCOME_FAILED:
+			failed++;
+			break;
+		case OUTCOME_ZERO:
+			zero++;
+			break;
+		}
+	}
+
+	gettimeofday(&finish, 0);
+	double time = finish.tv_sec - begin.tv_sec + 1e-6 * (finish.tv_usec - begin.tv_usec);
+	ERS_DEBUG(0, "Done with LUT estimates! (in " << time << "s with "
+			<< time / static_cast<double>(pixels) * 1e6 << "us per pixel)")
+	ERS_DEBUG(0, "Estimate summary: total bad = " << failed << ", total zero = " << zero
+			<< " (regression " << regression << " / crossing points " << crossing << ")")
+
+	std::shared_ptr<PixFitResult> result = std::make_shared<PixFitResult>(histo->getScanConfig());
+	result->thresh_array = std::move(par);
+	result->fitOutcomes.converged = regression + crossing;
+	result->fitOutcomes.failed = failed;
+	result->fitOutcomes.zero = zero;
+	return result;
+}
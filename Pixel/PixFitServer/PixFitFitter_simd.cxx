@@ -0,0 +1,512 @@
+/* @file PixFitFitter_simd.cxx
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <sys/time.h>
+
+#include <ers/ers.h>
+
+#include "PixFitFitter_simd.h"
+#include "PixFitSimd.h"
+#include "PixFitFitCache.h"
+#include "PixFitStreamingFit.h"
+#include "PixFitThreadPool.h"
+#include "RawHisto.h"
+#include "PixFitResult.h"
+
+using namespace PixLib;
+
+namespace {
+
+using namespace PixLib::PixFitSimd;
+
+/** Maximum number of LM iterations per pixel. */
+const int s_maxIter = 100;
+
+/** Relative reduction of the sum of squares below which a lane is considered converged. */
+const double s_ftol = 1e-10;
+
+/** Relative parameter change below which a lane is considered converged. */
+const double s_xtol = 1e-10;
+
+/** Step below which a fit that started from the previous curve of the pixel is final, in units
+ * of sigma. The curve has then been updated with the new data at least once. */
+const double s_seedTol = 0.05;
+
+/** Damping above which no improvement is possible anymore. */
+const double s_lambdaMax = 1e10;
+
+/** Lower bound for the initial sigma guess, the Jacobian is singular for sigma == 0. */
+const double s_sigmaMin = 0.5;
+
+const double cSqrt2 = 1.41421356237309504880;
+const double cInvSqrtPi = 0.56418958354775628695;
+
+/* Evaluates the model N * (1 - erfc((x - mu) / (sigma * sqrt2)) / 2) for all bins in [bmin, bmax]
+ * and accumulates the sum of squared residuals S, the normal matrix J^T*J (a00, a01, a11) and the
+ * gradient J^T*r (g0, g1). Bins outside a lane's valid range have weight 0. */
+template <class V>
+PIXFIT_SIMD_INLINE void evaluate(const double *y, const double *w, int bmin, int bmax,
+		double injections, const V &mu, const V &sigma, V &S, V &a00, V &a01, V &a11, V &g0, V &g1) {
+	const int W = Traits<V>::width;
+	const V inv = 1.0 / (sigma * cSqrt2);
+	const V zero = {};
+	S = a00 = a01 = a11 = g0 = g1 = zero;
+
+	for (int b = bmin; b <= bmax; b++) {
+		V yv, wv;
+		load(y + (b - bmin) * W, yv);
+		load(w + (b - bmin) * W, wv);
+		const V u = (static_cast<double>(b) - mu) * inv;
+		V gauss, erfcU;
+		exp(-u * u, gauss);
+		erfc(u, gauss, erfcU);
+		const V f = injections - (0.5 * injections) * erfcU;
+		const V r = (yv - f) * wv;
+
+		/* Partial derivatives of the model with respect to mu and sigma. */
+		const V jmu = (-injections * cInvSqrtPi) * gauss * inv * wv;
+		const V jsigma = jmu * u * cSqrt2;
+
+		S += r * r;
+		a00 += jmu * jmu;
+		a01 += jmu * jsigma;
+		a11 += jsigma * jsigma;
+		g0 += jmu * r;
+		g1 += jsigma * r;
+	}
+}
+
+/* Fits the pixels fitList[first] to fitList[last - 1], W pixels at a time.
+ * @tparam L Layout of the histogram. */
+template <class V, RawHisto::Layout L>
+PIXFIT_SIMD_INLINE void fitLanes(const PixFitFitter_simd::FitJob &job, int first, int last) {
+	typedef typename Traits<V>::IntV I;
+	const int W = Traits<V>::width;
+	const int bins = job.bins;
+
+	/* Data of the current batch as [bin][lane]. */
+	std::vector<double> y(bins * W);
+	std::vector<double> w(bins * W);
+
+	for (int i = first; i < last; i += W) {
+		const int n = std::min(W, last - i);
+
+		/* Common bin range of the batch. */
+		int bmin = bins;
+		int bmax = 0;
+		for (int l = 0; l < n; l++) {
+			const PixFitMoments::Estimate &vb = job.estimates[job.fitList[i + l]];
+			bmin = std::min(bmin, vb.start);
+			bmax = std::max(bmax, vb.end);
+		}
+
+		/* Gather data and initial guesses, unused lanes get zero weight. */
+		double mu0[W], sigma0[W];
+		long long lanes[W], seededLanes[W];
+		for (int l = 0; l < W; l++) {
+			const int pixel = (l < n) ? job.fitList[i + l] : -1;
+			mu0[l] = (l < n) ? job.par[2 * pixel] : 0.;
+			sigma0[l] = (l < n) ? job.par[2 * pixel + 1] : 1.;
+			lanes[l] = (l < n) ? -1 : 0;
+			seededLanes[l] = (l < n && job.seeded[pixel]) ? -1 : 0;
+			for (int b = bmin; b <= bmax; b++) {
+				const int k = (b - bmin) * W + l;
+				if (l < n && b >= job.estimates[pixel].start && b <= job.estimates[pixel].end) {
+					y[k] = job.histo->at<L>(pixel, b);
+					w[k] = 1.;
+				}
+				else {
+					y[k] = 0.;
+					w[k] = 0.;
+				}
+			}
+		}
+
+		V mu, sigma;
+		load(mu0, mu);
+		load(sigma0, sigma);
+		I active;
+		std::memcpy(&active, lanes, sizeof(I));
+		I seeded;
+		std::memcpy(&seeded, seededLanes, sizeof(I));
+		const I none = {};
+		I converged = none;
+		I trapped = none;
+
+		V S, a00, a01, a11, g0, g1;
+		evaluate(&y[0], &w[0], bmin, bmax, job.injections, mu, sigma, S, a00, a01, a11, g0, g1);
+		V lambda;
+		broadcast(1e-3, lambda);
+
+		for (int iter = 0; iter < s_maxIter && any(active); iter++) {
+			/* Solve the damped 2x2 normal equations. */
+			const V d00 = a00 * (1.0 + lambda);
+			const V d11 = a11 * (1.0 + lambda);
+			const V det = d00 * d11 - a01 * a01;
+			const V dmu = (g0 * d11 - g1 * a01) / det;
+			const V dsigma = (d00 * g1 - a01 * g0) / det;
+			const V muT = mu + dmu;
+			const V sigmaT = sigma + dsigma;
+
+			V ST, a00T, a01T, a11T, g0T, g1T;
+			evaluate(&y[0], &w[0], bmin, bmax, job.injections, muT, sigmaT,
+					ST, a00T, a01T, a11T, g0T, g1T);
+
+			/* Accept steps that reduce the sum of squares (NaNs fail all comparisons). */
+			const I accept = active & (ST <= S) & (sigmaT > 0.0);
+			const I smallF = (S - ST <= s_ftol * S);
+			V absDmu, absDsigma, absMu, absSigma;
+			abs(dmu, absDmu);
+			abs(dsigma, absDsigma);
+			abs(mu, absMu);
+			abs(sigma, absSigma);
+			const I smallX = (absDmu <= s_xtol * (absMu + s_xtol)) & (absDsigma <= s_xtol * (absSigma + s_xtol));
+
+			select(accept, muT, mu, mu);
+			select(accept, sigmaT, sigma, sigma);
+			select(accept, ST, S, S);
+			select(accept, a00T, a00, a00);
+			select(accept, a01T, a01, a01);
+			select(accept, a11T, a11, a11);
+			select(accept, g0T, g0, g0);
+			select(accept, g1T, g1, g1);
+			select(accept, lambda * 0.1, lambda * 10.0, lambda);
+
+			const I smallSeedStep = (absDmu <= s_seedTol * sigmaT) & (absDsigma <= s_seedTol * sigmaT);
+
+			const I done = active & ((accept & smallF) | smallX | (S == 0.0) | (seeded & accept & smallSeedStep));
+			const I stuck = active & ~done & ~accept & (lambda > s_lambdaMax);
+			converged |= done;
+			trapped |= stuck;
+			active &= ~(done | stuck);
+		}
+
+		/* Scatter results. */
+		for (int l = 0; l < n; l++) {
+			const int pixel = job.fitList[i + l];
+			job.par[2 * pixel] = mu[l];
+			job.par[2 * pixel + 1] = sigma[l];
+			job.chi2[pixel] = S[l];
+			if (converged[l]) {
+				job.outcome[pixel] = PixFitFitter_simd::OUTCOME_CONVERGED;
+			}
+			else if (trapped[l]) {
+				job.outcome[pixel] = PixFitFitter_simd::OUTCOME_TRAPPED;
+			}
+			else {
+				job.outcome[pixel] = PixFitFitter_simd::OUTCOME_EXHAUSTED;
+			}
+		}
+	}
+}
+
+/* Checks the layout once for the whole range. */
+template <class V>
+PIXFIT_SIMD_INLINE void fitRange(const PixFitFitter_simd::FitJob &job, int first, int last) {
+	if (job.histo->getLayout() == RawHisto::Layout::PIXEL_MAJOR) {
+		fitLanes<V, RawHisto::Layout::PIXEL_MAJOR>(job, first, last);
+	}
+	else {
+		fitLanes<V, RawHisto::Layout::BIN_MAJOR>(job, first, last);
+	}
+}
+
+/* ISA specific instantiations of the kernel. */
+void kernelGeneric(const PixFitFitter_simd::FitJob &job, int first, int last) {
+	fitRange<v2df>(job, first, last);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,fma")))
+void kernelAvx2(const PixFitFitter_simd::FitJob &job, int first, int last) {
+	fitRange<v4df>(job, first, last);
+}
+
+__attribute__((target("avx512f")))
+void kernelAvx512(const PixFitFitter_simd::FitJob &job, int first, int last) {
+	fitRange<v8df>(job, first, last);
+}
+#endif
+
+/* Picks the widest kernel supported by the CPU. */
+PixFitFitter_simd::Kernel selectKernel() {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return kernelAvx512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return kernelAvx2;
+#endif
+	return kernelGeneric;
+}
+
+} /* end of anonymous namespace */
+
+PixFitFitter_simd::Kernel PixFitFitter_simd::s_kernel = selectKernel();
+
+PixFitFitter_simd::PixFitFitter_simd() {
+}
+
+PixFitFitter_simd::~PixFitFitter_simd() {
+}
+
+const char* PixFitFitter_simd::getKernelName() {
+#if defined(__x86_64__)
+	if (s_kernel == kernelAvx512) return "AVX-512";
+	if (s_kernel == kernelAvx2) return "AVX2";
+#endif
+	return "SSE2";
+}
+
+/** State of a histogram whose pixel chunks have been handed to the thread pool. */
+class PixFitFitter_simd::Pending : public PixFitAbstractFitter::PendingFit {
+public:
+	Pending(std::shared_ptr<RawHisto> histo, PixFitThreadPool *pool, PixFitFitCache *fitCache,
+			bool momentFastPath);
+	virtual ~Pending();
+
+	virtual std::shared_ptr<PixFitResult> finish();
+
+private:
+	/** Guesses initial values and decides which pixels need a fit. */
+	void setup();
+
+	/** Posts the chunks of pixels to the pool or fits them right away if there is no pool. */
+	void post();
+
+	std::shared_ptr<RawHisto> m_histo;
+	PixFitThreadPool *m_pool;
+	PixFitFitCache *m_fitCache;
+	const bool m_momentFastPath;
+	const int m_npoints;
+	const int m_pixels;
+
+	/** Results of the fit (n_par variables: mu and sigma) plus chi2 at the end of the array. */
+	std::unique_ptr<double[]> m_par;
+	std::unique_ptr<PixFitMoments::Estimate[]> m_estimates;
+	std::unique_ptr<bool[]> m_seeded;
+	std::unique_ptr<double[]> m_chi2;
+	std::unique_ptr<int[]> m_outcome;
+	std::vector<int> m_fitList;
+	FitJob m_job;
+
+	/** Released when all chunks are done, nullptr if nothing was posted. */
+	std::unique_ptr<PixFitLatch> m_latch;
+
+	int m_zero;
+
+	/** Number of pixels taken from the PixFitStreamingFit. */
+	int m_streamed;
+
+	/** Number of pixels whose fit started from their previous curve in the PixFitFitCache. */
+	int m_reused;
+
+	/** Number of pixels taken from their moments without a fit. */
+	int m_estimated;
+	timeval m_begin;
+
+	static const int n_par = 2;
+};
+
+PixFitFitter_simd::Pending::Pending(std::shared_ptr<RawHisto> histo, PixFitThreadPool *pool,
+		PixFitFitCache *fitCache, bool momentFastPath) :
+		m_histo(histo),
+		m_pool(pool),
+		m_fitCache(fitCache),
+		m_momentFastPath(momentFastPath),
+		m_npoints(histo->getScanConfig()->getNumOfBins()),
+		m_pixels(histo->getScanConfig()->getNumOfPixels()),
+		m_par(new double[m_pixels * n_par + m_pixels]),
+		m_estimates(new PixFitMoments::Estimate[m_pixels]),
+		m_seeded(new bool[m_pixels]()),
+		m_chi2(new double[m_pixels]),
+		m_outcome(new int[m_pixels]),
+		m_zero(0),
+		m_streamed(0),
+		m_reused(0),
+		m_estimated(0) {
+	gettimeofday(&m_begin, 0);
+	setup();
+	post();
+}
+
+PixFitFitter_simd::Pending::~Pending() {
+	/* Chunks still refer to our arrays. */
+	if (m_latch) m_latch->wait();
+}
+
+void PixFitFitter_simd::Pending::setup() {
+	m_fitList.reserve(m_pixels);
+	const PixFitStreamingFit *streamingFit = m_histo->getStreamingFit().get();
+	const double injections = m_histo->getScanConfig()->getInjections();
+	std::shared_ptr<const PixFitFitCache::Entry> cached;
+	if (m_fitCache) cached = m_fitCache->find(*m_histo->getScanConfig());
+	if (cached && static_cast<int>(cached->mu.size()) != m_pixels) cached.reset();
+
+	/* One pass over the whole histogram, vectorized across pixels on bin-major data. */
+	PixFitMoments::estimateRange(*m_histo, 0, m_pixels, m_npoints, m_estimates.get());
+
+	for (int i = 0; i < m_pixels; i++) {
+		/* Take the estimate of pixels that were complete before the last bin arrived. */
+		double mu, sigma;
+		if (streamingFit && streamingFit->getResult(*m_histo, i, mu, sigma, m_chi2[i])) {
+			m_par[i * n_par + 0] = mu;
+			m_par[i * n_par + 1] = sigma;
+			m_outcome[i] = OUTCOME_CONVERGED;
+			m_streamed++;
+			continue;
+		}
+
+		const PixFitMoments::Estimate &vb = m_estimates[i];
+		m_outcome[i] = OUTCOME_NOTRUN;
+
+		/* Fit only when there are more than 2 valid bins, otherwise same as PixFitFitter_lmfit. */
+		if (vb.valid > 2) {
+			/* Clean S-curves are described by their moments already, only outliers are fitted. */
+			if (m_momentFastPath && matchesData(*m_histo, i, vb.start, vb.end, injections, vb.mu, vb.sigma,
+					m_chi2[i])) {
+				m_par[i * n_par + 0] = vb.mu;
+				m_par[i * n_par + 1] = vb.sigma;
+				m_outcome[i] = OUTCOME_CONVERGED;
+				m_estimated++;
+				continue;
+			}
+
+			/* Start from the curve of the previous scan, the fit only has to follow the change. */
+			if (cached && cached->mu[i] >= 0) {
+				m_par[i * n_par + 0] = cached->mu[i];
+				m_par[i * n_par + 1] = std::max<double>(cached->sigma[i], s_sigmaMin);
+				m_seeded[i] = true;
+				m_reused++;
+			}
+			else {
+				/* Noisy pixels can push the mean out of the rise, start from its middle then. */
+				const bool inside = vb.mu >= vb.start && vb.mu <= vb.end;
+				m_par[i * n_par + 0] = inside ? vb.mu : vb.start + (vb.valid / 2);
+				m_par[i * n_par + 1] = std::max(vb.sigma, s_sigmaMin);
+			}
+			m_fitList.push_back(i);
+		}
+		else if (vb.valid == 2) {
+			m_par[i * n_par + 0] = (vb.start + vb.end) / 2;
+			m_par[i * n_par + 1] = (vb.end - vb.start) * cInvSqrt6;
+		}
+		else {
+			if (vb.valid == 0) m_zero++;
+			m_par[i * n_par + 0] = -1;
+			m_par[i * n_par + 1] = -1;
+		}
+	}
+
+	m_job.histo = m_histo.get();
+	m_job.bins = m_npoints;
+	m_job.injections = injections;
+	m_job.fitList = m_fitList.data();
+	m_job.estimates = m_estimates.get();
+	m_job.seeded = m_seeded.get();
+	m_job.par = m_par.get();
+	m_job.chi2 = m_chi2.get();
+	m_job.outcome = m_outcome.get();
+}
+
+void PixFitFitter_simd::Pending::post() {
+	const int numToFit = m_fitList.size();
+	const int chunks = (numToFit + s_chunkSize - 1) / s_chunkSize;
+
+	if (!m_pool || chunks < 2) {
+		s_kernel(m_job, 0, numToFit);
+		return;
+	}
+
+	m_latch.reset(new PixFitLatch(chunks));
+	for (int c = 0; c < chunks; c++) {
+		m_pool->post(std::bind(s_kernel, std::cref(m_job), c * s_chunkSize,
+				std::min((c + 1) * s_chunkSize, numToFit)), m_latch.get());
+	}
+}
+
+std::shared_ptr<PixFitResult> PixFitFitter_simd::Pending::finish() {
+	if (m_latch) {
+		m_pool->wait(*m_latch);
+		m_latch.reset();
+	}
+
+	timeval finish;
+	gettimeofday(&finish, 0);
+	double time = finish.tv_sec - m_begin.tv_sec + 1e-6 * (finish.tv_usec - m_begin.tv_usec);
+	ERS_DEBUG(0, "Done fitting " << m_fitList.size() << " pixels with " << getKernelName() << " kernel, "
+			<< m_streamed << " streamed, " << m_reused << " reused, " << m_estimated << " estimated! (in "
+			<< time << "s with " << time / static_cast<double>(m_pixels) * 1e6 << "us per pixel)")
+
+	// Counters for fit results
+	int exh = 0, trap = 0, convbad = 0, conv = 0;
+	double *par = m_par.get();
+
+	/* Fit results. */
+	for (int i = 0; i < m_pixels; i++) {
+		if (m_outcome[i] == OUTCOME_NOTRUN) continue;
+
+		if (m_outcome[i] == OUTCOME_EXHAUSTED) exh++;
+		if (m_outcome[i] == OUTCOME_TRAPPED) trap++;
+
+		if (m_outcome[i] != OUTCOME_CONVERGED) {
+			if (s_doverbose) {
+				ERS_LOG("Pixel " << i << ": Fit failed with outcome " << m_outcome[i]
+						<< " -- mean = " << par[n_par * i + 0] << ", noise = " << par[n_par * i + 1])
+			}
+			par[n_par * i + 0] = -1;
+			par[n_par * i + 1] = -1;
+		}
+		else {
+			conv++;
+			/* Fit converged but outcome is negative (most likely noisy pixels). */
+			if (par[n_par * i + 0] < 0) {
+				convbad++;
+				par[n_par * i + 0] = -1;
+				par[n_par * i + 1] = -1;
+			}
+		}
+	}
+	ERS_DEBUG(0, "Fit failure summary: total bad = " << exh + trap + convbad << ", total zero = " << m_zero
+			<< " (ex " << exh << " / trap " << trap << " / convbad " << convbad << " / converged " << conv << ")")
+
+	/* Keep the curves as initial guesses for the next scan, before the chi2 values are appended. */
+	if (m_fitCache) m_fitCache->store(*m_histo->getScanConfig(), par, m_pixels);
+
+	/* Write chi2 values at the back of the array. lmmin reports the norm of the residual vector,
+	 * use the same definition to keep the chi2 histograms comparable. -1 if no fit was run. */
+	const int offset = m_pixels * n_par;
+	for (int i = 0; i < m_pixels; i++) {
+		if (m_outcome[i] != OUTCOME_NOTRUN) {
+			par[offset + i] = std::sqrt(m_chi2[i]) / (m_npoints - n_par - 1); // chi2 per n.d.f.
+		}
+		else {
+			par[offset + i] = -1;
+		}
+	}
+
+	std::shared_ptr<PixFitResult> result = std::make_shared<PixFitResult>(m_histo->getScanConfig());
+	result->thresh_array = std::move(m_par);
+	result->fitOutcomes.converged = conv;
+	result->fitOutcomes.badConvergence = convbad;
+	result->fitOutcomes.exhausted = exh;
+	result->fitOutcomes.trapped = trap;
+	result->fitOutcomes.zero = m_zero;
+	result->fitOutcomes.streamed = m_streamed;
+	result->fitOutcomes.reused = m_reused;
+	result->fitOutcomes.estimated = m_estimated;
+	return result;
+}
+
+std::unique_ptr<PixFitAbstractFitter::PendingFit> PixFitFitter_simd::startFit(std::shared_ptr<RawHisto> histo) {
+	return std::unique_ptr<PendingFit>(new Pending(histo, m_pool, m_fitCache, m_momentFastPath));
+}
+
+std::shared_ptr<PixFitResult> PixFitFitter_simd::fit(std::shared_ptr<RawHisto> histo) {
+	return startFit(histo)->finish();
+}
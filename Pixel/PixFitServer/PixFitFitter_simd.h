@@ -0,0 +1,102 @@
+/* @file PixFitFitter_simd.h
+ */
+
+#ifndef PIXFITFITTER_SIMD_H_
+#define PIXFITFITTER_SIMD_H_
+
+#include <memory>
+#include <vector>
+
+#include "PixFitAbstractFitter.h"
+#include "PixFitMoments.h"
+
+namespace PixLib {
+
+class PixFitResult;
+class RawHisto;
+
+/** S-curve fitter that processes several pixels at once in lockstep. Every SIMD lane holds one
+ * pixel and runs its own Levenberg-Marquardt minimization with an analytic Jacobian and a
+ * vectorized erfc. Lanes that have converged are masked out until all lanes of a batch are done.
+ * The kernel is compiled for AVX-512, AVX2 and generic SSE2 and selected at runtime depending on
+ * the CPU.
+ * The output has the same layout as the one of PixFitFitter_lmfit, i.e. (mu, sigma) pairs for all
+ * pixels followed by a block of chi2 values, and also uses the same conventions for pixels that
+ * could not be fitted (-1). */
+class PixFitFitter_simd : public PixFitAbstractFitter {
+public:
+	PixFitFitter_simd();
+	virtual ~PixFitFitter_simd();
+
+	virtual std::shared_ptr<PixFitResult> fit(std::shared_ptr<RawHisto> histo);
+
+	/** Sets up the histogram and posts chunks of pixels to the thread pool. */
+	virtual std::unique_ptr<PendingFit> startFit(std::shared_ptr<RawHisto> histo);
+
+	/** Outcome of the fit of a single pixel. */
+	enum Outcome {
+		OUTCOME_NOTRUN = -1,
+		OUTCOME_CONVERGED = 0,
+		OUTCOME_EXHAUSTED,
+		OUTCOME_TRAPPED
+	};
+
+	/** Everything a kernel needs to fit a range of pixels. Shared by all threads working on the
+	 * same histogram, every thread only writes the entries of its own pixels. */
+	struct FitJob {
+		/** Histogram holding the data. */
+		RawHisto *histo;
+
+		/** Number of bins per pixel. */
+		int bins;
+
+		/** Number of injections, i.e. the plateau of the S-curve. */
+		double injections;
+
+		/** Flat indices of the pixels that need a fit. */
+		const int *fitList;
+
+		/** Bin ranges for all pixels of the histogram. */
+		const PixFitMoments::Estimate *estimates;
+
+		/** Pixels whose guess is the curve of the previous scan (PixFitFitCache). */
+		const bool *seeded;
+
+		/** Results (mu, sigma) for all pixels of the histogram, initialized with the guesses. */
+		double *par;
+
+		/** Sum of squared residuals for all pixels of the histogram. */
+		double *chi2;
+
+		/** Outcome for all pixels of the histogram. */
+		int *outcome;
+	};
+
+	/** Signature of the ISA specific kernels.
+	 * @param job The fit job.
+	 * @param first First entry of job.fitList to process.
+	 * @param last One past the last entry of job.fitList to process. */
+	typedef void (*Kernel)(const FitJob &job, int first, int last);
+
+	/** @returns Name of the instruction set used by the kernel (for printouts). */
+	static const char* getKernelName();
+
+private:
+	class Pending;
+
+	/** Kernel selected at runtime. */
+	static Kernel s_kernel;
+
+	/** Number of pixels per task of the thread pool. */
+	static const int s_chunkSize = 512;
+
+	/** Controls the verbosity of the fit output. */
+	static const bool s_doverbose = false;
+
+	constexpr static const double cSqrt2 = 1.41421356237309504880;
+	constexpr static const double cInvSqrt6 = 0.40824829046386301637;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITFITTER_SIMD_H_ */
@@ -0,0 +1,132 @@
+/* @file PixFitFlatMap.h
+ */
+
+#ifndef PIXFITFLATMAP_H_
+#define PIXFITFLATMAP_H_
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace PixLib {
+
+/** Hash table with open addressing and linear probing, all entries in a single array.
+ * Lookups touch one or two neighbouring slots instead of following tree or bucket pointers.
+ * Erasing shifts the following entries of the probe sequence back, so there are no tombstones
+ * and the table does not degrade with the constant insert/erase traffic of the assembler.
+ * The table grows to keep at most half of the slots in use; it never shrinks.
+ * References and pointers to values are invalidated by insert() and erase().
+ * @tparam Key Copyable key with operator==.
+ * @tparam Value Default constructible, movable value.
+ * @tparam Hash Functor returning a well mixed size_t, the low bits select the slot. */
+template <class Key, class Value, class Hash>
+class PixFitFlatMap {
+public:
+	explicit PixFitFlatMap(size_t capacity = 16) : m_size(0) {
+		size_t slots = 16;
+		while (slots < 2 * capacity) slots *= 2;
+		m_slots.resize(slots);
+	}
+
+	/** @returns The value stored for key, nullptr if there is none. */
+	Value* find(const Key &key) {
+		size_t i = locate(key);
+		return m_slots[i].used ? &m_slots[i].value : nullptr;
+	}
+
+	/** Stores a value, replacing any previous one for the same key.
+	 * @returns The stored value. */
+	Value& insert(const Key &key, Value &&value) {
+		if (2 * (m_size + 1) > m_slots.size()) grow();
+		size_t i = locate(key);
+		Slot &slot = m_slots[i];
+		if (!slot.used) {
+			slot.used = true;
+			slot.key = key;
+			m_size++;
+		}
+		slot.value = std::move(value);
+		return slot.value;
+	}
+
+	/** Removes the value stored for key.
+	 * @returns False if there was none. */
+	bool erase(const Key &key) {
+		size_t i = locate(key);
+		if (!m_slots[i].used) return false;
+
+		/* Move later entries of the probe sequence into the gap unless they would then be found
+		 * before their home slot. */
+		const size_t mask = m_slots.size() - 1;
+		size_t j = i;
+		while (true) {
+			j = (j + 1) & mask;
+			if (!m_slots[j].used) break;
+			size_t home = m_hash(m_slots[j].key) & mask;
+			if (((j - home) & mask) < ((j - i) & mask)) continue;
+			m_slots[i].key = m_slots[j].key;
+			m_slots[i].value = std::move(m_slots[j].value);
+			i = j;
+		}
+		m_slots[i].used = false;
+		m_slots[i].value = Value();
+		m_size--;
+		return true;
+	}
+
+	/** Calls f(key, value) for every entry, in no particular order. */
+	template <class F>
+	void forEach(F f) {
+		for (auto& slot : m_slots) {
+			if (slot.used) f(static_cast<const Key&>(slot.key), slot.value);
+		}
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+
+	bool empty() const {
+		return m_size == 0;
+	}
+
+private:
+	struct Slot {
+		Slot() : used(false), key(), value() {};
+
+		bool used;
+		Key key;
+		Value value;
+	};
+
+	/** @returns The slot holding key, or the empty slot that ends its probe sequence. */
+	size_t locate(const Key &key) const {
+		const size_t mask = m_slots.size() - 1;
+		size_t i = m_hash(key) & mask;
+		while (m_slots[i].used && !(m_slots[i].key == key)) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	/** Doubles the number of slots and re-inserts all entries. */
+	void grow() {
+		std::vector<Slot> old(2 * m_slots.size());
+		old.swap(m_slots);
+		for (auto& slot : old) {
+			if (!slot.used) continue;
+			Slot &target = m_slots[locate(slot.key)];
+			target.used = true;
+			target.key = slot.key;
+			target.value = std::move(slot.value);
+		}
+	}
+
+	std::vector<Slot> m_slots;
+	size_t m_size;
+	Hash m_hash;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITFLATMAP_H_ */
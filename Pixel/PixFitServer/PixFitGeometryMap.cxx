@@ -0,0 +1,61 @@
+/* @file PixFitGeometryMap.cxx
+ */
+
+#include <cassert>
+#include <map>
+#include <tuple>
+
+#include <boost/thread.hpp>
+
+#include "PixFitGeometryMap.h"
+#include "PixFitScanConfig.h"
+
+using namespace PixLib;
+
+namespace {
+
+/* Total mask steps, mask ID, rows, columns and chips. */
+typedef std::tuple<int, int, int, int, int> Key;
+
+/* Tables of all combinations seen so far. There are only a few of them, at most one per mask step
+ * of every mask stepping that is in use, so they are never dropped. */
+std::map<Key, std::shared_ptr<const PixFitGeometryMap> > s_maps;
+boost::mutex s_mapsMutex;
+
+}
+
+PixFitGeometryMap::PixFitGeometryMap(int totalMaskSteps, int maskId, int nrow, int ncol, int chips) {
+	const int pixelsPerChip = (ncol * nrow) / totalMaskSteps;
+	m_locations.resize(pixelsPerChip * chips);
+
+	for (int j = 0; j < pixelsPerChip * chips; j++) {
+		const int chip = j / pixelsPerChip;
+		/* Rows of a chip in this histogram, every totalMaskSteps-th row of the chip. */
+		int row = ((j - chip * pixelsPerChip) / ncol) * totalMaskSteps;
+		if (j % 2 == 0) {
+			row += maskId;
+		}
+		else {
+			row += totalMaskSteps - 1 - maskId;
+		}
+		assert(row < nrow);
+
+		m_locations[j].chip = chip;
+		m_locations[j].col = j % ncol;
+		m_locations[j].row = row;
+	}
+}
+
+std::shared_ptr<const PixFitGeometryMap> PixFitGeometryMap::get(const PixFitScanConfig &scanConfig) {
+	const int totalMaskSteps = scanConfig.getNumOfTotalMaskSteps();
+	const Key key(totalMaskSteps, scanConfig.maskId, scanConfig.NumRow, scanConfig.NumCol,
+			scanConfig.getNumOfChips());
+
+	boost::lock_guard<boost::mutex> lock(s_mapsMutex);
+	std::shared_ptr<const PixFitGeometryMap> &map = s_maps[key];
+	if (!map) {
+		map = std::make_shared<PixFitGeometryMap>(totalMaskSteps, scanConfig.maskId, scanConfig.NumRow,
+				scanConfig.NumCol, scanConfig.getNumOfChips());
+	}
+	return map;
+}
@@ -0,0 +1,56 @@
+/* @file PixFitGeometryMap.h
+ */
+
+#ifndef PIXFITGEOMETRYMAP_H_
+#define PIXFITGEOMETRYMAP_H_
+
+#include <stdint.h> // change to cstdint for C++11
+#include <memory>
+#include <vector>
+
+namespace PixLib {
+
+class PixFitScanConfig;
+
+/** Table from the flat pixel index of a histogram to the chip, column and row of the pixel.
+ * With mask stepping a histogram only holds every n-th row of each chip, and the row within a
+ * mask step alternates with the parity of the pixel index (injection pattern of the FE-I4).
+ * Tables only depend on the mask stepping and the geometry of the chips, so they are built once
+ * and shared by all scans and assemblers, see get(). */
+class PixFitGeometryMap {
+public:
+	/** Position of a single pixel. */
+	struct Location {
+		uint16_t chip;
+		uint16_t col;
+		uint16_t row;
+	};
+
+	/** Builds the table.
+	 * @param totalMaskSteps Number of mask steps to cover all rows, see
+	 * PixFitScanConfig::getNumOfTotalMaskSteps().
+	 * @param maskId Mask step of the histogram.
+	 * @param nrow, ncol Rows and columns of a chip.
+	 * @param chips Number of chips. */
+	PixFitGeometryMap(int totalMaskSteps, int maskId, int nrow, int ncol, int chips);
+
+	/** @returns The table for the pixels of a histogram, built on first use. */
+	static std::shared_ptr<const PixFitGeometryMap> get(const PixFitScanConfig &scanConfig);
+
+	/** @param pixel Flat index of the pixel, starting from 0. */
+	const Location& operator[](int pixel) const {
+		return m_locations[pixel];
+	}
+
+	/** @returns Number of pixels in the table. */
+	int getNumOfPixels() const {
+		return m_locations.size();
+	}
+
+private:
+	std::vector<Location> m_locations;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITGEOMETRYMAP_H_ */
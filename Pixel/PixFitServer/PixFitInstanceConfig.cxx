@@ -11,6 +11,9 @@
 #include <vector>
 #include <algorithm> // for sorting blacklist
 #include <cassert>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
 #include <memory>
 
 /* Includes for getting RAM size and IP addresses. */
@@ -20,6 +23,7 @@
 #include <ifaddrs.h>
 
 #include <boost/thread.hpp> // blacklist
+#include <boost/algorithm/string.hpp>
 #include <ers/ers.h>
 
 #include "Config/Config.h"
@@ -36,6 +40,7 @@
 
 #include "PixFitInstanceConfig.h"
 #include "PixFitScanConfig.h"
+#include "PixFitBufferPool.h"
 
 using namespace PixLib;
 
@@ -43,6 +48,7 @@ using namespace PixLib;
 const std::string PixFitInstanceConfig::slaveEmuRootFile =
 		"/daq/db/scan-cfg/ANALOG_TEST/Base_I4/ANALOG_TEST_Base_I4_1398172938.root";
 const std::string PixFitInstanceConfig::fitServerVersion = "0.2";
+const RawHisto::Layout PixFitInstanceConfig::receiveLayout;
 
 PixFitInstanceConfig::PixFitInstanceConfig(std::string serverName,
 		std::string partitionName, std::string instanceID, bool slaveEmu)
@@ -51,14 +57,61 @@ PixFitInstanceConfig::PixFitInstanceConfig(std::string serverName,
 	this->partitionName = partitionName;
 	this->instanceID = instanceID;
 	this->slaveEmu = slaveEmu;
+	this->dumpWriter = nullptr;
+	this->fitPool = nullptr;
 
 	this->rodNetworkInterfaces.push_back("eth0"); //TODO: dynamically get the list of ROD interfaces
+
+	/* One thread per stage unless the configuration of this instance asks for more. */
+	std::map<std::string, std::string> topology = getTopology(instanceID);
+	this->networkStage = parseStageConfig(topology["NETWORK"]);
+	this->workerStage = parseStageConfig(topology["WORKERS"]);
+	this->assemblerStage = parseStageConfig(topology["ASSEMBLERS"]);
+	this->publisherStage = parseStageConfig(topology["PUBLISHERS"]);
+	for (auto& stage : topology) {
+		if (!stage.second.empty()) ERS_LOG("Pipeline stage " << stage.first << " configured as " << stage.second)
+	}
+
+	/* Leave the rest of the memory to the OS, ROOT and the OH provider. */
+	unsigned long budgetMB = getRam() * memoryBudgetPercent / 100;
+	const char *env = getenv("PIXFIT_MEMORY_BUDGET");
+	if (env != nullptr && atol(env) > 0) {
+		budgetMB = atol(env);
+	}
+	this->memoryBudget.setLimit(static_cast<size_t>(budgetMB) * 1024 * 1024);
+	ERS_LOG("Memory budget for histograms in flight: " << budgetMB << " MB")
+
+	this->fitCache.setMaxBytes(static_cast<size_t>(fitCacheMB) * 1024 * 1024);
+
+	/* Enough free histogram buffers for the next scan, without pinning down the whole budget. */
+	PixFitBufferPool::instance().setMaxCachedBytes(static_cast<size_t>(budgetMB) * 1024 * 1024 / 4);
 }
 
 PixFitInstanceConfig::~PixFitInstanceConfig() {
 
 }
 
+PixFitInstanceConfig::StageConfig PixFitInstanceConfig::parseStageConfig(const std::string &value) {
+	StageConfig stage;
+	stage.threads = 1;
+
+	std::vector<std::string> tokens;
+	boost::split(tokens, value, boost::is_any_of(":,"), boost::token_compress_on);
+
+	if (!tokens.empty() && !tokens[0].empty()) {
+		stage.threads = std::max(1, atoi(tokens[0].c_str()));
+	}
+	for (size_t i = 1; i < tokens.size(); i++) {
+		if (!tokens[i].empty()) stage.cpus.push_back(atoi(tokens[i].c_str()));
+	}
+	return stage;
+}
+
+int PixFitInstanceConfig::StageConfig::getCpu(int thread) const {
+	if (cpus.empty()) return -1;
+	return cpus[thread % cpus.size()];
+}
+
 int PixFitInstanceConfig::getThreadingSettings() {
 	return boost::thread::hardware_concurrency();
 }
@@ -203,6 +256,23 @@ std::map<std::string, std::string> PixFitInstanceConfig::getConfiguration() {
 	return config;
 }
 
+std::map<std::string, std::string> PixFitInstanceConfig::getTopology(std::string instanceId) {
+	std::map<std::string, std::string> topology;
+
+	/* FitServer-1 is configured by PIXFIT_FITSERVER_1_WORKERS, falling back to PIXFIT_WORKERS. */
+	std::string prefix = "PIXFIT_" + boost::to_upper_copy(instanceId) + "_";
+	std::replace_if(prefix.begin(), prefix.end(), [](char c) { return !isalnum(static_cast<unsigned char>(c)); }, '_');
+
+	const char *stages[] = {"NETWORK", "WORKERS", "ASSEMBLERS", "PUBLISHERS"};
+	for (const char *stage : stages) {
+		const char *env = getenv((prefix + stage).c_str());
+		if (env == nullptr) env = getenv((std::string("PIXFIT_") + stage).c_str());
+		if (env != nullptr && *env != '\0') topology[stage] = env;
+	}
+
+	return topology;
+}
+
 bool PixFitInstanceConfig::usingSlaveEmu() const {
 	return slaveEmu;
 }
@@ -226,6 +296,7 @@ const std::string& PixFitInstanceConfig::getServerName() const {
 /* BlackList implementation. */
 
 BlackList::BlackList() {
+	m_hits = 0;
 }
 
 BlackList::~BlackList() {
@@ -240,7 +311,13 @@ bool BlackList::isScanIdListed(PixFitScanConfig::ScanIdType scanId) {
 }
 
 bool BlackList::investigateWorkObject(std::shared_ptr<const PixFitWorkPackage> workPackage) {
-	return isScanIdListed(workPackage->getScanId());
+	if (!isScanIdListed(workPackage->getScanId())) return false;
+	m_hits.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+unsigned long BlackList::getHits() const {
+	return m_hits.load(std::memory_order_relaxed);
 }
 
 void BlackList::addScanId(PixFitScanConfig::ScanIdType scanId) {
@@ -266,14 +343,16 @@ ScanList::ScanList() {
 ScanList::~ScanList() {
 }
 
-void ScanList::setScanCount(int fitFarmId, int scanCount) {
+void ScanList::setScanCount(int fitFarmId, int scanCount, std::shared_ptr<PixFitScanConfig::Progress> progress) {
 	/* Get lock on map. */
 	boost::unique_lock<boost::shared_mutex> lock(m_mutex);
 
 	/* Element should not exist. */
 	assert(m_scanMap.count(fitFarmId) == 0);
 
-	m_scanMap.insert(std::pair<int, int>(fitFarmId, scanCount));
+	progress->remaining = scanCount;
+	progress->total = scanCount;
+	m_scanMap.insert(std::make_pair(fitFarmId, progress));
 }
 
 
@@ -282,16 +361,82 @@ int ScanList::reduceScanCount(int fitFarmId) {
 	boost::unique_lock<boost::shared_mutex> lock(m_mutex);
 
 	/* Element should exist! */
-	assert(m_scanMap.count(fitFarmId) > 0);
-
-	m_scanMap[fitFarmId]--;
+	std::map<int, std::shared_ptr<PixFitScanConfig::Progress> >::iterator it = m_scanMap.find(fitFarmId);
+	assert(it != m_scanMap.end());
+	if (it == m_scanMap.end()) return 0;
 
 	/* Remove element if count reached zero. */
-	if (m_scanMap[fitFarmId] == 0) {
-		m_scanMap.erase(fitFarmId);
+	if (--it->second->remaining == 0) {
+		m_scanMap.erase(it);
 		return 1;
 	}
 	else {
 		return 0;
 	}
 }
+
+
+/* MemoryBudget implementation. */
+
+MemoryBudget::MemoryBudget() : m_limit(SIZE_MAX), m_used(0), m_highWaterMark(0), m_releases(0) {
+}
+
+MemoryBudget::~MemoryBudget() {
+}
+
+void MemoryBudget::setLimit(size_t bytes) {
+	m_limit = bytes;
+}
+
+size_t MemoryBudget::getLimit() const {
+	return m_limit.load();
+}
+
+void MemoryBudget::charge(size_t bytes) {
+	const size_t used = m_used.fetch_add(bytes) + bytes;
+
+	size_t highWaterMark = m_highWaterMark.load();
+	while (used > highWaterMark && !m_highWaterMark.compare_exchange_weak(highWaterMark, used)) {
+	}
+}
+
+void MemoryBudget::release(size_t bytes) {
+	m_used.fetch_sub(bytes);
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_releases++;
+	}
+	m_cond.notify_all();
+}
+
+bool MemoryBudget::isExhausted() const {
+	return m_used.load() > m_limit.load();
+}
+
+bool MemoryBudget::waitForRelease(int timeout) {
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	const unsigned long releases = m_releases;
+	const boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(timeout);
+
+	while (m_releases == releases) {
+		if (!m_cond.timed_wait(lock, deadline)) break;
+	}
+	return m_releases != releases;
+}
+
+unsigned long MemoryBudget::getReleases() {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	return m_releases;
+}
+
+size_t MemoryBudget::getUsed() const {
+	return m_used.load();
+}
+
+size_t MemoryBudget::getHighWaterMark() const {
+	return m_highWaterMark.load();
+}
+
+void MemoryBudget::resetHighWaterMark() {
+	m_highWaterMark = m_used.load();
+}
@@ -7,18 +7,27 @@
 #ifndef PIXFITINSTANCECONFIG_H_
 #define PIXFITINSTANCECONFIG_H_
 
+#include <atomic>
 #include <string>
 #include <map>
 #include <memory>
+#include <vector>
 
 #include <boost/thread.hpp>
 
 #include "PixFitNetConfiguration.h"
 #include "PixFitScanConfig.h"
+#include "PixFitAbstractFitter.h"
+#include "RawHisto.h"
+#include "PixFitTracer.h"
+#include "PixFitMetrics.h"
+#include "PixFitFitCache.h"
 
 namespace PixLib {
 
 class PixFitAssembler;
+class PixFitDumpWriter;
+class PixFitThreadPool;
 class PixFitWorkPackage;
 
 /** Class that manages aborted scan IDs.
@@ -43,12 +52,17 @@ public:
 	 * @param scanId The scan ID to be added. */
 	void addScanId(PixFitScanConfig::ScanIdType scanId);
 
+	/** @returns Number of work objects that have been found blacklisted. */
+	unsigned long getHits() const;
+
 private:
 	/** Contains scan IDs that are blacklisted. */
 	std::vector<PixFitScanConfig::ScanIdType> m_blackList;
 
 	/** Controls r/w access to blackList. */
 	boost::shared_mutex m_mutex;
+
+	std::atomic<unsigned long> m_hits;
 };
 
 
@@ -62,8 +76,9 @@ public:
 	/** Set the initial count for a new ID.
 	 * @param fitFarmId The internal ID identifying the scan and ROD.
 	 * @param scanCount How many objects need to be published by the publisher before the finish
-	 * scan flag can be set. This is usually something like #histo units x #chips per unit. */
-	void setScanCount(int fitFarmId, int scanCount);
+	 * scan flag can be set. This is usually something like #histo units x #chips per unit.
+	 * @param progress Progress shared with the PixFitScanConfigs of the ID, the count is kept there. */
+	void setScanCount(int fitFarmId, int scanCount, std::shared_ptr<PixFitScanConfig::Progress> progress);
 
 	/** Reduce the count belonging to an ID.
 	 * If count reaches zero, removes the entry from the map.
@@ -72,14 +87,72 @@ public:
 	int reduceScanCount(int fitFarmId);
 
 private:
-	/** Contains IDs and their count. */
-	std::map<int, int> m_scanMap;
+	/** Contains IDs and their progress. */
+	std::map<int, std::shared_ptr<PixFitScanConfig::Progress> > m_scanMap;
 
 	/** Controls r/w access to m_scanMap. */
 	boost::shared_mutex m_mutex;
 };
 
 
+/** Class that accounts for the memory of the histograms that are in flight between PixFitNet and
+ * PixFitPublisher (RawHistos, fit results and ROOT histograms). PixFitNet stops reading from its
+ * socket while the budget is exhausted, so TCP flow control throttles the ROD instead of the
+ * FitServer node running out of memory. The limit is soft: charging memory never fails. */
+class MemoryBudget {
+public:
+	MemoryBudget();
+	virtual ~MemoryBudget();
+
+	/** Sets the limit.
+	 * @param bytes Maximum number of bytes before the budget counts as exhausted. */
+	void setLimit(size_t bytes);
+
+	/** @returns The limit in bytes. */
+	size_t getLimit() const;
+
+	/** Accounts for newly allocated memory.
+	 * @param bytes Number of bytes. */
+	void charge(size_t bytes);
+
+	/** Accounts for freed memory and wakes up threads waiting in waitForRelease().
+	 * @param bytes Number of bytes, as passed to charge() before. */
+	void release(size_t bytes);
+
+	/** @returns True if more memory than the limit is charged. */
+	bool isExhausted() const;
+
+	/** Waits until memory is released or the timeout expires.
+	 * @param timeout Timeout in milliseconds.
+	 * @returns True if memory has been released meanwhile. */
+	bool waitForRelease(int timeout);
+
+	/** @returns Number of release() calls so far, for polling instead of waitForRelease(). */
+	unsigned long getReleases();
+
+	/** @returns Number of bytes currently charged. */
+	size_t getUsed() const;
+
+	/** @returns Maximum number of bytes charged since the last call of resetHighWaterMark(). */
+	size_t getHighWaterMark() const;
+
+	/** Starts a new high-water-mark period with the current usage. */
+	void resetHighWaterMark();
+
+private:
+	std::atomic<size_t> m_limit;
+	std::atomic<size_t> m_used;
+	std::atomic<size_t> m_highWaterMark;
+
+	/** Number of release() calls, lets waiters detect progress. */
+	unsigned long m_releases;
+
+	/** Protects m_releases for waiting threads. */
+	boost::mutex m_mutex;
+	boost::condition_variable_any m_cond;
+};
+
+
 /** Holds the necessary configuration options that are associated with a
  * particular PixFitServer instance. It provides functions to discover machine spec details and
  * network configuration that are being used. There should be only one instance of this class per
@@ -98,6 +171,18 @@ public:
 
 	virtual ~PixFitInstanceConfig();
 
+	/** Number of threads and their CPU affinity for one stage of the processing pipeline. */
+	struct StageConfig {
+		/** Number of threads running the stage, at least 1. */
+		int threads;
+
+		/** CPUs the threads are pinned to; thread i uses cpus[i % cpus.size()]. No pinning if empty. */
+		std::vector<int> cpus;
+
+		/** @returns CPU for a thread of the stage, -1 if it should not be pinned. */
+		int getCpu(int thread) const;
+	};
+
 	/** Decide on the number of worker and fitting threads.
 	 * @returns Number of usable (virtual) cores for threading. */
 	static int getThreadingSettings();
@@ -113,6 +198,18 @@ public:
 	/** Retrieves the configuration from the DB and returns a map of RODs and FitFarm instance IDs. */
 	static std::map<std::string, std::string> getConfiguration();
 
+	/** Retrieves the pipeline topology of a FitFarm instance from the environment. A stage is set by
+	 * PIXFIT_<INSTANCE>_<STAGE> for this instance only (e.g. PIXFIT_FITSERVER_1_WORKERS for
+	 * FitServer-1, non-alphanumeric characters of the ID replaced by '_') or by PIXFIT_<STAGE> for
+	 * all instances of the host.
+	 * @returns A map of stages (NETWORK, WORKERS, ASSEMBLERS, PUBLISHERS) and their settings in the
+	 * form "threads[:cpu,cpu,...]", e.g. "4:0,2,4,6". Stages that are not listed are left out. */
+	static std::map<std::string, std::string> getTopology(std::string instanceId);
+
+	/** Builds the configuration of a pipeline stage.
+	 * @param value Setting in the form "threads[:cpu,cpu,...]", a single thread if empty. */
+	static StageConfig parseStageConfig(const std::string &value);
+
 	/** FitServer version number. */
 	static const std::string fitServerVersion;
 
@@ -122,9 +219,58 @@ public:
 	/** Lowest local port number for ROD network listening threads. */
 	static const int startPort = 6000;
 
-	/** Flag to indicate whether network traffic should be dumped. */
+	/** Flag to indicate whether network traffic should be dumped. Dumping can also be enabled at
+	 * runtime by setting PIXFIT_DUMP_DIR to the directory for the dump files. */
 	static const bool dumpNetwork = false;
 
+	/** Deflate-compress dumped payloads. Saves disk bandwidth for sparse occupancy data at the
+	 * expense of CPU time on the dump writer thread. */
+	static const bool dumpCompression = false;
+
+	/** Size in MB after which a new dump file is started. */
+	static const int dumpMaxFileSizeMB = 2048;
+
+	/** Maximum amount of data in MB waiting to be dumped, further records are dropped. */
+	static const int dumpBufferMB = 256;
+
+	/** Fitter used for threshold scans. */
+	static const FitMethod fitMethod = FitMethod::FIT_LMMIN;
+
+	/** Capacities of the work queues (number of items). Producers block when a queue is full, which
+	 * propagates backpressure from a slow stage up to PixFitNet. */
+	static const int fitQueueCapacity = 1024;
+	static const int resultQueueCapacity = 1024;
+	static const int publishQueueCapacity = 512;
+
+	/** Share of the installed RAM (in percent) that may be used by histograms in flight. Can be
+	 * overridden with the environment variable PIXFIT_MEMORY_BUDGET (in megabytes). */
+	static const int memoryBudgetPercent = 50;
+
+	/** Flag to run the work queues in priority mode (see PixFitScanConfig::priorityClass) instead
+	 * of strict FIFO order. */
+	static const bool priorityScheduling = true;
+
+	/** Memory layout PixFitNet fills the RawHistos in. Bin-major turns every received bin into a
+	 * sequential write. */
+	static const RawHisto::Layout receiveLayout = RawHisto::Layout::BIN_MAJOR;
+
+	/** Flag to transpose threshold histograms to pixel-major in the worker before fitting. Without it
+	 * the fitters read the histograms in the receive layout. */
+	static const bool transposeForFit = true;
+
+	/** Flag to leave the conversion of received bin data to the workers, so the networking threads
+	 * only move bytes. Data that already has the RawHisto format is received in place either way. */
+	static const bool deferUnpack = true;
+
+	/** Flag to estimate the S-curves of threshold scans while the bins arrive, see
+	 * PixFitStreamingFit. The fitters then only fit the pixels that have not reached their plateau
+	 * or whose estimate does not describe the data. */
+	static const bool streamingFit = true;
+
+	/** Size in MB of the threshold fit results kept as starting point for the next scan of the same
+	 * histogramming units, see PixFitFitCache. 0 disables the cache. */
+	static const int fitCacheMB = 256;
+
 	/* Getter functions. */
 	bool usingSlaveEmu() const;
 	std::string getInstanceId() const;
@@ -138,8 +284,33 @@ public:
 	/** Contains started scans. */
 	ScanList scanlist;
 
-	/** Pointer to PixFitAssembler. */
-	PixFitAssembler *assembler;
+	/** Memory used by histograms in flight. */
+	MemoryBudget memoryBudget;
+
+	/** Previous threshold fit results. */
+	PixFitFitCache fitCache;
+
+	/** Health metrics, published to IS by PixFitManager. */
+	PixFitMetrics metrics;
+
+	/** Latencies of the pipeline stages. PixFitManager exports them periodically to the file given
+	 * by PIXFIT_METRICS_FILE and writes a Chrome trace to PIXFIT_TRACE_FILE, if set. */
+	PixFitTracer tracer;
+
+	/** Pointers to all PixFitAssemblers (one per shard of the assembler hold). */
+	std::vector<PixFitAssembler*> assemblers;
+
+	/** Writer for raw network dumps, nullptr if dumping is disabled. */
+	PixFitDumpWriter *dumpWriter;
+
+	/** Fitting pool, also used to process the bins of streaming fits. nullptr if there is none. */
+	PixFitThreadPool *fitPool;
+
+	/** Topology of the pipeline as returned by getTopology(), one thread per stage by default. */
+	StageConfig networkStage;
+	StageConfig workerStage;
+	StageConfig assemblerStage;
+	StageConfig publisherStage;
 
 private:
 	/** Server name. */
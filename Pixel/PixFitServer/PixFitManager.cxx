@@ -7,6 +7,7 @@
 #include <vector>
 #include <iostream>
 #include <string>
+#include <sstream>
 #include <bitset>
 #include <map>
 #include <cmath>
@@ -14,6 +15,9 @@
 #include <memory>
 #include <functional>
 #include <utility> //std::pair
+#include <cctype>
+#include <cstdlib>
+#include <ctime>
 
 #include <boost/thread.hpp>
 #include <boost/regex.hpp>
@@ -31,15 +35,20 @@
 #include "PixFitManager.h"
 #include "PixFitNetConfiguration.h"
 #include "PixFitNet.h"
+#include "PixFitNetEngine.h"
+#include "PixFitDumpWriter.h"
+#include "PixFitReplay.h"
 #include "PixFitPublisher.h"
 #include "PixFitWorker.h"
 #include "PixFitAssembler.h"
 #include "PixFitInstanceConfig.h"
 #include "PixFitResult.h"
+#include "RawHisto.h"
 #include "PixFitWorkQueue.h"
+#include "PixFitBufferPool.h"
+#include "PixFitUnpack.h"
 
 /** @todo: rewrite the locking mechanisms. */
-/* Global lock for using anything remotely ROOTish. */
 namespace PixLib {
 boost::mutex root_m;
 boost::condition_variable_any root_cond;
@@ -52,18 +61,43 @@ using namespace PixLib;
 
 PixFitManager::PixFitManager(
 		const char* server_name, const char* partition_name, const char* instance_name, bool slaveEmu) :
-		fitQueue("FitQueue"),
-		resultQueue("ResultQueue"),
-		publishQueue("PublishQueue"),
+		fitQueue("FitQueue", PixFitInstanceConfig::fitQueueCapacity),
+		publishQueue("PublishQueue", PixFitInstanceConfig::publishQueueCapacity),
+		fitPool(PixFitInstanceConfig::getThreadingSettings()),
 		m_fitFarmCounter(0),
 		instanceConfig(server_name, partition_name, instance_name, slaveEmu)
 		{
 	getMrs();
 
+	/* One result queue per assembler shard. */
+	for (int i = 0; i < instanceConfig.assemblerStage.threads; i++) {
+		resultQueues.push_back(std::unique_ptr<PixFitWorkQueue<PixFitResult> >(
+				new PixFitWorkQueue<PixFitResult>("ResultQueue-" + std::to_string(i),
+						PixFitInstanceConfig::resultQueueCapacity)));
+	}
+
 	/* Associate blacklist with the queues. */
 	fitQueue.setBlackList(std::bind(&BlackList::investigateWorkObject, &instanceConfig.blacklist, std::placeholders::_1));
-	resultQueue.setBlackList(std::bind(&BlackList::investigateWorkObject, &instanceConfig.blacklist, std::placeholders::_1));
+	for (auto& resultQueue : resultQueues) {
+		resultQueue->setBlackList(std::bind(&BlackList::investigateWorkObject, &instanceConfig.blacklist, std::placeholders::_1));
+	}
 	publishQueue.setBlackList(std::bind(&BlackList::investigateWorkObject, &instanceConfig.blacklist, std::placeholders::_1));
+
+	/* Let urgent work overtake the rest. */
+	if (PixFitInstanceConfig::priorityScheduling) {
+		const int levels = PixFitScanConfig::numOfPriorities;
+		fitQueue.setPriority([this](std::shared_ptr<RawHisto> histo) {
+			return getPriority(histo->getScanConfig());
+		}, levels);
+		for (auto& resultQueue : resultQueues) {
+			resultQueue->setPriority([this](std::shared_ptr<PixFitResult> result) {
+				return getPriority(result->getScanConfig());
+			}, levels);
+		}
+		publishQueue.setPriority([this](std::shared_ptr<PixFitResult> result) {
+			return getPriority(result->getScanConfig());
+		}, levels);
+	}
 }
 
 PixFitManager::~PixFitManager() {
@@ -72,15 +106,44 @@ PixFitManager::~PixFitManager() {
 
 void PixFitManager::run() {
 	printBanner();
+	PixFitResult::setupRoot();
 	setupPixFitServer();
 
 	/* Setup IPC and IS */
 	IPCPartition partition(instanceConfig.getPartitionName());
 	ISInfoDictionary dict(partition);
 
-	/* Spawn network threads. */
-	ERS_LOG("Starting networking threads.")
-	boost::thread_group networkThreads;
+	/* Streaming fits process the bins of threshold scans in the fitting pool. */
+	instanceConfig.fitPool = &fitPool;
+
+	/* Optionally spawn the writer for raw network dumps. */
+	std::unique_ptr<PixFitDumpWriter> dumpWriter;
+	const char *dumpDir = getenv("PIXFIT_DUMP_DIR");
+	if (PixFitInstanceConfig::dumpNetwork || dumpDir != nullptr) {
+		const std::string prefix = "FitServer-" + instanceConfig.getInstanceId() + "-" + std::to_string(time(nullptr));
+		dumpWriter.reset(new PixFitDumpWriter(dumpDir != nullptr ? dumpDir : ".", prefix,
+				PixFitInstanceConfig::dumpCompression,
+				static_cast<size_t>(PixFitInstanceConfig::dumpMaxFileSizeMB) * 1024 * 1024,
+				static_cast<size_t>(PixFitInstanceConfig::dumpBufferMB) * 1024 * 1024));
+		dumpWriter->start();
+		instanceConfig.dumpWriter = dumpWriter.get();
+	}
+
+	/* Optionally trace every work package through the pipeline. */
+	const char *traceFile = getenv("PIXFIT_TRACE_FILE");
+	if (traceFile != nullptr && !instanceConfig.tracer.openTrace(traceFile)) {
+		ERS_INFO("Could not open trace file " << traceFile)
+	}
+
+	/* Spawn network threads, each one serving a share of the connections. */
+	ERS_LOG("Starting " << instanceConfig.networkStage.threads << " networking thread(s) ("
+			<< PixFitUnpack::getKernelName() << " unpacking).")
+	std::vector<std::unique_ptr<PixFitNetEngine> > engines;
+	for (int i = 0; i < instanceConfig.networkStage.threads; i++) {
+		engines.push_back(std::unique_ptr<PixFitNetEngine>(new PixFitNetEngine()));
+		engines.back()->setThreadIndex(i);
+		engines.back()->setCpuAffinity(instanceConfig.networkStage.getCpu(i));
+	}
 
 	for (auto& netConfig : networkConfigs) {
 		if (netConfig->isActive()) {
@@ -89,27 +152,57 @@ void PixFitManager::run() {
 		  //std::shared_ptr<PixFitNet> fitNet = std::make_shared<PixFitNet>(&fitQueue, it->get());
 		  std::shared_ptr<PixFitNet> fitNet(new PixFitNet(&fitQueue, netConfig.get(), &instanceConfig));
 		  m_netObjects.push_back(fitNet);
-		  fitNet->start();
 
-		  /* Add thread to the thread group. */
-		  networkThreads.add_thread(fitNet->getThread());
+		  /* Distribute the connections round-robin. */
+		  PixFitNetEngine *engine = engines[(m_netObjects.size() - 1) % engines.size()].get();
+		  if (!engine->addConnection(fitNet.get())) {
+			  ERS_INFO("Could not open listening socket for " << netConfig->getHistogrammer()->makeHistoString())
+		  }
 		}
 	}
+	for (auto& engine : engines) engine->start();
 
-	/* Spawn worker thread. */
-	ERS_LOG("Starting fitting threads.")
-	PixFitWorker worker(&fitQueue, &resultQueue);
-	worker.start();
+	std::vector<PixFitWorkQueue<PixFitResult>*> resultQueuePtrs;
+	for (auto& resultQueue : resultQueues) {
+		resultQueuePtrs.push_back(resultQueue.get());
+	}
 
-	/* Spawn assembler thread. */
-	ERS_LOG("Starting assembler thread.")
-	PixFitAssembler assembler(&resultQueue, &publishQueue, &instanceConfig);
-	assembler.start();
+	/* Spawn worker threads. */
+	ERS_LOG("Starting " << instanceConfig.workerStage.threads << " fitting thread(s).")
+	std::vector<std::unique_ptr<PixFitWorker> > workers;
+	for (int i = 0; i < instanceConfig.workerStage.threads; i++) {
+		workers.push_back(std::unique_ptr<PixFitWorker>(
+				new PixFitWorker(&fitQueue, resultQueuePtrs, &fitPool, PixFitInstanceConfig::fitMethod,
+						&instanceConfig)));
+		workers.back()->setThreadIndex(i);
+		workers.back()->setCpuAffinity(instanceConfig.workerStage.getCpu(i));
+		workers.back()->start();
+	}
 
-	/* Spawn publisher thread. */
-	ERS_LOG("Starting publishing thread.")
-	PixFitPublisher publisher(&publishQueue, &instanceConfig);
-	publisher.start();
+	/* Spawn assembler threads, each one serving its own shard. */
+	ERS_LOG("Starting " << instanceConfig.assemblerStage.threads << " assembler thread(s).")
+	std::vector<std::unique_ptr<PixFitAssembler> > assemblers;
+	for (int i = 0; i < instanceConfig.assemblerStage.threads; i++) {
+		assemblers.push_back(std::unique_ptr<PixFitAssembler>(
+				new PixFitAssembler(resultQueuePtrs[i], &publishQueue, &instanceConfig)));
+		assemblers.back()->setThreadIndex(i);
+		assemblers.back()->setCpuAffinity(instanceConfig.assemblerStage.getCpu(i));
+		assemblers.back()->start();
+	}
+
+	/* Spawn publisher threads. */
+	ERS_LOG("Starting " << instanceConfig.publisherStage.threads << " publishing thread(s).")
+	std::vector<std::unique_ptr<PixFitPublisher> > publishers;
+	for (int i = 0; i < instanceConfig.publisherStage.threads; i++) {
+		publishers.push_back(std::unique_ptr<PixFitPublisher>(
+				new PixFitPublisher(&publishQueue, &instanceConfig)));
+		publishers.back()->setThreadIndex(i);
+		publishers.back()->setCpuAffinity(instanceConfig.publisherStage.getCpu(i));
+		publishers.back()->start();
+	}
+
+	registerMetrics();
+	boost::thread monitorThread(&PixFitManager::monitorLoop, this);
 
 	/* Subscribe to IS. */
 	ISInfoReceiver rec(partition); 
@@ -175,8 +268,13 @@ void PixFitManager::run() {
 	  }
 	  else {
 	    setupScan(instanceConfig.slaveEmuRootFile, 33, 2, 16, 8);
-	    /* Dirty hack to wait for emulator. */
-	    std::cin.ignore().get();
+	    if (getenv("PIXFIT_REPLAY") != nullptr) {
+	      replay(33);
+	    }
+	    else {
+	      /* Dirty hack to wait for emulator. */
+	      std::cin.ignore().get();
+	    }
 	}
 
 	  //PixScanTask::saveResults to write outcome somewhere, TODO: tell the other code that it doesn't need to this anymore
@@ -184,10 +282,198 @@ void PixFitManager::run() {
 	/* Unsubscribe from IS. */
 	rec.unsubscribe(serverName, criteria);
 
-	networkThreads.join_all();
-	worker.join();
-	assembler.join();
-	publisher.join();
+	for (auto& engine : engines) engine->join();
+	for (auto& worker : workers) worker->join();
+	for (auto& assembler : assemblers) assembler->join();
+	for (auto& publisher : publishers) publisher->join();
+	if (dumpWriter) dumpWriter->join();
+
+	monitorThread.interrupt();
+	monitorThread.join();
+}
+
+void PixFitManager::replay(PixFitScanConfig::ScanIdType scanId) {
+	PixFitReplay replay;
+	for (auto& net : m_netObjects) replay.addEndpoint(*net->getConfig());
+
+	/* PIXFIT_REPLAY is either "synthetic" or a comma-separated list of dump files. */
+	std::string source(getenv("PIXFIT_REPLAY"));
+	if (source == "synthetic") {
+		PixFitScanConfig emuConfig(true);
+		emuConfig.scanId = scanId;
+		replay.setSynthetic(PixFitReplay::makeSynthetic(emuConfig));
+	}
+	else {
+		std::vector<std::string> files;
+		boost::split(files, source, boost::is_any_of(","), boost::token_compress_on);
+		for (auto& file : files) {
+			if (!file.empty()) replay.addDumpFile(file);
+		}
+	}
+
+	const char *rate = getenv("PIXFIT_REPLAY_RATE");
+	if (rate != nullptr) replay.setRate(atof(rate));
+	const char *repetitions = getenv("PIXFIT_REPLAY_REPEAT");
+	if (repetitions != nullptr) replay.setRepetitions(std::max(1, atoi(repetitions)));
+
+	ERS_LOG("Replaying " << source << " to " << m_netObjects.size() << " endpoint(s).")
+	replay.run();
+}
+
+int PixFitManager::getPriority(std::shared_ptr<const PixFitScanConfig> scanConfig) {
+	int priority = static_cast<int>(scanConfig->priority);
+
+	/* Favour RODs that are about to finish: FinishScan is signalled per ROD, so completing them one
+	 * after the other gives the Controller results earlier than finishing all of them at the end. */
+	const PixFitScanConfig::Progress *progress = scanConfig->progress.get();
+	if (priority > 0 && progress != nullptr) {
+		const int total = progress->total.load(std::memory_order_relaxed);
+		const int remaining = progress->remaining.load(std::memory_order_relaxed);
+		if (total > 0 && remaining <= total / s_nearCompletionFraction) priority--;
+	}
+	return priority;
+}
+
+void PixFitManager::registerMetrics() {
+	PixFitMetrics &metrics = instanceConfig.metrics;
+
+	auto addQueue = [&](const std::string &name, std::function<int()> size,
+			std::function<size_t()> highWaterMark, std::function<unsigned long()> fullCount) {
+		metrics.addGauge(name + "_Occupancy", [=]() -> int64_t {return size();});
+		metrics.addGauge(name + "_HighWaterMark", [=]() -> int64_t {return highWaterMark();});
+		metrics.addGauge(name + "_FullCount", [=]() -> int64_t {return fullCount();});
+	};
+	addQueue(fitQueue.getName(), [this]() {return fitQueue.getSize();},
+			[this]() {return fitQueue.getHighWaterMark();}, [this]() {return fitQueue.getFullCount();});
+	for (auto& resultQueue : resultQueues) {
+		PixFitWorkQueue<PixFitResult> *queue = resultQueue.get();
+		addQueue(queue->getName(), [queue]() {return queue->getSize();},
+				[queue]() {return queue->getHighWaterMark();}, [queue]() {return queue->getFullCount();});
+	}
+	addQueue(publishQueue.getName(), [this]() {return publishQueue.getSize();},
+			[this]() {return publishQueue.getHighWaterMark();}, [this]() {return publishQueue.getFullCount();});
+	metrics.addGauge(RODqueue.getName() + "_Dropped", []() -> int64_t {return RODqueue.getDroppedCount();});
+
+	const int64_t MB = 1024 * 1024;
+	MemoryBudget *budget = &instanceConfig.memoryBudget;
+	metrics.addGauge("Memory_UsedMB", [=]() -> int64_t {return budget->getUsed() / MB;});
+	metrics.addGauge("Memory_HighWaterMarkMB", [=]() -> int64_t {return budget->getHighWaterMark() / MB;});
+	metrics.addGauge("Memory_LimitMB", [=]() -> int64_t {return budget->getLimit() / MB;});
+
+	metrics.addGauge("BufferPool_Hits", []() -> int64_t {return PixFitBufferPool::instance().getStatistics().hits;});
+	metrics.addGauge("BufferPool_Misses", []() -> int64_t {return PixFitBufferPool::instance().getStatistics().misses;});
+	metrics.addGauge("BufferPool_TotalMB", [=]() -> int64_t {
+		return PixFitBufferPool::instance().getStatistics().totalBytes / MB;
+	});
+	metrics.addGauge("BufferPool_CachedMB", [=]() -> int64_t {
+		return PixFitBufferPool::instance().getStatistics().cachedBytes / MB;
+	});
+
+	metrics.addGauge("Assembler_HeldHistograms", [this]() -> int64_t {
+		int64_t size = 0;
+		for (auto assembler : instanceConfig.assemblers) size += assembler->getHoldSize();
+		return size;
+	});
+	metrics.addGauge("BlackList_Hits", [this]() -> int64_t {return instanceConfig.blacklist.getHits();});
+	metrics.addGauge("FitCache_Entries", [this]() -> int64_t {return instanceConfig.fitCache.getEntries();});
+	metrics.addGauge("FitCache_MB", [=]() -> int64_t {return instanceConfig.fitCache.getBytes() / MB;});
+
+	for (int step = 0; step < PixFitTracer::numOfSteps; step++) {
+		const PixFitTracer::Step tracerStep = static_cast<PixFitTracer::Step>(step);
+		std::string name = PixFitTracer::getStepName(tracerStep);
+		name[0] = toupper(name[0]);
+		metrics.addGauge("Latency_" + name + "P99Ms", [this, tracerStep]() -> int64_t {
+			return instanceConfig.tracer.getPercentile(tracerStep, 99) / 1000000;
+		});
+	}
+	metrics.addGauge("Latency_TotalP50Ms", [this]() -> int64_t {
+		return instanceConfig.tracer.getPercentile(PixFitTracer::STEP_TOTAL, 50) / 1000000;
+	});
+
+	if (instanceConfig.dumpWriter != nullptr) {
+		PixFitDumpWriter *dumpWriter = instanceConfig.dumpWriter;
+		metrics.addGauge("Dump_Records", [=]() -> int64_t {return dumpWriter->getStatistics().records;});
+		metrics.addGauge("Dump_Dropped", [=]() -> int64_t {return dumpWriter->getStatistics().dropped;});
+		metrics.addGauge("Dump_WrittenMB", [=]() -> int64_t {return dumpWriter->getStatistics().bytesWritten / MB;});
+	}
+}
+
+void PixFitManager::monitorLoop() {
+	IPCPartition partition(instanceConfig.getPartitionName());
+	ISInfoDictionary dict(partition);
+	const std::string prefix = instanceConfig.getServerName() + "." + instanceConfig.getInstanceId() + "_";
+	const char *metricsFile = getenv("PIXFIT_METRICS_FILE");
+
+	try {
+		while (true) {
+			boost::this_thread::sleep(boost::posix_time::seconds(s_monitorInterval));
+
+			/* All metrics go to IS as one object. This comes first, the high-water marks are reset
+			 * below. */
+			std::ostringstream metrics;
+			instanceConfig.metrics.write(metrics);
+			try {
+				dict.checkin(prefix + "Metrics", ISInfoString(metrics.str()));
+			}
+			catch (...) {
+				ERS_DEBUG(0, "Failed to publish metrics to IS")
+			}
+
+			std::ostringstream status;
+			auto report = [&](const std::string &name, int size, size_t capacity, size_t highWaterMark,
+					unsigned long fullCount) {
+				status << name << " " << size << "/" << capacity << " (max " << highWaterMark
+						<< ", full " << fullCount << ") ";
+			};
+
+			report(fitQueue.getName(), fitQueue.getSize(), fitQueue.getCapacity(),
+					fitQueue.getHighWaterMark(), fitQueue.getFullCount());
+			fitQueue.resetHighWaterMark();
+
+			for (auto& queue : resultQueues) {
+				report(queue->getName(), queue->getSize(), queue->getCapacity(),
+						queue->getHighWaterMark(), queue->getFullCount());
+				queue->resetHighWaterMark();
+			}
+
+			report(publishQueue.getName(), publishQueue.getSize(), publishQueue.getCapacity(),
+					publishQueue.getHighWaterMark(), publishQueue.getFullCount());
+			publishQueue.resetHighWaterMark();
+
+			MemoryBudget &budget = instanceConfig.memoryBudget;
+			const int usedMB = budget.getUsed() / (1024 * 1024);
+			const int highWaterMarkMB = budget.getHighWaterMark() / (1024 * 1024);
+			budget.resetHighWaterMark();
+			status << "Memory " << usedMB << "/" << budget.getLimit() / (1024 * 1024) << " MB (max "
+					<< highWaterMarkMB << " MB)";
+
+			PixFitBufferPool::Statistics pool = PixFitBufferPool::instance().getStatistics();
+			status << ", buffer pool " << pool.hits << " hits / " << pool.misses << " misses, "
+					<< pool.cachedBytes / (1024 * 1024) << " of " << pool.totalBytes / (1024 * 1024)
+					<< " MB free, " << pool.hugePageBytes / (1024 * 1024) << " MB huge pages";
+
+			if (instanceConfig.dumpWriter != nullptr) {
+				PixFitDumpWriter::Statistics dump = instanceConfig.dumpWriter->getStatistics();
+				status << ", dumped " << dump.records << " records / " << dump.bytesWritten / (1024 * 1024)
+						<< " MB in " << dump.files << " file(s), " << dump.dropped << " dropped";
+			}
+
+			PixFitTracer &tracer = instanceConfig.tracer;
+			status << ", latency " << tracer.getPercentile(PixFitTracer::STEP_TOTAL, 50) / 1000000 << " ms (p50) / "
+					<< tracer.getPercentile(PixFitTracer::STEP_TOTAL, 99) / 1000000 << " ms (p99)";
+			if (metricsFile != nullptr && !tracer.writeMetrics(metricsFile)) {
+				ERS_DEBUG(0, "Failed to write metrics to " << metricsFile)
+			}
+			tracer.flushTrace();
+
+			/* Only fill the log while something is going on. */
+			if (highWaterMarkMB > 0) {
+				ERS_LOG("Pipeline status: " << status.str())
+			}
+		}
+	}
+	catch (boost::thread_interrupted&) {
+	}
 }
 
 
@@ -255,7 +541,12 @@ void PixFitManager::callback(ISCallbackInfo * isc) {
 	else {
 	    type = "abort";
 	}
-	RODqueue.addWork(std::make_shared<std::pair<std::string, std::string>>(std::make_pair(type, static_cast<std::string>(isi))));
+
+	/* Never block the IS callback thread; if the scan loop is that far behind, the flag is lost. */
+	if (!RODqueue.tryAddWork(std::make_shared<std::pair<std::string, std::string>>(std::make_pair(type, static_cast<std::string>(isi))))) {
+		ERS_INFO("RODqueue full, dropped " << type << " scan flag for " << isi << " ("
+				<< RODqueue.getDroppedCount() << " dropped in total).")
+	}
 }
 
 void PixLib::PixFitManager::setupScan(std::string decName,
@@ -322,6 +613,18 @@ void PixLib::PixFitManager::setupScan(std::string decName,
   /* Count how many PixFitScanConfig objects are created (ignoring extra ones for mask stepping.) */
   int objCount = 0;
 
+  /* Publishing progress of the ROD, shared by all its configs and filled in with objCount below. */
+  std::shared_ptr<PixFitScanConfig::Progress> progress = std::make_shared<PixFitScanConfig::Progress>();
+
+  /* Intermediate histograms (one per chip and bin) are published on top of the final ones and have
+   * to be counted as well, as they may be published after the final ones. */
+  int intermediatesPerUnit = 0;
+  if (pixScanFitServer) {
+	  PixFitScanConfig unitConfig(instanceConfig.usingSlaveEmu());
+	  unitConfig.pixScanConfig = pixScanFitServer;
+	  if (unitConfig.doIntermediateHistos()) intermediatesPerUnit = 8 * unitConfig.getNumOfBins();
+  }
+
   /* Build and enqueue PixFitScanConfig objects. We iterate through the active histo units and
    * look for a match in the networking threads. When a match is found the correct number of
    * PixFitScanConfigs is created and put in the network thread's queue. */
@@ -350,6 +653,11 @@ void PixLib::PixFitManager::setupScan(std::string decName,
 					pixFitScanConfig->scanId = scanId;
 					pixFitScanConfig->modMask = modMask;
 					pixFitScanConfig->fitFarmId = m_fitFarmCounter;
+					pixFitScanConfig->progress = progress;
+					/* The last mask step completes the results of the unit in the assembler. */
+					if (j == numOfMaskSteps - 1) {
+						pixFitScanConfig->priority = PixFitScanConfig::priorityClass::PRIORITY_HIGH;
+					}
 
 				/* Enqueue pixFitScanConfig into network thread queue. */
 				(*net_it)->putScanConfig(pixFitScanConfig);
@@ -357,12 +665,12 @@ void PixLib::PixFitManager::setupScan(std::string decName,
 			  /* Increment created object count (ignoring mask steps) for this fitFarmId.
 			   * This works for the usual case with 8 chips per histounit. For cases where one ROD
 			   * might use strange combinations of active FEs per histo unit this will break! */
-			  objCount += 8;
+			  objCount += 8 + intermediatesPerUnit;
 		  }
     }
   }
   /* Put ID/objCount in ScanList. */
-  instanceConfig.scanlist.setScanCount(m_fitFarmCounter, objCount);
+  instanceConfig.scanlist.setScanCount(m_fitFarmCounter, objCount, progress);
 
   /* Increment internal counter after each setupScan for a ROD. */
   m_fitFarmCounter++;
@@ -534,8 +842,10 @@ void PixFitManager::cancelScan(PixFitScanConfig::ScanIdType scanId, int crate, i
 		}
 	}
 
-	/* Tell assembler to clean up the hold to remove orphaned objects. */
-	instanceConfig.assembler->setCleanFlag();
+	/* Tell assemblers to clean up the hold to remove orphaned objects. */
+	for (auto assembler : instanceConfig.assemblers) {
+		assembler->setCleanFlag();
+	}
 }
 
 
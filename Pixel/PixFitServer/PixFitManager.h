@@ -27,13 +27,15 @@
 #include "PixFitNetConfiguration.h"
 #include "PixFitScanConfig.h"
 #include "PixFitInstanceConfig.h"
+#include "PixFitThreadPool.h"
 
 namespace PixLib {
 
 class PixFitResult;
 class RawHisto;
 
-/** @todo: rewrite the locking mechanism for ROOT stuff */
+/** Serializes the access to ROOT files through PixLib (RootDb), which is not thread safe.
+ * Histograms do not need it, see PixFitResult::setupRoot(). */
 extern boost::mutex root_m;
 
 /** Manages one FitFarm process (Spawns and coordinates threads/scans). Should be
@@ -56,14 +58,18 @@ class PixFitManager {
    * Contains RawHistos that might need fitting/calculating. */
   PixFitWorkQueue<RawHisto> fitQueue;
 
-  /** Queue between PixFitWorker/Fitter and PixFitAssembler.
-   * Contains processed results that still need to be assembled. */
-  PixFitWorkQueue<PixFitResult> resultQueue;
+  /** Queues between PixFitWorker/Fitter and PixFitAssembler, one per assembler.
+   * Contain processed results that still need to be assembled. */
+  std::vector<std::unique_ptr<PixFitWorkQueue<PixFitResult> > > resultQueues;
 
   /** Queue between PixFitAssembler and PixFitPublisher.
    * Contains completely assembled results that are ready for publishing to OH */
   PixFitWorkQueue<PixFitResult> publishQueue;
 
+  /** Fitting threads shared by all PixFitWorkers. Lives as long as the manager, so no threads are
+   * created or joined per histogram. */
+  PixFitThreadPool fitPool;
+
   /** Looks for free ports by trying to bind to them. This is a poor-man's-workaround for running
    * multiple PixFitServers of different partitions on the same machine.
    * @param ipAddress The IPv4 address that we are interested in.
@@ -120,6 +126,12 @@ class PixFitManager {
   void setupScan(std::string decName, PixFitScanConfig::ScanIdType scanId, int crate, int rod,
 		  int modMask, PixActions::SyncType sync=PixActions::Asynchronous);
 
+  /** Feeds the networking threads with data from PixFitReplay instead of the slave emulator,
+   * configured with the environment variables PIXFIT_REPLAY ("synthetic" or a comma-separated list
+   * of dump files), PIXFIT_REPLAY_RATE (MB/s per endpoint) and PIXFIT_REPLAY_REPEAT.
+   * @param scanId Scan ID of the generated data. */
+  void replay(PixFitScanConfig::ScanIdType scanId);
+
   /** Cancels an ongoing scan.
    * Eliminates PixFitScanConfig objects that fit the scanId as soon as they are popped from queues. Also signals PixFitNetwork threads
    * to discard a possibly ongoing receive operation and PixFitAssembler in case of buffered incomplete histograms.
@@ -138,9 +150,30 @@ class PixFitManager {
    * @returns Vector containing HistoUnits that are only valid in their slave and histo field. */
   std::vector<HistoUnit> translateModuleMask(int modMask);
 
+  /** Determines the priority class of a work package in the queues.
+   * @param scanConfig The PixFitScanConfig of the work package.
+   * @returns Priority class, 0 is served first. */
+  int getPriority(std::shared_ptr<const PixFitScanConfig> scanConfig);
+
+  /** Work of a ROD with no more than 1/s_nearCompletionFraction of its objects (final and
+   * intermediate histograms) left to publish is promoted by one priority class. */
+  static const int s_nearCompletionFraction = 4;
+
   /** Prints some information after startup of the PixFitServer. */
   void printBanner();
 
+  /** Adds the gauges of the queues, the memory budget, the buffer pool, the assembler hold, the
+   * blacklist, the latencies and the dump writer to the metrics of the instance. */
+  void registerMetrics();
+
+  /** Periodically publishes the metrics to IS as one object (named <instance>_Metrics) and reports
+   * occupancy and high-water mark of the work queues and the memory budget to the log. Runs in its
+   * own thread until interrupted. */
+  void monitorLoop();
+
+  /** Seconds between two reports of monitorLoop(). */
+  static const int s_monitorInterval = 5;
+
   /* PixMessages object to report in GUI */
   PixMessages *m_msg; 
   PixMessages &getMrs();
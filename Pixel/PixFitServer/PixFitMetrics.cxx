@@ -0,0 +1,81 @@
+/* @file PixFitMetrics.cxx
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "PixFitMetrics.h"
+
+using namespace PixLib;
+
+PixFitMetrics::Counter::Counter() {
+	void *memory = nullptr;
+	if (posix_memalign(&memory, alignof(Slot), s_slots * sizeof(Slot)) != 0) throw std::bad_alloc();
+	m_slots = static_cast<Slot*>(memory);
+	for (int i = 0; i < s_slots; i++) {
+		new (&m_slots[i]) Slot();
+		m_slots[i].value = 0;
+	}
+}
+
+PixFitMetrics::Counter::~Counter() {
+	for (int i = 0; i < s_slots; i++) m_slots[i].~Slot();
+	free(m_slots);
+}
+
+int PixFitMetrics::Counter::getSlot() {
+	/* Threads are assigned slots round-robin when they first count something. */
+	static std::atomic<int> nextSlot(0);
+	static thread_local int slot = nextSlot.fetch_add(1, std::memory_order_relaxed) % s_slots;
+	return slot;
+}
+
+uint64_t PixFitMetrics::Counter::get() const {
+	uint64_t sum = 0;
+	for (int i = 0; i < s_slots; i++) sum += m_slots[i].value.load(std::memory_order_relaxed);
+	return sum;
+}
+
+PixFitMetrics::PixFitMetrics() {
+}
+
+PixFitMetrics::~PixFitMetrics() {
+}
+
+PixFitMetrics::Counter& PixFitMetrics::getCounter(const std::string &name) {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	std::unique_ptr<Counter> &counter = m_counters[name];
+	if (!counter) counter.reset(new Counter);
+	return *counter;
+}
+
+void PixFitMetrics::addGauge(const std::string &name, std::function<int64_t()> read) {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_gauges[name] = read;
+}
+
+std::vector<std::pair<std::string, int64_t> > PixFitMetrics::getValues() const {
+	std::vector<std::pair<std::string, int64_t> > values;
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		for (auto& counter : m_counters) {
+			values.push_back(std::make_pair(counter.first, static_cast<int64_t>(counter.second->get())));
+		}
+		for (auto& gauge : m_gauges) {
+			values.push_back(std::make_pair(gauge.first, gauge.second()));
+		}
+	}
+	std::sort(values.begin(), values.end());
+	return values;
+}
+
+void PixFitMetrics::write(std::ostream &out) const {
+	out << "{";
+	bool first = true;
+	for (auto& value : getValues()) {
+		out << (first ? "" : ", ") << "\"" << value.first << "\": " << value.second;
+		first = false;
+	}
+	out << "}";
+}
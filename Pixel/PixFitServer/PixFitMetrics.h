@@ -0,0 +1,90 @@
+/* @file PixFitMetrics.h
+ */
+
+#ifndef PIXFITMETRICS_H_
+#define PIXFITMETRICS_H_
+
+#include <stdint.h> // change to cstdint for C++11
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+namespace PixLib {
+
+/** Registry of the health metrics of the FitServer. PixFitManager publishes all of them together as
+ * one IS object every monitoring interval, so the hot paths only increment counters and never log.
+ * There are two kinds of metrics:
+ * - Counters are incremented by the threads that observe an event. Look them up once with
+ *   getCounter() and keep the reference, incrementing is a relaxed atomic add on a slot that is
+ *   mostly used by the calling thread only.
+ * - Gauges are read when the metrics are published, by a function that samples the current value
+ *   (e.g. the size of a queue). They cost nothing in between. */
+class PixFitMetrics {
+public:
+	/** Monotonic counter. Every thread adds to one of s_slots slots, the value is their sum. */
+	class Counter {
+	public:
+		Counter();
+		~Counter();
+
+		Counter(const Counter&) = delete;
+		Counter& operator=(const Counter&) = delete;
+
+		void add(uint64_t n = 1) {
+			m_slots[getSlot()].value.fetch_add(n, std::memory_order_relaxed);
+		}
+
+		/** @returns Sum over all slots, the increments of other threads may show up late. */
+		uint64_t get() const;
+
+	private:
+		/** Slot on a cache line of its own. */
+		struct alignas(64) Slot {
+			std::atomic<uint64_t> value;
+		};
+
+		static const int s_slots = 16;
+
+		/** @returns Slot of the calling thread. */
+		static int getSlot();
+
+		/** Allocated with posix_memalign(), operator new does not respect the alignment of Slot
+		 * before C++17. */
+		Slot *m_slots;
+	};
+
+	PixFitMetrics();
+	virtual ~PixFitMetrics();
+
+	/** @returns The counter with the given name, created on first use. References stay valid for
+	 * the lifetime of the registry. */
+	Counter& getCounter(const std::string &name);
+
+	/** Adds a gauge or replaces the function of an existing one.
+	 * @param read Function that returns the current value, called from the publishing thread. */
+	void addGauge(const std::string &name, std::function<int64_t()> read);
+
+	/** @returns Current values of all counters and gauges, sorted by name. */
+	std::vector<std::pair<std::string, int64_t> > getValues() const;
+
+	/** Writes all values as one JSON object. */
+	void write(std::ostream &out) const;
+
+private:
+	std::map<std::string, std::unique_ptr<Counter> > m_counters;
+	std::map<std::string, std::function<int64_t()> > m_gauges;
+
+	/** Protects the maps, not the counters themselves. */
+	mutable boost::mutex m_mutex;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITMETRICS_H_ */
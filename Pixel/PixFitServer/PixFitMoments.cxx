@@ -0,0 +1,194 @@
+/* @file PixFitMoments.cxx
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "PixFitMoments.h"
+#include "PixFitSimd.h"
+#include "RawHisto.h"
+
+using namespace PixLib;
+
+namespace {
+
+/** Pixels estimated side by side on a bin-major histogram. */
+const int s_block = 256;
+
+/** Turns the sums over the bins before the last one into the estimate of a pixel.
+ * @param top Occupancy of the last bin.
+ * @param firstNonZero First bin with hits, last if there is none before the last bin.
+ * @param firstPlateau First bin on the plateau, last if there is none before the last bin. */
+void finish(int last, double top, double sum, double weightedSum, int firstNonZero, int firstPlateau,
+		PixFitMoments::Estimate *estimate) {
+	/* Include one zero data point. Everything before start is zero, so the plateau can only be
+	 * found before start if the plateau itself is zero. */
+	const bool empty = (top == 0. && firstNonZero == last);
+	const int start = (!empty && firstNonZero > 0) ? firstNonZero - 1 : 0;
+	const int end = (top > 0.) ? firstPlateau : start;
+	estimate->start = start;
+	estimate->end = end;
+	if ((end - start > 0) || (end - start == 0 && end != 0)) estimate->valid = end - start + 1;
+	else estimate->valid = 0;
+
+	/* The increase d(b) = y(b) - y(b - 1) sits at b - 1/2 and adds up to the last bin L. Summing by
+	 * parts gives sum(d * x) = y(L) * (L - 1/2) - sum(y) and sum(d * x^2) = y(L) * (L - 1/2)^2
+	 * - 2 * sum(b * y), both sums over the bins before L. Sheppard's correction removes the width
+	 * of a bin from the variance. */
+	estimate->mu = -1.;
+	estimate->sigma = 0.;
+	if (top > 0.) {
+		const double x = last - 0.5;
+		const double mu = x - sum / top;
+		const double variance = x * x - 2. * weightedSum / top - mu * mu - 1. / 12.;
+		estimate->mu = mu;
+		if (variance > 0.) estimate->sigma = std::sqrt(variance);
+	}
+}
+
+/** Sums of a block of pixels on a bin-major histogram. The bin indices are kept as doubles, so
+ * all per-pixel values have the same type and fit the same vectors. */
+struct Block {
+	double plateau[s_block];
+	double sum[s_block];
+	double weightedSum[s_block];
+	double firstNonZero[s_block];
+	double firstPlateau[s_block];
+};
+
+/** Adds the bins before lastBin of the pixels first to n - 1 of a block.
+ * @param y First bin of the first pixel of the block, the next bin is stride words further. */
+void accumulateRange(const RawHisto::histoWord_type *y, size_t stride, int lastBin, int first, int n, Block &block) {
+	for (int b = 0; b < lastBin; b++) {
+		const RawHisto::histoWord_type *row = y + b * stride;
+		const double bin = b;
+		for (int p = first; p < n; p++) {
+			const double v = row[p];
+			block.sum[p] += v;
+			block.weightedSum[p] += bin * v;
+			block.firstNonZero[p] = std::min(block.firstNonZero[p], (v != 0.) ? bin : lastBin);
+			block.firstPlateau[p] = std::min(block.firstPlateau[p], (v >= block.plateau[p]) ? bin : lastBin);
+		}
+	}
+}
+
+/** Vector version of accumulateRange() for the pixels 0 to n - 1, same order of the additions.
+ * @returns Number of pixels done, the rest is left to accumulateRange(). */
+template <class V>
+PIXFIT_SIMD_INLINE int accumulateLanes(const RawHisto::histoWord_type *y, size_t stride, int lastBin, int n,
+		Block &block) {
+	using namespace PixFitSimd;
+	const int W = Traits<V>::width;
+	const int lanes = n - n % W;
+	for (int b = 0; b < lastBin; b++) {
+		const RawHisto::histoWord_type *row = y + b * stride;
+		V bin;
+		broadcast(static_cast<double>(b), bin);
+		for (int p = 0; p < lanes; p += W) {
+			V v = {};
+			for (int l = 0; l < W; l++) v[l] = row[p + l];
+			V sum, weightedSum, firstNonZero, firstPlateau, plateau;
+			load(block.sum + p, sum);
+			load(block.weightedSum + p, weightedSum);
+			load(block.firstNonZero + p, firstNonZero);
+			load(block.firstPlateau + p, firstPlateau);
+			load(block.plateau + p, plateau);
+			select((v != 0.) & (bin < firstNonZero), bin, firstNonZero, firstNonZero);
+			select((v >= plateau) & (bin < firstPlateau), bin, firstPlateau, firstPlateau);
+			store(block.sum + p, sum + v);
+			store(block.weightedSum + p, weightedSum + bin * v);
+			store(block.firstNonZero + p, firstNonZero);
+			store(block.firstPlateau + p, firstPlateau);
+		}
+	}
+	return lanes;
+}
+
+typedef int (*Kernel)(const RawHisto::histoWord_type *y, size_t stride, int lastBin, int n, Block &block);
+
+/* ISA specific instantiations of the kernel. */
+int kernelGeneric(const RawHisto::histoWord_type *y, size_t stride, int lastBin, int n, Block &block) {
+	return accumulateLanes<PixFitSimd::v2df>(y, stride, lastBin, n, block);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+int kernelAvx2(const RawHisto::histoWord_type *y, size_t stride, int lastBin, int n, Block &block) {
+	return accumulateLanes<PixFitSimd::v4df>(y, stride, lastBin, n, block);
+}
+#endif
+
+/* Picks the widest kernel supported by the CPU. */
+Kernel selectKernel() {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return kernelAvx2;
+#endif
+	return kernelGeneric;
+}
+
+const Kernel s_kernel = selectKernel();
+
+} /* end of anonymous namespace */
+
+void PixFitMoments::estimate(RawHisto &histo, int pixel, int bins, Estimate *estimate) {
+	const RawHisto::histoWord_type *y = histo(pixel);
+	const int stride = histo.getBinStride();
+	const int last = bins - 1;
+	const double top = y[static_cast<size_t>(last) * stride];
+	const double plateau = 0.999 * top;
+
+	/* No early exit and no branches, so the compiler can vectorize the loop. */
+	double sum = 0.;
+	double weightedSum = 0.;
+	int firstNonZero = last;
+	int firstPlateau = last;
+	for (int b = 0; b < last; b++) {
+		const double v = y[static_cast<size_t>(b) * stride];
+		sum += v;
+		weightedSum += b * v;
+		firstNonZero = std::min(firstNonZero, (v != 0.) ? b : last);
+		firstPlateau = std::min(firstPlateau, (v >= plateau) ? b : last);
+	}
+
+	finish(last, top, sum, weightedSum, firstNonZero, firstPlateau, estimate);
+}
+
+void PixFitMoments::estimateRange(RawHisto &histo, int first, int last, int bins, Estimate *estimates) {
+	if (histo.getLayout() != RawHisto::Layout::BIN_MAJOR || histo.getPixelStride() != 1) {
+		for (int i = first; i < last; i++) {
+			estimate(histo, i, bins, &estimates[i - first]);
+		}
+		return;
+	}
+
+	/* The bins of neighbouring pixels are adjacent, so a block of pixels goes through the bins
+	 * together, each vector lane holding the sums of one pixel. */
+	const size_t stride = histo.getBinStride();
+	const int lastBin = bins - 1;
+	double top[s_block];
+	Block block;
+
+	for (int blockStart = first; blockStart < last; blockStart += s_block) {
+		const int n = std::min(s_block, last - blockStart);
+		const RawHisto::histoWord_type *y = histo(blockStart);
+
+		const RawHisto::histoWord_type *row = y + static_cast<size_t>(lastBin) * stride;
+		for (int p = 0; p < n; p++) {
+			top[p] = row[p];
+			block.plateau[p] = 0.999 * top[p];
+			block.sum[p] = 0.;
+			block.weightedSum[p] = 0.;
+			block.firstNonZero[p] = lastBin;
+			block.firstPlateau[p] = lastBin;
+		}
+
+		const int done = s_kernel(y, stride, lastBin, n, block);
+		accumulateRange(y, stride, lastBin, done, n, block);
+
+		for (int p = 0; p < n; p++) {
+			finish(lastBin, top[p], block.sum[p], block.weightedSum[p], static_cast<int>(block.firstNonZero[p]),
+					static_cast<int>(block.firstPlateau[p]), &estimates[blockStart - first + p]);
+		}
+	}
+}
@@ -0,0 +1,48 @@
+/* @file PixFitMoments.h
+ */
+
+#ifndef PIXFITMOMENTS_H_
+#define PIXFITMOMENTS_H_
+
+namespace PixLib {
+
+class RawHisto;
+
+/** Analytic estimate of the S-curve of a pixel. The increase of the occupancy from one bin to the
+ * next follows a Gaussian for an erf S-curve, so its mean is mu and its width sigma. Both moments
+ * follow from the sums of y and b*y over the bins b, which only takes one pass over the data
+ * without any branches. The same pass finds the range of bins the fitters use. */
+class PixFitMoments {
+public:
+	/** Result for a single pixel. */
+	struct Estimate {
+		/** Last bin without hits before the rise (0 if there is none). */
+		int start;
+
+		/** First bin on the plateau, i.e. with at least 99.9% of the occupancy of the last bin. */
+		int end;
+
+		/** Number of bins from start to end, 0 if the pixel has no hits. */
+		int valid;
+
+		/** Estimated S-curve in bins, sigma is 0 if the curve is too steep to be resolved. */
+		double mu;
+		double sigma;
+	};
+
+	/** Estimates the S-curve of a pixel.
+	 * @param bins Number of bins of the histogram. */
+	static void estimate(RawHisto &histo, int pixel, int bins, Estimate *estimate);
+
+	/** Estimates the S-curves of the pixels first to last - 1, with the same results as estimate().
+	 * On a bin-major histogram with one word per pixel the pixels are processed side by side, one
+	 * bin after the other, so the loops are vectorized across pixels instead of walking the bins
+	 * of each pixel with a stride.
+	 * @param bins Number of bins of the histogram.
+	 * @param estimates One entry per pixel of the range. */
+	static void estimateRange(RawHisto &histo, int first, int last, int bins, Estimate *estimates);
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITMOMENTS_H_ */
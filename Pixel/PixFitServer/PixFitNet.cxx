@@ -5,9 +5,8 @@
  */
 
 #include <iostream>
-#include <fstream>	// for dumping raw network data
 #include <stdio.h>	// TODO: used for printfs
-#include <cstdlib> // for malloc
+#include <cerrno>
 #include <memory>
 #include <string>
 #include <functional>
@@ -15,7 +14,6 @@
 
 /* Networking via POSIX sockets */
 #include <sys/socket.h>
-#include <sys/poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -25,11 +23,15 @@
 #include <ers/ers.h>
 
 #include "iblSlaveNetCmds.h"
-#include "rodHisto.hxx"
 
 #include "PixFitNet.h"
+#include "PixFitNetEngine.h"
 #include "PixFitNetConfiguration.h"
 #include "PixFitInstanceConfig.h"
+#include "PixFitUnpack.h"
+#include "PixFitStreamingFit.h"
+#include "PixFitBufferPool.h"
+#include "PixFitDumpWriter.h"
 
 using namespace PixLib;
 
@@ -39,29 +41,44 @@ PixFitNet::PixFitNet(PixFitWorkQueue<RawHisto> *queue,
 		m_scanConfigQueue("ScanConfigQueue"), m_msg() {
 	this->m_queue = queue;
 	this->m_configuration = netConfig;
-	this->m_rodSock = 0;
-	this->m_rxBuf = 0;
-	this->m_currentBin = 0;
-	this->m_threadName = "network";
 	this->m_instanceConfig = instanceConfig;
+	this->m_engine = nullptr;
+	this->m_token = 0;
+	this->m_listenSock = -1;
+	this->m_rodSock = -1;
+	this->m_listenArmed = false;
+	this->m_sockArmed = false;
+	this->m_rxState = RxState::HEADER;
+	this->m_rxLen = 0;
+	this->m_rxTarget = nullptr;
+	this->m_payloadWords = 0;
+	this->m_inPlace = false;
+	this->m_currentBin = 0;
 	this->m_resetFlag = 0;
+	this->m_stalled = false;
+	this->m_stallReleases = 0;
+	this->m_stallReported = false;
 	this->m_scanConfigQueue.setBlackList(std::bind(&BlackList::investigateWorkObject, &m_instanceConfig->blacklist, std::placeholders::_1));
 	this->m_histoUnitString = netConfig->getHistogrammer()->makeHistoString();
+
+	const HistoUnit *unit = netConfig->getHistogrammer();
+	this->m_bytesReceived = &instanceConfig->metrics.getCounter("Net_BytesReceived_ROD_" + unit->crateletter
+			+ std::to_string(unit->crate) + "_S" + std::to_string(unit->rod) + "_" + std::to_string(unit->slave)
+			+ "_" + std::to_string(unit->histo));
 }
 
 PixFitNet::~PixFitNet() {
 	/* TODO Gracefully close open connections */
-	free(m_rxBuf);
+	if (m_rodSock != -1) close(m_rodSock);
+	if (m_listenSock != -1) close(m_listenSock);
 }
 
-/* @todo: error handling for socket -> exit thread? */
-void PixFitNet::loop() {
-	std::ostringstream buf; // for buffering lines of output
+int PixFitNet::openListener(PixFitNetEngine *engine, uint64_t token) {
+	m_engine = engine;
+	m_token = token;
 	ERS_LOG(m_histoUnitString << ": Opening socket.")
 
 	sockaddr_in my_addr;
-	sockaddr_in their_addr; // connector's address information
-	socklen_t sin_size;
 	int rc;
 	int localSock = -1;
 
@@ -69,7 +86,7 @@ void PixFitNet::loop() {
 	localSock = socket(AF_INET, SOCK_STREAM, 0);
 	if (-1 == localSock) {
 		ERS_LOG(m_histoUnitString << ": Opening socket failed.")
-		return;
+		return -1;
 	}
 
 	/* Allow port number to be reused. */
@@ -77,7 +94,7 @@ void PixFitNet::loop() {
 	if (setsockopt(localSock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
 		ERS_LOG(m_histoUnitString << ": Setting socket option failed.")
 		close(localSock);
-		return;
+		return -1;
 	}
 
 	/* Configure local part. */
@@ -90,171 +107,178 @@ void PixFitNet::loop() {
 	if (0 != rc) {
 		ERS_LOG(m_histoUnitString << ": Bind failed.")
 		close(localSock);
-		return;
+		return -1;
 	}
 
 	rc = listen(localSock, 10); // @todo backlog
 	if (0 != rc) {
 		ERS_LOG(m_histoUnitString << ": Listen failed.")
 		close(localSock);
-		return;
+		return -1;
 	}
 
-	/* Get buffer for histogram data. */
-	if (0 == (m_rxBuf = (unsigned char*) malloc(s_bufSize))) {
-		ERS_LOG(m_histoUnitString << ": Buffer allocation failed.")
-		close(localSock);
-		return;
-	}
+	/* The engine must never block on accept(). */
+	fcntl(localSock, F_SETFL, O_NONBLOCK);
+	m_listenSock = localSock;
+	m_listenArmed = true;
+	return m_listenSock;
+}
 
-	/* Main loop.
-	 * @todo Communication to/from PixFitManager.
-	 * @todo Signal readiness (to PixFitManager). */
-	while (1) {
-		ERS_DEBUG(1, m_histoUnitString << ": Begin of loop, localsock " << localSock)
+void PixFitNet::onAccept() {
+	if (m_rodSock != -1) return;
 
-		sin_size = sizeof their_addr;
-		/* Blocking here. */
-		m_rodSock = accept(localSock, (struct sockaddr *) &their_addr, &sin_size);
-		if (-1 == m_rodSock) {
+	sockaddr_in their_addr; // connector's address information
+	socklen_t sin_size = sizeof their_addr;
+	int sock = accept(m_listenSock, (struct sockaddr *) &their_addr, &sin_size);
+	if (-1 == sock) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
 			ERS_LOG(m_histoUnitString << ": Accept failed.")
-			close(localSock);
-			break;
 		}
-		ERS_LOG(m_histoUnitString << ": FitServer connection successful!")
+		return;
+	}
+	ERS_LOG(m_histoUnitString << ": FitServer connection successful!")
 
-		/* Set socket to be non-blocking. */
-		fcntl(m_rodSock, F_SETFL, O_NONBLOCK);
+	/* Set socket to be non-blocking. */
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	m_rodSock = sock;
+	m_rxState = RxState::HEADER;
+	m_rxLen = 0;
 
-		/* Discard reset requests from before a connection has actually been established. */
-		m_resetMutex.lock();
-		m_resetFlag = 0;
-		m_resetMutex.unlock();
-
-		/* Read and process commands. */
-		while (1) {
-			/* Get scan config from queue if no scan is ongoing. Blocks if no items in queue. */
-			if (m_scanConfig == 0) {
-				m_dumpFile.close(); /* Close potentially open stream, not throwing by default. */
-				m_scanConfig = m_scanConfigQueue.getWork();
-
-				/* Initialize RawHisto object. */
-				m_rawHisto = std::make_shared<RawHisto>(m_scanConfig);
-				if (!(m_rawHisto->allocateMemory())) {
-					ERS_DEBUG(0, m_histoUnitString <<
-							": Allocated " << m_rawHisto->getSize() << " bytes for histogram.")
-					m_currentBin = 0;
-				}
-				else {
-					return;
-				}
+	/* Discard reset requests from before a connection has actually been established. */
+	m_resetMutex.lock();
+	m_resetFlag = 0;
+	m_resetMutex.unlock();
 
-				/* Optionally open file for dumping network data. */
-				if (m_instanceConfig->dumpNetwork) {
-					std::string crate = std::to_string(m_configuration->getHistogrammer()->crate);
-					std::string rod = std::to_string(m_configuration->getHistogrammer()->rod);
-					std::string slave = std::to_string(m_configuration->getHistogrammer()->slave);
-					std::string histo = std::to_string(m_configuration->getHistogrammer()->histo);
-					std::string scanId = std::to_string(m_scanConfig->scanId);
-					std::string maskId = std::to_string(m_scanConfig->maskId);
-					std::string fileName = "FitServer-" + scanId + "-" + "m" + maskId + "-" + crate + "_"
-							+ rod + "_" + slave + "_" + histo + ".dump";
-					m_dumpFile.open(fileName.c_str(), ios::out | ios::binary | ios::ate);
-					/* @todo: fail check */
-				}
-			}
+	m_engine->addSocket(m_rodSock, m_token, false);
+	updateInterest();
+}
 
-			rc = readCommand();
-			if (1 != rc) {
-				break;
+void PixFitNet::onReadable(bool hangup) {
+	while (m_rodSock != -1 && isReady()) {
+		int rc;
+		if (m_rxState == RxState::HEADER) {
+			rc = receive(reinterpret_cast<char *>(m_rxBuf) + m_rxLen, sizeof(RodSlvTcpCmd) - m_rxLen);
+		}
+		else {
+			rc = receive(m_rxTarget + m_rxLen, m_cmd.payloadSize - m_rxLen);
+		}
+		if (rc == 0) break; // no more data for now
+		if (rc < 0) {
+			closeConnection();
+			break;
+		}
+		m_rxLen += rc;
+
+		if (m_rxState == RxState::HEADER && m_rxLen == sizeof(RodSlvTcpCmd)) {
+			/* Optionally dump data to file. */
+			if (m_instanceConfig->dumpWriter != nullptr) {
+				m_instanceConfig->dumpWriter->submit(makeDumpHeader(PixFitDump::RECORD_COMMAND, -1),
+						reinterpret_cast<char *>(m_rxBuf), m_rxLen);
 			}
+			handleResult(procRequest());
+		}
+		else if (m_rxState == RxState::PAYLOAD && m_rxLen == m_cmd.payloadSize) {
+			handleResult(procPayload());
+		}
+	}
 
-			/* Process complete commands. */
-			rc = procRequest();
+	/* A hangup is reported even while we do not read, do not wait for data that will never come. */
+	if (hangup && m_rodSock != -1 && !isReady()) {
+		ERS_LOG(m_histoUnitString << ": Socket closed from remote.")
+		closeConnection();
+	}
+	updateInterest();
+}
 
+void PixFitNet::service() {
+	if (m_rodSock != -1) resetCheck();
+	updateInterest();
+}
 
-			/* Publish RawHisto to queue. */
-			if (2 == rc) {
-				m_queue->addWork(m_rawHisto);
-				m_rawHisto.reset();
-				m_scanConfig.reset();
-			}
-			else if (0 == rc) {
-				;
-			}
-			/* Reset connection in case of error */
-			else {
-				break;
-			}
-		}
+bool PixFitNet::isStalled() const {
+	return m_stalled;
+}
 
-		int rc;
-		rc = shutdown(m_rodSock, SHUT_WR);
-		if (rc != 0) {
-		    ERS_LOG(m_histoUnitString << ": Error on shutdown socket")
-		}
-		rc = close(m_rodSock);
-		if (rc != 0) {
-		    ERS_LOG(m_histoUnitString << ": Error on close socket")
-		}
-		m_rodSock = 0;
-		sleep(1);
-		m_scanConfig = 0;
+void PixFitNet::handleResult(int rc) {
+	/* Receive the payload. */
+	if (3 == rc) {
+		m_rxState = RxState::PAYLOAD;
+		m_rxLen = 0;
+		return;
 	}
 
-	/** @todo Only reached when accept() fails. Free memory (when thread is terminated?) */
-	free(m_rxBuf);
-	ERS_LOG(m_histoUnitString << ": Done!")
-	return;
+	m_rxState = RxState::HEADER;
+	m_rxLen = 0;
+	m_rxTarget = nullptr;
+	m_packed.reset();
+
+	/* Publish RawHisto to queue. */
+	if (2 == rc) {
+		m_rawHisto->stamp(PixFitWorkPackage::Stage::ENQUEUED);
+		m_queue->addWork(m_rawHisto);
+		m_rawHisto.reset();
+		m_scanConfig.reset();
+	}
+	else if (0 == rc) {
+		;
+	}
+	/* Reset connection in case of error */
+	else {
+		closeConnection();
+	}
 }
 
-int PixFitNet::readCommand() {
-	unsigned int rxLen = 0;
-	int rc = 0;
-	int poll_rc;
-	pollfd ufds[1];
+int PixFitNet::receive(char *target, size_t length) {
+	ssize_t rc = recv(m_rodSock, target, length, 0);
+	if (rc > 0) {
+		m_bytesReceived->add(rc);
+		return rc;
+	}
+	if (0 == rc) {
+		ERS_LOG(m_histoUnitString << ": Socket closed from remote.")
+		return -1;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+	ERS_LOG(m_histoUnitString << ": Socket error.")
+	return -1;
+}
 
-	/* Fill struct for poll() call. */
-	ufds[0].fd = m_rodSock;
-	ufds[0].events = POLLIN;
+bool PixFitNet::isReady() {
+	if (m_rodSock == -1) return false;
 
-	while (rxLen < sizeof(RodSlvTcpCmd)) {
-		poll_rc = poll(ufds, 1, s_timeout);
+	/* Commands are only started with a histogram to fill and enough memory. */
+	if (m_rxState == RxState::HEADER && m_rxLen == 0) {
+		if (m_scanConfig == 0 && !startScan()) return false;
+		if (!checkMemory()) return false;
+	}
+	return true;
+}
 
-		/* Timeout. */
-		if (poll_rc == 0) {
-			/* Check if reset was requested. */
-			if (resetCheck()) return -2;
-		}
-		/* Error on poll. */
-		else if (poll_rc == -1) {
-			return -2;
-		}
-		/* Activity on socket. */
-		else {
-			rc = recv(m_rodSock, m_rxBuf + rxLen, sizeof(RodSlvTcpCmd) - rxLen, 0);
-			//printf("Received %d bytes\n",rc);
-			if (-1 == rc) {
-				ERS_LOG(m_histoUnitString << ": Socket error.")
-				return rc;
-			}
-			else if (0 == rc) {
-				ERS_LOG(m_histoUnitString << ": Socket closed from remote.")
-				return rc;
-			}
-			rxLen += rc; // update len
+bool PixFitNet::startScan() {
+	m_scanConfig = m_scanConfigQueue.getWorkNb();
+	if (m_scanConfig == 0) return false;
+
+	/* Initialize RawHisto object. */
+	m_rawHisto = std::make_shared<RawHisto>(m_scanConfig, PixFitInstanceConfig::receiveLayout);
+	if (!(m_rawHisto->allocateMemory(&m_instanceConfig->memoryBudget))) {
+		ERS_DEBUG(0, m_histoUnitString <<
+				": Allocated " << m_rawHisto->getSize() << " bytes for histogram.")
+		m_currentBin = 0;
+		if (PixFitInstanceConfig::streamingFit) {
+			m_rawHisto->setStreamingFit(PixFitStreamingFit::create(*m_scanConfig, m_instanceConfig->fitPool));
 		}
 	}
-
-	/* Optionally dump data to file. */
-	if (m_dumpFile.is_open()) {
-		m_dumpFile.write(reinterpret_cast<char *>(m_rxBuf), rxLen);
+	else {
+		ERS_LOG(m_histoUnitString << ": Allocation of " << m_rawHisto->getSize() << " bytes for histogram failed.")
+		closeConnection();
+		return false;
 	}
-	return 1;
+	return true;
 }
 
 void PixFitNet::putScanConfig(std::shared_ptr<const PixFitScanConfig> scanConfig) {
 	m_scanConfigQueue.addWork(scanConfig);
+	if (m_engine != nullptr) m_engine->wakeUp();
 }
 
 int PixFitNet::procRequest() {
@@ -262,22 +286,11 @@ int PixFitNet::procRequest() {
 	getMrs(m_rawHisto->getScanConfig());
 
 	RodSlvTcpCmd cmdBuf; // temp buffer is data size too small
-	RodSlvTcpCmd cmd;
-	unsigned int i, j;
-	unsigned int rxLen = 0;
-	int rc;
+	RodSlvTcpCmd &cmd = m_cmd;
+	unsigned int i;
 	void *buf = (void *) m_rxBuf;
 
-	int poll_rc;
-	pollfd ufds[1];
-
-	/* Fill struct for poll() call. */
-	ufds[0].fd = m_rodSock;
-	ufds[0].events = POLLIN;
-
-	const int numberBins = m_rawHisto->getScanConfig()->getNumOfBins();
 	const int numberPixels = m_rawHisto->getScanConfig()->getNumOfPixels();
-	const int multiplicity = m_rawHisto->getScanConfig()->getBytesPerPixel();
 
 	memcpy((void*) &cmdBuf, buf, sizeof(RodSlvTcpCmd));
 
@@ -302,230 +315,314 @@ int PixFitNet::procRequest() {
 	  ERS_LOG(m_histoUnitString << ": Histogram data for bin = "
 			  << cmd.bins << " (" << m_currentBin << ")")
 
-		if (0 != cmd.payloadSize) {
-			ERS_DEBUG(0, m_histoUnitString
-					<< ": Receiving " << cmd.payloadSize << " bytes of histo data from ROD.")
-			while (rxLen < cmd.payloadSize * sizeof(char)) {
-				poll_rc = poll(ufds, 1, s_timeout);
-					/* Timeout. */
-					if (poll_rc == 0) {
-						if (resetCheck()) return -2;
-					}
-					/* Error on poll. */
-					else if (poll_rc == -1) {
-						return -2;
-					}
-					/* Activity on socket. */
-					else {
-						rc = recv(m_rodSock, m_histoBuf + rxLen, cmd.payloadSize * sizeof(char) - rxLen, 0);
-						if (-1 == rc) {
-							ERS_LOG(m_histoUnitString << ": Socket error.")
-							return rc;
-						}
-						if (0 == rc) {
-							ERS_LOG(m_histoUnitString << ": Socket closed from remote.")
-							return rc;
-						}
-						rxLen += rc;
-					}
-			}
+		/* The latency of a histogram is counted from its first data. */
+		if (0 == m_currentBin) m_rawHisto->stamp(PixFitWorkPackage::Stage::RECEIVED);
 
-			/* Optionally dump data to file. */
-			if (m_dumpFile.is_open()) {
-				m_dumpFile.write(m_histoBuf, rxLen);
-			}
+		if (0 == cmd.payloadSize) {
+			return nextBin();
+		}
 
-			ERS_LOG(m_histoUnitString <<
-					": Histogram data received for bin " << m_currentBin << ": " <<
-					rxLen / sizeof(char) << " bytes stored at 0x" << std::hex << m_histoBuf)
-
-			std::string info = "PixFitNet";
-			if ((static_cast<int>(cmd.payloadSize) / multiplicity) != numberPixels) {
-			  std::string mess = "Mismatch in number of pixels. Expected " +
-					  std::to_string(numberPixels) +
-					  " but got " + std::to_string(cmd.payloadSize / multiplicity);
-			  m_msg->publishMessage(PixMessages::ERROR, info , mess);
-			  return 1;
-			}
+		/* Nothing is allocated for a payload that does not match the scan configuration. */
+		const int multiplicity = m_rawHisto->getScanConfig()->getBytesPerPixel();
+		if (cmd.payloadSize != static_cast<size_t>(numberPixels) * multiplicity) {
+			std::string mess = "Mismatch in number of pixels. Expected " +
+					std::to_string(numberPixels) + " (" + std::to_string(numberPixels * multiplicity) +
+					" bytes) but got " + std::to_string(cmd.payloadSize) + " bytes";
+			m_msg->publishMessage(PixMessages::ERROR, "PixFitNet", mess);
+			return 1;
+		}
 
-			if(m_scanConfig->scanId != static_cast<int>(cmd.scanId) && !m_instanceConfig->usingSlaveEmu()){
-			  std::string mess = "Mismatch in scanId. Slave says " +
-					  std::to_string(cmd.scanId) + ", PixLib says " +
-					  std::to_string(m_scanConfig->scanId);
-			  m_msg->publishMessage(PixMessages::ERROR, info , mess);
-			  return 1;
-			}
+		/* pHisto points to the first pixel of the current bin, consecutive pixels are
+		 * pixelStride words apart (1 word per pixel for bin-major). */
+		RawHisto::histoWord_type *pHisto = (*m_rawHisto)(0, m_currentBin);
+		const int pixelStride = m_rawHisto->getPixelStride();
+
+		/* Memory layout depends on histogrammer readout mode and scan configuration. */
+		PixFitScanConfig::scanType scanType = m_scanConfig->findScanType();
+		PixFitScanConfig::readoutMode readoutMode =  m_scanConfig->getReadoutMode();
 
-			/* Get entries and fill RawHisto. */
-			RawHisto::histoWord_type *pHisto = m_rawHisto->getRawData();
-			uint32_t* histoBufint = (uint32_t*) m_histoBuf;
-
-			/* Memory layout depends on histogrammer readout mode and scan configuration. */
-			PixFitScanConfig::scanType scanType = m_scanConfig->findScanType();
-			PixFitScanConfig::readoutMode readoutMode =  m_scanConfig->getReadoutMode();
-
-			//ERS_DEBUG(1,m_histoUnitString << ": Scantype " << scanType << " with readout mode " << readoutMode)
-
-			/* -----------------------------------
-			 * Analog, digital or threshold scan
-			 * ----------------------------------- */
-			if (scanType == PixFitScanConfig::scanType::ANALOG
-					|| scanType == PixFitScanConfig::scanType::DIGITAL
-					|| scanType == PixFitScanConfig::scanType::THRESHOLD) {
-			  if (readoutMode == PixFitScanConfig::readoutMode::OFFLINE_OCCUPANCY) {
-			    for (j = 0; j < (cmd.payloadSize / multiplicity); j++) {
-			      pHisto[numberBins * j + m_currentBin] = (RawHisto::histoWord_type) m_histoBuf[j];
-			      //printf("value 0x%x: \t occ %d, \t at %d \n", pHisto[j], (pHisto[j] >> 0*8) & ((1 << 8) - 1), j);
-			    }
-			  }
-			  else if (readoutMode == PixFitScanConfig::readoutMode::ONLINE_OCCUPANCY) {
-			    for (j = 0; j < (cmd.payloadSize / multiplicity); j++) {
-			      pHisto[numberBins * j + m_currentBin] = (RawHisto::histoWord_type) histoBufint[j];
-			      //printf("value 0x%x: \t occ %d \t at %d \n", pHisto[j], pHisto[j], j);
-			    }
-			  }
-			  else if (readoutMode == PixFitScanConfig::readoutMode::SHORT_TOT) {
-			    for ( j = 0; j < (cmd.payloadSize / multiplicity); j++) {
-			      pHisto[numberBins * j + m_currentBin] = ( histoBufint[j] >> ONEWORD_MISSING_TRIGGERS_RESULT_SHIFT) & ((1 << (MISSING_TRIGGERS_RESULT_BITS)) - 1);
-			      //printf("value 0x%x: \t missing triggers %d \t at %d \n",  histoBufint[j], ( histoBufint[j] >> ONEWORD_MISSING_TRIGGERS_RESULT_SHIFT) & ((1 << (MISSING_TRIGGERS_RESULT_BITS)) - 1), j);
-			    }
-			  }					   
-			  else if (readoutMode == PixFitScanConfig::readoutMode::LONG_TOT) {
-			    for ( j = 0; j < (cmd.payloadSize * 2 / multiplicity); j++) {
-			      if (j % 2 == 0) { // first partial data word
-				pHisto[numberBins * j/2 + m_currentBin] = ( histoBufint[j] >> TWOWORD_OCC_RESULT_SHIFT) & ((1 << OCC_RESULT_BITS) - 1);
-				//printf("value 0x%x: \t occ %d \t at %d \n", histoBufint[j] , ( histoBufint[j] >> TWOWORD_OCC_RESULT_SHIFT) & ((1 << OCC_RESULT_BITS) - 1), j);
-			      }
-			    }
-			  }
+		//ERS_DEBUG(1,m_histoUnitString << ": Scantype " << scanType << " with readout mode " << readoutMode)
+
+		/* Number of words per pixel to fill, 0 if the data is not used. */
+		m_payloadWords = 0;
+
+		/* -----------------------------------
+		 * Analog, digital or threshold scan
+		 * ----------------------------------- */
+		if (scanType == PixFitScanConfig::scanType::ANALOG
+				|| scanType == PixFitScanConfig::scanType::DIGITAL
+				|| scanType == PixFitScanConfig::scanType::THRESHOLD) {
+			/* Occupancy (or missing triggers for SHORT_TOT) only. */
+			m_payloadWords = 1;
+		}
+		/* -----------------------------------
+		 * TOT scans
+		 * ----------------------------------- */
+		else if (scanType == PixFitScanConfig::scanType::TOT || scanType == PixFitScanConfig::scanType::TOT_CALIB) {
+
+			/* Other readout modes do not make sense for TOT based stuff. */
+			assert(readoutMode == PixFitScanConfig::readoutMode::SHORT_TOT ||
+					readoutMode == PixFitScanConfig::readoutMode::LONG_TOT);
+
+			/* We have 3 words for TOT: occ/missing occ, TOT, TOT² */
+			if (readoutMode == PixFitScanConfig::readoutMode::SHORT_TOT ||
+					readoutMode == PixFitScanConfig::readoutMode::LONG_TOT) {
+				m_payloadWords = 3;
 			}
-			/* -----------------------------------
-			 * TOT scans
-			 * ----------------------------------- */
-			else if (scanType == PixFitScanConfig::scanType::TOT || scanType == PixFitScanConfig::scanType::TOT_CALIB) {
-
-				/* Other readout modes do not make sense for TOT based stuff. */
-				assert(readoutMode == PixFitScanConfig::readoutMode::SHORT_TOT ||
-						readoutMode == PixFitScanConfig::readoutMode::LONG_TOT);
-
-				 /* We have 3 words for TOT: occ/missing occ, TOT, TOT² */
-				const int wordsPerPixel = m_rawHisto->getScanConfig()->getWordsPerPixel();
-
-			  if (readoutMode == PixFitScanConfig::readoutMode::SHORT_TOT) {
-			    for (j = 0; j < (cmd.payloadSize / multiplicity); j++) {
-			      pHisto[numberBins * wordsPerPixel * j + wordsPerPixel * m_currentBin + 0] = ( histoBufint[j] >> ONEWORD_MISSING_TRIGGERS_RESULT_SHIFT)
-				& ((1 << (MISSING_TRIGGERS_RESULT_BITS)) - 1); // fill missing triggers
-			      pHisto[numberBins * wordsPerPixel * j + wordsPerPixel * m_currentBin + 1] = ( histoBufint[j] >> ONEWORD_TOT_RESULT_SHIFT)
-				& ((1 << (TOT_RESULT_BITS)) - 1); // then fill ToT
-			      pHisto[numberBins * wordsPerPixel * j + wordsPerPixel * m_currentBin + 2] = ( histoBufint[j] >> ONEWORD_TOTSQR_RESULT_SHIFT)
-				& ((1 << (TOTSQR_RESULT_BITS)) - 1); // then fill ToT2
-
-			      /*printf("value 0x%x: \t missing triggers %d, \t tot %d, \t tot² %d \t at %d \n",  histoBufint[j], 
-				( histoBufint[j] >> ONEWORD_MISSING_TRIGGERS_RESULT_SHIFT) & ((1 << (MISSING_TRIGGERS_RESULT_BITS)) - 1),
-				( histoBufint[j] >> ONEWORD_TOT_RESULT_SHIFT) & ((1 << (TOT_RESULT_BITS)) - 1),
-				( histoBufint[j] >> ONEWORD_TOTSQR_RESULT_SHIFT) & ((1 << (TOTSQR_RESULT_BITS)) - 1), j);*/
-			    }
-			  }
-			  else if (readoutMode == PixFitScanConfig::readoutMode::LONG_TOT) {
-			    for (j = 0; j < (cmd.payloadSize * 2 / multiplicity); j++) {
-			      if (j % 2 == 0) { // first partial data word
-				pHisto[numberBins * wordsPerPixel * j/2 + wordsPerPixel * m_currentBin + 0] = ( histoBufint[j] >> TWOWORD_OCC_RESULT_SHIFT)
-				  & ((1 << OCC_RESULT_BITS) - 1); // fill occ
-				//printf("value 0x%x: \t occ %d \t at %d \n", histoBufint[j] , ( histoBufint[j] >> TWOWORD_OCC_RESULT_SHIFT) & ((1 << OCC_RESULT_BITS) - 1), j);
-			      }
-			      if(j % 2 == 1) { // second partial word
-				pHisto[numberBins * wordsPerPixel * (j-1)/2 + wordsPerPixel * m_currentBin + 1] = ( histoBufint[j] >> TWOWORD_TOT_RESULT_SHIFT)
-				  & ((1 << (TOT_RESULT_BITS)) - 1); // then fill ToT
-				pHisto[numberBins * wordsPerPixel * (j-1)/2 + wordsPerPixel * m_currentBin + 2] = ( histoBufint[j] >> TWOWORD_TOTSQR_RESULT_SHIFT)
-				  & ((1 << (TOTSQR_RESULT_BITS)) - 1); // then fill ToT2
-				/*printf("value 0x%x: \t tot %d, \t tot² %d \t at %d \n",  histoBufint[j], 
-				  ( histoBufint[j] >> TWOWORD_TOT_RESULT_SHIFT) & ((1 << (TOT_RESULT_BITS)) - 1),
-				  ( histoBufint[j] >> TWOWORD_TOTSQR_RESULT_SHIFT) & ((1 << (TOTSQR_RESULT_BITS)) - 1), j);*/
-			      }
-			    }
-			  }
+		}
+
+		/* Data that has one 32 bit word per pixel goes straight into the RawHisto if the pixels
+		 * of a bin are contiguous, everything else into a buffer from the pool. */
+		m_inPlace = m_payloadWords == 1 && pixelStride == 1
+				&& cmd.payloadSize == numberPixels * sizeof(RawHisto::histoWord_type)
+				&& (readoutMode == PixFitScanConfig::readoutMode::ONLINE_OCCUPANCY
+						|| readoutMode == PixFitScanConfig::readoutMode::SHORT_TOT);
+		m_rxTarget = reinterpret_cast<char *>(pHisto);
+		if (!m_inPlace) {
+			m_packed = PixFitBufferPool::instance().acquireShared(cmd.payloadSize);
+			if (!m_packed) {
+				ERS_LOG(m_histoUnitString << ": Buffer allocation failed.")
+				return 1;
 			}
+			m_rxTarget = m_packed.get();
+		}
 
-			/* Handle intermediate histograms. */
-			if (m_rawHisto->getScanConfig()->doIntermediateHistos()) {
-				/* Duplicate PixFitScanConfig. */
-				std::shared_ptr<const PixFitScanConfig> newScanConfig(new PixFitScanConfig(*m_scanConfig));
+		ERS_DEBUG(0, m_histoUnitString
+				<< ": Receiving " << cmd.payloadSize << " bytes of histo data from ROD.")
+		return 3;
+	}
 
-				/* Get access to PixFitScanConfig and manipulate the settings for the intermediate histo. */
-				std::shared_ptr<PixFitScanConfig> \
-					ncScancfg(std::const_pointer_cast<PixFitScanConfig>(newScanConfig));
-				ncScancfg->binNumber = m_currentBin;
+	/* No other commands supported. */
+	default:
+	        ERS_LOG(m_histoUnitString << ": Invalid command: " << std::hex << cmd.command)
+		return 0;
+		break;
+	}
+}
 
-				auto scanType = newScanConfig->findScanType();
-				/* THRESHOLD scans */
-				if (scanType == PixFitScanConfig::scanType::THRESHOLD) {
-					ncScancfg->intermediate = PixFitScanConfig::intermediateType::INTERMEDIATE_ANALOG;
-				}
-				/* TOT_CALIB scans */
-				else if (scanType == PixFitScanConfig::scanType::TOT_CALIB) {
-					ncScancfg->intermediate = PixFitScanConfig::intermediateType::INTERMEDIATE_TOT;
-				}
+int PixFitNet::procPayload() {
+	const RodSlvTcpCmd &cmd = m_cmd;
+	const size_t rxLen = m_rxLen;
+	char *rxTarget = m_rxTarget;
+	std::shared_ptr<char> packed = m_packed;
+	const int words = m_payloadWords;
+	const bool inPlace = m_inPlace;
 
-				/* Create new RawHisto for intermediate histo. */
-				std::shared_ptr<RawHisto> tmpRawHisto = std::make_shared<RawHisto>(ncScancfg);
+	const int numberPixels = m_rawHisto->getScanConfig()->getNumOfPixels();
+	RawHisto::histoWord_type *pHisto = (*m_rawHisto)(0, m_currentBin);
+	const int pixelStride = m_rawHisto->getPixelStride();
+	PixFitScanConfig::readoutMode readoutMode =  m_scanConfig->getReadoutMode();
+
+	/* Optionally dump data to file. Data in a pool buffer is only converted later and can be
+	 * shared, data in the RawHisto has to be copied. */
+	if (m_instanceConfig->dumpWriter != nullptr) {
+		const PixFitDump::RecordHeader dumpHeader = makeDumpHeader(PixFitDump::RECORD_PAYLOAD, m_currentBin);
+		if (packed) {
+			m_instanceConfig->dumpWriter->submit(dumpHeader, std::shared_ptr<const char>(packed), rxLen);
+		}
+		else {
+			m_instanceConfig->dumpWriter->submit(dumpHeader, rxTarget, rxLen);
+		}
+	}
 
-				/* Allocate memory and get raw pointer. */
-				tmpRawHisto->allocateMemory();
-				RawHisto::histoWord_type *pTmpHisto = tmpRawHisto->getRawData();
+	ERS_LOG(m_histoUnitString <<
+			": Histogram data received for bin " << m_currentBin << ": " <<
+			rxLen / sizeof(char) << " bytes stored at 0x" << std::hex << static_cast<void *>(rxTarget))
+
+	std::string info = "PixFitNet";
+	if(m_scanConfig->scanId != static_cast<int>(cmd.scanId) && !m_instanceConfig->usingSlaveEmu()){
+	  std::string mess = "Mismatch in scanId. Slave says " +
+			  std::to_string(cmd.scanId) + ", PixLib says " +
+			  std::to_string(m_scanConfig->scanId);
+	  m_msg->publishMessage(PixMessages::ERROR, info , mess);
+	  return 1;
+	}
 
-				/* Fill RawHisto with relevant data. */
-				int numOfPixels = ncScancfg->getNumOfPixels();
-				if (scanType == PixFitScanConfig::scanType::THRESHOLD) {
-					for (int k = 0; k < numOfPixels; k++) {
-						pTmpHisto[k] = pHisto[numberBins * k + m_currentBin];
-					}
-				}
-				else if (scanType == PixFitScanConfig::scanType::TOT_CALIB) {
-					const int wordsPerPixel = m_rawHisto->getScanConfig()->getWordsPerPixel();
-					for (int k = 0; k < numOfPixels; k++) {
-						int target = k * wordsPerPixel;
-						int source = numberBins * wordsPerPixel * k + wordsPerPixel * m_currentBin;
-						pTmpHisto[target + 0] = pHisto[source + 0];
-						pTmpHisto[target + 1] = pHisto[source + 1];
-						pTmpHisto[target + 2] = pHisto[source + 2];
-					}
-				}
+	/* Fill RawHisto. Missing triggers are extracted in place, other formats are converted
+	 * here or later by the worker. */
+	const bool deferred = words != 0 && !inPlace && PixFitInstanceConfig::deferUnpack;
+	if (inPlace) {
+		if (readoutMode == PixFitScanConfig::readoutMode::SHORT_TOT) {
+			PixFitUnpack::unpack(readoutMode, 1, rxTarget, numberPixels, pHisto, pixelStride);
+		}
+	}
+	else if (deferred) {
+		m_rawHisto->addPackedBin(m_currentBin, readoutMode, words, packed, cmd.payloadSize);
+	}
+	else if (words != 0) {
+		PixFitUnpack::unpack(readoutMode, words, rxTarget, numberPixels, pHisto, pixelStride);
+	}
+
+	/* Update the S-curve estimates with the new bin. */
+	std::shared_ptr<PixFitStreamingFit> streamingFit = m_rawHisto->getStreamingFit();
+	if (streamingFit && words != 0) {
+		if (deferred) streamingFit->addPackedBin(m_currentBin, packed);
+		else streamingFit->addBin(m_currentBin, m_rawHisto);
+	}
+
+	/* Handle intermediate histograms. */
+	if (m_rawHisto->getScanConfig()->doIntermediateHistos()) {
+		/* Duplicate PixFitScanConfig. */
+		std::shared_ptr<const PixFitScanConfig> newScanConfig(new PixFitScanConfig(*m_scanConfig));
 
-				ERS_DEBUG(0, tmpRawHisto->getScanConfig()->histogrammer.makeHistoString()
-					<< ": Created intermediate histogram for bin " << m_currentBin)
+		/* Get access to PixFitScanConfig and manipulate the settings for the intermediate histo. */
+		std::shared_ptr<PixFitScanConfig> \
+			ncScancfg(std::const_pointer_cast<PixFitScanConfig>(newScanConfig));
+		ncScancfg->binNumber = m_currentBin;
 
-				/* Enqueue intermediate histo object. */
-				m_queue->addWork(tmpRawHisto);
+		auto scanType = newScanConfig->findScanType();
+		/* THRESHOLD scans */
+		if (scanType == PixFitScanConfig::scanType::THRESHOLD) {
+			ncScancfg->intermediate = PixFitScanConfig::intermediateType::INTERMEDIATE_ANALOG;
+		}
+		/* TOT_CALIB scans */
+		else if (scanType == PixFitScanConfig::scanType::TOT_CALIB) {
+			ncScancfg->intermediate = PixFitScanConfig::intermediateType::INTERMEDIATE_TOT;
+		}
+		ncScancfg->priority = PixFitScanConfig::priorityClass::PRIORITY_LOW;
+
+		/* Create new RawHisto for intermediate histo. */
+		std::shared_ptr<RawHisto> tmpRawHisto = std::make_shared<RawHisto>(ncScancfg);
+
+		/* Allocate memory and get raw pointer. */
+		tmpRawHisto->allocateMemory(&m_instanceConfig->memoryBudget);
+		RawHisto::histoWord_type *pTmpHisto = tmpRawHisto->getRawData();
+
+		/* Fill RawHisto with relevant data (all words of the current bin). For bin-major
+		 * RawHistos the bin is one contiguous block. Received data that has not been
+		 * converted yet is shared with the main histogram. */
+		int numOfPixels = ncScancfg->getNumOfPixels();
+		const int wordsPerPixel = m_rawHisto->getWordsPerPixel();
+		if (deferred) {
+			tmpRawHisto->addPackedBin(0, readoutMode, words, packed, cmd.payloadSize);
+		}
+		else if (pixelStride == wordsPerPixel) {
+			memcpy(pTmpHisto, pHisto, numOfPixels * wordsPerPixel * sizeof(RawHisto::histoWord_type));
+		}
+		else {
+			for (int k = 0; k < numOfPixels; k++) {
+				for (int w = 0; w < wordsPerPixel; w++) {
+					pTmpHisto[k * wordsPerPixel + w] = pHisto[pixelStride * k + w];
+				}
 			}
-			/* End of intermediate histo section. */
 		}
 
-		/* Notice the different numbering schemes (1 to NumOfBins here, from 0 to maxBins above). */
-	  	std::string currentHistoUnit = m_rawHisto->getScanConfig()->histogrammer.makeHistoString();
-		if (m_currentBin + 1 != m_rawHisto->getScanConfig()->getNumOfBins()) {
-		  ERS_LOG(currentHistoUnit << " is at bin " << m_currentBin + 1 << " of "
-				  << m_rawHisto->getScanConfig()->getNumOfBins())
-		  m_currentBin++;
-		  return 0;
-		}
+		ERS_DEBUG(0, tmpRawHisto->getScanConfig()->histogrammer.makeHistoString()
+			<< ": Created intermediate histogram for bin " << m_currentBin)
+
+		/* Enqueue intermediate histo object. */
+		tmpRawHisto->copyTimestamps(*m_rawHisto);
+		tmpRawHisto->stamp(PixFitWorkPackage::Stage::ENQUEUED);
+		m_queue->addWork(tmpRawHisto);
+	}
+	/* End of intermediate histo section. */
+
+	return nextBin();
+}
 
-		ERS_LOG(currentHistoUnit << ": Histogram termination")
+int PixFitNet::nextBin() {
+	/* Notice the different numbering schemes (1 to NumOfBins here, from 0 to maxBins above). */
+	std::string currentHistoUnit = m_rawHisto->getScanConfig()->histogrammer.makeHistoString();
+	if (m_currentBin + 1 != m_rawHisto->getScanConfig()->getNumOfBins()) {
+	  ERS_LOG(currentHistoUnit << " is at bin " << m_currentBin + 1 << " of "
+			  << m_rawHisto->getScanConfig()->getNumOfBins())
+	  m_currentBin++;
+	  return 0;
+	}
+
+	ERS_LOG(currentHistoUnit << ": Histogram termination")
+	return 2;
+}
 
-                /* Optionally close dump file. */
-                if (m_dumpFile.is_open()) {
-                    m_dumpFile.write(m_histoBuf, rxLen);
+bool PixFitNet::checkMemory() {
+	MemoryBudget &budget = m_instanceConfig->memoryBudget;
+	if (!budget.isExhausted()) {
+		if (m_stalled) {
+			ERS_LOG(m_histoUnitString << ": Memory budget available again, resuming reception.")
 		}
+		m_stalled = false;
+		m_stallReported = false;
+		return true;
+	}
 
-		return 2;
-		break;
+	const boost::system_time now = boost::get_system_time();
+	if (!m_stalled) {
+		ERS_LOG(m_histoUnitString << ": Memory budget exhausted (" << budget.getUsed() / (1024 * 1024)
+				<< " of " << budget.getLimit() / (1024 * 1024) << " MB used), pausing reception.")
+		m_stalled = true;
+		m_stallSince = now;
+		m_stallReleases = budget.getReleases();
+	}
+	else if (budget.getReleases() != m_stallReleases) {
+		m_stallSince = now;
+		m_stallReleases = budget.getReleases();
+		m_stallReported = false;
+	}
+	else if (!m_stallReported && now - m_stallSince >= boost::posix_time::milliseconds(s_maxStallTime)) {
+		/* Most likely the assembler holds the memory while it waits for mask steps that only we
+		 * can deliver. Reception stays paused, the budget is not exceeded; the operator has to
+		 * abort the scan. */
+		std::string mess = "No memory freed for " + std::to_string(s_maxStallTime / 1000) +
+				" s, reception of scan " + std::to_string(m_scanConfig->getScanId()) + " for " +
+				m_histoUnitString + " is blocked by the memory budget. Abort the scan if it does not recover.";
+		getMrs(m_rawHisto->getScanConfig());
+		m_msg->publishMessage(PixMessages::ERROR, "PixFitNet", mess);
+		m_stallReported = true;
 	}
+	return false;
+}
 
-	/* No other commands supported. */
-	default:
-	        ERS_LOG(m_histoUnitString << ": Invalid command: " << std::hex << cmd.command)
-		return 0;
-		break;
+void PixFitNet::updateInterest() {
+	const bool listen = (m_rodSock == -1);
+	if (m_listenSock != -1 && listen != m_listenArmed) {
+		m_engine->setInterest(m_listenSock, m_token + 1, listen);
+		m_listenArmed = listen;
+	}
+
+	if (m_rodSock != -1) {
+		const bool read = isReady();
+		if (read != m_sockArmed) {
+			m_engine->setInterest(m_rodSock, m_token, read);
+			m_sockArmed = read;
+		}
+	}
+}
+
+void PixFitNet::closeConnection() {
+	if (m_rodSock != -1) {
+		m_engine->removeSocket(m_rodSock);
+		int rc;
+		rc = shutdown(m_rodSock, SHUT_WR);
+		if (rc != 0) {
+		    ERS_LOG(m_histoUnitString << ": Error on shutdown socket")
+		}
+		rc = close(m_rodSock);
+		if (rc != 0) {
+		    ERS_LOG(m_histoUnitString << ": Error on close socket")
+		}
 	}
+	m_rodSock = -1;
+	m_sockArmed = false;
+	m_rxState = RxState::HEADER;
+	m_rxLen = 0;
+	m_rxTarget = nullptr;
+	m_packed.reset();
+	m_rawHisto.reset();
+	m_scanConfig.reset();
+	m_stalled = false;
+}
+
+PixFitDump::RecordHeader PixFitNet::makeDumpHeader(PixFitDump::RecordType type, int bin) const {
+	PixFitDump::RecordHeader header;
+	header.type = type;
+	header.crate = m_configuration->getHistogrammer()->crate;
+	header.rod = m_configuration->getHistogrammer()->rod;
+	header.slave = m_configuration->getHistogrammer()->slave;
+	header.histo = m_configuration->getHistogrammer()->histo;
+	header.scanId = m_scanConfig->scanId;
+	header.maskId = m_scanConfig->maskId;
+	header.bin = bin;
+	return header;
 }
 
 const PixFitNetConfiguration* PixFitNet::getConfig() const {
@@ -544,10 +641,12 @@ bool PixLib::PixFitNet::resetCheck() {
 	boost::lock_guard<boost::mutex> lock(m_resetMutex);
 
 	/* Always abort for m_resetFlag == 1 or check if scanId is blacklisted for m_resetFlag == 2. */
-	if ((1 == m_resetFlag) || (2 == m_resetFlag && m_instanceConfig->blacklist.isScanIdListed(m_scanConfig->getScanId())) ) {
-		ERS_LOG(m_histoUnitString << ": Resetting network thread " << getThreadId())
+	if ((1 == m_resetFlag) || (2 == m_resetFlag && m_scanConfig != 0
+			&& m_instanceConfig->blacklist.isScanIdListed(m_scanConfig->getScanId())) ) {
+		ERS_LOG(m_histoUnitString << ": Resetting network connection")
 
-		cleanup();
+		closeConnection();
+		m_resetFlag = 0;
 		return true;
 	}
 	/* Flag not set, do not abort. */
@@ -566,21 +665,15 @@ PixMessages& PixFitNet::getMrs(std::shared_ptr<const PixFitScanConfig> scanConfi
 }
 
 void PixFitNet::resetNetwork(bool ifBlacklisted) {
-	boost::lock_guard<boost::mutex> lock(m_resetMutex);
-	if (!ifBlacklisted) {
-		m_resetFlag = 1;
-	}
-	else {
-		m_resetFlag = 2;
+	{
+		boost::lock_guard<boost::mutex> lock(m_resetMutex);
+		if (!ifBlacklisted) {
+			m_resetFlag = 1;
+		}
+		else {
+			m_resetFlag = 2;
+		}
+		ERS_DEBUG(0, m_histoUnitString << ": Setting network reset flag to " << m_resetFlag)
 	}
-	ERS_DEBUG(0, m_histoUnitString << ": Setting network reset flag to " << m_resetFlag)
-}
-
-void PixFitNet::cleanup() {
-	shutdown(m_rodSock, SHUT_WR);
-	close(m_rodSock);
-
-	m_rawHisto.reset();
-	m_scanConfig.reset();
-	m_resetFlag = 0;
+	if (m_engine != nullptr) m_engine->wakeUp();
 }
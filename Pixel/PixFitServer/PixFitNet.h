@@ -7,8 +7,8 @@
 #ifndef PIXFITNET_H_
 #define PIXFITNET_H_
 
-#include <fstream>
 #include <memory>
+#include <stdint.h> // change to cstdint for C++11
 
 #include <boost/thread.hpp>
 
@@ -16,21 +16,31 @@
 
 #include "iblSlaveNetCmds.h"
 
-#include "PixFitThread.h"
 #include "PixFitWorkQueue.h"
 #include "RawHisto.h"
+#include "PixFitDump.h"
+#include "PixFitMetrics.h"
 
 namespace PixLib {
 
 class PixFitNetConfiguration;
 class PixFitScanConfig;
 class PixFitInstanceConfig;
+class PixFitNetEngine;
 
 /** This class represents a network socket for a ROD histo-unit to FitFarm connection. It is created
  * and controlled by PixFitManager. PixFitScanConfig objects are enqueued and the incoming data is
  * reformatted according to the scan configuration and put in RawHistos. These are subsequently
- * enqueued in the fitQueue for processing. */
-class PixFitNet : public PixFitThread {
+ * enqueued in the fitQueue for processing.
+ * Bin data is received without intermediate copies: either directly into the RawHisto, if the data
+ * format matches, or into a buffer from PixFitBufferPool that is converted by the worker (see
+ * PixFitInstanceConfig::deferUnpack).
+ * PixFitNet has no thread of its own. It is a state machine for one connection (waiting for a
+ * command header, then for its payload) that is driven by a PixFitNetEngine, which serves many
+ * PixFitNet objects with non-blocking sockets. The socket is only read while a scan configuration
+ * is available and the memory budget allows it, otherwise the data stays in the socket and TCP flow
+ * control throttles the ROD. */
+class PixFitNet {
 public:
 	/** @param queue Pointer to the fitQueue where completely received histograms will be put.
 	 * @param netConfig Configuration for this particular PixFitNet instance.
@@ -40,31 +50,84 @@ public:
 			PixFitInstanceConfig *instanceConfig);
 	virtual ~PixFitNet();
 
-	/** Enqueues a PixFitScanConfig object. */
+	/** Enqueues a PixFitScanConfig object and wakes up the engine. */
 	void putScanConfig(std::shared_ptr<const PixFitScanConfig> scanConfig);
 
 	/** Get a pointer to the network configuration.
 	 * @returns Pointer to PixFitNetConfiguration of the PixFitNeto object/thread. */
 	const PixFitNetConfiguration* getConfig() const;
 
-	/** Reset the networking thread.
+	/** Reset the networking connection.
 	 * Triggers graceful closing of possibly open socket and discarding of current PixFitScanConfig
-	 * and RawHisto objects.
+	 * and RawHisto objects. The engine is woken up to do this immediately.
 	 * @param ifBlacklisted Decides whether action happens only if current scan object is blacklisted. */
 	void resetNetwork(bool ifBlacklisted = false);
 
-private:
-    void loop();
+	/* Interface for PixFitNetEngine, only to be called from the engine thread. */
+
+	/** Opens the listening socket.
+	 * @param engine The engine serving this object.
+	 * @param token Identifies this object in the engine's event notifications.
+	 * @returns The non-blocking listening socket, -1 on failure. */
+	int openListener(PixFitNetEngine *engine, uint64_t token);
+
+	/** Accepts a connection from the ROD. */
+	void onAccept();
+
+	/** Reads and processes as much data as is available and may be consumed.
+	 * @param hangup True if the engine reported a hangup or error on the socket. */
+	void onReadable(bool hangup);
 
-    /** Reads command from socket.
-     * @return -1 on socket error, 0 if socket was remotely closed. 1 for complete command. */
-    int readCommand();
+	/** Handles resets, new scan configurations and recovery of the memory budget. Called when the
+	 * engine is woken up and periodically while stalled. */
+	void service();
 
-    /** Processes commands.
+	/** @returns True if reading is paused because the memory budget is exhausted. */
+	bool isStalled() const;
+
+private:
+    /** Processes a complete command header.
      * @return 0 If more data (bins) are needed for histogram. 1 in case of error. 2 if histogram
-     * is completed. */
+     * is completed. 3 if the payload of the command has to be received. */
     int procRequest();
 
+    /** Processes the payload of a histogram data command once it is complete.
+     * @return Same as procRequest(). */
+    int procPayload();
+
+    /** Advances to the next bin.
+     * @return 0 If more data (bins) are needed for histogram, 2 if the histogram is completed. */
+    int nextBin();
+
+    /** Acts on the return code of procRequest() and procPayload(). */
+    void handleResult(int rc);
+
+    /** Receives data from the socket without blocking.
+     * @returns Number of bytes received, 0 if no data is available, -1 if the connection failed. */
+    int receive(char *target, size_t length);
+
+    /** @returns True if the socket may be read now. Starts the next scan if none is ongoing. */
+    bool isReady();
+
+    /** Gets the next scan configuration and allocates its RawHisto.
+     * @returns False if there is no scan configuration or allocation failed. */
+    bool startScan();
+
+    /** Checks the memory budget before a new command is read. Reading stops while the budget is
+     * exhausted. If no memory has been freed for s_maxStallTime, the scan is flagged with an error
+     * once per stall and reading stays paused.
+     * @returns True if reading may continue. */
+    bool checkMemory();
+
+    /** Tells the engine whether the listening and the connected socket should be read. */
+    void updateInterest();
+
+    /** Closes the connection and discards the current scan. */
+    void closeConnection();
+
+    /** @returns Header for a record of the network dump, see PixFitDumpWriter. */
+    PixFitDump::RecordHeader makeDumpHeader(PixFitDump::RecordType type, int bin) const;
+
     /** Converts command struct from network byte order to host byte order.
      * @param cmd Input RodSlvTcpCmd in network byte order.
      * @param hostCmd Output RodSlvTcpCmd in host byte order. */
@@ -76,23 +139,49 @@ private:
     /** Pointer to fitQueue. */
     PixFitWorkQueue<RawHisto> *m_queue;
 
-    /** Socket number of the active connection for this PixFitNet thread. */
+    /** Handle to the PixFitServer instance configuration. */
+    PixFitInstanceConfig *m_instanceConfig;
+
+    /** Engine serving this object and our token for its event notifications. */
+    PixFitNetEngine *m_engine;
+    uint64_t m_token;
+
+    /** Listening socket. */
+    int m_listenSock;
+
+    /** Socket number of the active connection for this PixFitNet, -1 if not connected. */
     int m_rodSock;
 
+    /** Read interest currently registered with the engine. */
+    bool m_listenArmed;
+    bool m_sockArmed;
+
+    /** Receive states of the connection. */
+    enum class RxState {HEADER, PAYLOAD};
+    RxState m_rxState;
+
+    /** Number of bytes received of the current header or payload. */
+    size_t m_rxLen;
+
+    /** Current command (host byte order), valid while receiving its payload. */
+    RodSlvTcpCmd m_cmd;
+
+    /** Where the payload goes: the RawHisto itself or m_packed. */
+    char *m_rxTarget;
+
+    /** Buffer for payloads that need conversion. */
+    std::shared_ptr<char> m_packed;
+
+    /** Number of words per pixel the payload fills (0 if unused) and whether it is received in place. */
+    int m_payloadWords;
+    bool m_inPlace;
+
     /** Stores the current bin while receiving a histogram. Used to determine correct memory location
      * while filling a RawHisto. */
     int m_currentBin;
 
-    /** Receive-buffer pointer. */
-    unsigned char *m_rxBuf;
-
-    /** Receive-buffer size.
-    * @TODO: Make IBL/Pixel agnostic. */
-    static const int s_bufSize = 4000000; // 4M as receive buffer
-
-    /** Histogram buffer. Maximum buffer for one bin is maxBytesPerPixel * chipSize * numOfChips.
-     * @TODO: Make IBL/Pixel agnostic. */
-    char m_histoBuf[2 * sizeof(RawHisto::histoWord_type) * 26880 * 8];
+    /** Receive buffer for command headers. */
+    unsigned char m_rxBuf[sizeof(RodSlvTcpCmd)];
 
     /** Internal queue where PixFitScanConfig objects are stored. */
     PixFitWorkQueue<const PixFitScanConfig> m_scanConfigQueue;
@@ -103,9 +192,6 @@ private:
     /** Current RawHisto being filled. */
     std::shared_ptr<RawHisto> m_rawHisto;
 
-    /** File for dumping raw network data to disk. */
-    std::ofstream m_dumpFile;
-
     /** Reset flag that triggers closing the possibly open socket and cleaning up member variables.
      * Value of 1 triggers action all the time, 2 only if current scan config being processed is blacklisted. */
     int m_resetFlag;
@@ -117,15 +203,25 @@ private:
 	/** Mutex for accessing the reset flag. */
 	boost::mutex m_resetMutex;
 
-	/** Clean up networking. Assumes lock on m_resetMutex for writing to m_resetFlag. */
-	void cleanup();
+	/** Milliseconds without any memory being freed after which checkMemory() reports the stall. */
+	static const int s_maxStallTime = 10000;
+
+	/** Set while reading is paused because of the memory budget. */
+	bool m_stalled;
 
-	/** Milliseconds that poll waits until timeout before recv() calls. */
-	static const int s_timeout = 1000;
+	/** Start of the current stall period and number of budget releases at that time. */
+	boost::system_time m_stallSince;
+	unsigned long m_stallReleases;
+
+	/** Set when checkMemory() has reported the current stall. */
+	bool m_stallReported;
 
     /* String containing histogram unit identifier for this PixFitNet. */
     std::string m_histoUnitString;
 
+    /** Metrics counter of the bytes received from this histogramming unit. */
+    PixFitMetrics::Counter *m_bytesReceived;
+
     /* PixMessages object to report in GUI */
     PixMessages *m_msg; 
     PixMessages &getMrs(std::shared_ptr<const PixFitScanConfig> scanConfig);
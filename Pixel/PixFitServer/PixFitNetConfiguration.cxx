@@ -4,6 +4,7 @@
  *      Author: mkretz, marx
  */
 
+#include <cassert>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -99,6 +100,13 @@ bool HistoUnit::operator <(const HistoUnit& rhs) const{
 	return false;
 }
 
+HistoUnit::Key HistoUnit::getKey() const {
+	assert(crate >= 0 && crate < (1 << 16) && rod >= 0 && rod < (1 << 8));
+	assert(slave >= 0 && slave < (1 << 4) && histo >= 0 && histo < (1 << 4));
+	return static_cast<Key>(crate) << 16 | static_cast<Key>(rod) << 8 | static_cast<Key>(slave) << 4
+			| static_cast<Key>(histo);
+}
+
 /* Print HistoUnit details to cout. */
 void HistoUnit::printHistoUnit() const {
 	std::cout << "(Crate / ROD / Slave / HistoUnit) : ("
@@ -7,6 +7,7 @@
 #ifndef PIXFITNETCONFIGURATION_H_
 #define PIXFITNETCONFIGURATION_H_
 
+#include <stdint.h> // change to cstdint for C++11
 #include <string>
 #include <memory>
 
@@ -33,6 +34,11 @@ struct HistoUnit
 	bool operator!=(const HistoUnit& rhs) const;
 	bool operator<(const HistoUnit& rhs) const;
 
+	/** Packed crate, ROD, slave and histogramming unit: 16, 8, 4 and 4 bits. Equal for equal
+	 * units and ordered like operator<, so it can replace the struct as a key. */
+	typedef uint32_t Key;
+	Key getKey() const;
+
 	/** Outputs the member variables that identify the histo unit to std::cout. */
 	void printHistoUnit() const;
 
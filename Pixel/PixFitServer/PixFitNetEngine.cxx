@@ -0,0 +1,117 @@
+/* @file PixFitNetEngine.cxx
+ */
+
+#include <cerrno>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <ers/ers.h>
+
+#include "PixFitNetEngine.h"
+#include "PixFitNet.h"
+
+using namespace PixLib;
+
+PixFitNetEngine::PixFitNetEngine() {
+	m_threadName = "network";
+	m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_epollFd == -1 || m_wakeFd == -1) {
+		ERS_INFO("Could not create the event notification for the networking engine.")
+	}
+	addSocket(m_wakeFd, s_wakeToken, true);
+}
+
+PixFitNetEngine::~PixFitNetEngine() {
+	if (m_wakeFd != -1) close(m_wakeFd);
+	if (m_epollFd != -1) close(m_epollFd);
+}
+
+bool PixFitNetEngine::addConnection(PixFitNet *net) {
+	const uint64_t token = 2 * static_cast<uint64_t>(m_nets.size());
+	const int sock = net->openListener(this, token);
+	if (sock == -1) return false;
+
+	m_nets.push_back(net);
+	addSocket(sock, token + 1, true);
+	return true;
+}
+
+void PixFitNetEngine::wakeUp() {
+	const uint64_t one = 1;
+	/* Only fails if the counter would overflow, the engine is awake then anyway. */
+	ssize_t rc = write(m_wakeFd, &one, sizeof(one));
+	(void) rc;
+}
+
+void PixFitNetEngine::addSocket(int sock, uint64_t token, bool read) {
+	epoll_event ev;
+	ev.events = read ? static_cast<uint32_t>(EPOLLIN) : 0;
+	ev.data.u64 = token;
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, sock, &ev) != 0) {
+		ERS_LOG(m_threadName << ": Registering socket " << sock << " failed.")
+	}
+}
+
+void PixFitNetEngine::setInterest(int sock, uint64_t token, bool read) {
+	epoll_event ev;
+	ev.events = read ? static_cast<uint32_t>(EPOLLIN) : 0;
+	ev.data.u64 = token;
+	if (epoll_ctl(m_epollFd, EPOLL_CTL_MOD, sock, &ev) != 0) {
+		ERS_LOG(m_threadName << ": Modifying socket " << sock << " failed.")
+	}
+}
+
+void PixFitNetEngine::removeSocket(int sock) {
+	epoll_event ev; // ignored, but must not be null for old kernels
+	epoll_ctl(m_epollFd, EPOLL_CTL_DEL, sock, &ev);
+}
+
+void PixFitNetEngine::serviceAll() {
+	for (auto net : m_nets) net->service();
+}
+
+void PixFitNetEngine::loop() {
+	ERS_LOG(m_threadName << ": Serving " << m_nets.size() << " connection(s).")
+	epoll_event events[s_maxEvents];
+
+	while (true) {
+		bool stalled = false;
+		for (auto net : m_nets) stalled = stalled || net->isStalled();
+
+		const int n = epoll_wait(m_epollFd, events, s_maxEvents, stalled ? s_stallInterval : -1);
+		if (n < 0) {
+			if (errno != EINTR) {
+				ERS_LOG(m_threadName << ": epoll_wait failed.")
+			}
+			continue;
+		}
+
+		/* Timeout while stalled. */
+		if (n == 0) {
+			serviceAll();
+			continue;
+		}
+
+		for (int i = 0; i < n; i++) {
+			const uint64_t token = events[i].data.u64;
+			if (token == s_wakeToken) {
+				uint64_t count;
+				ssize_t rc = read(m_wakeFd, &count, sizeof(count));
+				(void) rc;
+				serviceAll();
+				continue;
+			}
+
+			PixFitNet *net = m_nets[token / 2];
+			if (token & 1) {
+				net->onAccept();
+			}
+			else {
+				net->onReadable(events[i].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP));
+			}
+		}
+	}
+}
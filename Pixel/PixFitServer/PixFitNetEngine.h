@@ -0,0 +1,76 @@
+/* @file PixFitNetEngine.h
+ */
+
+#ifndef PIXFITNETENGINE_H_
+#define PIXFITNETENGINE_H_
+
+#include <vector>
+#include <stdint.h> // change to cstdint for C++11
+
+#include "PixFitThread.h"
+
+namespace PixLib {
+
+class PixFitNet;
+
+/** Event loop that serves the connections of several PixFitNet objects with one thread, instead of
+ * one blocking thread per histogram unit. Readiness of the non-blocking sockets is monitored with
+ * epoll; PixFitNet decides itself whether its socket should be read (see PixFitNet::isReady()).
+ * Other threads wake the engine up via an eventfd, e.g. when a new scan configuration has been
+ * enqueued or a reset was requested. While any connection is paused because of the memory budget,
+ * the engine polls it every s_stallInterval milliseconds. */
+class PixFitNetEngine : public PixFitThread {
+public:
+	PixFitNetEngine();
+	virtual ~PixFitNetEngine();
+
+	/** Adds a connection to the engine and opens its listening socket. Has to be called before start().
+	 * @returns False if the listening socket could not be opened. */
+	bool addConnection(PixFitNet *net);
+
+	/** Makes the engine service all of its connections. Can be called from any thread. */
+	void wakeUp();
+
+	/* Interface for PixFitNet. */
+
+	/** Registers a socket.
+	 * @param sock Socket.
+	 * @param token Passed back by the event notifications of the socket.
+	 * @param read Initial read interest. */
+	void addSocket(int sock, uint64_t token, bool read);
+
+	/** Enables or disables read notifications for a registered socket. */
+	void setInterest(int sock, uint64_t token, bool read);
+
+	/** Unregisters a socket, has to be called before closing it. */
+	void removeSocket(int sock);
+
+private:
+	void loop();
+
+	/** Calls PixFitNet::service() for all connections. */
+	void serviceAll();
+
+	/** epoll instance. */
+	int m_epollFd;
+
+	/** eventfd for wakeUp(). */
+	int m_wakeFd;
+
+	/** Connections served by this engine. Connection i uses the tokens 2 * i for its ROD socket
+	 * and 2 * i + 1 for its listening socket. */
+	std::vector<PixFitNet*> m_nets;
+
+	/** Token of the eventfd. */
+	static const uint64_t s_wakeToken = ~0ull;
+
+	/** Maximum number of events handled per epoll_wait() call. */
+	static const int s_maxEvents = 64;
+
+	/** Polling interval in milliseconds while a connection is paused. */
+	static const int s_stallInterval = 100;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITNETENGINE_H_ */
@@ -72,6 +72,9 @@ void PixFitPublisher::loop() {
     PixFitScanConfig::scanType scanType = scanConfig->findScanType();
     PixFitScanConfig::intermediateType intermediateType = scanConfig->intermediate;
 
+    /* Turn the maps of the assembler into ROOT histograms. */
+    result->createHistograms();
+
     /* Build an OHRootProvider using scanConfig information */
     IPCPartition partition(scanConfig->partitionName);
     PixFitPublisherCommandListener lst;
@@ -131,11 +134,13 @@ void PixFitPublisher::loop() {
 
     ERS_DEBUG(0, result->getScanConfig()->histogrammer.makeHistoString() << " - " << chipId << ": Histogram was published to OH with internal ID " << result->getScanConfig()->fitFarmId)
 
+    result->stamp(PixFitWorkPackage::Stage::PUBLISHED);
+    m_instanceConfig->tracer.recordPublished(*result, scanConfig->histogrammer);
+
     /* Check if publishing of results is complete for a particular ROD and signal to IS.
-     * Make sure there is no race introduced here, in case non-intermediate histograms are published
-     * before their corresponding intermediate histos. */
-    if (intermediateType == PixFitScanConfig::intermediateType::INTERMEDIATE_NONE
-    		&& m_instanceConfig->scanlist.reduceScanCount(result->getScanConfig()->fitFarmId)) {
+     * Intermediate histos are part of the count: with several workers, assemblers and publishers
+     * the final histograms may well be published before the intermediate ones. */
+    if (m_instanceConfig->scanlist.reduceScanCount(result->getScanConfig()->fitFarmId)) {
 		ERS_LOG("Scan finished! All histograms for " << ROD_String << " are ready.")
 		ISInfoBool isfinish(1);
 		dict.checkin(scanConfig->serverName + "." + ROD_String + "_FinishScan", isfinish);
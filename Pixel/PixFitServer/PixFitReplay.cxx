@@ -0,0 +1,362 @@
+/* @file PixFitReplay.cxx
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <boost/thread.hpp>
+#include <ers/ers.h>
+
+#include "iblSlaveNetCmds.h"
+
+#include "PixFitReplay.h"
+#include "PixFitToolCommon.h"
+
+using namespace PixLib;
+using PixFitToolCommon::now;
+
+PixFitReplay::PixFitReplay() {
+	this->m_synthetic = false;
+	this->m_rate = 0;
+	this->m_repetitions = 1;
+}
+
+PixFitReplay::~PixFitReplay() {
+}
+
+void PixFitReplay::addEndpoint(const PixFitNetConfiguration &config) {
+	Endpoint endpoint;
+	endpoint.address = config.getLocalIpAddress();
+	endpoint.port = config.getLocalPort();
+	endpoint.histogrammer = *config.getHistogrammer();
+	m_endpoints.push_back(endpoint);
+}
+
+bool PixFitReplay::addDumpFile(const std::string &fileName) {
+	std::ifstream in(fileName.c_str(), std::ios::in | std::ios::binary);
+	if (!in) {
+		ERS_LOG("Replay: could not open " << fileName)
+		return false;
+	}
+	m_files.push_back(fileName);
+
+	PixFitDump::FileHeader header;
+	in.read(reinterpret_cast<char *>(&header), sizeof(header));
+	in.seekg(0);
+	if (in && header.magic == PixFitDump::s_fileMagic) {
+		return readIndexedDump(m_files.size() - 1, in);
+	}
+	return readLegacyDump(m_files.size() - 1, in);
+}
+
+bool PixFitReplay::readIndexedDump(size_t file, std::ifstream &in) {
+	size_t count = 0;
+	auto add = [&](const PixFitDump::RecordHeader &header, uint64_t offset) {
+		HistoUnit unit;
+		unit.crate = header.crate;
+		unit.rod = header.rod;
+		unit.slave = header.slave;
+		unit.histo = header.histo;
+
+		DumpRecord record;
+		record.file = file;
+		record.offset = offset + sizeof(PixFitDump::RecordHeader);
+		record.storedSize = header.storedSize;
+		record.rawSize = header.rawSize;
+		record.type = header.type;
+		record.flags = header.flags;
+		m_dumps[unit].push_back(record);
+		count++;
+	};
+
+	/* Without the index (e.g. it got lost) the records are found by walking through the file, the
+	 * zero padding of an unfinished file ends the walk. */
+	std::ifstream index((m_files[file] + ".idx").c_str(), std::ios::in | std::ios::binary);
+	PixFitDump::FileHeader header;
+	if (index.read(reinterpret_cast<char *>(&header), sizeof(header)) && header.magic == PixFitDump::s_indexMagic) {
+		PixFitDump::IndexEntry entry;
+		while (index.read(reinterpret_cast<char *>(&entry), sizeof(entry))) add(entry.header, entry.offset);
+	}
+	else {
+		uint64_t offset = sizeof(PixFitDump::FileHeader);
+		PixFitDump::RecordHeader record;
+		in.seekg(offset);
+		while (in.read(reinterpret_cast<char *>(&record), sizeof(record)) && record.magic == PixFitDump::s_recordMagic) {
+			add(record, offset);
+			offset += sizeof(record) + record.storedSize;
+			in.seekg(offset);
+		}
+	}
+
+	ERS_LOG("Replay: " << count << " records in " << m_files[file])
+	return true;
+}
+
+bool PixFitReplay::readLegacyDump(size_t file, std::ifstream &in) {
+	/* File names end with crate_rod_slave_histo.dump. */
+	HistoUnit unit;
+	const std::string &fileName = m_files[file];
+	const size_t pos = fileName.find_last_of('-');
+	if (pos == std::string::npos || sscanf(fileName.c_str() + pos + 1, "%d_%d_%d_%d",
+			&unit.crate, &unit.rod, &unit.slave, &unit.histo) != 4) {
+		ERS_LOG("Replay: " << fileName << " is no network dump")
+		return false;
+	}
+
+	std::vector<DumpRecord> &records = m_dumps[unit];
+	uint64_t offset = 0;
+	RodSlvTcpCmd cmd;
+	while (in.read(reinterpret_cast<char *>(&cmd), sizeof(cmd))) {
+		if (ntohl(cmd.magic) != SLVNET_MAGIC) {
+			ERS_LOG("Replay: invalid magic word at offset " << offset << " of " << fileName)
+			return false;
+		}
+		DumpRecord record;
+		record.file = file;
+		record.offset = offset;
+		record.storedSize = sizeof(cmd);
+		record.rawSize = sizeof(cmd);
+		record.type = PixFitDump::RECORD_COMMAND;
+		record.flags = 0;
+		records.push_back(record);
+		offset += sizeof(cmd);
+
+		const uint32_t payloadSize = ntohl(cmd.payloadSize);
+		if (payloadSize > 0) {
+			record.offset = offset;
+			record.storedSize = payloadSize;
+			record.rawSize = payloadSize;
+			record.type = PixFitDump::RECORD_PAYLOAD;
+			records.push_back(record);
+			offset += payloadSize;
+			in.seekg(offset);
+		}
+	}
+
+	ERS_LOG("Replay: " << records.size() << " records in " << fileName)
+	return true;
+}
+
+void PixFitReplay::setSynthetic(const Synthetic &synthetic) {
+	m_synthetic = true;
+	m_syntheticConfig = synthetic;
+}
+
+void PixFitReplay::setRate(double megabytesPerSecond) {
+	m_rate = megabytesPerSecond;
+}
+
+void PixFitReplay::setRepetitions(int repetitions) {
+	m_repetitions = repetitions;
+}
+
+PixFitReplay::Synthetic PixFitReplay::makeSynthetic(const PixFitScanConfig &scanConfig) {
+	Synthetic synthetic;
+	synthetic.histograms = scanConfig.getNumOfMaskSteps();
+	synthetic.pixels = scanConfig.getNumOfPixels();
+	synthetic.bins = scanConfig.getNumOfBins();
+	synthetic.triggers = 100;
+	synthetic.readoutMode = scanConfig.getReadoutMode();
+	synthetic.scanId = scanConfig.scanId;
+	synthetic.muMean = synthetic.bins / 2.;
+	synthetic.muSpread = synthetic.bins / 20.;
+	synthetic.sigmaMean = synthetic.bins / 30.;
+	synthetic.sigmaSpread = synthetic.bins / 150.;
+	synthetic.seed = 1;
+	return synthetic;
+}
+
+PixFitReplay::Statistics PixFitReplay::run() {
+	assignDumps();
+
+	std::vector<Statistics> stats(m_endpoints.size());
+	boost::thread_group threads;
+	const double start = now();
+	for (size_t i = 0; i < m_endpoints.size(); i++) {
+		stats[i].commands = 0;
+		stats[i].bytes = 0;
+		stats[i].seconds = 0;
+		stats[i].failedEndpoints = 0;
+		threads.create_thread(boost::bind(&PixFitReplay::sendAll, this, boost::ref(m_endpoints[i]), boost::ref(stats[i])));
+	}
+	threads.join_all();
+
+	Statistics total;
+	total.commands = 0;
+	total.bytes = 0;
+	total.seconds = now() - start;
+	total.failedEndpoints = 0;
+	for (auto& endpointStats : stats) {
+		total.commands += endpointStats.commands;
+		total.bytes += endpointStats.bytes;
+		total.failedEndpoints += endpointStats.failedEndpoints;
+	}
+	ERS_LOG("Replay: sent " << total.commands << " commands, " << total.bytes / (1024 * 1024) << " MB in "
+			<< total.seconds << " s to " << m_endpoints.size() << " endpoint(s), " << total.failedEndpoints << " failed")
+	return total;
+}
+
+void PixFitReplay::assignDumps() {
+	size_t next = 0;
+	for (auto& dump : m_dumps) {
+		Endpoint *target = nullptr;
+		for (auto& endpoint : m_endpoints) {
+			if (endpoint.histogrammer == dump.first) target = &endpoint;
+		}
+		if (target == nullptr && !m_endpoints.empty()) {
+			target = &m_endpoints[next++ % m_endpoints.size()];
+			ERS_LOG("Replay: no endpoint for " << dump.first.makeHistoString() << ", sending to "
+					<< target->histogrammer.makeHistoString())
+		}
+		if (target != nullptr) {
+			target->records.insert(target->records.end(), dump.second.begin(), dump.second.end());
+		}
+	}
+	m_dumps.clear();
+}
+
+void PixFitReplay::sendAll(Endpoint &endpoint, Statistics &stats) {
+	const int sock = connectTo(endpoint);
+	if (sock == -1) {
+		stats.failedEndpoints = 1;
+		return;
+	}
+
+	double start = now();
+	bool ok = true;
+	for (int i = 0; i < m_repetitions && ok; i++) {
+		ok = sendDump(sock, endpoint, stats, start);
+		if (ok && m_synthetic) ok = sendSynthetic(sock, &endpoint - &m_endpoints[0], stats, start);
+	}
+	if (!ok) stats.failedEndpoints = 1;
+	stats.seconds = now() - start;
+	close(sock);
+}
+
+bool PixFitReplay::sendDump(int sock, Endpoint &endpoint, Statistics &stats, double start) {
+	std::vector<std::unique_ptr<std::ifstream> > files(m_files.size());
+	std::vector<char> stored;
+	std::vector<char> raw;
+
+	for (auto& record : endpoint.records) {
+		if (!files[record.file]) {
+			files[record.file].reset(new std::ifstream(m_files[record.file].c_str(), std::ios::in | std::ios::binary));
+		}
+		std::ifstream &in = *files[record.file];
+		stored.resize(record.storedSize);
+		in.seekg(record.offset);
+		if (!in.read(stored.data(), stored.size())) {
+			ERS_LOG("Replay: could not read " << m_files[record.file])
+			return false;
+		}
+
+		const char *data = stored.data();
+		if (record.flags & PixFitDump::FLAG_DEFLATE) {
+			raw.resize(record.rawSize);
+			uLongf length = raw.size();
+			if (uncompress(reinterpret_cast<Bytef *>(raw.data()), &length,
+					reinterpret_cast<const Bytef *>(stored.data()), stored.size()) != Z_OK || length != raw.size()) {
+				ERS_LOG("Replay: corrupt record in " << m_files[record.file])
+				return false;
+			}
+			data = raw.data();
+		}
+
+		if (record.type == PixFitDump::RECORD_COMMAND) stats.commands++;
+		if (!send(sock, data, record.rawSize, stats, start)) return false;
+	}
+	return true;
+}
+
+bool PixFitReplay::sendSynthetic(int sock, int index, Statistics &stats, double start) {
+	const Synthetic &config = m_syntheticConfig;
+	std::mt19937 random(config.seed + index);
+	std::normal_distribution<double> muDistribution(config.muMean, config.muSpread);
+	std::normal_distribution<double> sigmaDistribution(config.sigmaMean, config.sigmaSpread);
+
+	const size_t payloadSize = static_cast<size_t>(config.pixels) * PixFitToolCommon::bytesPerPixel(config.readoutMode);
+	std::vector<char> payload(payloadSize);
+	std::vector<double> mu(config.pixels);
+	std::vector<double> sigma(config.pixels);
+
+	for (int h = 0; h < config.histograms; h++) {
+		for (int p = 0; p < config.pixels; p++) {
+			mu[p] = muDistribution(random);
+			sigma[p] = std::max(0.05, sigmaDistribution(random));
+		}
+
+		for (int bin = 0; bin < config.bins; bin++) {
+			for (int p = 0; p < config.pixels; p++) {
+				const double efficiency = 0.5 * erfc((mu[p] - bin) / (M_SQRT2 * sigma[p]));
+				PixFitToolCommon::encode(config.readoutMode, config.triggers,
+						static_cast<uint32_t>(lround(config.triggers * efficiency)), 0, 0, payload.data(), p);
+			}
+
+			RodSlvTcpCmd cmd;
+			cmd.magic = htonl(SLVNET_MAGIC);
+			cmd.command = htonl(SLVNET_HIST_DATA_CMD);
+			cmd.bins = htonl(bin);
+			cmd.payloadSize = htonl(payloadSize);
+			cmd.scanId = htonl(config.scanId);
+			stats.commands++;
+			if (!send(sock, reinterpret_cast<const char *>(&cmd), sizeof(cmd), stats, start)) return false;
+			if (!send(sock, payload.data(), payloadSize, stats, start)) return false;
+		}
+	}
+	return true;
+}
+
+bool PixFitReplay::send(int sock, const char *data, size_t size, Statistics &stats, double start) {
+	while (size > 0) {
+		ssize_t rc = ::send(sock, data, size, MSG_NOSIGNAL);
+		if (rc < 0 && errno == EINTR) continue;
+		if (rc <= 0) {
+			ERS_LOG("Replay: send failed: " << strerror(errno))
+			return false;
+		}
+		data += rc;
+		size -= rc;
+		stats.bytes += rc;
+	}
+
+	/* Pace to the configured rate. */
+	if (m_rate > 0) {
+		const double ahead = start + stats.bytes / (m_rate * 1024 * 1024) - now();
+		if (ahead > 0) boost::this_thread::sleep(boost::posix_time::microseconds(static_cast<long>(ahead * 1e6)));
+	}
+	return true;
+}
+
+int PixFitReplay::connectTo(const Endpoint &endpoint) {
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = endpoint.port;
+	addr.sin_addr = endpoint.address;
+
+	/* The server may still be starting up. */
+	const double deadline = now() + s_connectTimeout;
+	while (true) {
+		int sock = socket(AF_INET, SOCK_STREAM, 0);
+		if (sock == -1) return -1;
+		if (connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0) return sock;
+		close(sock);
+		if (now() > deadline) {
+			ERS_LOG("Replay: could not connect to " << endpoint.histogrammer.makeHistoString() << " at "
+					<< inet_ntoa(endpoint.address) << ":" << ntohs(endpoint.port))
+			return -1;
+		}
+		boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+	}
+}
@@ -0,0 +1,145 @@
+/* @file PixFitReplay.h
+ */
+
+#ifndef PIXFITREPLAY_H_
+#define PIXFITREPLAY_H_
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h> // for in_addr, in_port_t
+
+#include "PixFitNetConfiguration.h"
+#include "PixFitScanConfig.h"
+#include "PixFitDump.h"
+
+namespace PixLib {
+
+/** Load generator that plays the part of the ROD slaves: it connects to PixFitNet endpoints and
+ * sends histogram data with the RodSlvTcpCmd protocol, one thread per endpoint, optionally at a
+ * limited rate. The data either comes from network dumps (see PixFitDumpWriter, files written
+ * before the indexed format are understood as well) or is generated: threshold scan S-curves with
+ * mu and sigma of every pixel drawn from normal distributions.
+ * Dumped data is sent to the endpoint that serves the histogramming unit it was recorded from.
+ * Units without such an endpoint are distributed round-robin over all endpoints. */
+class PixFitReplay {
+public:
+	/** Parameters of generated data. mu and sigma are in units of bins. */
+	struct Synthetic {
+		/** Histograms (mask steps) per endpoint. */
+		int histograms;
+		int pixels;
+		int bins;
+		int triggers;
+		PixFitScanConfig::readoutMode readoutMode;
+		PixFitScanConfig::ScanIdType scanId;
+		double muMean;
+		double muSpread;
+		double sigmaMean;
+		double sigmaSpread;
+		unsigned int seed;
+	};
+
+	/** Counters of a finished run, summed over all endpoints. */
+	struct Statistics {
+		unsigned long commands;
+		size_t bytes;
+		double seconds;
+		int failedEndpoints;
+	};
+
+	PixFitReplay();
+	virtual ~PixFitReplay();
+
+	/** Adds an endpoint to send data to. */
+	void addEndpoint(const PixFitNetConfiguration &config);
+
+	/** Adds the records of a dump file.
+	 * @returns False if the file could not be read. */
+	bool addDumpFile(const std::string &fileName);
+
+	/** Sends generated data to every endpoint, in addition to dumped data. */
+	void setSynthetic(const Synthetic &synthetic);
+
+	/** Limits the rate per endpoint.
+	 * @param megabytesPerSecond Rate in MB/s, 0 for no limit (default). */
+	void setRate(double megabytesPerSecond);
+
+	/** Sends all data this many times (default 1). */
+	void setRepetitions(int repetitions);
+
+	/** Sends the data to all endpoints concurrently and returns when done.
+	 * @returns Counters of the run. */
+	Statistics run();
+
+	/** @returns Parameters for generated data that match a scan configuration. */
+	static Synthetic makeSynthetic(const PixFitScanConfig &scanConfig);
+
+private:
+	/** A command or payload in a dump file. */
+	struct DumpRecord {
+		size_t file;
+
+		/** Position and size of the data in the file. */
+		uint64_t offset;
+		uint32_t storedSize;
+		uint32_t rawSize;
+		uint16_t type;
+		uint16_t flags;
+	};
+
+	struct Endpoint {
+		in_addr address;
+		in_port_t port;
+		HistoUnit histogrammer;
+
+		/** Dumped records to be sent to this endpoint. */
+		std::vector<DumpRecord> records;
+	};
+
+	/** Reads a dump file written by PixFitDumpWriter, using its index if there is one. */
+	bool readIndexedDump(size_t file, std::ifstream &in);
+
+	/** Reads a dump file from before the indexed format: a plain copy of the TCP stream, the
+	 * histogramming unit is taken from the file name. */
+	bool readLegacyDump(size_t file, std::ifstream &in);
+
+	/** Distributes the dumped records over the endpoints. */
+	void assignDumps();
+
+	/** Sends everything to one endpoint, runs in its own thread. */
+	void sendAll(Endpoint &endpoint, Statistics &stats);
+
+	/** Sends the dumped records of an endpoint. */
+	bool sendDump(int sock, Endpoint &endpoint, Statistics &stats, double start);
+
+	/** Sends generated histograms. */
+	bool sendSynthetic(int sock, int index, Statistics &stats, double start);
+
+	/** Sends a buffer completely, waiting as needed to keep the configured rate. */
+	bool send(int sock, const char *data, size_t size, Statistics &stats, double start);
+
+	/** Connects to an endpoint, retrying for s_connectTimeout seconds.
+	 * @returns The socket, -1 on failure. */
+	int connectTo(const Endpoint &endpoint);
+
+	std::vector<Endpoint> m_endpoints;
+	std::vector<std::string> m_files;
+
+	/** Dumped records by histogramming unit, in the order they were received. */
+	std::map<HistoUnit, std::vector<DumpRecord> > m_dumps;
+
+	bool m_synthetic;
+	Synthetic m_syntheticConfig;
+	double m_rate;
+	int m_repetitions;
+
+	/** Seconds to wait for an endpoint to accept connections. */
+	static const int s_connectTimeout = 30;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITREPLAY_H_ */
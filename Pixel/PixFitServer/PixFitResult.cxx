@@ -6,16 +6,35 @@
 
 #include <memory>
 
+#include <RVersion.h>
+#include <TROOT.h>
+#include <TThread.h>
+
 #include "PixFitResult.h"
 #include "PixFitScanConfig.h"
+#include "PixFitInstanceConfig.h" // for MemoryBudget
 
 using namespace PixLib;
 
+namespace {
+/* Bytes used by the bin contents of a ROOT histogram (including under- and overflow). */
+size_t histoBytes(const std::shared_ptr<TH1F> &histo) {
+	return histo ? (histo->GetNbinsX() + 2) * sizeof(float) : 0;
+}
+
+size_t histoBytes(const std::shared_ptr<TH2F> &histo) {
+	return histo ? (histo->GetNbinsX() + 2) * (histo->GetNbinsY() + 2) * sizeof(float) : 0;
+}
+}
+
 PixFitResult::PixFitResult(std::shared_ptr<const PixFitScanConfig> scanConfig) {
 	this->m_scanConfig = scanConfig;
+	this->m_budget = nullptr;
+	this->m_charged = 0;
 }
 
 PixFitResult::~PixFitResult() {
+	if (m_budget != nullptr) m_budget->release(m_charged);
 }
 
 std::shared_ptr<const PixFitScanConfig> PixFitResult::getScanConfig() const {
@@ -25,3 +44,115 @@ std::shared_ptr<const PixFitScanConfig> PixFitResult::getScanConfig() const {
 PixFitScanConfig::ScanIdType PixFitResult::getScanId() const {
 	return m_scanConfig->scanId;
 }
+
+void PixFitResult::chargeMemory(MemoryBudget *budget) {
+	if (m_budget != nullptr) m_budget->release(m_charged);
+
+	/* mu/sigma pairs and chi2 value per pixel. */
+	size_t bytes = thresh_array ? 3 * m_scanConfig->getNumOfPixels() * sizeof(double) : 0;
+
+	bytes += map_occ.getBytes() + map_thresh.getBytes() + map_noise.getBytes() + map_chi2.getBytes();
+	bytes += map_totmean.getBytes() + map_totsum.getBytes() + map_totsum2.getBytes() + map_totsigma.getBytes();
+
+	bytes += histoBytes(histo_occ);
+	bytes += histoBytes(histo_thresh) + histoBytes(histo_thresh2D);
+	bytes += histoBytes(histo_noise) + histoBytes(histo_noise2D);
+	bytes += histoBytes(histo_chi2) + histoBytes(histo_chi2_2D);
+	bytes += histoBytes(histo_totmean) + histoBytes(histo_totsum);
+	bytes += histoBytes(histo_totsum2) + histoBytes(histo_totsigma);
+
+	m_budget = budget;
+	m_charged = bytes;
+	if (m_budget != nullptr) m_budget->charge(m_charged);
+}
+
+void PixFitResult::setupRoot() {
+	/* Histograms belong to their result, not to the current directory, which is shared by all
+	 * threads. */
+	TH1::AddDirectory(false);
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6, 4, 0)
+	ROOT::EnableThreadSafety();
+#else
+	TThread::Initialize();
+#endif
+}
+
+std::shared_ptr<TH2F> PixFitResult::makeHisto(const PixFitChipMap &map, const std::string &name) {
+	const int ncol = map.getNumOfCols();
+	const int nrow = map.getNumOfRows();
+	std::shared_ptr<TH2F> histo = std::make_shared<TH2F>(name.c_str(), name.c_str(), ncol, 0, ncol, nrow, 0, nrow);
+	histo->GetXaxis()->SetTitle("Column");
+	histo->GetYaxis()->SetTitle("Row");
+	return histo;
+}
+
+void PixFitResult::createHistograms() {
+	const HistoUnit &unit = m_scanConfig->histogrammer;
+	const PixFitScanConfig::scanType scanType = m_scanConfig->findScanType();
+	const PixFitScanConfig::intermediateType intermediateType = m_scanConfig->intermediate;
+
+	/* The suffix makes names and titles of the histograms unique, intermediate histograms also
+	 * carry the bin. */
+	std::string k = std::to_string(unit.crate) + "-" + std::to_string(unit.rod) + "-"
+			+ std::to_string(unit.slave) + "-" + std::to_string(unit.histo) + "-" + std::to_string(chipId);
+	if (intermediateType != PixFitScanConfig::intermediateType::INTERMEDIATE_NONE) {
+		k += "-" + std::to_string(m_scanConfig->binNumber);
+	}
+
+	if (map_occ.isAllocated()) {
+		const bool tot = intermediateType == PixFitScanConfig::intermediateType::INTERMEDIATE_TOT
+				|| (intermediateType == PixFitScanConfig::intermediateType::INTERMEDIATE_NONE
+						&& scanType == PixFitScanConfig::scanType::TOT);
+		histo_occ = makeHisto(map_occ, (tot ? "occ" : "occupancy-") + k);
+	}
+	if (map_totmean.isAllocated()) histo_totmean = makeHisto(map_totmean, "totmean-" + k);
+	if (map_totsum.isAllocated()) histo_totsum = makeHisto(map_totsum, "totsum-" + k);
+	if (map_totsum2.isAllocated()) histo_totsum2 = makeHisto(map_totsum2, "totsum2-" + k);
+	if (map_totsigma.isAllocated()) histo_totsigma = makeHisto(map_totsigma, "totsigma-" + k);
+	if (map_thresh.isAllocated()) {
+		TString name = "threshold-" + k;
+		histo_thresh = std::make_shared<TH1F>(name, name, 1000, 0., m_scanConfig->getNumOfBins());
+		name = "noise-" + k;
+		histo_noise = std::make_shared<TH1F>(name, name, 100, 0., 10.);
+		name = "chi2-" + k;
+		histo_chi2 = std::make_shared<TH1F>(name, name, 25, 0., 50.);
+
+		const int ncol = map_thresh.getNumOfCols();
+		const int nrow = map_thresh.getNumOfRows();
+		name = "threshold2D-" + k;
+		histo_thresh2D = std::make_shared<TH2F>(name, name, ncol, 0, ncol, nrow, 0, nrow);
+		name = "noise2D-" + k;
+		histo_noise2D = std::make_shared<TH2F>(name, name, ncol, 0, ncol, nrow, 0, nrow);
+		name = "chi2_2D-" + k;
+		histo_chi2_2D = std::make_shared<TH2F>(name, name, ncol, 0, ncol, nrow, 0, nrow);
+	}
+
+	if (histo_occ) map_occ.copyTo(*histo_occ);
+	if (histo_totmean) map_totmean.copyTo(*histo_totmean);
+	if (histo_totsum) map_totsum.copyTo(*histo_totsum);
+	if (histo_totsum2) map_totsum2.copyTo(*histo_totsum2);
+	if (histo_totsigma) map_totsigma.copyTo(*histo_totsigma);
+	if (histo_thresh) {
+		map_thresh.fillInto(*histo_thresh);
+		map_noise.fillInto(*histo_noise);
+		map_chi2.fillInto(*histo_chi2);
+
+		/* Only the 2D histograms are converted to Vcal, which is linear in the bin. The scan start
+		 * is not added to the noise. */
+		const double vcalMin = m_scanConfig->getVcalfromBin(0);
+		const double vcalStep = m_scanConfig->getVcalfromBin(1) - vcalMin;
+		map_thresh.copyTo(*histo_thresh2D, vcalStep, vcalMin);
+		map_noise.copyTo(*histo_noise2D, vcalStep, 0.);
+		map_chi2.copyTo(*histo_chi2_2D);
+	}
+
+	map_occ.release();
+	map_thresh.release();
+	map_noise.release();
+	map_chi2.release();
+	map_totmean.release();
+	map_totsum.release();
+	map_totsum2.release();
+	map_totsigma.release();
+	if (m_budget != nullptr) chargeMemory(m_budget);
+}
@@ -8,19 +8,23 @@
 #define PIXFITRESULT_H_
 
 #include <memory>
+#include <string>
 
 #include "TH1.h"
 #include "TH2.h"
 
+#include "PixFitChipMap.h"
 #include "PixFitWorkPackage.h"
 #include "PixFitScanConfig.h"
 
 namespace PixLib {
 
 class RawHisto;
+class MemoryBudget;
 
 /** This is a container for processed histogram data (almost) ready for publishing.
- * The ROOT histograms are created by the PixFitAssembler and are empty otherwise. thresh_array and
+ * The PixFitAssembler fills the per-chip maps, which are turned into ROOT histograms by
+ * createHistograms() before publishing; the histograms are empty otherwise. thresh_array and
  * rawHisto hold data that is being shipped between PixFitWorker/Fitter and PixFitAssembler. */
 class PixFitResult : public PixFitWorkPackage {
 public:
@@ -39,7 +43,47 @@ public:
 	/** Holds the results from a threshold scan fit. */
 	std::unique_ptr<double[]> thresh_array;
 
-	/* Resulting ROOT histograms created by PixFitAssembler. */
+	/** Number of pixels per outcome of a threshold scan fit, for the metrics. Pixels that converged
+	 * to a negative threshold count as converged and badConvergence. Pixels taken from the
+	 * PixFitStreamingFit count as converged and streamed, pixels taken from their moments without a
+	 * fit (PixFitMoments) as converged and estimated. Pixels whose fit started from the curve of
+	 * the previous scan (PixFitFitCache) count as reused, in addition to the outcome of the fit. */
+	struct FitOutcomes {
+		FitOutcomes() : converged(0), badConvergence(0), exhausted(0), trapped(0), failed(0), zero(0),
+				streamed(0), reused(0), estimated(0) {};
+		int converged;
+		int badConvergence;
+		int exhausted;
+		int trapped;
+		int failed;
+		int zero;
+		int streamed;
+		int reused;
+		int estimated;
+	} fitOutcomes;
+
+	/* Values per pixel of a chip filled by PixFitAssembler. Threshold and noise are in bins, the
+	 * conversion to Vcal happens in createHistograms(). */
+	PixFitChipMap map_occ;
+	PixFitChipMap map_thresh;
+	PixFitChipMap map_noise;
+	PixFitChipMap map_chi2;
+	PixFitChipMap map_totmean;
+	PixFitChipMap map_totsum;
+	PixFitChipMap map_totsum2;
+	PixFitChipMap map_totsigma;
+
+	/** Creates the ROOT histograms from the allocated maps and frees the maps. Results are
+	 * independent of each other, so several threads can do this at the same time without a lock
+	 * once setupRoot() has been called. */
+	void createHistograms();
+
+	/** Sets up ROOT for creating histograms in several threads: histograms are not attached to
+	 * the current directory and ROOT protects its own global state. Call it once before any of the
+	 * threads are started. */
+	static void setupRoot();
+
+	/* Resulting ROOT histograms created by createHistograms(). */
 	std::shared_ptr<TH2F> histo_occ;
 
 	std::shared_ptr<TH1F> histo_thresh;
@@ -63,9 +107,24 @@ public:
 	/** Get the scan ID belonging to the work object. */
 	virtual PixFitScanConfig::ScanIdType getScanId() const;
 
+	/** Charges the memory of thresh_array, the maps and the ROOT histograms to a budget until the
+	 * result is destroyed. Call it after these have been created; a previous charge is replaced.
+	 * The RawHisto is accounted for on its own. */
+	void chargeMemory(MemoryBudget *budget);
+
 private:
+	/** Creates a 2D histogram for a map with the column and row axes.
+	 * @param name Prefix of name and title. */
+	static std::shared_ptr<TH2F> makeHisto(const PixFitChipMap &map, const std::string &name);
+
 	/** Handle for the corresponding PixFitScanConfig. */
 	std::shared_ptr<const PixFitScanConfig> m_scanConfig;
+
+	/** Budget the memory is charged to, nullptr if none. */
+	MemoryBudget *m_budget;
+
+	/** Number of bytes charged to m_budget. */
+	size_t m_charged;
 };
 } /* end of namespace PixLib */
 
@@ -27,6 +27,7 @@ namespace {
 
 PixFitScanConfig::PixFitScanConfig(bool slaveEmu = false) {
 	intermediate = intermediateType::INTERMEDIATE_NONE;
+	priority = priorityClass::PRIORITY_NORMAL;
 	binNumber = -1;
 	m_slaveEmu = slaveEmu;
 
@@ -213,6 +214,24 @@ PixFitScanConfig::ScanIdType PixFitScanConfig::getScanId() const {
 	return scanId;
 }
 
+void PixFitScanConfig::setSlaveEmuParameters(scanType type, readoutMode mode, int maskSteps, int bins, int injections) {
+	nscantype = type;
+	nreadoutmode = mode;
+	masknum = maskSteps;
+	masksteps = maskSteps;
+	nbins = bins;
+	ntrigs = injections;
+}
+
+int PixFitScanConfig::getAssemblerShard(int numOfShards) const {
+	unsigned int hash = static_cast<unsigned int>(scanId);
+	hash = hash * 31 + histogrammer.crate;
+	hash = hash * 31 + histogrammer.rod;
+	hash = hash * 31 + histogrammer.slave;
+	hash = hash * 31 + histogrammer.histo;
+	return hash % numOfShards;
+}
+
 bool PixFitScanConfig::doIntermediateHistos() const {
   /* Check if it is a threshold scan and occupancy histograms are needed on top as intermediate. */
   if (findScanType() == scanType::THRESHOLD
@@ -7,6 +7,7 @@
 #ifndef PIXFITSCANCONFIG_H_
 #define PIXFITSCANCONFIG_H_
 
+#include <atomic>
 #include <string>
 #include <map>
 #include <memory>
@@ -135,6 +136,31 @@ public:
 	/** Type of intermediate histograms. */
 	intermediateType intermediate;
 
+	/** Priority classes for the work queues in priority mode, PRIORITY_HIGH is served first. */
+	enum class priorityClass {PRIORITY_HIGH = 0, PRIORITY_NORMAL, PRIORITY_LOW};
+
+	/** Number of priority classes. */
+	static const int numOfPriorities = 3;
+
+	/** Priority class of the work packages belonging to this config. PRIORITY_HIGH for the last
+	 * mask step (which completes a vector in the assembler hold), PRIORITY_LOW for intermediate
+	 * histograms and PRIORITY_NORMAL otherwise. */
+	priorityClass priority;
+
+	/** Publishing progress of a ROD, shared by all PixFitScanConfigs with the same fitFarmId. */
+	struct Progress {
+		Progress() : total(0), remaining(0) {}
+
+		/** Number of objects to be published, 0 until the PixFitManager has counted them. */
+		std::atomic<int> total;
+
+		/** Number of objects not published yet. */
+		std::atomic<int> remaining;
+	};
+
+	/** Progress of the ROD, read by the work queues without locking. nullptr if not tracked. */
+	std::shared_ptr<Progress> progress;
+
 	/** The bin number of the histogram for more advanced scans such as threshold. This is used
 	 * in case intermediate histograms need to be published and is then used for naming them.
 	 * We also use this to keep track of the bin for a TOT_CALIBRATION. */
@@ -146,6 +172,20 @@ public:
 	/** Get the scan ID belonging to the work object. */
 	virtual ScanIdType getScanId() const;
 
+	/** Selects one out of several PixFitAssemblers for this object. The choice only depends on
+	 * scanId and histogrammer, so all mask steps and bins of a histogramming unit end up in the
+	 * same assembler hold.
+	 * @param numOfShards Number of assemblers.
+	 * @returns Index between 0 and numOfShards - 1. */
+	int getAssemblerShard(int numOfShards) const;
+
+	/** Changes what objects created for the slave emulator report, so that tools like PixFitBench
+	 * can go through all scan types and readout modes without a PixScan. Has to be called while no
+	 * such objects are in use, the settings are shared by all of them.
+	 * @param maskSteps Number of mask steps (total and sent), 1, 2, 4 or 8.
+	 * @param bins Number of bins of the histograms. */
+	static void setSlaveEmuParameters(scanType type, readoutMode mode, int maskSteps, int bins, int injections);
+
 private:
 	/** Contains scan type sizes in words. */
 	const std::map<scanType, int> m_scanTypeWords {
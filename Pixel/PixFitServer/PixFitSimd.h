@@ -0,0 +1,146 @@
+/* @file PixFitSimd.h
+ */
+
+#ifndef PIXFITSIMD_H_
+#define PIXFITSIMD_H_
+
+#include <cstring> // for memcpy
+
+namespace PixLib {
+
+/** Small collection of SIMD helpers built on top of the GCC vector extensions. The functions are
+ * templated on the vector type and forced inline, so that they pick up the instruction set of the
+ * (target-attributed) function they are used in. This allows to compile AVX-512, AVX2 and a
+ * generic SSE2 version of the same kernel from a single source file and to select one at runtime.
+ * Vectors are taken by reference and results are returned through the last argument: passing a
+ * vector by value in a function that is not compiled for its width would change the ABI (-Wpsabi).
+ * Only double precision is supported. */
+namespace PixFitSimd {
+
+#define PIXFIT_SIMD_INLINE inline __attribute__((always_inline))
+
+/* Vector types for the different register widths. */
+typedef double v2df __attribute__((vector_size(16)));
+typedef long long v2di __attribute__((vector_size(16)));
+typedef double v4df __attribute__((vector_size(32)));
+typedef long long v4di __attribute__((vector_size(32)));
+typedef double v8df __attribute__((vector_size(64)));
+typedef long long v8di __attribute__((vector_size(64)));
+
+/** Maps a double vector type to its lane count and the integer vector type used for masks. */
+template <class V> struct Traits;
+
+template <> struct Traits<v2df> {
+	typedef v2di IntV;
+	static const int width = 2;
+};
+
+template <> struct Traits<v4df> {
+	typedef v4di IntV;
+	static const int width = 4;
+};
+
+template <> struct Traits<v8df> {
+	typedef v8di IntV;
+	static const int width = 8;
+};
+
+/** Sets all lanes to the same value. */
+template <class V> PIXFIT_SIMD_INLINE void broadcast(double x, V &v) {
+	const V zero = {};
+	v = zero + x;
+}
+
+/** Unaligned load of a full vector. */
+template <class V> PIXFIT_SIMD_INLINE void load(const double *p, V &v) {
+	std::memcpy(&v, p, sizeof(V));
+}
+
+/** Unaligned store of a full vector. */
+template <class V> PIXFIT_SIMD_INLINE void store(double *p, const V &v) {
+	std::memcpy(p, &v, sizeof(V));
+}
+
+/** Lane-wise blend: result is a where mask is set and b otherwise. result may be a or b.
+ * @param mask Result of a vector comparison (all bits set or cleared per lane). */
+template <class V> PIXFIT_SIMD_INLINE void select(const typename Traits<V>::IntV &mask, const V &a, const V &b,
+		V &result) {
+	typedef typename Traits<V>::IntV I;
+	result = (V) (((I) a & mask) | ((I) b & ~mask));
+}
+
+/** @returns True if the mask is set in at least one lane. */
+template <class I> PIXFIT_SIMD_INLINE bool any(const I &mask) {
+	const int n = sizeof(I) / sizeof(mask[0]);
+	long long acc = 0;
+	for (int i = 0; i < n; i++) acc |= mask[i];
+	return acc != 0;
+}
+
+template <class V> PIXFIT_SIMD_INLINE void abs(const V &x, V &result) {
+	typedef typename Traits<V>::IntV I;
+	I m = {};
+	result = (V) ((I) x & (m + 0x7fffffffffffffffLL));
+}
+
+/** Lane-wise exponential function (Cephes algorithm, relative error below 2e-16).
+ * Arguments are clamped to [-708, 709], i.e. underflow yields ~1e-308 rather than zero. */
+template <class V> PIXFIT_SIMD_INLINE void exp(const V &arg, V &result) {
+	typedef typename Traits<V>::IntV I;
+
+	V x, limit;
+	broadcast(709.0, limit);
+	select(arg > 709.0, limit, arg, x);
+	broadcast(-708.0, limit);
+	select(x < -708.0, limit, x, x);
+
+	/* Round x/ln2 to the nearest integer with the 1.5*2^52 trick. */
+	const double round = 6755399441055744.0;
+	V n = (x * 1.4426950408889634073599 + round) - round;
+
+	/* Cody-Waite reduction: r = x - n*ln2 with ln2 split in two parts. */
+	V r = x - n * 6.93145751953125E-1;
+	r = r - n * 1.42860682030941723212E-6;
+
+	/* Pade approximation of exp(r) on [-ln2/2, ln2/2]. */
+	V rr = r * r;
+	V p = r * ((1.26177193074810590878E-4 * rr + 3.02994407707441961300E-2) * rr
+			+ 9.99999999999999999910E-1);
+	V q = ((3.00198505138664455042E-6 * rr + 2.52448340349684104192E-3) * rr
+			+ 2.27265548208155028766E-1) * rr + 2.00000000000000000009E0;
+	V e = 1.0 + 2.0 * p / (q - p);
+
+	/* Build 2^n directly in the exponent bits. The low mantissa bits of (n + 1023 + 1.5*2^52)
+	 * hold the biased exponent, shifting by 52 moves it into place. */
+	I scale = (I) (n + (1023.0 + round)) << 52;
+	result = e * (V) scale;
+}
+
+/** Lane-wise complementary error function for when exp(-z*z) is already at hand.
+ * Uses the Chebyshev fit from Numerical Recipes (erfcc), fractional error below 1.2e-7
+ * everywhere. This is well below the statistical precision of the S-curve data.
+ * @param z Argument.
+ * @param gauss Must be exp(-z*z). */
+template <class V> PIXFIT_SIMD_INLINE void erfc(const V &z, const V &gauss, V &result) {
+	V absZ;
+	abs(z, absZ);
+	V t = 1.0 / (1.0 + 0.5 * absZ);
+	V poly = -1.26551223 + t * (1.00002368 + t * (0.37409196 + t * (0.09678418
+			+ t * (-0.18628806 + t * (0.27886807 + t * (-1.13520398 + t * (1.48851587
+			+ t * (-0.82215223 + t * 0.17087277))))))));
+	V expPoly;
+	exp(poly, expPoly);
+	V ans = t * gauss * expPoly;
+	select(z >= 0.0, ans, 2.0 - ans, result);
+}
+
+template <class V> PIXFIT_SIMD_INLINE void erfc(const V &z, V &result) {
+	V gauss;
+	exp(-z * z, gauss);
+	erfc(z, gauss, result);
+}
+
+} /* end of namespace PixFitSimd */
+} /* end of namespace PixLib */
+
+#endif /* PIXFITSIMD_H_ */
@@ -0,0 +1,195 @@
+/* @file PixFitStreamingFit.cxx
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "PixFitStreamingFit.h"
+#include "PixFitAbstractFitter.h"
+#include "PixFitThreadPool.h"
+#include "PixFitUnpack.h"
+
+using namespace PixLib;
+
+PixFitStreamingFit::PixFitStreamingFit(int pixels, int injections, PixFitScanConfig::readoutMode mode,
+		PixFitThreadPool *pool) :
+		m_pixels(pixels),
+		m_injections(injections),
+		m_mode(mode),
+		m_pool(pool),
+		m_lastBin(-1),
+		m_moment1(new double[pixels]),
+		m_moment2(new double[pixels]),
+		m_last(new float[pixels]),
+		m_start(new int16_t[pixels]),
+		m_end(new int16_t[pixels]),
+		m_plateauRun(new uint8_t[pixels]),
+		m_state(new State[pixels]),
+		m_final(0),
+		m_processing(false),
+		m_scheduled(false) {
+	std::fill(m_moment1.get(), m_moment1.get() + pixels, 0.);
+	std::fill(m_moment2.get(), m_moment2.get() + pixels, 0.);
+	std::fill(m_last.get(), m_last.get() + pixels, 0.f);
+	std::fill(m_start.get(), m_start.get() + pixels, -1);
+	std::fill(m_end.get(), m_end.get() + pixels, -1);
+	std::fill(m_plateauRun.get(), m_plateauRun.get() + pixels, 0);
+	std::fill(m_state.get(), m_state.get() + pixels, RISING);
+}
+
+PixFitStreamingFit::~PixFitStreamingFit() {
+}
+
+std::shared_ptr<PixFitStreamingFit> PixFitStreamingFit::create(const PixFitScanConfig &scanConfig,
+		PixFitThreadPool *pool) {
+	const PixFitScanConfig::readoutMode mode = scanConfig.getReadoutMode();
+	if (scanConfig.findScanType() != PixFitScanConfig::scanType::THRESHOLD
+			|| scanConfig.intermediate != PixFitScanConfig::intermediateType::INTERMEDIATE_NONE
+			|| (mode != PixFitScanConfig::readoutMode::ONLINE_OCCUPANCY
+					&& mode != PixFitScanConfig::readoutMode::OFFLINE_OCCUPANCY)) {
+		return std::shared_ptr<PixFitStreamingFit>();
+	}
+	return std::make_shared<PixFitStreamingFit>(scanConfig.getNumOfPixels(), scanConfig.getInjections(), mode, pool);
+}
+
+void PixFitStreamingFit::addBin(int bin, std::shared_ptr<RawHisto> histo) {
+	Bin item;
+	item.bin = bin;
+	item.histo = histo;
+	add(std::move(item));
+}
+
+void PixFitStreamingFit::addPackedBin(int bin, std::shared_ptr<const char> data) {
+	Bin item;
+	item.bin = bin;
+	item.data = data;
+	add(std::move(item));
+}
+
+void PixFitStreamingFit::add(Bin &&bin) {
+	{
+		boost::lock_guard<boost::mutex> lock(m_mutex);
+		m_bins.push_back(std::move(bin));
+		/* A running drain() takes the bin as well. */
+		if (m_processing || m_scheduled) return;
+		m_scheduled = m_pool != nullptr;
+	}
+
+	if (m_pool) {
+		/* The task keeps us alive, even if the histogram is dropped meanwhile. */
+		std::shared_ptr<PixFitStreamingFit> self = shared_from_this();
+		m_pool->post([self]() {
+			{
+				boost::lock_guard<boost::mutex> lock(self->m_mutex);
+				self->m_scheduled = false;
+			}
+			self->drain();
+		});
+	}
+	else {
+		drain();
+	}
+}
+
+void PixFitStreamingFit::drain() {
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	if (m_processing) return;
+	m_processing = true;
+	while (!m_bins.empty()) {
+		{
+			Bin bin = std::move(m_bins.front());
+			m_bins.pop_front();
+			lock.unlock();
+			process(bin);
+			/* The bin may hold the last reference to the histogram, release it unlocked. */
+		}
+		lock.lock();
+	}
+	m_processing = false;
+	m_idle.notify_all();
+}
+
+void PixFitStreamingFit::complete() {
+	/* Do the work right away instead of waiting for the pool to get to the task. */
+	drain();
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	while (m_processing) m_idle.wait(lock);
+}
+
+void PixFitStreamingFit::process(const Bin &bin) {
+	const Word *data;
+	int stride;
+	if (bin.data) {
+		if (!m_scratch) m_scratch.reset(new Word[m_pixels]);
+		PixFitUnpack::unpack(m_mode, 1, bin.data.get(), m_pixels, m_scratch.get(), 1);
+		data = m_scratch.get();
+		stride = 1;
+	}
+	else {
+		data = (*bin.histo)(0, bin.bin);
+		stride = bin.histo->getPixelStride();
+	}
+
+	/* The increase from the previous bin is located half-way between the two. */
+	const double x = 0.5 * (m_lastBin + bin.bin);
+	const float plateau = s_plateauFraction * m_injections;
+
+	for (int p = 0; p < m_pixels; p++) {
+		if (m_state[p] != RISING) continue;
+
+		const float y = data[static_cast<size_t>(p) * stride];
+		const double d = y - m_last[p];
+		m_last[p] = y;
+		if (d != 0.) {
+			m_moment1[p] += d * x;
+			m_moment2[p] += d * x * x;
+
+			if (m_start[p] < 0 && y != 0.f) {
+				/* Occupancy in the first bin means the threshold is below the scan range. */
+				if (m_lastBin < 0) {
+					m_state[p] = INVALID;
+					continue;
+				}
+				m_start[p] = m_lastBin;
+			}
+		}
+
+		if (y < plateau) {
+			m_end[p] = -1;
+			m_plateauRun[p] = 0;
+			continue;
+		}
+		if (m_end[p] < 0) m_end[p] = bin.bin;
+		if (++m_plateauRun[p] >= s_plateauBins) finalise(p);
+	}
+
+	m_lastBin = bin.bin;
+}
+
+void PixFitStreamingFit::finalise(int pixel) {
+	/* Moments of the derivative, the sum of the increases is the plateau. Sheppard's correction
+	 * removes the width of a bin from the variance. */
+	const double n = m_last[pixel];
+	const double mu = m_moment1[pixel] / n;
+	const double variance = m_moment2[pixel] / n - mu * mu - 1. / 12.;
+	if (!(variance > 0.) || m_start[pixel] < 0) {
+		m_state[pixel] = INVALID;
+		return;
+	}
+	m_moment1[pixel] = mu;
+	m_moment2[pixel] = std::sqrt(variance);
+	m_state[pixel] = FINAL;
+	m_final++;
+}
+
+bool PixFitStreamingFit::getResult(RawHisto &histo, int pixel, double &mu, double &sigma, double &residuals) const {
+	if (m_state[pixel] != FINAL) return false;
+	mu = m_moment1[pixel];
+	sigma = m_moment2[pixel];
+	return PixFitAbstractFitter::matchesData(histo, pixel, m_start[pixel], m_end[pixel], m_injections,
+			mu, sigma, residuals);
+}
+
+int PixFitStreamingFit::getNumOfFinal() const {
+	return m_final;
+}
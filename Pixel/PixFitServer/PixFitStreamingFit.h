@@ -0,0 +1,145 @@
+/* @file PixFitStreamingFit.h
+ */
+
+#ifndef PIXFITSTREAMINGFIT_H_
+#define PIXFITSTREAMINGFIT_H_
+
+#include <stdint.h> // change to cstdint for C++11
+#include <deque>
+#include <memory>
+
+#include <boost/thread.hpp>
+
+#include "PixFitScanConfig.h"
+#include "RawHisto.h"
+
+namespace PixLib {
+
+class PixFitThreadPool;
+
+/** Estimates the S-curves of a threshold scan while its bins are still being received.
+ * PixFitNet hands over every bin as soon as it has arrived. For each pixel the derivative of the
+ * occupancy is accumulated (its sum and first and second moments over the Vcal steps), so the mean
+ * and width of the derivative give mu and sigma of the S-curve without keeping earlier bins.
+ * A pixel is final once its occupancy has stayed on the plateau for s_plateauBins bins; the
+ * fitters take its estimate after checking it against the data and only fit the other pixels
+ * when the last bin has arrived.
+ *
+ * The bins are processed in order by one task at a time, in the fitting pool if there is one and
+ * in the calling thread otherwise. complete() has to be called before the histogram is modified
+ * (transpose()) or the estimates are used. */
+class PixFitStreamingFit : public std::enable_shared_from_this<PixFitStreamingFit> {
+public:
+	typedef RawHisto::histoWord_type Word;
+
+	/** @param pixels Number of pixels.
+	 * @param injections Number of injections per bin, the height of the plateau.
+	 * @param mode Readout mode of the histogrammer.
+	 * @param pool Pool the bins are processed in, nullptr to process them in addBin(). */
+	PixFitStreamingFit(int pixels, int injections, PixFitScanConfig::readoutMode mode, PixFitThreadPool *pool);
+
+	virtual ~PixFitStreamingFit();
+
+	/** Creates the streaming fit for a histogram if it supports it: threshold scans in an occupancy
+	 * readout mode, no intermediate histograms.
+	 * @returns The new object or nullptr. */
+	static std::shared_ptr<PixFitStreamingFit> create(const PixFitScanConfig &scanConfig, PixFitThreadPool *pool);
+
+	/** Adds a bin that has been filled into the histogram. The histogram is kept alive until the bin
+	 * has been processed. Bins have to be added in increasing order. */
+	void addBin(int bin, std::shared_ptr<RawHisto> histo);
+
+	/** Adds a bin in its received format, see RawHisto::addPackedBin(). */
+	void addPackedBin(int bin, std::shared_ptr<const char> data);
+
+	/** Processes all bins that are left in the calling thread, or waits for the thread that does so. */
+	void complete();
+
+	/** Gets the estimate of a final pixel and checks it against the data points between the last
+	 * empty bin and the start of the plateau, see PixFitAbstractFitter::matchesData(). Call
+	 * complete() first.
+	 * @param histo The histogram with all bins.
+	 * @param mu, sigma The S-curve.
+	 * @param residuals Sum of squared residuals of the data points, as minimised by the fitters.
+	 * @returns False if the pixel is not final or its estimate does not describe the data. */
+	bool getResult(RawHisto &histo, int pixel, double &mu, double &sigma, double &residuals) const;
+
+	/** @returns Number of final pixels, call complete() first. */
+	int getNumOfFinal() const;
+
+private:
+	/** A bin waiting to be processed: either in the histogram or in its received format. */
+	struct Bin {
+		int bin;
+		std::shared_ptr<RawHisto> histo;
+		std::shared_ptr<const char> data;
+	};
+
+	/** States of a pixel. */
+	enum State : uint8_t {RISING, FINAL, INVALID};
+
+	/** Queues a bin and starts processing if nobody is doing so. */
+	void add(Bin &&bin);
+
+	/** Processes queued bins until the queue is empty. Returns right away if another thread is
+	 * doing so already. */
+	void drain();
+
+	/** Updates all pixels that are not final yet with one bin. */
+	void process(const Bin &bin);
+
+	/** Turns the moments of a pixel into mu and sigma. */
+	void finalise(int pixel);
+
+	const int m_pixels;
+	const double m_injections;
+	const PixFitScanConfig::readoutMode m_mode;
+	PixFitThreadPool *m_pool;
+
+	/** Last processed bin, -1 before the first one. */
+	int m_lastBin;
+
+	/** Sums of d*x and d*x^2 with the increase d of the occupancy from one bin to the next and x
+	 * half-way between the two. Once a pixel is final they hold mu and sigma. */
+	std::unique_ptr<double[]> m_moment1;
+	std::unique_ptr<double[]> m_moment2;
+
+	/** Occupancy in the last bin. */
+	std::unique_ptr<float[]> m_last;
+
+	/** Last bin with zero occupancy before the rise and first bin of the plateau, -1 if not yet seen. */
+	std::unique_ptr<int16_t[]> m_start;
+	std::unique_ptr<int16_t[]> m_end;
+
+	/** Number of consecutive bins on the plateau. */
+	std::unique_ptr<uint8_t[]> m_plateauRun;
+
+	std::unique_ptr<State[]> m_state;
+
+	/** Unpacked data of a bin in its received format. */
+	std::unique_ptr<Word[]> m_scratch;
+
+	int m_final;
+
+	/** Bins that have not been processed yet. */
+	std::deque<Bin> m_bins;
+
+	/** True while a thread processes bins in drain(). */
+	bool m_processing;
+
+	/** True while a task for drain() is queued in the pool. */
+	bool m_scheduled;
+
+	mutable boost::mutex m_mutex;
+	boost::condition_variable m_idle;
+
+	/** Share of the injections from which on a bin counts as plateau, as in the fitters. */
+	constexpr static const double s_plateauFraction = 0.999;
+
+	/** Number of plateau bins after which a pixel is final. */
+	static const int s_plateauBins = 3;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITSTREAMINGFIT_H_ */
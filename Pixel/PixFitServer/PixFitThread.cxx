@@ -8,6 +8,9 @@
 
 #include <string>
 
+#include <pthread.h>
+#include <sched.h>
+
 #include <ers/ers.h>
 
 #include "PixFitThread.h"
@@ -18,6 +21,7 @@ PixFitThread::PixFitThread() {
 	m_status = 0;
 	m_threadName = "NONE";
 	m_instanceConfig = nullptr;
+	m_cpu = -1;
 }
 
 PixFitThread::~PixFitThread() {
@@ -47,8 +51,26 @@ int PixFitThread::getStatus() {
 	return m_status;
 }
 
+void PixFitThread::setCpuAffinity(int cpu) {
+	m_cpu = cpu;
+}
+
+void PixFitThread::setThreadIndex(int index) {
+	m_threadName += "-" + std::to_string(index);
+}
+
 void PixFitThread::setupThread() {
 	m_threadId = boost::this_thread::get_id();
-	ERS_DEBUG(1, "Started " << m_threadName << " thread with ID " << m_threadId)
+
+	if (m_cpu >= 0) {
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		CPU_SET(m_cpu, &cpuSet);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) != 0) {
+			ERS_INFO("Could not pin " << m_threadName << " thread to CPU " << m_cpu)
+		}
+	}
+
+	ERS_DEBUG(1, "Started " << m_threadName << " thread with ID " << m_threadId << " on CPU " << m_cpu)
 	loop();
 }
@@ -44,6 +44,13 @@ public:
 	/** @returns Status code of the thread. */
 	virtual int getStatus();
 
+	/** Pins the thread to a CPU. Has to be called before start().
+	 * @param cpu Index of the CPU, -1 for no pinning (default). */
+	void setCpuAffinity(int cpu);
+
+	/** Appends an index to the thread name, used when several threads of a type are running. */
+	void setThreadIndex(int index);
+
 protected:
 	/** Name of the thread (type) used during printouts for easier identification. */
 	std::string m_threadName;
@@ -67,6 +74,9 @@ private:
 	/** Identifier for the associated thread. */
 	boost::thread::id m_threadId;
 
+	/** CPU the thread is pinned to, -1 if not pinned. */
+	int m_cpu;
+
 	/** The associated thread. */
 	boost::thread m_thread;
 };
@@ -0,0 +1,150 @@
+/* @file PixFitThreadPool.cxx
+ */
+
+#include <exception>
+
+#include <ers/ers.h>
+
+#include "PixFitThreadPool.h"
+
+using namespace PixLib;
+
+namespace {
+/* Identifies the pool (and deque) of the current thread, nullptr for threads outside of any pool. */
+thread_local const PixFitThreadPool *t_pool = nullptr;
+thread_local unsigned int t_index = 0;
+}
+
+PixFitLatch::PixFitLatch(int count) : m_count(count) {
+}
+
+void PixFitLatch::countDown() {
+	/* Decrement under the lock, a waiter may destroy the latch as soon as it can take the lock. */
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	if (--m_count <= 0) {
+		m_cond.notify_all();
+	}
+}
+
+bool PixFitLatch::isReady() const {
+	return m_count.load() <= 0;
+}
+
+void PixFitLatch::wait() {
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	while (!isReady()) {
+		m_cond.wait(lock);
+	}
+}
+
+PixFitThreadPool::PixFitThreadPool(unsigned int threads) : m_pending(0), m_next(0), m_stop(false) {
+	if (threads == 0) threads = 1;
+
+	for (unsigned int i = 0; i < threads; i++) {
+		m_queues.push_back(std::unique_ptr<Queue>(new Queue));
+	}
+	for (unsigned int i = 0; i < threads; i++) {
+		m_threads.create_thread(std::bind(&PixFitThreadPool::loop, this, i));
+	}
+	ERS_LOG("Started fitting thread pool with " << threads << " threads.")
+}
+
+PixFitThreadPool::~PixFitThreadPool() {
+	{
+		boost::lock_guard<boost::mutex> lock(m_idleMutex);
+		m_stop = true;
+	}
+	m_idleCond.notify_all();
+	m_threads.join_all();
+}
+
+void PixFitThreadPool::post(Task task, PixFitLatch *latch) {
+	/* Pool threads keep their own work, others distribute it. */
+	const unsigned int index = (t_pool == this) ? t_index : m_next++ % m_queues.size();
+
+	{
+		boost::lock_guard<boost::mutex> lock(m_queues[index]->mutex);
+		m_queues[index]->items.push_back(Item(std::move(task), latch));
+	}
+	++m_pending;
+
+	/* Taking the lock makes sure that a thread that is about to sleep sees the new task. */
+	{
+		boost::lock_guard<boost::mutex> lock(m_idleMutex);
+	}
+	m_idleCond.notify_one();
+}
+
+void PixFitThreadPool::wait(PixFitLatch &latch) {
+	const unsigned int index = (t_pool == this) ? t_index : m_queues.size();
+
+	/* Help out until the remaining tasks of the latch are all running on other threads. */
+	while (!latch.isReady() && runOne(index)) {
+	}
+	latch.wait();
+}
+
+unsigned int PixFitThreadPool::getNumOfThreads() const {
+	return m_queues.size();
+}
+
+void PixFitThreadPool::loop(unsigned int index) {
+	t_pool = this;
+	t_index = index;
+	ERS_DEBUG(1, "Started fitting pool thread " << index << " with ID " << boost::this_thread::get_id())
+
+	while (1) {
+		if (runOne(index)) continue;
+
+		boost::unique_lock<boost::mutex> lock(m_idleMutex);
+		while (m_pending.load() == 0 && !m_stop) {
+			m_idleCond.wait(lock);
+		}
+		if (m_stop) return;
+	}
+}
+
+bool PixFitThreadPool::runOne(unsigned int index) {
+	const unsigned int n = m_queues.size();
+	Item item;
+	bool found = false;
+
+	/* Newest task from the own deque first. */
+	if (index < n) {
+		Queue &own = *m_queues[index];
+		boost::lock_guard<boost::mutex> lock(own.mutex);
+		if (!own.items.empty()) {
+			item = std::move(own.items.back());
+			own.items.pop_back();
+			found = true;
+		}
+	}
+
+	/* Steal the oldest task of another thread. */
+	for (unsigned int k = 1; !found && k <= n; k++) {
+		Queue &victim = *m_queues[(index + k) % n];
+		boost::lock_guard<boost::mutex> lock(victim.mutex);
+		if (!victim.items.empty()) {
+			item = std::move(victim.items.front());
+			victim.items.pop_front();
+			found = true;
+			if (s_doverbose) ERS_LOG("Thread " << index << " stole a task from thread " << (index + k) % n)
+		}
+	}
+
+	if (!found) return false;
+
+	--m_pending;
+	execute(item);
+	return true;
+}
+
+void PixFitThreadPool::execute(Item &item) {
+	try {
+		item.first();
+	}
+	catch (std::exception &e) {
+		ERS_LOG("Fitting task failed: " << e.what())
+	}
+	if (item.second) item.second->countDown();
+}
@@ -0,0 +1,110 @@
+/* @file PixFitThreadPool.h
+ */
+
+#ifndef PIXFITTHREADPOOL_H_
+#define PIXFITTHREADPOOL_H_
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+namespace PixLib {
+
+/** Counts down the outstanding tasks of a job (e.g. all pixel chunks of one histogram) and lets
+ * a thread wait until all of them are done. */
+class PixFitLatch {
+public:
+	/** @param count Number of countDown() calls needed to release the latch. */
+	explicit PixFitLatch(int count);
+
+	/** Marks one task as done. Wakes up waiting threads when the count reaches zero. */
+	void countDown();
+
+	/** @returns True if all tasks are done. */
+	bool isReady() const;
+
+	/** Blocks until all tasks are done. Use PixFitThreadPool::wait() to help out meanwhile.
+	 * The latch may be destroyed as soon as wait() returns. */
+	void wait();
+
+private:
+	std::atomic<int> m_count;
+	boost::mutex m_mutex;
+	boost::condition_variable_any m_cond;
+};
+
+/** Long-lived pool of fitting threads shared by all fitters of a PixFitServer process.
+ * Every pool thread owns a task deque. A thread takes its newest task first and steals the oldest
+ * task of another thread when its own deque is empty, so chunks of one histogram spread over all
+ * cores while a thread that just posted work keeps the data of that work in its cache.
+ * Threads outside of the pool (e.g. PixFitWorker) post in a round-robin fashion and can help
+ * executing tasks while waiting for their latch, so a fitter can prepare the next histogram while
+ * the pool is still busy with the previous one. */
+class PixFitThreadPool {
+public:
+	typedef std::function<void()> Task;
+
+	/** @param threads Number of threads to spawn, at least one is created. */
+	explicit PixFitThreadPool(unsigned int threads);
+
+	/** Stops and joins all threads. Tasks that are still queued are dropped. */
+	~PixFitThreadPool();
+
+	/** Queues a task for execution.
+	 * @param task The task.
+	 * @param latch Latch that is counted down after the task has run (also if it threw), may be nullptr. */
+	void post(Task task, PixFitLatch *latch = nullptr);
+
+	/** Waits for a latch and executes queued tasks in the calling thread until it is released. */
+	void wait(PixFitLatch &latch);
+
+	/** @returns Number of threads in the pool. */
+	unsigned int getNumOfThreads() const;
+
+private:
+	typedef std::pair<Task, PixFitLatch*> Item;
+
+	/** Task deque of a single pool thread. */
+	struct Queue {
+		boost::mutex mutex;
+		std::deque<Item> items;
+	};
+
+	/** Main loop of the pool threads. */
+	void loop(unsigned int index);
+
+	/** Takes a task from the own deque or steals from others and runs it.
+	 * @param index Index of the own deque, number of threads for non-pool threads.
+	 * @returns False if no task was found. */
+	bool runOne(unsigned int index);
+
+	/** Executes a task and counts down its latch. */
+	void execute(Item &item);
+
+	/** One deque per pool thread. */
+	std::vector<std::unique_ptr<Queue> > m_queues;
+
+	boost::thread_group m_threads;
+
+	/** Number of queued tasks, used to put idle threads to sleep. */
+	std::atomic<int> m_pending;
+
+	/** Round-robin counter for posts from outside of the pool. */
+	std::atomic<unsigned int> m_next;
+
+	bool m_stop;
+	boost::mutex m_idleMutex;
+	boost::condition_variable_any m_idleCond;
+
+	/** Controls the verbosity of the pool. */
+	static const bool s_doverbose = false;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITTHREADPOOL_H_ */
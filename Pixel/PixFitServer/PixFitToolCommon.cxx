@@ -0,0 +1,61 @@
+/* @file PixFitToolCommon.cxx
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "rodHisto.hxx"
+
+#include "PixFitToolCommon.h"
+
+using namespace PixLib;
+
+namespace {
+
+/** @returns value cut to a field of the histogrammer words, shifted into place. */
+uint32_t field(uint32_t value, int shift, int bits) {
+	return (value & ((1u << bits) - 1)) << shift;
+}
+
+} /* end of anonymous namespace */
+
+double PixFitToolCommon::now() {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int PixFitToolCommon::bytesPerPixel(PixFitScanConfig::readoutMode mode) {
+	switch (mode) {
+	case PixFitScanConfig::readoutMode::OFFLINE_OCCUPANCY:
+		return 1;
+	case PixFitScanConfig::readoutMode::LONG_TOT:
+		return 8;
+	default:
+		return 4;
+	}
+}
+
+void PixFitToolCommon::encode(PixFitScanConfig::readoutMode mode, int triggers, uint32_t occupancy, uint32_t tot,
+		uint32_t tot2, char *payload, int pixel) {
+	uint32_t words[2] = {0, 0};
+	switch (mode) {
+	case PixFitScanConfig::readoutMode::OFFLINE_OCCUPANCY:
+		payload[pixel] = static_cast<char>(std::min<uint32_t>(occupancy, 255));
+		return;
+	case PixFitScanConfig::readoutMode::ONLINE_OCCUPANCY:
+		words[0] = occupancy;
+		break;
+	case PixFitScanConfig::readoutMode::SHORT_TOT:
+		words[0] = field(triggers - occupancy, ONEWORD_MISSING_TRIGGERS_RESULT_SHIFT, MISSING_TRIGGERS_RESULT_BITS)
+				| field(tot, ONEWORD_TOT_RESULT_SHIFT, TOT_RESULT_BITS)
+				| field(tot2, ONEWORD_TOTSQR_RESULT_SHIFT, TOTSQR_RESULT_BITS);
+		break;
+	case PixFitScanConfig::readoutMode::LONG_TOT:
+		words[0] = field(occupancy, TWOWORD_OCC_RESULT_SHIFT, OCC_RESULT_BITS);
+		words[1] = field(tot, TWOWORD_TOT_RESULT_SHIFT, TOT_RESULT_BITS)
+				| field(tot2, TWOWORD_TOTSQR_RESULT_SHIFT, TOTSQR_RESULT_BITS);
+		memcpy(payload + 8 * pixel, words, sizeof(words));
+		return;
+	}
+	memcpy(payload + 4 * pixel, words, sizeof(words[0]));
+}
@@ -0,0 +1,34 @@
+/* @file PixFitToolCommon.h
+ */
+
+#ifndef PIXFITTOOLCOMMON_H_
+#define PIXFITTOOLCOMMON_H_
+
+#include <stdint.h> // change to cstdint for C++11
+
+#include "PixFitScanConfig.h"
+
+namespace PixLib {
+
+/** Helpers shared by the tools that generate histogrammer data (PixFitReplay, PixFitBench and
+ * PixFitUnpackTest). */
+namespace PixFitToolCommon {
+
+/** @returns Monotonic time in seconds. */
+double now();
+
+/** @returns Bytes per pixel the ROD sends in a readout mode. */
+int bytesPerPixel(PixFitScanConfig::readoutMode mode);
+
+/** Writes a pixel in the format of a readout mode, see rodHisto.hxx. Values are cut to the width
+ * of their fields, the offline occupancy saturates at 255.
+ * @param triggers Number of triggers, SHORT_TOT sends the missing ones instead of the occupancy.
+ * @param tot, tot2 Sum of ToT and ToT², only sent in the ToT modes.
+ * @param payload Data of the bin, pixel is the index of the pixel in it. */
+void encode(PixFitScanConfig::readoutMode mode, int triggers, uint32_t occupancy, uint32_t tot, uint32_t tot2,
+		char *payload, int pixel);
+
+} /* end of namespace PixFitToolCommon */
+} /* end of namespace PixLib */
+
+#endif /* PIXFITTOOLCOMMON_H_ */
@@ -0,0 +1,324 @@
+/* @file PixFitTracer.cxx
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+
+#include <unistd.h>
+
+#include <ers/ers.h>
+
+#include "PixFitTracer.h"
+
+using namespace PixLib;
+
+namespace {
+
+typedef PixFitWorkPackage::Stage Stage;
+
+/** Stages a step starts and ends with, indexed by PixFitTracer::Step. */
+const Stage s_stepBegin[PixFitTracer::numOfSteps] = {
+	Stage::RECEIVED, Stage::ENQUEUED, Stage::DEQUEUED, Stage::FITTED, Stage::ASSEMBLED, Stage::RECEIVED
+};
+const Stage s_stepEnd[PixFitTracer::numOfSteps] = {
+	Stage::ENQUEUED, Stage::DEQUEUED, Stage::FITTED, Stage::ASSEMBLED, Stage::PUBLISHED, Stage::PUBLISHED
+};
+
+/** @returns Nanoseconds as milliseconds. */
+double toMs(double ns) {
+	return ns * 1e-6;
+}
+
+} /* end of anonymous namespace */
+
+/* Powers of two up to 2^63, the first one covers all values below s_subBuckets. */
+const int LatencyHistogram::s_buckets = (64 - s_subBucketBits + 1) * (s_subBuckets / 2) + s_subBuckets / 2;
+
+LatencyHistogram::LatencyHistogram() : m_counts(new std::atomic<uint64_t>[s_buckets]) {
+	reset();
+}
+
+void LatencyHistogram::reset() {
+	for (int i = 0; i < s_buckets; i++) m_counts[i] = 0;
+	m_count = 0;
+	m_sum = 0;
+	m_max = 0;
+}
+
+int LatencyHistogram::getBucket(uint64_t value) {
+	if (value < static_cast<uint64_t>(s_subBuckets)) return value;
+	const int msb = 63 - __builtin_clzll(value);
+	const int shift = msb - (s_subBucketBits - 1);
+	return shift * (s_subBuckets / 2) + static_cast<int>(value >> shift);
+}
+
+uint64_t LatencyHistogram::getBucketValue(int bucket) {
+	if (bucket < s_subBuckets) return bucket;
+	const int shift = bucket / (s_subBuckets / 2) - 1;
+	const uint64_t lower = static_cast<uint64_t>(bucket - shift * (s_subBuckets / 2)) << shift;
+	return lower + ((1ull << shift) >> 1);
+}
+
+void LatencyHistogram::record(uint64_t value) {
+	m_counts[getBucket(value)].fetch_add(1, std::memory_order_relaxed);
+	m_count.fetch_add(1, std::memory_order_relaxed);
+	m_sum.fetch_add(value, std::memory_order_relaxed);
+	uint64_t max = m_max.load(std::memory_order_relaxed);
+	while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::getSnapshot() const {
+	Snapshot snapshot;
+	snapshot.counts.resize(s_buckets);
+	snapshot.count = 0;
+	for (int i = 0; i < s_buckets; i++) {
+		snapshot.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+		snapshot.count += snapshot.counts[i];
+	}
+	snapshot.sum = m_sum.load(std::memory_order_relaxed);
+	snapshot.max = m_max.load(std::memory_order_relaxed);
+	return snapshot;
+}
+
+uint64_t LatencyHistogram::Snapshot::getPercentile(double p) const {
+	if (count == 0) return 0;
+	const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p / 100 * count)));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < counts.size(); i++) {
+		seen += counts[i];
+		if (seen >= rank) return std::min(getBucketValue(i), max);
+	}
+	return max;
+}
+
+double LatencyHistogram::Snapshot::getMean() const {
+	return count > 0 ? static_cast<double>(sum) / count : 0;
+}
+
+LatencyHistogram::Snapshot& LatencyHistogram::Snapshot::operator-=(const Snapshot &earlier) {
+	if (earlier.counts.size() != counts.size()) return *this;
+	count = 0;
+	for (size_t i = 0; i < counts.size(); i++) {
+		counts[i] -= std::min(counts[i], earlier.counts[i]);
+		count += counts[i];
+	}
+	sum -= std::min(sum, earlier.sum);
+	return *this;
+}
+
+PixFitTracer::PixFitTracer() {
+	m_tracing = false;
+	m_traceDropped = 0;
+	m_nextTraceId = 0;
+	m_traceWritten = 0;
+	m_traceUnitsWritten = 0;
+	m_start = PixFitWorkPackage::now();
+}
+
+PixFitTracer::~PixFitTracer() {
+	if (m_tracing) flushTrace();
+}
+
+const char* PixFitTracer::getStepName(Step step) {
+	static const char *names[numOfSteps] = {"network", "fitQueue", "fit", "assembly", "publish", "total"};
+	return names[step];
+}
+
+PixFitTracer::UnitEntry& PixFitTracer::getUnit(const HistoUnit &unit) {
+	{
+		boost::shared_lock<boost::shared_mutex> lock(m_unitsMutex);
+		auto it = m_units.find(unit);
+		if (it != m_units.end()) return *it->second;
+	}
+
+	boost::unique_lock<boost::shared_mutex> lock(m_unitsMutex);
+	auto it = m_units.find(unit);
+	if (it != m_units.end()) return *it->second;
+	m_unitEntries.push_back(std::unique_ptr<UnitEntry>(new UnitEntry));
+	UnitEntry *entry = m_unitEntries.back().get();
+	entry->traceId = m_unitEntries.size();
+	m_units.insert(std::make_pair(unit, entry));
+	return *entry;
+}
+
+void PixFitTracer::recordFitted(const PixFitWorkPackage &package, const HistoUnit &unit) {
+	record(package, unit, STEP_NETWORK, STEP_FIT);
+}
+
+void PixFitTracer::recordPublished(const PixFitWorkPackage &package, const HistoUnit &unit) {
+	record(package, unit, STEP_ASSEMBLY, STEP_TOTAL);
+}
+
+void PixFitTracer::record(const PixFitWorkPackage &package, const HistoUnit &unit, Step first, Step last) {
+	UnitEntry &entry = getUnit(unit);
+	const bool tracing = m_tracing;
+	TraceEvent events[numOfSteps];
+	int numOfEvents = 0;
+
+	for (int step = first; step <= last; step++) {
+		const uint64_t begin = package.getTimestamp(s_stepBegin[step]);
+		const uint64_t end = package.getTimestamp(s_stepEnd[step]);
+		if (begin == 0 || end < begin) continue;
+
+		m_total.steps[step].record(end - begin);
+		entry.histograms.steps[step].record(end - begin);
+
+		/* The total spans the other steps, it would only clutter the trace. */
+		if (tracing && step != STEP_TOTAL) {
+			TraceEvent &event = events[numOfEvents++];
+			event.step = static_cast<Step>(step);
+			event.traceId = entry.traceId;
+			event.begin = begin;
+			event.end = end;
+		}
+	}
+
+	if (numOfEvents == 0) return;
+	const int scanId = package.getScanId();
+	boost::lock_guard<boost::mutex> lock(m_traceMutex);
+	if (m_traceEvents.size() + numOfEvents > s_maxTraceEvents) {
+		m_traceDropped += numOfEvents;
+		return;
+	}
+	const uint64_t id = m_nextTraceId++;
+	for (int i = 0; i < numOfEvents; i++) {
+		events[i].id = id;
+		events[i].scanId = scanId;
+		m_traceEvents.push_back(events[i]);
+	}
+}
+
+bool PixFitTracer::openTrace(const std::string &fileName) {
+	boost::lock_guard<boost::mutex> lock(m_traceMutex);
+	m_traceFile.open(fileName.c_str(), std::ios::out | std::ios::trunc);
+	if (!m_traceFile) return false;
+
+	/* The closing bracket is optional in the JSON array format, so the file stays valid if the
+	 * server is killed. */
+	m_traceFile << "[" << std::endl;
+	m_tracing = true;
+	ERS_LOG("Writing trace events to " << fileName)
+	return true;
+}
+
+void PixFitTracer::flushTrace() {
+	std::vector<TraceEvent> events;
+	{
+		boost::lock_guard<boost::mutex> lock(m_traceMutex);
+		if (!m_tracing) return;
+		events.swap(m_traceEvents);
+	}
+
+	/* Name the processes of new units after them. */
+	std::vector<std::pair<int, std::string> > newUnits;
+	{
+		boost::shared_lock<boost::shared_mutex> lock(m_unitsMutex);
+		for (auto& unit : m_units) {
+			if (unit.second->traceId > m_traceUnitsWritten) {
+				newUnits.push_back(std::make_pair(unit.second->traceId, unit.first.makeHistoString()));
+			}
+		}
+		m_traceUnitsWritten = m_unitEntries.size();
+	}
+
+	const int pid = getpid();
+	char buffer[512];
+	for (auto& unit : newUnits) {
+		m_traceFile << (m_traceWritten++ > 0 ? ",\n" : "")
+				<< "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << unit.first
+				<< ", \"args\": {\"name\": \"Histogrammer " << unit.second << " (" << pid << ")\"}}";
+	}
+	for (auto& event : events) {
+		const double begin = (static_cast<int64_t>(event.begin) - static_cast<int64_t>(m_start)) * 1e-3;
+		const double end = (static_cast<int64_t>(event.end) - static_cast<int64_t>(m_start)) * 1e-3;
+		snprintf(buffer, sizeof(buffer),
+				"%s{\"name\": \"%s\", \"cat\": \"pixfit\", \"ph\": \"b\", \"id\": %llu, \"pid\": %d, \"tid\": 0, "
+				"\"ts\": %.3f, \"args\": {\"scanId\": %d}},\n"
+				"{\"name\": \"%s\", \"cat\": \"pixfit\", \"ph\": \"e\", \"id\": %llu, \"pid\": %d, \"tid\": 0, \"ts\": %.3f}",
+				m_traceWritten > 0 ? ",\n" : "",
+				getStepName(event.step), static_cast<unsigned long long>(event.id), event.traceId, begin, event.scanId,
+				getStepName(event.step), static_cast<unsigned long long>(event.id), event.traceId, end);
+		m_traceFile << buffer;
+		m_traceWritten += 2;
+	}
+	m_traceFile.flush();
+
+	boost::lock_guard<boost::mutex> lock(m_traceMutex);
+	if (m_traceDropped > 0) {
+		ERS_LOG("Dropped " << m_traceDropped << " trace events, the trace file is not written fast enough.")
+		m_traceDropped = 0;
+	}
+}
+
+std::vector<LatencyHistogram::Snapshot> PixFitTracer::getSnapshots(const StepHistograms &histograms) {
+	std::vector<LatencyHistogram::Snapshot> snapshots;
+	for (int step = 0; step < numOfSteps; step++) {
+		snapshots.push_back(histograms.steps[step].getSnapshot());
+	}
+	return snapshots;
+}
+
+void PixFitTracer::writeSteps(std::ostream &out, const std::vector<LatencyHistogram::Snapshot> &snapshots) {
+	out << "{";
+	for (int step = 0; step < numOfSteps; step++) {
+		const LatencyHistogram::Snapshot &s = snapshots[step];
+		out << (step > 0 ? ", " : "") << "\"" << getStepName(static_cast<Step>(step)) << "\": {"
+				<< "\"count\": " << s.count
+				<< ", \"mean\": " << toMs(s.getMean())
+				<< ", \"p50\": " << toMs(s.getPercentile(50))
+				<< ", \"p90\": " << toMs(s.getPercentile(90))
+				<< ", \"p99\": " << toMs(s.getPercentile(99))
+				<< ", \"max\": " << toMs(s.max) << "}";
+	}
+	out << "}";
+}
+
+void PixFitTracer::writeSummary(std::ostream &out) {
+	writeSteps(out, getSnapshots(m_total));
+}
+
+bool PixFitTracer::writeMetrics(const std::string &fileName) {
+	const std::string tmpName = fileName + ".tmp";
+	std::ofstream out(tmpName.c_str(), std::ios::out | std::ios::trunc);
+	if (!out) return false;
+
+	std::vector<LatencyHistogram::Snapshot> total = getSnapshots(m_total);
+	std::vector<LatencyHistogram::Snapshot> recent = total;
+	if (m_previousTotal.size() == recent.size()) {
+		for (size_t i = 0; i < recent.size(); i++) recent[i] -= m_previousTotal[i];
+	}
+	m_previousTotal = total;
+
+	out << "{\"time\": " << time(nullptr) << ", \"unit\": \"ms\"," << std::endl << " \"sinceStart\": ";
+	writeSteps(out, total);
+	out << "," << std::endl << " \"sincePrevious\": ";
+	writeSteps(out, recent);
+	out << "," << std::endl << " \"units\": {";
+	{
+		boost::shared_lock<boost::shared_mutex> lock(m_unitsMutex);
+		bool first = true;
+		for (auto& unit : m_units) {
+			out << (first ? "" : ",") << std::endl << "  \"" << unit.first.makeHistoString() << "\": ";
+			writeSteps(out, getSnapshots(unit.second->histograms));
+			first = false;
+		}
+	}
+	out << "}}" << std::endl;
+	out.close();
+	if (!out) return false;
+	return rename(tmpName.c_str(), fileName.c_str()) == 0;
+}
+
+uint64_t PixFitTracer::getPercentile(Step step, double p) const {
+	return m_total.steps[step].getSnapshot().getPercentile(p);
+}
+
+void PixFitTracer::reset() {
+	boost::unique_lock<boost::shared_mutex> lock(m_unitsMutex);
+	for (int step = 0; step < numOfSteps; step++) {
+		m_total.steps[step].reset();
+		for (auto& entry : m_unitEntries) entry->histograms.steps[step].reset();
+	}
+	m_previousTotal.clear();
+}
@@ -0,0 +1,192 @@
+/* @file PixFitTracer.h
+ */
+
+#ifndef PIXFITTRACER_H_
+#define PIXFITTRACER_H_
+
+#include <stdint.h> // change to cstdint for C++11
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "PixFitNetConfiguration.h"
+#include "PixFitWorkPackage.h"
+
+namespace PixLib {
+
+/** Histogram of latencies in nanoseconds with buckets of constant relative width (like HdrHistogram):
+ * every power of two is split into s_subBuckets buckets, so percentiles are accurate to about 3%
+ * over the whole range. Recording only increments atomic counters and never blocks. */
+class LatencyHistogram {
+public:
+	/** Copy of the counters at one point in time. */
+	struct Snapshot {
+		std::vector<uint64_t> counts;
+		uint64_t count;
+		uint64_t sum;
+		uint64_t max;
+
+		/** @returns Value below which p percent (0 to 100) of the recorded values are, in ns. */
+		uint64_t getPercentile(double p) const;
+
+		/** @returns Mean value in ns, 0 if empty. */
+		double getMean() const;
+
+		/** Removes the values of an earlier snapshot, leaving those recorded in between. max is
+		 * kept, as it cannot be told apart. */
+		Snapshot& operator-=(const Snapshot &earlier);
+	};
+
+	LatencyHistogram();
+
+	/** Adds a value in nanoseconds. */
+	void record(uint64_t value);
+
+	Snapshot getSnapshot() const;
+
+	/** Clears all counters. */
+	void reset();
+
+	/** Number of buckets. */
+	static const int s_buckets;
+
+	/** @returns Bucket a value goes to. */
+	static int getBucket(uint64_t value);
+
+	/** @returns Value in the middle of a bucket. */
+	static uint64_t getBucketValue(int bucket);
+
+private:
+	/** Bits of a value that tell the bucket within its power of two. */
+	static const int s_subBucketBits = 5;
+	static const int s_subBuckets = 1 << s_subBucketBits;
+
+	std::unique_ptr<std::atomic<uint64_t>[]> m_counts;
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sum;
+	std::atomic<uint64_t> m_max;
+};
+
+/** Collects the latencies of the pipeline stages from the timestamps of the work packages (see
+ * PixFitWorkPackage::Stage), in total and per histogramming unit.
+ * The steps between two timestamps go into separate histograms: network (first data received to
+ * enqueued for fitting), fitQueue, fit (including unpacking), assembly (fitted to assembled, for
+ * the mask step that completed the histogram) and publish (waiting in the publish queue and
+ * publishing). total goes from the first data received to publishing.
+ * Optionally every package is written to a trace file in the Chrome trace event format, which
+ * can be viewed with chrome://tracing; each histogramming unit shows up as a process there. */
+class PixFitTracer {
+public:
+	/** Steps between two stages that are measured. */
+	enum Step {STEP_NETWORK, STEP_FIT_QUEUE, STEP_FIT, STEP_ASSEMBLY, STEP_PUBLISH, STEP_TOTAL};
+
+	/** Number of steps. */
+	static const int numOfSteps = 6;
+
+	PixFitTracer();
+	virtual ~PixFitTracer();
+
+	/** Records the steps up to fitting. Called once per RawHisto with its fit result. */
+	void recordFitted(const PixFitWorkPackage &package, const HistoUnit &unit);
+
+	/** Records the steps from fitting to publishing and the total. Called once per published result. */
+	void recordPublished(const PixFitWorkPackage &package, const HistoUnit &unit);
+
+	/** Starts writing trace events to a file.
+	 * @returns False if the file could not be opened. */
+	bool openTrace(const std::string &fileName);
+
+	/** Writes the trace events collected so far to the trace file. */
+	void flushTrace();
+
+	/** Writes the latency percentiles (in milliseconds) since startup and since the previous call as
+	 * JSON. The file is replaced atomically, so it can be polled at any time.
+	 * @returns False if the file could not be written. */
+	bool writeMetrics(const std::string &fileName);
+
+	/** Writes the latency percentiles of all units since the last reset() as a JSON object. */
+	void writeSummary(std::ostream &out);
+
+	/** Gives the percentile of a step over all units since startup, in nanoseconds. */
+	uint64_t getPercentile(Step step, double p) const;
+
+	/** Starts over with empty histograms. Must not be called while packages are being recorded. */
+	void reset();
+
+	/** @returns Name of a step as used in the output. */
+	static const char* getStepName(Step step);
+
+private:
+	/** Histograms of all steps. */
+	struct StepHistograms {
+		LatencyHistogram steps[numOfSteps];
+	};
+
+	/** Histograms of one histogramming unit. */
+	struct UnitEntry {
+		StepHistograms histograms;
+
+		/** Process ID of the unit in the trace. */
+		int traceId;
+	};
+
+	/** A step of a package in the trace. */
+	struct TraceEvent {
+		Step step;
+		int traceId;
+		uint64_t id;
+		uint64_t begin;
+		uint64_t end;
+		int scanId;
+	};
+
+	/** @returns The entry of a unit, created on first use. */
+	UnitEntry& getUnit(const HistoUnit &unit);
+
+	/** Records the steps from first to last (inclusive) that have both timestamps. */
+	void record(const PixFitWorkPackage &package, const HistoUnit &unit, Step first, Step last);
+
+	/** Writes percentiles of a set of snapshots as a JSON object. */
+	static void writeSteps(std::ostream &out, const std::vector<LatencyHistogram::Snapshot> &snapshots);
+
+	/** @returns Snapshots of all steps. */
+	static std::vector<LatencyHistogram::Snapshot> getSnapshots(const StepHistograms &histograms);
+
+	StepHistograms m_total;
+
+	/** Units in the order they have been seen first, the map only contains pointers into this. */
+	std::vector<std::unique_ptr<UnitEntry> > m_unitEntries;
+	std::map<HistoUnit, UnitEntry*> m_units;
+
+	/** Protects m_units and m_unitEntries. Recording only needs shared access. */
+	mutable boost::shared_mutex m_unitsMutex;
+
+	/** Snapshots of the previous writeMetrics() call, for the values since then. */
+	std::vector<LatencyHistogram::Snapshot> m_previousTotal;
+
+	/* Trace file and the events that still have to be written to it. */
+	std::atomic<bool> m_tracing;
+	std::ofstream m_traceFile;
+	std::vector<TraceEvent> m_traceEvents;
+	uint64_t m_traceDropped;
+	uint64_t m_nextTraceId;
+	size_t m_traceWritten;
+	int m_traceUnitsWritten;
+	boost::mutex m_traceMutex;
+
+	/** Time all trace timestamps are relative to. */
+	uint64_t m_start;
+
+	/** Maximum number of trace events waiting for flushTrace(), further events are dropped. */
+	static const size_t s_maxTraceEvents = 1 << 20;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITTRACER_H_ */
@@ -0,0 +1,297 @@
+/* @file PixFitUnpack.cxx
+ */
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <stdint.h> // change to cstdint for C++11
+
+#include "rodHisto.hxx"
+
+#include "PixFitUnpack.h"
+#include "PixFitSimd.h"
+
+using namespace PixLib;
+
+namespace {
+
+typedef PixFitUnpack::Word Word;
+typedef PixFitScanConfig::readoutMode Mode;
+
+/** Extracts a bit field from a data word. */
+inline uint32_t field(uint32_t word, int shift, int bits) {
+	return (word >> shift) & static_cast<uint32_t>((1 << bits) - 1);
+}
+
+/* The vector helpers take vectors by reference and return them through the last argument, see
+ * PixFitSimd.h. */
+
+/** field() for all lanes of a vector of data words. */
+template <class U> PIXFIT_SIMD_INLINE void field(const U &word, int shift, int bits, U &result) {
+	result = (word >> shift) & static_cast<uint32_t>((1 << bits) - 1);
+}
+
+/** Unaligned load of a full vector. */
+template <class V> PIXFIT_SIMD_INLINE void load(const void *p, V &v) {
+	std::memcpy(&v, p, sizeof(V));
+}
+
+/** Unaligned store of a full vector. */
+template <class V> PIXFIT_SIMD_INLINE void store(void *p, const V &v) {
+	std::memcpy(p, &v, sizeof(V));
+}
+
+/** Vector types and shuffle patterns for W lanes of 32 bit. */
+template <int W> struct Vec;
+
+template <> struct Vec<4> {
+	typedef uint32_t U __attribute__((vector_size(16)));
+	typedef int32_t S __attribute__((vector_size(16)));
+	typedef signed char B __attribute__((vector_size(16)));
+
+	/** Copies byte i into all bytes of lane i. */
+	static PIXFIT_SIMD_INLINE void byteBase(B &m) {
+		const B base = {0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3};
+		m = base;
+	}
+
+	/** Even and odd words of two concatenated vectors. */
+	static PIXFIT_SIMD_INLINE void even(U &m) {
+		const U e = {0, 2, 4, 6};
+		m = e;
+	}
+
+	static PIXFIT_SIMD_INLINE void odd(U &m) {
+		const U o = {1, 3, 5, 7};
+		m = o;
+	}
+
+	/** Interleaves three vectors (a0 b0 c0 a1 b1 c1 ...). */
+	static PIXFIT_SIMD_INLINE void interleave3(const U &a, const U &b, const U &c, U &o0, U &o1, U &o2) {
+		const U x0 = {0, 4, 0, 1}, y0 = {0, 1, 4, 3};
+		const U x1 = {5, 0, 2, 6}, y1 = {0, 5, 2, 3};
+		const U x2 = {0, 3, 7, 0}, y2 = {6, 1, 2, 7};
+		o0 = __builtin_shuffle(__builtin_shuffle(a, b, x0), c, y0);
+		o1 = __builtin_shuffle(__builtin_shuffle(a, b, x1), c, y1);
+		o2 = __builtin_shuffle(__builtin_shuffle(a, b, x2), c, y2);
+	}
+};
+
+template <> struct Vec<8> {
+	typedef uint32_t U __attribute__((vector_size(32)));
+	typedef int32_t S __attribute__((vector_size(32)));
+	typedef signed char B __attribute__((vector_size(32)));
+
+	static PIXFIT_SIMD_INLINE void byteBase(B &m) {
+		const B base = {0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+				4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7};
+		m = base;
+	}
+
+	static PIXFIT_SIMD_INLINE void even(U &m) {
+		const U e = {0, 2, 4, 6, 8, 10, 12, 14};
+		m = e;
+	}
+
+	static PIXFIT_SIMD_INLINE void odd(U &m) {
+		const U o = {1, 3, 5, 7, 9, 11, 13, 15};
+		m = o;
+	}
+
+	static PIXFIT_SIMD_INLINE void interleave3(const U &a, const U &b, const U &c, U &o0, U &o1, U &o2) {
+		const U x0 = {0, 8, 0, 1, 9, 0, 2, 10}, y0 = {0, 1, 8, 3, 4, 9, 6, 7};
+		const U x1 = {0, 3, 11, 0, 4, 12, 0, 5}, y1 = {10, 1, 2, 11, 4, 5, 12, 7};
+		const U x2 = {13, 0, 6, 14, 0, 7, 15, 0}, y2 = {0, 13, 2, 3, 14, 5, 6, 15};
+		o0 = __builtin_shuffle(__builtin_shuffle(a, b, x0), c, y0);
+		o1 = __builtin_shuffle(__builtin_shuffle(a, b, x1), c, y1);
+		o2 = __builtin_shuffle(__builtin_shuffle(a, b, x2), c, y2);
+	}
+};
+
+/** Widens the bytes Q * W to Q * W + W - 1 of a vector to 32 bit words, like the conversion of a
+ * (signed or unsigned, depending on the platform) char does. */
+template <int W, int Q> PIXFIT_SIMD_INLINE void widen(const typename Vec<W>::B &bytes, typename Vec<W>::U &result) {
+	typedef typename Vec<W>::U U;
+	typedef typename Vec<W>::S S;
+	typedef typename Vec<W>::B B;
+	/* Every lane holds four copies of its byte, the shift keeps the topmost one. */
+	B base;
+	Vec<W>::byteBase(base);
+	const S s = (S) __builtin_shuffle(bytes, base + static_cast<signed char>(Q * W));
+	result = std::numeric_limits<char>::is_signed ? (U) (s >> 24) : ((U) s >> 24);
+}
+
+/* Vectorized unpacking of W pixels at a time into a contiguous destination. */
+template <int W>
+PIXFIT_SIMD_INLINE int unpackLanes(Mode mode, int words, const char *src, int pixels, Word *dst) {
+	typedef typename Vec<W>::U U;
+	typedef typename Vec<W>::B B;
+	int p = 0;
+
+	if (mode == Mode::OFFLINE_OCCUPANCY && words == 1) {
+		for (; p + 4 * W <= pixels; p += 4 * W) {
+			B bytes;
+			load(src + p, bytes);
+			U w0, w1, w2, w3;
+			widen<W, 0>(bytes, w0);
+			widen<W, 1>(bytes, w1);
+			widen<W, 2>(bytes, w2);
+			widen<W, 3>(bytes, w3);
+			store(dst + p, w0);
+			store(dst + p + W, w1);
+			store(dst + p + 2 * W, w2);
+			store(dst + p + 3 * W, w3);
+		}
+	}
+	else if (mode == Mode::ONLINE_OCCUPANCY && words == 1) {
+		std::memcpy(dst, src, pixels * sizeof(Word));
+		p = pixels;
+	}
+	else if (mode == Mode::SHORT_TOT && words == 1) {
+		for (; p + W <= pixels; p += W) {
+			U w, occ;
+			load(src + p * sizeof(Word), w);
+			field(w, ONEWORD_MISSING_TRIGGERS_RESULT_SHIFT, MISSING_TRIGGERS_RESULT_BITS, occ);
+			store(dst + p, occ);
+		}
+	}
+	else if (mode == Mode::SHORT_TOT && words == 3) {
+		for (; p + W <= pixels; p += W) {
+			U w, occ, tot, totSqr;
+			load(src + p * sizeof(Word), w);
+			field(w, ONEWORD_MISSING_TRIGGERS_RESULT_SHIFT, MISSING_TRIGGERS_RESULT_BITS, occ);
+			field(w, ONEWORD_TOT_RESULT_SHIFT, TOT_RESULT_BITS, tot);
+			field(w, ONEWORD_TOTSQR_RESULT_SHIFT, TOTSQR_RESULT_BITS, totSqr);
+			U o0, o1, o2;
+			Vec<W>::interleave3(occ, tot, totSqr, o0, o1, o2);
+			store(dst + 3 * p, o0);
+			store(dst + 3 * p + W, o1);
+			store(dst + 3 * p + 2 * W, o2);
+		}
+	}
+	else if (mode == Mode::LONG_TOT && words == 1) {
+		U even;
+		Vec<W>::even(even);
+		for (; p + W <= pixels; p += W) {
+			U a, b, occ;
+			load(src + 2 * p * sizeof(Word), a);
+			load(src + (2 * p + W) * sizeof(Word), b);
+			const U first = __builtin_shuffle(a, b, even);
+			field(first, TWOWORD_OCC_RESULT_SHIFT, OCC_RESULT_BITS, occ);
+			store(dst + p, occ);
+		}
+	}
+	else if (mode == Mode::LONG_TOT && words == 3) {
+		U even, odd;
+		Vec<W>::even(even);
+		Vec<W>::odd(odd);
+		for (; p + W <= pixels; p += W) {
+			U a, b, occ, tot, totSqr;
+			load(src + 2 * p * sizeof(Word), a);
+			load(src + (2 * p + W) * sizeof(Word), b);
+			const U first = __builtin_shuffle(a, b, even);
+			const U second = __builtin_shuffle(a, b, odd);
+			field(first, TWOWORD_OCC_RESULT_SHIFT, OCC_RESULT_BITS, occ);
+			field(second, TWOWORD_TOT_RESULT_SHIFT, TOT_RESULT_BITS, tot);
+			field(second, TWOWORD_TOTSQR_RESULT_SHIFT, TOTSQR_RESULT_BITS, totSqr);
+			U o0, o1, o2;
+			Vec<W>::interleave3(occ, tot, totSqr, o0, o1, o2);
+			store(dst + 3 * p, o0);
+			store(dst + 3 * p + W, o1);
+			store(dst + 3 * p + 2 * W, o2);
+		}
+	}
+	return p;
+}
+
+/* Scalar unpacking of the pixels first to last - 1, this is the reference for the kernels. */
+void unpackRange(Mode mode, int words, const char *src, int first, int last, Word *dst, int pixelStride) {
+	const uint32_t *in = reinterpret_cast<const uint32_t*>(src);
+	for (int j = first; j < last; j++) {
+		Word *out = dst + static_cast<size_t>(pixelStride) * j;
+		switch (mode) {
+		case Mode::OFFLINE_OCCUPANCY:
+			out[0] = (Word) src[j];
+			break;
+		case Mode::ONLINE_OCCUPANCY:
+			out[0] = (Word) in[j];
+			break;
+		case Mode::SHORT_TOT:
+			out[0] = field(in[j], ONEWORD_MISSING_TRIGGERS_RESULT_SHIFT, MISSING_TRIGGERS_RESULT_BITS);
+			if (words == 3) {
+				out[1] = field(in[j], ONEWORD_TOT_RESULT_SHIFT, TOT_RESULT_BITS);
+				out[2] = field(in[j], ONEWORD_TOTSQR_RESULT_SHIFT, TOTSQR_RESULT_BITS);
+			}
+			break;
+		case Mode::LONG_TOT:
+			out[0] = field(in[2 * j], TWOWORD_OCC_RESULT_SHIFT, OCC_RESULT_BITS);
+			if (words == 3) {
+				out[1] = field(in[2 * j + 1], TWOWORD_TOT_RESULT_SHIFT, TOT_RESULT_BITS);
+				out[2] = field(in[2 * j + 1], TWOWORD_TOTSQR_RESULT_SHIFT, TOTSQR_RESULT_BITS);
+			}
+			break;
+		}
+	}
+}
+
+/* ISA specific instantiations of the kernel. */
+int kernelGeneric(Mode mode, int words, const char *src, int pixels, Word *dst) {
+	return unpackLanes<4>(mode, words, src, pixels, dst);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+int kernelAvx2(Mode mode, int words, const char *src, int pixels, Word *dst) {
+	return unpackLanes<8>(mode, words, src, pixels, dst);
+}
+#endif
+
+/* Picks the widest kernel supported by the CPU. */
+PixFitUnpack::Kernel selectKernel() {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return kernelAvx2;
+#endif
+	return kernelGeneric;
+}
+
+} /* end of anonymous namespace */
+
+PixFitUnpack::Kernel PixFitUnpack::s_kernel = selectKernel();
+
+void PixFitUnpack::unpack(PixFitScanConfig::readoutMode mode, int words, const char *src, int pixels,
+		Word *dst, int pixelStride) {
+	unpackWith(s_kernel, mode, words, src, pixels, dst, pixelStride);
+}
+
+void PixFitUnpack::unpackWith(Kernel kernel, PixFitScanConfig::readoutMode mode, int words, const char *src,
+		int pixels, Word *dst, int pixelStride) {
+	assert(words == 1 || (words == 3 && (mode == Mode::SHORT_TOT || mode == Mode::LONG_TOT)));
+	int done = 0;
+	if (pixelStride == words) {
+		done = kernel(mode, words, src, pixels, dst);
+	}
+	unpackRange(mode, words, src, done, pixels, dst, pixelStride);
+}
+
+void PixFitUnpack::unpackScalar(PixFitScanConfig::readoutMode mode, int words, const char *src, int pixels,
+		Word *dst, int pixelStride) {
+	unpackRange(mode, words, src, 0, pixels, dst, pixelStride);
+}
+
+std::vector<PixFitUnpack::KernelInfo> PixFitUnpack::getKernels() {
+	std::vector<KernelInfo> kernels;
+	kernels.push_back(KernelInfo{"SSE2", kernelGeneric});
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) kernels.push_back(KernelInfo{"AVX2", kernelAvx2});
+#endif
+	return kernels;
+}
+
+const char* PixFitUnpack::getKernelName() {
+#if defined(__x86_64__)
+	if (s_kernel == kernelAvx2) return "AVX2";
+#endif
+	return "SSE2";
+}
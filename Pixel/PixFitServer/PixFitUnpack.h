@@ -0,0 +1,67 @@
+/* @file PixFitUnpack.h
+ */
+
+#ifndef PIXFITUNPACK_H_
+#define PIXFITUNPACK_H_
+
+#include <vector>
+
+#include "PixFitScanConfig.h"
+#include "RawHisto.h"
+
+namespace PixLib {
+
+/** Converts the histogrammer data of one bin, as received from the ROD, into RawHisto words.
+ * Depending on the readout mode a pixel is sent as a single byte (OFFLINE_OCCUPANCY), one 32 bit
+ * word (ONLINE_OCCUPANCY, SHORT_TOT) or two 32 bit words (LONG_TOT), see rodHisto.hxx for the
+ * position of the occupancy/missing triggers, ToT and ToT² fields.
+ * If the pixels of a bin are contiguous in the RawHisto (bin-major layout) the fields of several
+ * pixels are extracted at once with AVX2 or generic SSE2 kernels, selected at runtime depending on
+ * the CPU. Otherwise, and for the remainder of a bin, the scalar reference code is used. */
+class PixFitUnpack {
+public:
+	typedef RawHisto::histoWord_type Word;
+
+	/** Unpacks one bin.
+	 * @param mode Readout mode of the histogrammer.
+	 * @param words Number of words per pixel to fill: 1 for occupancy (or missing triggers), 3 for
+	 * occupancy, ToT and ToT². 3 is only supported for SHORT_TOT and LONG_TOT.
+	 * @param src Data received from the ROD.
+	 * @param pixels Number of pixels.
+	 * @param dst Word 0 of pixel 0 in the current bin of the RawHisto.
+	 * @param pixelStride Distance in words between two pixels in dst. */
+	static void unpack(PixFitScanConfig::readoutMode mode, int words, const char *src, int pixels,
+			Word *dst, int pixelStride);
+
+	/** Scalar reference implementation of unpack(). */
+	static void unpackScalar(PixFitScanConfig::readoutMode mode, int words, const char *src, int pixels,
+			Word *dst, int pixelStride);
+
+	/** @returns Name of the kernel that is used on this CPU. */
+	static const char* getKernelName();
+
+	/** Signature of the vectorized kernels. They handle contiguous destinations only (pixelStride
+	 * equal to words) and return the number of pixels done, the rest is left to the scalar code. */
+	typedef int (*Kernel)(PixFitScanConfig::readoutMode mode, int words, const char *src, int pixels, Word *dst);
+
+	/** A kernel and the name of its instruction set. */
+	struct KernelInfo {
+		const char *name;
+		Kernel kernel;
+	};
+
+	/** @returns All kernels the CPU can run, to compare them with the scalar code. */
+	static std::vector<KernelInfo> getKernels();
+
+	/** unpack() with a given kernel instead of the one selected at startup. */
+	static void unpackWith(Kernel kernel, PixFitScanConfig::readoutMode mode, int words, const char *src,
+			int pixels, Word *dst, int pixelStride);
+
+private:
+	/** Kernel selected at startup. */
+	static Kernel s_kernel;
+};
+
+} /* end of namespace PixLib */
+
+#endif /* PIXFITUNPACK_H_ */
@@ -0,0 +1,160 @@
+/* @file PixFitUnpackTest.cxx
+ */
+
+/* Compares the vectorized unpack kernels with the scalar reference code (PixFitUnpack). Every
+ * histogram payload of the given network dumps is unpacked with every kernel the CPU supports, in
+ * every readout mode its size fits, and compared word by word with PixFitUnpack::unpackScalar().
+ * Without dump files random payloads are used. Pixel counts that are not a multiple of the vector
+ * width and strided destinations (pixel-major RawHisto) are covered by unpacking shortened
+ * payloads and with a stride of words + 1.
+ *
+ * Usage: PixFitUnpackTest [file.dump ...]
+ * The exit code is 1 if any word differs or a dump cannot be read. */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "iblSlaveNetCmds.h"
+
+#include "PixFitDump.h"
+#include "PixFitToolCommon.h"
+#include "PixFitUnpack.h"
+
+using namespace PixLib;
+
+namespace {
+
+typedef PixFitUnpack::Word Word;
+typedef PixFitScanConfig::readoutMode Mode;
+
+const Mode s_modes[] = {Mode::OFFLINE_OCCUPANCY, Mode::ONLINE_OCCUPANCY, Mode::SHORT_TOT, Mode::LONG_TOT};
+
+/** Number of random payloads without dump files. */
+const int s_randomPayloads = 16;
+
+/** Number of pixels of a random payload, as for a FE-I4. */
+const int s_randomPixels = 26880;
+
+int s_comparisons = 0;
+int s_mismatches = 0;
+
+/** Unpacks the first pixels of a payload with every kernel and compares them with the scalar code. */
+void compare(const std::string &what, Mode mode, int words, const char *payload, int pixels, int stride) {
+	std::vector<Word> expected(static_cast<size_t>(pixels) * stride, 0);
+	PixFitUnpack::unpackScalar(mode, words, payload, pixels, expected.data(), stride);
+
+	for (const PixFitUnpack::KernelInfo &kernel : PixFitUnpack::getKernels()) {
+		std::vector<Word> actual(expected.size(), 0);
+		PixFitUnpack::unpackWith(kernel.kernel, mode, words, payload, pixels, actual.data(), stride);
+		s_comparisons++;
+		if (std::memcmp(actual.data(), expected.data(), expected.size() * sizeof(Word)) == 0) continue;
+
+		size_t first = 0;
+		while (actual[first] == expected[first]) first++;
+		printf("MISMATCH %s: %s kernel, mode %d, %d word(s), %d pixels, stride %d: word %zu is %u instead of %u\n",
+				what.c_str(), kernel.name, static_cast<int>(mode), words, pixels, stride, first,
+				static_cast<unsigned int>(actual[first]), static_cast<unsigned int>(expected[first]));
+		s_mismatches++;
+	}
+}
+
+/** Checks a payload in every readout mode its size fits. */
+void checkPayload(const std::string &what, const std::vector<char> &payload) {
+	for (Mode mode : s_modes) {
+		const int bytes = PixFitToolCommon::bytesPerPixel(mode);
+		if (payload.size() % bytes != 0) continue;
+		const int pixels = payload.size() / bytes;
+
+		const int maxWords = (mode == Mode::SHORT_TOT || mode == Mode::LONG_TOT) ? 3 : 1;
+		for (int words = 1; words <= maxWords; words += 2) {
+			/* Full payload, a remainder for the scalar code and a strided destination. */
+			compare(what, mode, words, payload.data(), pixels, words);
+			if (pixels > 7) compare(what, mode, words, payload.data(), pixels - 7, words);
+			compare(what, mode, words, payload.data(), pixels, words + 1);
+		}
+	}
+}
+
+/** Reads the data of a record, inflating it if needed. */
+bool readRecord(std::ifstream &in, const PixFitDump::RecordHeader &header, std::vector<char> &data) {
+	std::vector<char> stored(header.storedSize);
+	if (!in.read(stored.data(), stored.size())) return false;
+	if (!(header.flags & PixFitDump::FLAG_DEFLATE)) {
+		data.swap(stored);
+		return true;
+	}
+	data.resize(header.rawSize);
+	uLongf size = data.size();
+	return uncompress(reinterpret_cast<Bytef*>(data.data()), &size,
+			reinterpret_cast<const Bytef*>(stored.data()), stored.size()) == Z_OK && size == data.size();
+}
+
+/** Checks all payloads of a dump file, indexed or from before the indexed format.
+ * @returns Number of payloads, -1 if the file cannot be read. */
+int checkDump(const std::string &fileName) {
+	std::ifstream in(fileName.c_str(), std::ios::in | std::ios::binary);
+	PixFitDump::FileHeader fileHeader;
+	if (!in.read(reinterpret_cast<char*>(&fileHeader), sizeof(fileHeader))) return -1;
+
+	int payloads = 0;
+	std::vector<char> data;
+	if (fileHeader.magic == PixFitDump::s_fileMagic) {
+		PixFitDump::RecordHeader header;
+		while (in.read(reinterpret_cast<char*>(&header), sizeof(header)) && header.magic == PixFitDump::s_recordMagic) {
+			if (!readRecord(in, header, data)) return -1;
+			if (header.type != PixFitDump::RECORD_PAYLOAD) continue;
+			checkPayload(fileName + " record " + std::to_string(payloads), data);
+			payloads++;
+		}
+		return payloads;
+	}
+
+	/* Plain copy of the TCP stream. */
+	in.seekg(0);
+	RodSlvTcpCmd cmd;
+	while (in.read(reinterpret_cast<char*>(&cmd), sizeof(cmd))) {
+		if (ntohl(cmd.magic) != SLVNET_MAGIC) return -1;
+		data.resize(ntohl(cmd.payloadSize));
+		if (data.empty()) continue;
+		if (!in.read(data.data(), data.size())) return -1;
+		checkPayload(fileName + " payload " + std::to_string(payloads), data);
+		payloads++;
+	}
+	return payloads;
+}
+
+} /* end of anonymous namespace */
+
+int main(int argc, char **argv) {
+	bool failed = false;
+
+	if (argc < 2) {
+		std::mt19937 rng(1);
+		std::vector<char> payload;
+		for (int i = 0; i < s_randomPayloads; i++) {
+			payload.resize(8 * s_randomPixels);
+			for (char &c : payload) c = static_cast<char>(rng());
+			checkPayload("random payload " + std::to_string(i), payload);
+		}
+	}
+	for (int i = 1; i < argc; i++) {
+		const int payloads = checkDump(argv[i]);
+		if (payloads < 0) {
+			printf("Cannot read %s\n", argv[i]);
+			failed = true;
+		}
+		else {
+			printf("%s: %d payloads\n", argv[i], payloads);
+		}
+	}
+
+	printf("%d comparisons with the scalar code, %d mismatches\n", s_comparisons, s_mismatches);
+	return (failed || s_mismatches > 0) ? 1 : 0;
+}
@@ -7,20 +7,60 @@
 #ifndef PIXFITWORKPACKAGE_H_
 #define PIXFITWORKPACKAGE_H_
 
+#include <stdint.h> // change to cstdint for C++11
+#include <algorithm>
+#include <chrono>
+
 namespace PixLib {
 
-/** Abstract base class for classes that are enqueued in one of the PixFitWorkQueues. */
+/** Abstract base class for classes that are enqueued in one of the PixFitWorkQueues.
+ * Work packages carry the time they passed the stages of the pipeline, so that PixFitTracer can
+ * tell where they spent their time. Packages made from another one (e.g. fit results from a
+ * RawHisto) take over its timestamps with copyTimestamps(). */
 class PixFitWorkPackage {
 public:
-	PixFitWorkPackage() {};
+	PixFitWorkPackage() {
+		std::fill(m_timestamps, m_timestamps + numOfStages, 0);
+	};
 	virtual ~PixFitWorkPackage() {};
 
+	/** Points in the pipeline at which a package is timestamped, in the order they are passed. */
+	enum class Stage {RECEIVED, ENQUEUED, DEQUEUED, FITTED, ASSEMBLED, PUBLISHED};
+
+	/** Number of stages. */
+	static const int numOfStages = 6;
+
+	/** Records the current time for a stage. */
+	void stamp(Stage stage) {
+		m_timestamps[static_cast<int>(stage)] = now();
+	}
+
+	/** @returns Time the stage was passed in nanoseconds of the monotonic clock, 0 if not yet. */
+	uint64_t getTimestamp(Stage stage) const {
+		return m_timestamps[static_cast<int>(stage)];
+	}
+
+	/** Takes over the timestamps of the package this one has been made from. */
+	void copyTimestamps(const PixFitWorkPackage &other) {
+		std::copy(other.m_timestamps, other.m_timestamps + numOfStages, m_timestamps);
+	}
+
+	/** @returns Current time in nanoseconds of the monotonic clock. */
+	static uint64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
 	/** Typedef this once more, as including PixFitScanConfig.h generates loop.
 	 * @todo Move this typedef to a central place. */
 	typedef int ScanIdType;
 
 	/** Get the scan ID belonging to the work object. */
 	virtual ScanIdType getScanId() const = 0;
+
+private:
+	/** Timestamps indexed by Stage. */
+	uint64_t m_timestamps[numOfStages];
 };
 
 } /* end of namespace PixLib */
@@ -7,10 +7,20 @@
 #ifndef PIXFITWORKQUEUE_H_
 #define PIXFITWORKQUEUE_H_
 
-#include <deque>		// for deque m_workQueue
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
 #include <string>		// for queue name
 #include <memory>
 #include <functional>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include <ers/ers.h>
 #include <boost/thread.hpp>
@@ -18,29 +28,128 @@
 
 namespace PixLib {
 
-/** Used to supply minimalist thread-safe work queues for the multiple
- * producer/consumer use cases in the FitFarm software. Global locks are used during en/dequeueing.
+/** Lets threads sleep until another thread signals a change, without a lock on the signalling
+ * path when nobody is waiting. A waiter first calls prepareWait(), re-checks its condition and
+ * then calls wait() with the returned key (or cancelWait() if the condition became true).
+ * Uses a futex on Linux and a condition variable otherwise. */
+class PixFitEventCount {
+public:
+	PixFitEventCount() : m_epoch(0), m_waiters(0) {};
+
+	/** Announces a waiter. @returns Key for wait(). */
+	uint32_t prepareWait() {
+		m_waiters.fetch_add(1);
+		/* Pairs with the fence in notify(). */
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return m_epoch.load();
+	}
+
+	/** Withdraws a prepareWait() without sleeping. */
+	void cancelWait() {
+		m_waiters.fetch_sub(1);
+	}
+
+	/** Sleeps until notify*() has been called after prepareWait() returned key. */
+	void wait(uint32_t key) {
+#ifdef __linux__
+		while (m_epoch.load() == key) {
+			syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_epoch), FUTEX_WAIT_PRIVATE, key, nullptr, nullptr, 0);
+		}
+#else
+		boost::unique_lock<boost::mutex> lock(m_mutex);
+		while (m_epoch.load() == key) {
+			m_cond.wait(lock);
+		}
+#endif
+		m_waiters.fetch_sub(1);
+	}
+
+	/** Wakes up one waiting thread. */
+	void notifyOne() {
+		notify(1);
+	}
+
+	/** Wakes up all waiting threads. */
+	void notifyAll() {
+		notify(INT_MAX);
+	}
+
+private:
+	void notify(int count) {
+		/* Orders the caller's state change before the check for waiters; a waiter that is not
+		 * seen here will see the state change when re-checking after prepareWait(). */
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_waiters.load() == 0) return;
+
+		m_epoch.fetch_add(1);
+#ifdef __linux__
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&m_epoch), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+		{
+			boost::lock_guard<boost::mutex> lock(m_mutex);
+		}
+		if (count == 1) m_cond.notify_one();
+		else m_cond.notify_all();
+#endif
+	}
+
+	std::atomic<uint32_t> m_epoch;
+	std::atomic<int> m_waiters;
+#ifndef __linux__
+	boost::mutex m_mutex;
+	boost::condition_variable_any m_cond;
+#endif
+};
+
+/** Used to supply thread-safe work queues for the multiple producer/consumer use cases in the
+ * FitFarm software. The queue is a bounded lock-free ring buffer (FIFO): producers and consumers
+ * claim slots with a compare-and-swap on a position counter and every slot carries a sequence
+ * number that tells whether it is free or filled. Threads only sleep if the queue is empty
+ * (consumers) or full (producers using addWork(); tryAddWork() drops the item instead).
+ * In priority mode (see setPriority()) there is one ring per priority class. Consumers take from
+ * the highest non-empty class, except for every s_starvationInterval-th item which goes to one of
+ * the lower classes in turn, so low and middle priority work keeps moving under load.
  * @tparam T The type of objects that are put in the queue. */
 template <class T> class PixFitWorkQueue {
 
 public:
-	/** @param queueName Name of the queue used for printouts. */
-	PixFitWorkQueue(std::string queueName) {
+	/** @param queueName Name of the queue used for printouts.
+	 * @param capacity Maximum number of items (per priority class), rounded up to a power of two. */
+	PixFitWorkQueue(std::string queueName, size_t capacity = s_defaultCapacity) :
+		m_capacity(roundUpToPowerOfTwo(capacity)),
+		m_highWaterMark(0),
+		m_fullCount(0),
+		m_droppedCount(0),
+		m_popCount(0) {
 		m_queueName = queueName;
+		m_rings.push_back(std::unique_ptr<Ring>(new Ring(m_capacity)));
 
-		/* Use no blacklist by default. */
+		/* Use no blacklist and a single priority class by default. */
 		isBlacklisted = [](std::shared_ptr<T>) -> bool {return false;};
+		getPriority = [](std::shared_ptr<T>) -> int {return 0;};
 	};
 
 	virtual ~PixFitWorkQueue() {;};
 
-	/** Associates a blacklisting function with the queue.
+	/** Associates a blacklisting function with the queue. Must be called before the queue is used
+	 * by other threads.
 	 * @param fnct Predicate function that investigates an object from the queue. */
 	void setBlackList(std::function<bool(std::shared_ptr<T>)> fnct) {
 		isBlacklisted = fnct;
 	}
 
-	/** Adds a work item to the queue.
+	/** Switches the queue to priority mode. Must be called before the queue is used by other threads.
+	 * @param fnct Function that returns the priority class of an object, 0 being the most urgent one.
+	 * Values outside of [0, levels - 1] are clamped.
+	 * @param levels Number of priority classes. */
+	void setPriority(std::function<int(std::shared_ptr<T>)> fnct, int levels) {
+		getPriority = fnct;
+		while (m_rings.size() < static_cast<size_t>(levels)) {
+			m_rings.push_back(std::unique_ptr<Ring>(new Ring(m_capacity)));
+		}
+	}
+
+	/** Adds a work item to the queue. Blocks while the queue (or its priority class) is full.
 	 * @param workObject Pointer to an item. */
 	int addWork(std::shared_ptr<T> workObject) {
 		/* First check if item might be blacklisted. */
@@ -50,13 +159,46 @@ public:
 			return 0;
 		}
 
-		boost::lock_guard<boost::mutex> lock(m_mutex);
-		m_workQueue.push_front(workObject);
+		Ring &ring = *m_rings[getLevel(workObject)];
+		while (!ring.tryPush(workObject)) {
+			const uint32_t key = ring.notFull.prepareWait();
+			if (ring.tryPush(workObject)) {
+				ring.notFull.cancelWait();
+				break;
+			}
+			m_fullCount++;
+			if (s_doverbose) ERS_LOG(m_queueName << ": Queue full, waiting for free slot.")
+			ring.notFull.wait(key);
+		}
+
+		updateHighWaterMark();
 		if (s_doverbose) ERS_LOG(m_queueName << ": Thread " << boost::this_thread::get_id() << " added work item. Queue size: " << getSize())
-		m_cond.notify_one();
+		m_notEmpty.notifyOne();
 		return 0;
 	}
 
+	/** Adds a work item to the queue unless the queue (or its priority class) is full. For producers
+	 * that must not block, e.g. IS callbacks; a rejected item is counted in getDroppedCount().
+	 * @param workObject Pointer to an item.
+	 * @returns False if the item was dropped because the queue is full. */
+	bool tryAddWork(std::shared_ptr<T> workObject) {
+		if (isBlacklisted(workObject)) {
+			if (s_doverbose) ERS_LOG(m_queueName << ": Thread " << boost::this_thread::get_id() <<
+					" tried to add work item. Rejected due to blacklist. Queue size: " << getSize())
+			return true;
+		}
+
+		if (!m_rings[getLevel(workObject)]->tryPush(workObject)) {
+			m_droppedCount++;
+			return false;
+		}
+
+		updateHighWaterMark();
+		if (s_doverbose) ERS_LOG(m_queueName << ": Thread " << boost::this_thread::get_id() << " added work item. Queue size: " << getSize())
+		m_notEmpty.notifyOne();
+		return true;
+	}
+
 	/** Calls non-blocking version of getWork().
 	 * @returns Empty ptr if no data present in queue. */
 	std::shared_ptr<T> getWorkNb() {
@@ -68,62 +210,273 @@ public:
 		return getWork(false);
 	}
 
-	/** Get the number of items in the queue. Watch out for thread-safety when using this. */
-	int getSize() {
-		return m_workQueue.size();	// is locking necessary here?
+	/** Removes up to maxItems elements at once. Blocks until at least one element is available.
+	 * @param maxItems Maximum number of elements to return.
+	 * @returns Elements in queue order, blacklisted ones are dropped. */
+	std::vector<std::shared_ptr<T> > getWorkBatch(size_t maxItems) {
+		std::vector<std::shared_ptr<T> > batch;
+		if (maxItems == 0) return batch;
+
+		batch.push_back(getWork(false));
+		std::shared_ptr<T> temp;
+		while (batch.size() < maxItems && tryPopValid(temp)) {
+			batch.push_back(std::move(temp));
+		}
+		return batch;
+	}
+
+	/** Get the number of items in the queue. Lock-free, the value is a snapshot that may be
+	 * outdated as soon as it is returned. */
+	int getSize() const {
+		size_t size = 0;
+		for (auto& ring : m_rings) {
+			size += ring->getSize();
+		}
+		return static_cast<int>(size);
+	}
+
+	/** @returns Maximum number of items in the queue (all priority classes). */
+	size_t getCapacity() const {
+		return m_capacity * m_rings.size();
+	}
+
+	/** @returns Maximum number of items in the queue since the last call of resetHighWaterMark(). */
+	size_t getHighWaterMark() const {
+		return m_highWaterMark.load(std::memory_order_relaxed);
+	}
+
+	/** Starts a new high-water-mark period with the current occupancy. */
+	void resetHighWaterMark() {
+		m_highWaterMark.store(getSize(), std::memory_order_relaxed);
+	}
+
+	/** @returns How often a producer had to wait because the queue was full. */
+	unsigned long getFullCount() const {
+		return m_fullCount.load(std::memory_order_relaxed);
+	}
+
+	/** @returns Number of items tryAddWork() dropped because the queue was full. */
+	unsigned long getDroppedCount() const {
+		return m_droppedCount.load(std::memory_order_relaxed);
+	}
+
+	/** @returns Name of the queue. */
+	const std::string& getName() const {
+		return m_queueName;
 	}
 
 	/** Clears the queue. */
 	void clear() {
-		boost::lock_guard<boost::mutex> lock(m_mutex);
-		m_workQueue.clear();
+		std::shared_ptr<T> temp;
+		for (auto& ring : m_rings) {
+			while (ring->tryPop(temp)) {
+			}
+			ring->notFull.notifyAll();
+		}
 	}
 
 private:
-	/** Removes and returns the last element of the queue if existent. Blocks if queue is locked or
-	 * does not contain any elements for blocking calls.
+	/** Removes and returns the oldest element of the queue if existent. Blocks if the queue does
+	 * not contain any elements for blocking calls.
 	 * @param nonBlocking Choose blocking or non-blocking access.
-	 * @returns Last element of the queue. */
+	 * @returns Oldest element of the queue. */
 	std::shared_ptr<T> getWork(bool nonBlocking) {
 		std::shared_ptr<T> temp;
-		boost::lock_guard<boost::mutex> lock(m_mutex);
-
-		do {
-			/* Wait for available work items in queue, return if nonBlocking. */
-			while (0 == m_workQueue.size()) {
-				if (nonBlocking) {
-					ERS_LOG(m_queueName << ": No work item ready, returning non-blocking call. ")
-					return std::shared_ptr<T>();
-				}
-				if(s_doverbose) ERS_LOG(m_queueName << ": Waiting for work item.")
-				m_cond.wait(m_mutex);
+
+		while (!tryPopValid(temp)) {
+			if (nonBlocking) {
+				if (s_doverbose) ERS_LOG(m_queueName << ": No work item ready, returning non-blocking call. ")
+				return std::shared_ptr<T>();
 			}
+			const uint32_t key = m_notEmpty.prepareWait();
+			if (tryPopValid(temp)) {
+				m_notEmpty.cancelWait();
+				break;
+			}
+			if (s_doverbose) ERS_LOG(m_queueName << ": Waiting for work item.")
+			m_notEmpty.wait(key);
+		}
+
+		if(s_doverbose) {
+			ERS_LOG(m_queueName << ": Thread " << boost::this_thread::get_id()
+				<< " removed work item. Queue size: " << getSize())
+		}
+		return temp;
+	}
 
-			temp = m_workQueue.back();
-			m_workQueue.pop_back();
+	/** Pops elements until a non-blacklisted one is found.
+	 * @returns False if the queue ran empty. */
+	bool tryPopValid(std::shared_ptr<T> &item) {
+		while (tryPop(item)) {
+			if (!isBlacklisted(item)) return true;
 
-			if(s_doverbose && isBlacklisted(temp)) {
+			if (s_doverbose) {
 				ERS_LOG(m_queueName << ": Thread " << boost::this_thread::get_id() <<
 						" tried to remove work item. REJECTED due to blacklist. Queue size: "
 						<< getSize())
 			}
-		} while (isBlacklisted(temp));
+		}
+		return false;
+	}
 
-		if(s_doverbose) {
-			ERS_LOG(m_queueName << ": Thread " << boost::this_thread::get_id()
-				<< " removed work item. Queue size: " << getSize())
+	/** Takes the next item according to the priority classes. @returns False if the queue is empty. */
+	bool tryPop(std::shared_ptr<T> &item) {
+		const size_t levels = m_rings.size();
+
+		/* Every s_starvationInterval-th pop starts at one of the lower classes, taking turns. */
+		size_t first = 0;
+		if (levels > 1) {
+			const unsigned long pop = m_popCount.fetch_add(1, std::memory_order_relaxed);
+			if (pop % s_starvationInterval == s_starvationInterval - 1) {
+				first = 1 + (pop / s_starvationInterval) % (levels - 1);
+			}
 		}
-		return temp;
+
+		for (size_t k = 0; k < levels; k++) {
+			Ring &ring = *m_rings[(first + k) % levels];
+			if (ring.tryPop(item)) {
+				/* Only producers of this class can make progress now. */
+				ring.notFull.notifyOne();
+				return true;
+			}
+		}
+		return false;
 	}
 
-	/** Contains the elements of the queue. */
-	std::deque<std::shared_ptr<T> > m_workQueue;
+	/** @returns Index of the ring for an item. */
+	size_t getLevel(const std::shared_ptr<T> &item) {
+		if (m_rings.size() == 1) return 0;
+		const int level = getPriority(item);
+		if (level < 0) return 0;
+		return std::min(static_cast<size_t>(level), m_rings.size() - 1);
+	}
 
-	/** Mutex for synchronization. */
-	boost::mutex m_mutex;
+	void updateHighWaterMark() {
+		const size_t size = getSize();
+		size_t highWaterMark = m_highWaterMark.load(std::memory_order_relaxed);
+		while (size > highWaterMark &&
+				!m_highWaterMark.compare_exchange_weak(highWaterMark, size, std::memory_order_relaxed)) {
+		}
+	}
 
-	/** Condition variable for synchronization. */
-	boost::condition_variable_any m_cond;
+	static size_t roundUpToPowerOfTwo(size_t n) {
+		size_t result = 2;
+		while (result < n) result <<= 1;
+		return result;
+	}
+
+	/** A slot of the ring buffer. sequence == position: free for the producer at that position,
+	 * sequence == position + 1: filled for the consumer at that position. */
+	struct Cell {
+		std::atomic<size_t> sequence;
+		std::shared_ptr<T> data;
+	};
+
+	/** Bounded lock-free MPMC ring buffer holding one priority class. */
+	class Ring {
+	public:
+		explicit Ring(size_t capacity) :
+			m_capacity(capacity),
+			m_mask(capacity - 1),
+			m_cells(new Cell[capacity]),
+			m_enqueuePos(0),
+			m_dequeuePos(0) {
+			for (size_t i = 0; i < m_capacity; i++) {
+				m_cells[i].sequence.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		/** Claims a free slot and stores the item. @returns False if the ring is full. */
+		bool tryPush(std::shared_ptr<T> &item) {
+			size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+			Cell *cell;
+			while (true) {
+				cell = &m_cells[pos & m_mask];
+				const size_t seq = cell->sequence.load(std::memory_order_acquire);
+				const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+				if (diff == 0) {
+					if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+				}
+				else if (diff < 0) {
+					return false;
+				}
+				else {
+					pos = m_enqueuePos.load(std::memory_order_relaxed);
+				}
+			}
+			cell->data = std::move(item);
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		/** Claims the oldest filled slot and takes the item. @returns False if the ring is empty. */
+		bool tryPop(std::shared_ptr<T> &item) {
+			size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+			Cell *cell;
+			while (true) {
+				cell = &m_cells[pos & m_mask];
+				const size_t seq = cell->sequence.load(std::memory_order_acquire);
+				const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+				if (diff == 0) {
+					if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+				}
+				else if (diff < 0) {
+					return false;
+				}
+				else {
+					pos = m_dequeuePos.load(std::memory_order_relaxed);
+				}
+			}
+			item = std::move(cell->data);
+			cell->data.reset();
+			cell->sequence.store(pos + m_capacity, std::memory_order_release);
+			return true;
+		}
+
+		/** Producers of this class wait here while the ring is full. */
+		PixFitEventCount notFull;
+
+		/** @returns Snapshot of the number of items. */
+		size_t getSize() const {
+			const size_t dequeuePos = m_dequeuePos.load(std::memory_order_acquire);
+			const size_t enqueuePos = m_enqueuePos.load(std::memory_order_acquire);
+			return (enqueuePos > dequeuePos) ? enqueuePos - dequeuePos : 0;
+		}
+
+	private:
+		const size_t m_capacity;
+		const size_t m_mask;
+		std::unique_ptr<Cell[]> m_cells;
+
+		/** Producer and consumer positions, padded to keep them on separate cache lines. (No alignas
+		 * here, rings are allocated with new which does not honour it before C++17.) */
+		char m_pad0[64];
+		std::atomic<size_t> m_enqueuePos;
+		char m_pad1[64 - sizeof(std::atomic<size_t>)];
+		std::atomic<size_t> m_dequeuePos;
+		char m_pad2[64 - sizeof(std::atomic<size_t>)];
+	};
+
+	/** Capacity of each ring. */
+	const size_t m_capacity;
+
+	/** One ring per priority class, index 0 is the most urgent class. */
+	std::vector<std::unique_ptr<Ring> > m_rings;
+
+	/** Consumers wait here while the queue is empty. */
+	PixFitEventCount m_notEmpty;
+
+	/** Maximum occupancy. */
+	std::atomic<size_t> m_highWaterMark;
+
+	/** Number of times a producer found the queue full. */
+	std::atomic<unsigned long> m_fullCount;
+
+	/** Number of items tryAddWork() dropped. */
+	std::atomic<unsigned long> m_droppedCount;
+
+	/** Number of pops in priority mode, used for the starvation protection. */
+	std::atomic<unsigned long> m_popCount;
 
 	/** Queue identifier. */
 	std::string m_queueName;
@@ -131,8 +484,18 @@ private:
 	/** Pointer to function that checks for aborted scans. */
 	std::function<bool(std::shared_ptr<T>)> isBlacklisted;
 
+	/** Pointer to function that determines the priority class of an item. */
+	std::function<int(std::shared_ptr<T>)> getPriority;
+
+	/** Default maximum number of items. */
+	static const size_t s_defaultCapacity = 4096;
+
+	/** Every n-th pop in priority mode starts at one of the lower priority classes instead of the
+	 * highest, the lower classes taking turns. Empty classes are skipped as usual. */
+	static const unsigned long s_starvationInterval = 8;
+
 	/** Controls the verbosity of the queue. */
-	static const bool s_doverbose = true;
+	static const bool s_doverbose = false;
 };
 
 } /* end of namespace PixLib */
@@ -8,19 +8,43 @@
 
 #include "PixFitAbstractFitter.h"
 #include "PixFitFitter_lmfit.h"
+#include "PixFitFitter_simd.h"
+#include "PixFitFitter_lut.h"
 #include "PixFitWorker.h"
+#include "PixFitInstanceConfig.h"
+#include "PixFitTracer.h"
 #include "PixFitWorkQueue.h"
 #include "PixFitResult.h"
+#include "PixFitStreamingFit.h"
 #include "RawHisto.h"
 
 using namespace PixLib;
 
 PixFitWorker::PixFitWorker(PixFitWorkQueue<RawHisto> *histoQueue,
-		PixFitWorkQueue<PixFitResult> *resultQueue, FitMethod fitterType) {
+		const std::vector<PixFitWorkQueue<PixFitResult>*> &resultQueues, PixFitThreadPool *pool,
+		FitMethod fitterType, PixFitInstanceConfig *instanceConfig) {
 	this->m_histoQueue = histoQueue;
-	this->m_resultQueue = resultQueue;
+	this->m_budget = instanceConfig ? &instanceConfig->memoryBudget : nullptr;
+	this->m_tracer = instanceConfig ? &instanceConfig->tracer : nullptr;
+	this->m_fitCounters = FitCounters();
+	if (instanceConfig) {
+		PixFitMetrics &metrics = instanceConfig->metrics;
+		this->m_fitCounters.histograms = &metrics.getCounter("Fit_Histograms");
+		this->m_fitCounters.converged = &metrics.getCounter("Fit_Converged");
+		this->m_fitCounters.badConvergence = &metrics.getCounter("Fit_BadConvergence");
+		this->m_fitCounters.exhausted = &metrics.getCounter("Fit_Exhausted");
+		this->m_fitCounters.trapped = &metrics.getCounter("Fit_Trapped");
+		this->m_fitCounters.failed = &metrics.getCounter("Fit_Failed");
+		this->m_fitCounters.zero = &metrics.getCounter("Fit_Zero");
+		this->m_fitCounters.streamed = &metrics.getCounter("Fit_Streamed");
+		this->m_fitCounters.reused = &metrics.getCounter("Fit_Reused");
+		this->m_fitCounters.estimated = &metrics.getCounter("Fit_Estimated");
+	}
+	this->m_resultQueues = resultQueues;
 	this->m_threadName = "worker";
 	this->m_fitter = createFitter(fitterType);
+	this->m_fitter->setThreadPool(pool);
+	this->m_fitter->setFitCache(instanceConfig ? &instanceConfig->fitCache : nullptr);
 }
 
 PixFitWorker::~PixFitWorker() {
@@ -31,17 +55,78 @@ switch (fitterType) {
         case FitMethod::FIT_LMMIN:
                 return std::unique_ptr<PixFitAbstractFitter>(new PixFitFitter_lmfit);
                 break;
+        case FitMethod::FIT_DSP_LUT:
+                return std::unique_ptr<PixFitAbstractFitter>(new PixFitFitter_lut);
+                break;
+        case FitMethod::FIT_SIMD:
+                return std::unique_ptr<PixFitAbstractFitter>(new PixFitFitter_simd);
+                break;
+        case FitMethod::FIT_MOMENT: {
+                /* SIMD fitter that only fits the pixels whose moments do not describe the data. */
+                std::unique_ptr<PixFitAbstractFitter> fitter(new PixFitFitter_simd);
+                fitter->setMomentFastPath(true);
+                return fitter;
+                }
         default:
                 return std::unique_ptr<PixFitAbstractFitter>(new PixFitFitter_lmfit);
                 break;
         }
 }
 
+void PixFitWorker::countFit(const PixFitResult &result) {
+	if (!m_fitCounters.histograms) return;
+	const PixFitResult::FitOutcomes &outcomes = result.fitOutcomes;
+	m_fitCounters.histograms->add();
+	m_fitCounters.converged->add(outcomes.converged);
+	m_fitCounters.badConvergence->add(outcomes.badConvergence);
+	m_fitCounters.exhausted->add(outcomes.exhausted);
+	m_fitCounters.trapped->add(outcomes.trapped);
+	m_fitCounters.failed->add(outcomes.failed);
+	m_fitCounters.zero->add(outcomes.zero);
+	m_fitCounters.streamed->add(outcomes.streamed);
+	m_fitCounters.reused->add(outcomes.reused);
+	m_fitCounters.estimated->add(outcomes.estimated);
+}
+
+void PixFitWorker::addResult(std::shared_ptr<PixFitResult> result, const RawHisto &histo) {
+	/* Fit results may wait in the assembler hold for the other mask steps. */
+	if (result->thresh_array) {
+		result->chargeMemory(m_budget);
+		countFit(*result);
+	}
+
+	result->copyTimestamps(histo);
+	result->stamp(PixFitWorkPackage::Stage::FITTED);
+	if (m_tracer) m_tracer->recordFitted(*result, result->getScanConfig()->histogrammer);
+
+	const int shard = result->getScanConfig()->getAssemblerShard(m_resultQueues.size());
+	m_resultQueues[shard]->addWork(result);
+}
+
 void PixFitWorker::loop() {
+	/* Threshold fit that is still running in the thread pool, and its histogram. */
+	std::unique_ptr<PixFitAbstractFitter::PendingFit> pending;
+	std::shared_ptr<RawHisto> pendingHisto;
 
 	while (1) {
-		/* Get work. */
-		std::shared_ptr<RawHisto> histo = m_histoQueue->getWork();
+		/* Get work. Only wait for new work when there is no fit left to complete. */
+		std::shared_ptr<RawHisto> histo;
+		if (!pending) {
+			histo = m_histoQueue->getWork();
+		}
+		else if (m_histoQueue->getSize() > 0) {
+			histo = m_histoQueue->getWorkNb();
+		}
+		if (!histo) {
+			addResult(pending->finish(), *pendingHisto);
+			pending.reset();
+			pendingHisto.reset();
+			continue;
+		}
+		histo->stamp(PixFitWorkPackage::Stage::DEQUEUED);
+
+		/* Convert the bins PixFitNet left in their received format. */
+		histo->unpackPending();
 
 		/* Instantiate PixFitFitter. */
 		std::shared_ptr<PixFitResult> result;
@@ -61,9 +146,22 @@ void PixFitWorker::loop() {
 			tmpResult->rawHisto = histo;
 			result = tmpResult;
 		}
-		/* THRESHOLD */
+		/* THRESHOLD
+		 * Set up this fit before completing the previous one, so the pool does not run dry. */
 		else if (scanType == PixFitScanConfig::scanType::THRESHOLD) {
-			result = m_fitter->fit(histo);
+			/* The S-curve estimates may still be reading the last bins in the receive layout. */
+			if (histo->getStreamingFit()) histo->getStreamingFit()->complete();
+
+			/* The fitters walk along the bins of a pixel. If the transpose fails (no memory), they
+			 * still work on the receive layout, only slower. */
+			if (PixFitInstanceConfig::transposeForFit) {
+				histo->transpose(RawHisto::Layout::PIXEL_MAJOR);
+			}
+			std::unique_ptr<PixFitAbstractFitter::PendingFit> next = m_fitter->startFit(histo);
+			if (pending) addResult(pending->finish(), *pendingHisto);
+			pending = std::move(next);
+			pendingHisto = histo;
+			continue;
 		}
 		/* TOT_CALIB
 		 * We currently don't process the data for TOT_CALIB type scans, as this is done
@@ -74,7 +172,12 @@ void PixFitWorker::loop() {
 			result = std::make_shared<PixFitResult>(histo->getScanConfig());
 		}
 
-		/* Enqueue PixFitResult object. */
-		m_resultQueue->addWork(result);
+		/* Enqueue PixFitResult object, keeping the order of arrival. */
+		if (pending) {
+			addResult(pending->finish(), *pendingHisto);
+			pending.reset();
+			pendingHisto.reset();
+		}
+		addResult(result, *histo);
 	}
 }
@@ -8,35 +8,37 @@
 #define PIXFITWORKER_H_
 
 #include <memory>
+#include <vector>
 
+#include "PixFitAbstractFitter.h"
+#include "PixFitMetrics.h"
 #include "PixFitWorkQueue.h"
 #include "PixFitThread.h"
 
 namespace PixLib {
 
-class PixFitAbstractFitter;
 class RawHisto;
-
-/** Different fitting methods matching PixFitAbstractFitter derived fitters. */
-enum class FitMethod : int {
-	FIT_NONE,
-	FIT_LMMIN,
-	FIT_LEVMAR,
-	FIT_DSP,
-	FIT_DSP_LUT,
-	FIT_ROOT,
-	FIT_CUDA
-};
+class PixFitThreadPool;
+class PixFitInstanceConfig;
+class MemoryBudget;
+class PixFitTracer;
 
 /** Represents a worker thread that does fitting. It is created by PixFitManager and retrieves work
  * packages from the histoQueue and puts the results in the resultQueue.
  * One can configure the fitter being used (i.e. which class derived from PixFitAbstractFitter will
- * do the fit).*/
+ * do the fit). The fits themselves run in the thread pool; while the pool works on a histogram the
+ * worker already sets up the next one if it is available. */
 class PixFitWorker : public PixFitThread {
 public:
   /** @param histoQueue Pointer to the input queue that is holding RawHistos from PixFitNet.
-   * @param resultQueue Pointer to the output queue that holds processed histogram data. */
-  PixFitWorker(PixFitWorkQueue<RawHisto> *histoQueue, PixFitWorkQueue<PixFitResult> *resultQueue, FitMethod fitterType = FitMethod::FIT_LMMIN);
+   * @param resultQueues Output queues that hold processed histogram data, one per assembler.
+   * @param pool Thread pool shared by the fitters, fits run in the worker thread if nullptr.
+   * @param instanceConfig Provides the memory budget for the fit results, the tracer and the
+   * metrics. Neither is used if nullptr. */
+  PixFitWorker(PixFitWorkQueue<RawHisto> *histoQueue,
+		  const std::vector<PixFitWorkQueue<PixFitResult>*> &resultQueues,
+		  PixFitThreadPool *pool, FitMethod fitterType = FitMethod::FIT_LMMIN,
+		  PixFitInstanceConfig *instanceConfig = nullptr);
 
   virtual ~PixFitWorker();
 
@@ -47,8 +49,34 @@ private:
   	/** Pointer to the input queue. */
 	PixFitWorkQueue<RawHisto> *m_histoQueue;
 
-	/** Pointer to the output queue. */
-	PixFitWorkQueue<PixFitResult> *m_resultQueue;
+	/** Pointers to the output queues. */
+	std::vector<PixFitWorkQueue<PixFitResult>*> m_resultQueues;
+
+	/** Puts a result in the queue of the assembler that is responsible for it. The result takes
+	 * over the timestamps of the histogram it has been made from. */
+	void addResult(std::shared_ptr<PixFitResult> result, const RawHisto &histo);
+
+	/** Memory budget for fit results. */
+	MemoryBudget *m_budget;
+
+	PixFitTracer *m_tracer;
+
+	/** Metrics counters of the fit outcomes, see PixFitResult::FitOutcomes. */
+	struct FitCounters {
+		PixFitMetrics::Counter *histograms;
+		PixFitMetrics::Counter *converged;
+		PixFitMetrics::Counter *badConvergence;
+		PixFitMetrics::Counter *exhausted;
+		PixFitMetrics::Counter *trapped;
+		PixFitMetrics::Counter *failed;
+		PixFitMetrics::Counter *zero;
+		PixFitMetrics::Counter *streamed;
+		PixFitMetrics::Counter *reused;
+		PixFitMetrics::Counter *estimated;
+	} m_fitCounters;
+
+	/** Adds the fit outcomes of a result to the metrics. */
+	void countFit(const PixFitResult &result);
 
 	/** Pointer to the Fitter instance. */
 	std::unique_ptr<PixFitAbstractFitter> m_fitter;
@@ -4,19 +4,24 @@
  *      Author: mkretz
  */
 
-#include <cstdlib> // for malloc/free
 //#define NDEBUG
 #include <cassert>
 #include <stdint.h> // change to cstdint for C++11
+#include <algorithm>
 #include <memory>
 
 #include "RawHisto.h"
+#include "PixFitInstanceConfig.h" // for MemoryBudget
+#include "PixFitBufferPool.h"
+#include "PixFitUnpack.h"
 
 using namespace PixLib;
 
-RawHisto::RawHisto(std::shared_ptr<const PixFitScanConfig> scanConfig) {
+RawHisto::RawHisto(std::shared_ptr<const PixFitScanConfig> scanConfig, Layout layout) {
 	m_rawData = nullptr;
 	m_size = 0;
+	m_capacity = 0;
+	m_budget = nullptr;
 	m_scanConfig = scanConfig;
 
 	/* Get information from PixFitScanConfig. */
@@ -24,21 +29,29 @@ RawHisto::RawHisto(std::shared_ptr<const PixFitScanConfig> scanConfig) {
 	m_wordsPerPixel = scanConfig->getWordsPerPixel();
 	m_bytesPerPixel = m_wordsPerPixel * sizeof(histoWord_type);
 	m_bins = scanConfig->getNumOfBins();
+	/* Intermediate histograms only hold a single bin. */
+	if (scanConfig->intermediate != PixFitScanConfig::intermediateType::INTERMEDIATE_NONE) {
+		m_bins = 1;
+	}
+	m_layout = layout;
 }
 
 RawHisto::~RawHisto() {
-	free(m_rawData);
+	PixFitBufferPool::instance().release(m_rawData, m_capacity);
+	if (m_budget != nullptr) {
+		m_budget->release(m_size);
+		for (auto& packed : m_packedBins) m_budget->release(packed.size);
+	}
 }
 
-int RawHisto::allocateMemory() {
-	int size = 0;
-	if (m_scanConfig->intermediate != PixFitScanConfig::intermediateType::INTERMEDIATE_NONE) {
-		size = m_pixels * m_bytesPerPixel;
-	}
-	else {
-		size = m_pixels * m_bytesPerPixel * m_bins;
+int RawHisto::allocateMemory(MemoryBudget *budget) {
+	int size = m_pixels * m_bytesPerPixel * m_bins;
+	int rc = alloc(size);
+	if (0 == rc && budget != nullptr) {
+		m_budget = budget;
+		m_budget->charge(m_size);
 	}
-	return alloc(size);
+	return rc;
 }
 
 std::shared_ptr<const PixFitScanConfig> RawHisto::getScanConfig() const {
@@ -56,23 +69,92 @@ int RawHisto::getWords() const {
 	return m_size/sizeof(histoWord_type);
 }
 
+int RawHisto::getPixels() const {
+	return m_pixels;
+}
+
+int RawHisto::getBins() const {
+	return m_bins;
+}
+
+int RawHisto::getWordsPerPixel() const {
+	return m_wordsPerPixel;
+}
+
+RawHisto::Layout RawHisto::getLayout() const {
+	return m_layout;
+}
+
+int RawHisto::getBinStride() const {
+	return (m_layout == Layout::PIXEL_MAJOR) ? m_wordsPerPixel : m_pixels * m_wordsPerPixel;
+}
+
+int RawHisto::getPixelStride() const {
+	return (m_layout == Layout::PIXEL_MAJOR) ? m_bins * m_wordsPerPixel : m_wordsPerPixel;
+}
+
 RawHisto::histoWord_type* RawHisto::operator ()(int pixel) {
-	assert(pixel >= 0 && pixel < m_pixels);
-	return &m_rawData[pixel * m_bins];
+	return &(*this)(pixel, 0, 0);
 }
 
 RawHisto::histoWord_type* RawHisto::operator ()(int pixel, int bin) {
-	assert(pixel >= 0 && pixel < m_pixels);
-	assert(bin >= 0 && bin < m_bins);
-	return &m_rawData[pixel * m_bins * m_wordsPerPixel + bin * m_wordsPerPixel];
+	return &(*this)(pixel, bin, 0);
 }
 
 RawHisto::histoWord_type& RawHisto::operator ()(int pixel, int bin, int word) {
 	assert(pixel >= 0 && pixel < m_pixels);
 	assert(bin >= 0 && bin < m_bins);
 	assert(word >= 0 && word < m_wordsPerPixel);
-	assert(pixel * m_bins * m_wordsPerPixel + bin * m_wordsPerPixel + word < m_size/static_cast<int>(sizeof(histoWord_type)));
-	return m_rawData[pixel * m_bins * m_wordsPerPixel + bin * m_wordsPerPixel + word];
+	const size_t i = (m_layout == Layout::PIXEL_MAJOR) ? index<Layout::PIXEL_MAJOR>(pixel, bin, word) :
+			index<Layout::BIN_MAJOR>(pixel, bin, word);
+	assert(i < m_size / sizeof(histoWord_type));
+	return m_rawData[i];
+}
+
+int RawHisto::transpose(Layout layout) {
+	if (layout == m_layout) return 0;
+	/* With a single bin (or no data yet) both layouts are identical. */
+	if (m_bins == 1 || m_rawData == nullptr) {
+		m_layout = layout;
+		return 0;
+	}
+
+	size_t capacity = 0;
+	histoWord_type *data = static_cast<histoWord_type *>(PixFitBufferPool::instance().acquire(m_size, capacity));
+	if (data == nullptr) return 2;
+
+	if (layout == Layout::PIXEL_MAJOR) {
+		copyTiles<Layout::BIN_MAJOR, Layout::PIXEL_MAJOR>(m_rawData, data);
+	}
+	else {
+		copyTiles<Layout::PIXEL_MAJOR, Layout::BIN_MAJOR>(m_rawData, data);
+	}
+
+	/* The new buffer has the same size, so the memory budget stays as it is. */
+	PixFitBufferPool::instance().release(m_rawData, m_capacity);
+	m_rawData = data;
+	m_capacity = capacity;
+	m_layout = layout;
+	return 0;
+}
+
+template <RawHisto::Layout From, RawHisto::Layout To>
+void RawHisto::copyTiles(const histoWord_type *src, histoWord_type *dst) const {
+	for (int p0 = 0; p0 < m_pixels; p0 += s_tileSize) {
+		const int p1 = std::min(p0 + s_tileSize, m_pixels);
+		for (int b0 = 0; b0 < m_bins; b0 += s_tileSize) {
+			const int b1 = std::min(b0 + s_tileSize, m_bins);
+			for (int p = p0; p < p1; p++) {
+				for (int b = b0; b < b1; b++) {
+					const histoWord_type *s = &src[index<From>(p, b, 0)];
+					histoWord_type *d = &dst[index<To>(p, b, 0)];
+					for (int w = 0; w < m_wordsPerPixel; w++) {
+						d[w] = s[w];
+					}
+				}
+			}
+		}
+	}
 }
 
 int RawHisto::alloc(int size) {
@@ -81,8 +163,8 @@ int RawHisto::alloc(int size) {
 		return 1;
 	}
 	else {
-		/* Allocate memory and return 0 on success. */
-		m_rawData = (histoWord_type *) malloc(size);
+		/* Get memory from the pool and return 0 on success. */
+		m_rawData = static_cast<histoWord_type *>(PixFitBufferPool::instance().acquire(size, m_capacity));
 		if (m_rawData != 0) {
 			this->m_size = size;
 			return 0;
@@ -94,6 +176,31 @@ int RawHisto::alloc(int size) {
 	}
 }
 
+void RawHisto::addPackedBin(int bin, PixFitScanConfig::readoutMode mode, int words,
+		std::shared_ptr<const char> data, size_t size) {
+	assert(bin >= 0 && bin < m_bins);
+	PackedBin packed = {bin, mode, words, data, size};
+	m_packedBins.push_back(packed);
+	if (m_budget != nullptr) m_budget->charge(size);
+}
+
+void RawHisto::unpackPending() {
+	for (auto& packed : m_packedBins) {
+		PixFitUnpack::unpack(packed.mode, packed.words, packed.data.get(), m_pixels,
+				&(*this)(0, packed.bin, 0), getPixelStride());
+		if (m_budget != nullptr) m_budget->release(packed.size);
+	}
+	m_packedBins.clear();
+}
+
+void RawHisto::setStreamingFit(std::shared_ptr<PixFitStreamingFit> streamingFit) {
+	m_streamingFit = streamingFit;
+}
+
+std::shared_ptr<PixFitStreamingFit> RawHisto::getStreamingFit() const {
+	return m_streamingFit;
+}
+
 PixFitScanConfig::ScanIdType RawHisto::getScanId() const {
 	return m_scanConfig->scanId;
 }
@@ -8,29 +8,45 @@
 #define RAWHISTO_H_
 
 #include <stdint.h> // change to cstdint for C++11
+#include <cassert>
+#include <cstddef>
 #include <memory>
+#include <vector>
 
 #include "PixFitWorkPackage.h"
 #include "PixFitScanConfig.h"
 
 namespace PixLib {
 
+class MemoryBudget;
+class PixFitStreamingFit;
+
 /** Stores the reformatted (partial) histograms from the ROD. It is filled by a networking thread and
- * then put into the Fit-Queue for processing. The memory layout is not hidden and could be a
- * starting point for further optimization. */
+ * then put into the Fit-Queue for processing. The memory comes from PixFitBufferPool and goes back
+ * there when the RawHisto is destroyed.
+ * Two memory layouts are supported: PIXEL_MAJOR ([pixel][bin][word], all bins of a pixel are
+ * contiguous, which is what the fitters like) and BIN_MAJOR ([bin][pixel][word], every bin is a
+ * contiguous block, which is how the data arrives from the ROD). transpose() converts between them.
+ * operator() works for both layouts; code that loops over many words can use at<>() with the layout
+ * as template parameter, or the strides, to avoid checking the layout on every access. */
 class RawHisto : public PixFitWorkPackage {
 public:
         /** Type of a word for a histogram. */
 	typedef uint32_t histoWord_type;
 
-        /** @param scanConfig Pointer to associated PixFitScanConfig. */
-	RawHisto(std::shared_ptr<const PixFitScanConfig> scanConfig);
+        /** Memory layouts, see class description. */
+	enum class Layout {PIXEL_MAJOR, BIN_MAJOR};
+
+        /** @param scanConfig Pointer to associated PixFitScanConfig.
+         * @param layout Memory layout of the histogram. */
+	RawHisto(std::shared_ptr<const PixFitScanConfig> scanConfig, Layout layout = Layout::PIXEL_MAJOR);
 
 	virtual ~RawHisto();
 
         /** Allocates the amount of memory that is needed to store the histogram. 
+         * @param budget Budget that is charged with the memory until the RawHisto is destroyed, may be nullptr.
          * @returns 0 on success, 1 if memory has already been allocated, 2 on failure. */
-	int allocateMemory();
+	int allocateMemory(MemoryBudget *budget = nullptr);
 
         /** Getter for PixFitScanConfig. */
 	std::shared_ptr<const PixFitScanConfig> getScanConfig() const;
@@ -45,9 +61,53 @@ public:
         /** @returns Number of words in the histogram. */
 	int getWords() const;
 
+        /** @returns Number of pixels in the histogram. */
+	int getPixels() const;
+
+        /** @returns Number of bins in the histogram (1 for intermediate histograms). */
+	int getBins() const;
+
+        /** @returns Number of data words per pixel and bin. */
+	int getWordsPerPixel() const;
+
+        /** @returns The current memory layout. */
+	Layout getLayout() const;
+
+        /** @returns Distance in words between two consecutive bins of a pixel. */
+	int getBinStride() const;
+
+        /** @returns Distance in words between two consecutive pixels of a bin. */
+	int getPixelStride() const;
+
+        /** Converts the histogram to another memory layout. The data is copied tile by tile (small
+         * blocks of pixels and bins that fit in the L1 cache) into a new buffer, so neither reads nor
+         * writes run over the whole histogram with a large stride.
+         * @param layout The new layout.
+         * @returns 0 on success (also if nothing had to be done), 2 if no memory was available. */
+	int transpose(Layout layout);
+
+        /** Position of a data word in memory for a given layout.
+         * @tparam L The layout, has to match getLayout().
+         * @returns Offset in words from getRawData(). */
+	template <Layout L> size_t index(int pixel, int bin, int word) const {
+		return (L == Layout::PIXEL_MAJOR) ?
+				(static_cast<size_t>(pixel) * m_bins + bin) * m_wordsPerPixel + word :
+				(static_cast<size_t>(bin) * m_pixels + pixel) * m_wordsPerPixel + word;
+	}
+
+        /** Accesses a data word without checking the layout at runtime.
+         * @tparam L The layout, has to match getLayout(). */
+	template <Layout L> histoWord_type& at(int pixel, int bin, int word = 0) {
+		assert(L == m_layout);
+		assert(pixel >= 0 && pixel < m_pixels);
+		assert(bin >= 0 && bin < m_bins);
+		assert(word >= 0 && word < m_wordsPerPixel);
+		return m_rawData[index<L>(pixel, bin, word)];
+	}
+
 	/** Overloading () for accessing histogram subset. 
          * @param pixel The pixel in question (flat address).
-         * @returns Pointer to a pixel. */
+         * @returns Pointer to the first bin of a pixel, further bins are getBinStride() words apart. */
 	histoWord_type* operator() (int pixel);
 
 	/** Overloading () for accessing histogram subset. 
@@ -63,6 +123,26 @@ public:
          * @returns Data word. */
 	histoWord_type& operator() (int pixel, int bin, int word);
 
+        /** Attaches the data of a bin as it was received from the ROD. The conversion into histogram
+         * words is left to unpackPending(), so the networking thread only has to receive the data.
+         * @param bin The bin.
+         * @param mode Readout mode of the histogrammer.
+         * @param words Number of words per pixel to fill, see PixFitUnpack::unpack().
+         * @param data The received data, may be shared with other RawHistos.
+         * @param size Size of the data in bytes, charged to the memory budget until unpacked. */
+	void addPackedBin(int bin, PixFitScanConfig::readoutMode mode, int words, std::shared_ptr<const char> data, size_t size);
+
+        /** Converts all bins attached with addPackedBin() and releases their data. Has to be called
+         * before the histogram data is accessed. */
+	void unpackPending();
+
+        /** Attaches the S-curve estimates that are updated while the bins arrive.
+         * @param streamingFit See PixFitStreamingFit, nullptr to detach. */
+	void setStreamingFit(std::shared_ptr<PixFitStreamingFit> streamingFit);
+
+        /** @returns The attached PixFitStreamingFit, nullptr if there is none. */
+	std::shared_ptr<PixFitStreamingFit> getStreamingFit() const;
+
 	/** Get the scan ID belonging to the work object. */
 	virtual PixFitScanConfig::ScanIdType getScanId() const;
 
@@ -80,6 +160,36 @@ private:
         /** Size of the raw memory in bytes. */
 	int m_size;
 
+        /** Size of the buffer from PixFitBufferPool, may be larger than m_size. */
+	size_t m_capacity;
+
+        /** Memory layout of m_rawData. */
+	Layout m_layout;
+
+        /** Copies the data from one layout to the other in tiles. */
+	template <Layout From, Layout To> void copyTiles(const histoWord_type *src, histoWord_type *dst) const;
+
+        /** Edge length (pixels and bins) of a tile in transpose(). */
+	static const int s_tileSize = 32;
+
+        /** Budget the memory is charged to, nullptr if none. */
+	MemoryBudget *m_budget;
+
+        /** Received but not yet converted data of a bin. */
+	struct PackedBin {
+		int bin;
+		PixFitScanConfig::readoutMode mode;
+		int words;
+		std::shared_ptr<const char> data;
+		size_t size;
+	};
+
+        /** Bins waiting for unpackPending(). */
+	std::vector<PackedBin> m_packedBins;
+
+        /** S-curve estimates of a threshold scan, nullptr if there are none. */
+	std::shared_ptr<PixFitStreamingFit> m_streamingFit;
+
         /** Pointer to the associated PixFitScanConfig. */
 	std::shared_ptr<const PixFitScanConfig> m_scanConfig;
 